@@ -12,8 +12,24 @@
 #include "bitfield.h"
 #include "utils.h" /* tr_free */
 
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
 #include "libtransmission-test.h"
 
+static void random_bitfield(tr_bitfield* bf, size_t bit_count)
+{
+    tr_bitfieldConstruct(bf, bit_count);
+
+    for (size_t i = 0, n = tr_rand_int_weak(bit_count); i < n; ++i)
+    {
+        tr_bitfieldAdd(bf, tr_rand_int_weak(bit_count));
+    }
+}
+
 static int test_bitfield_count_range(void)
 {
     int begin;
@@ -221,12 +237,213 @@ static int test_bitfield_has_all_none(void)
     return 0;
 }
 
+static int test_bitfield_raw(void)
+{
+    /* odd sizes so the last byte and the last word are both partial */
+    size_t const bit_counts[] = { 1, 63, 64, 65, 200, 1001 };
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(bit_counts); ++i)
+    {
+        size_t const bit_count = bit_counts[i];
+        size_t const byte_count = (bit_count + 7) / 8;
+        uint8_t bytes[256];
+        uint8_t* raw;
+        size_t raw_count;
+        tr_bitfield bf;
+        tr_bitfield copy;
+
+        /* pass in an extra byte of garbage to check that it's ignored */
+        tr_rand_buffer(bytes, byte_count + 1);
+
+        tr_bitfieldConstruct(&bf, bit_count);
+        tr_bitfieldSetRaw(&bf, bytes, byte_count + 1, true);
+
+        for (size_t j = 0; j < bit_count; ++j)
+        {
+            check_bool(tr_bitfieldHas(&bf, j), ==, (bytes[j / 8] & (0x80 >> (j % 8))) != 0);
+        }
+
+        check(tr_bitfieldHasAll(&bf) || !tr_bitfieldHas(&bf, bit_count));
+        check_uint(tr_bitfieldCountTrueBits(&bf), ==, tr_bitfieldCountRange(&bf, 0, bit_count));
+
+        /* the excess bits come back cleared */
+        bytes[byte_count - 1] &= 0xff << (byte_count * 8 - bit_count);
+        raw = tr_bitfieldGetRaw(&bf, &raw_count);
+        check_uint(raw_count, ==, byte_count);
+        check_mem(raw, ==, bytes, byte_count);
+        tr_free(raw);
+
+        tr_bitfieldConstruct(&copy, bit_count);
+        tr_bitfieldSetFromBitfield(&copy, &bf);
+        raw = tr_bitfieldGetRaw(&copy, &raw_count);
+        check_mem(raw, ==, bytes, byte_count);
+        tr_free(raw);
+
+        tr_bitfieldDestruct(&copy);
+        tr_bitfieldDestruct(&bf);
+    }
+
+    return 0;
+}
+
+static int test_bitfield_next_set(void)
+{
+    tr_bitfield bf;
+
+    for (int l = 0; l < 100; ++l)
+    {
+        size_t const bit_count = 1 + tr_rand_int_weak(1000);
+        size_t expected = SIZE_MAX;
+
+        random_bitfield(&bf, bit_count);
+
+        for (size_t i = bit_count + 1; i-- > 0;)
+        {
+            if (i < bit_count && tr_bitfieldHas(&bf, i))
+            {
+                expected = i;
+            }
+
+            check_uint(tr_bitfieldNextSet(&bf, i), ==, expected);
+        }
+
+        tr_bitfieldDestruct(&bf);
+    }
+
+    tr_bitfieldConstruct(&bf, 100);
+    check_uint(tr_bitfieldNextSet(&bf, 0), ==, SIZE_MAX);
+    tr_bitfieldSetHasAll(&bf);
+    check_uint(tr_bitfieldNextSet(&bf, 0), ==, 0);
+    check_uint(tr_bitfieldNextSet(&bf, 99), ==, 99);
+    check_uint(tr_bitfieldNextSet(&bf, 100), ==, SIZE_MAX);
+    tr_bitfieldDestruct(&bf);
+
+    return 0;
+}
+
+static int test_bitfield_count_and_not(void)
+{
+    tr_bitfield a;
+    tr_bitfield b;
+
+    for (int l = 0; l < 100; ++l)
+    {
+        size_t const bit_count = 1 + tr_rand_int_weak(1000);
+        size_t expected = 0;
+
+        random_bitfield(&a, bit_count);
+        random_bitfield(&b, bit_count);
+
+        for (size_t i = 0; i < bit_count; ++i)
+        {
+            if (tr_bitfieldHas(&a, i) && !tr_bitfieldHas(&b, i))
+            {
+                ++expected;
+            }
+        }
+
+        check_uint(tr_bitfieldCountAndNot(&a, &b), ==, expected);
+
+        /* the ends of the range, where one side is all or nothing */
+        check_uint(tr_bitfieldCountAndNot(&a, &a), ==, 0);
+        tr_bitfieldSetHasAll(&a);
+        check_uint(tr_bitfieldCountAndNot(&a, &b), ==, bit_count - tr_bitfieldCountTrueBits(&b));
+        check_uint(tr_bitfieldCountAndNot(&b, &a), ==, 0);
+        tr_bitfieldSetHasNone(&a);
+        check_uint(tr_bitfieldCountAndNot(&a, &b), ==, 0);
+        check_uint(tr_bitfieldCountAndNot(&b, &a), ==, tr_bitfieldCountTrueBits(&b));
+
+        tr_bitfieldDestruct(&b);
+        tr_bitfieldDestruct(&a);
+    }
+
+    return 0;
+}
+
+#if SPEED_TEST
+
+static int test_speed(void)
+{
+    size_t const bit_count = 4 * 1024 * 1024;
+    size_t const loops = 100;
+    size_t sum = 0;
+    uint64_t start;
+    tr_bitfield a;
+    tr_bitfield b;
+
+    random_bitfield(&a, bit_count);
+    random_bitfield(&b, bit_count);
+
+    start = tr_time_msec();
+
+    for (size_t l = 0; l < loops; ++l)
+    {
+        size_t const begin = tr_rand_int_weak(bit_count / 2);
+        sum += tr_bitfieldCountRange(&a, begin, begin + bit_count / 2);
+    }
+
+    fprintf(stderr, "count range: %.3f ms\n", (double)(tr_time_msec() - start) / loops);
+    start = tr_time_msec();
+
+    for (size_t l = 0; l < loops; ++l)
+    {
+        for (size_t i = 0; i < bit_count; ++i)
+        {
+            sum += tr_bitfieldHas(&a, i);
+        }
+    }
+
+    fprintf(stderr, "walk with has: %.3f ms\n", (double)(tr_time_msec() - start) / loops);
+    start = tr_time_msec();
+
+    for (size_t l = 0; l < loops; ++l)
+    {
+        for (size_t i = tr_bitfieldNextSet(&a, 0); i != SIZE_MAX; i = tr_bitfieldNextSet(&a, i + 1))
+        {
+            sum += i;
+        }
+    }
+
+    fprintf(stderr, "walk with next set: %.3f ms\n", (double)(tr_time_msec() - start) / loops);
+    start = tr_time_msec();
+
+    for (size_t l = 0; l < loops; ++l)
+    {
+        sum += tr_bitfieldCountAndNot(&a, &b);
+    }
+
+    fprintf(stderr, "count and not: %.3f ms\n", (double)(tr_time_msec() - start) / loops);
+    start = tr_time_msec();
+
+    for (size_t l = 0; l < loops; ++l)
+    {
+        size_t const begin = tr_rand_int_weak(bit_count / 2);
+        tr_bitfieldRemRange(&b, begin, begin + bit_count / 2);
+        tr_bitfieldAddRange(&b, begin, begin + bit_count / 2);
+    }
+
+    fprintf(stderr, "remove and add range: %.3f ms\n", (double)(tr_time_msec() - start) / loops);
+
+    fprintf(stderr, "(%zu)\n", sum);
+    tr_bitfieldDestruct(&b);
+    tr_bitfieldDestruct(&a);
+    return 0;
+}
+
+#endif
+
 int main(void)
 {
     testFunc const tests[] =
     {
         test_bitfields,
-        test_bitfield_has_all_none
+        test_bitfield_has_all_none,
+        test_bitfield_raw,
+        test_bitfield_next_set,
+        test_bitfield_count_and_not,
+#if SPEED_TEST
+        test_speed
+#endif
     };
 
     int ret = runTests(tests, NUM_TESTS(tests));
@@ -15,7 +15,7 @@
 
 tr_bitfield const TR_BITFIELD_INIT =
 {
-    .bits = NULL,
+    .words = NULL,
     .alloc_count = 0,
     .bit_count = 0,
     .true_count = 0,
@@ -27,102 +27,139 @@ tr_bitfield const TR_BITFIELD_INIT =
 *****
 ****/
 
-static int8_t const trueBitCount[256] =
-{
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
-};
+#define WORD_BITS 64U
 
-static size_t countArray(tr_bitfield const* b)
+static inline size_t wordIndex(size_t n)
+{
+    return n >> 6U;
+}
+
+static inline uint64_t bitMask(size_t n)
+{
+    return UINT64_C(0x8000000000000000) >> (n & 63U);
+}
+
+/* mask of the bits [begin, end) of a word, where 0 <= begin < end <= 64 */
+static inline uint64_t rangeMask(size_t begin, size_t end)
+{
+    uint64_t const tail = end < WORD_BITS ? UINT64_MAX >> end : 0;
+
+    return (UINT64_MAX >> begin) & ~tail;
+}
+
+static inline size_t popcount64(uint64_t w)
+{
+#if __has_builtin(__builtin_popcountll) || TR_GNUC_CHECK_VERSION(3, 4)
+
+    return (size_t)__builtin_popcountll(w);
+
+#else
+
+    w = w - ((w >> 1) & UINT64_C(0x5555555555555555));
+    w = (w & UINT64_C(0x3333333333333333)) + ((w >> 2) & UINT64_C(0x3333333333333333));
+    w = (w + (w >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+    return (size_t)((w * UINT64_C(0x0101010101010101)) >> 56);
+
+#endif
+}
+
+/* index of the first set bit in a nonzero word */
+static inline size_t firstSet64(uint64_t w)
+{
+    TR_ASSERT(w != 0);
+
+#if __has_builtin(__builtin_clzll) || TR_GNUC_CHECK_VERSION(3, 4)
+
+    return (size_t)__builtin_clzll(w);
+
+#else
+
+    size_t n = 0;
+
+    while ((w & UINT64_C(0x8000000000000000)) == 0)
+    {
+        w <<= 1;
+        ++n;
+    }
+
+    return n;
+
+#endif
+}
+
+/* a word is eight bytes of the wire format, read big-endian */
+static inline uint64_t loadWord(uint8_t const* bytes)
+{
+    return (uint64_t)bytes[0] << 56 | (uint64_t)bytes[1] << 48 | (uint64_t)bytes[2] << 40 | (uint64_t)bytes[3] << 32 |
+        (uint64_t)bytes[4] << 24 | (uint64_t)bytes[5] << 16 | (uint64_t)bytes[6] << 8 | (uint64_t)bytes[7];
+}
+
+static inline void storeWord(uint8_t* bytes, uint64_t w)
+{
+    bytes[0] = (uint8_t)(w >> 56);
+    bytes[1] = (uint8_t)(w >> 48);
+    bytes[2] = (uint8_t)(w >> 40);
+    bytes[3] = (uint8_t)(w >> 32);
+    bytes[4] = (uint8_t)(w >> 24);
+    bytes[5] = (uint8_t)(w >> 16);
+    bytes[6] = (uint8_t)(w >> 8);
+    bytes[7] = (uint8_t)w;
+}
+
+static size_t countWords(uint64_t const* words, size_t n)
 {
     size_t ret = 0;
-    size_t i = b->alloc_count;
 
-    while (i > 0)
+    for (size_t i = 0; i < n; ++i)
     {
-        ret += trueBitCount[b->bits[--i]];
+        ret += popcount64(words[i]);
     }
 
     return ret;
 }
 
+static size_t countArray(tr_bitfield const* b)
+{
+    return countWords(b->words, b->alloc_count);
+}
+
 static size_t countRange(tr_bitfield const* b, size_t begin, size_t end)
 {
     size_t ret = 0;
-    size_t const first_byte = begin >> 3U;
-    size_t const last_byte = (end - 1) >> 3U;
+    size_t const first_word = wordIndex(begin);
+    size_t const last_word = wordIndex(end - 1);
 
     if (b->bit_count == 0)
     {
         return 0;
     }
 
-    if (first_byte >= b->alloc_count)
+    if (first_word >= b->alloc_count)
     {
         return 0;
     }
 
     TR_ASSERT(begin < end);
-    TR_ASSERT(b->bits != NULL);
+    TR_ASSERT(b->words != NULL);
 
-    if (first_byte == last_byte)
+    if (first_word == last_word)
     {
-        int i;
-        uint8_t val = b->bits[first_byte];
-
-        i = begin - (first_byte * 8);
-        val <<= i;
-        val >>= i;
-        i = (last_byte + 1) * 8 - end;
-        val >>= i;
-        val <<= i;
-
-        ret += trueBitCount[val];
+        ret += popcount64(b->words[first_word] & rangeMask(begin & 63U, end - first_word * WORD_BITS));
     }
     else
     {
-        uint8_t val;
-        size_t const walk_end = MIN(b->alloc_count, last_byte);
-
-        /* first byte */
-        size_t const first_shift = begin - (first_byte * 8);
-        val = b->bits[first_byte];
-        val <<= first_shift;
-        val >>= first_shift;
-        ret += trueBitCount[val];
+        size_t const walk_end = MIN(b->alloc_count, last_word);
 
-        /* middle bytes */
-        for (size_t i = first_byte + 1; i < walk_end; ++i)
-        {
-            ret += trueBitCount[b->bits[i]];
-        }
+        ret += popcount64(b->words[first_word] & rangeMask(begin & 63U, WORD_BITS));
+        ret += countWords(b->words + first_word + 1, walk_end - first_word - 1);
 
-        /* last byte */
-        if (last_byte < b->alloc_count)
+        if (last_word < b->alloc_count)
         {
-            size_t const last_shift = (last_byte + 1) * 8 - end;
-            val = b->bits[last_byte];
-            val >>= last_shift;
-            val <<= last_shift;
-            ret += trueBitCount[val];
+            ret += popcount64(b->words[last_word] & rangeMask(0, end - last_word * WORD_BITS));
         }
     }
 
-    TR_ASSERT(ret <= (begin - end));
+    TR_ASSERT(ret <= end - begin);
     return ret;
 }
 
@@ -153,12 +190,75 @@ bool tr_bitfieldHas(tr_bitfield const* b, size_t n)
         return false;
     }
 
-    if (n >> 3U >= b->alloc_count)
+    if (wordIndex(n) >= b->alloc_count)
     {
         return false;
     }
 
-    return (b->bits[n >> 3U] << (n & 7U) & 0x80) != 0;
+    return (b->words[wordIndex(n)] & bitMask(n)) != 0;
+}
+
+size_t tr_bitfieldNextSet(tr_bitfield const* b, size_t begin)
+{
+    if (tr_bitfieldHasAll(b))
+    {
+        return b->bit_count == 0 || begin < b->bit_count ? begin : SIZE_MAX;
+    }
+
+    if (tr_bitfieldHasNone(b))
+    {
+        return SIZE_MAX;
+    }
+
+    size_t i = wordIndex(begin);
+
+    if (i >= b->alloc_count)
+    {
+        return SIZE_MAX;
+    }
+
+    uint64_t w = b->words[i] & rangeMask(begin & 63U, WORD_BITS);
+
+    while (w == 0)
+    {
+        if (++i == b->alloc_count)
+        {
+            return SIZE_MAX;
+        }
+
+        w = b->words[i];
+    }
+
+    return i * WORD_BITS + firstSet64(w);
+}
+
+size_t tr_bitfieldCountAndNot(tr_bitfield const* a, tr_bitfield const* b)
+{
+    if (tr_bitfieldHasNone(a) || tr_bitfieldHasAll(b))
+    {
+        return 0;
+    }
+
+    if (tr_bitfieldHasNone(b))
+    {
+        return tr_bitfieldCountTrueBits(a);
+    }
+
+    if (tr_bitfieldHasAll(a))
+    {
+        size_t const bit_count = a->bit_count != 0 ? a->bit_count : b->bit_count;
+        return bit_count != 0 ? bit_count - tr_bitfieldCountRange(b, 0, bit_count) : 0;
+    }
+
+    size_t ret = 0;
+    size_t const n = MIN(a->alloc_count, b->alloc_count);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        ret += popcount64(a->words[i] & ~b->words[i]);
+    }
+
+    return ret + countWords(a->words + n, a->alloc_count - n);
 }
 
 /***
@@ -170,8 +270,8 @@ bool tr_bitfieldHas(tr_bitfield const* b, size_t n)
 static bool tr_bitfieldIsValid(tr_bitfield const* b)
 {
     TR_ASSERT(b != NULL);
-    TR_ASSERT((b->alloc_count == 0) == (b->bits == NULL));
-    TR_ASSERT(b->bits == NULL || b->true_count == countArray(b));
+    TR_ASSERT((b->alloc_count == 0) == (b->words == NULL));
+    TR_ASSERT(b->words == NULL || b->true_count == countArray(b));
 
     return true;
 }
@@ -190,16 +290,20 @@ static size_t get_bytes_needed(size_t bit_count)
     return (bit_count >> 3) + ((bit_count & 7) != 0 ? 1 : 0);
 }
 
-static void set_all_true(uint8_t* array, size_t bit_count)
+static size_t get_words_needed(size_t bit_count)
 {
-    uint8_t const val = 0xFF;
-    size_t const n = get_bytes_needed(bit_count);
+    return (bit_count >> 6) + ((bit_count & 63) != 0 ? 1 : 0);
+}
+
+static void set_all_true(uint64_t* words, size_t bit_count)
+{
+    size_t const n = get_words_needed(bit_count);
 
     if (n > 0)
     {
-        memset(array, val, n - 1);
+        memset(words, 0xff, (n - 1) * sizeof(uint64_t));
 
-        array[n - 1] = val << (n * 8 - bit_count);
+        words[n - 1] = rangeMask(0, bit_count - (n - 1) * WORD_BITS);
     }
 }
 
@@ -212,12 +316,26 @@ void* tr_bitfieldGetRaw(tr_bitfield const* b, size_t* byte_count)
 
     if (b->alloc_count != 0)
     {
-        TR_ASSERT(b->alloc_count <= n);
-        memcpy(bits, b->bits, b->alloc_count);
+        size_t const copy_count = MIN(n, b->alloc_count * sizeof(uint64_t));
+        size_t i = 0;
+
+        TR_ASSERT(b->alloc_count <= get_words_needed(b->bit_count));
+
+        for (; i + 8 <= copy_count; i += 8)
+        {
+            storeWord(bits + i, b->words[i >> 3]);
+        }
+
+        for (; i < copy_count; ++i)
+        {
+            bits[i] = (uint8_t)(b->words[i >> 3] >> (56 - 8 * (i & 7)));
+        }
     }
     else if (tr_bitfieldHasAll(b))
     {
-        set_all_true(bits, b->bit_count);
+        memset(bits, 0xff, n - 1);
+
+        bits[n - 1] = 0xff << (n * 8 - b->bit_count);
     }
 
     *byte_count = n;
@@ -226,27 +344,27 @@ void* tr_bitfieldGetRaw(tr_bitfield const* b, size_t* byte_count)
 
 static void tr_bitfieldEnsureBitsAlloced(tr_bitfield* b, size_t n)
 {
-    size_t bytes_needed;
+    size_t words_needed;
     bool const has_all = tr_bitfieldHasAll(b);
 
     if (has_all)
     {
-        bytes_needed = get_bytes_needed(MAX(n, b->true_count));
+        words_needed = get_words_needed(MAX(n, b->true_count));
     }
     else
     {
-        bytes_needed = get_bytes_needed(n);
+        words_needed = get_words_needed(n);
     }
 
-    if (b->alloc_count < bytes_needed)
+    if (b->alloc_count < words_needed)
     {
-        b->bits = tr_renew(uint8_t, b->bits, bytes_needed);
-        memset(b->bits + b->alloc_count, 0, bytes_needed - b->alloc_count);
-        b->alloc_count = bytes_needed;
+        b->words = tr_renew(uint64_t, b->words, words_needed);
+        memset(b->words + b->alloc_count, 0, (words_needed - b->alloc_count) * sizeof(uint64_t));
+        b->alloc_count = words_needed;
 
         if (has_all)
         {
-            set_all_true(b->bits, b->true_count);
+            set_all_true(b->words, b->true_count);
         }
     }
 }
@@ -265,8 +383,8 @@ static bool tr_bitfieldEnsureNthBitAlloced(tr_bitfield* b, size_t nth)
 
 static void tr_bitfieldFreeArray(tr_bitfield* b)
 {
-    tr_free(b->bits);
-    b->bits = NULL;
+    tr_free(b->words);
+    b->words = NULL;
     b->alloc_count = 0;
 }
 
@@ -313,7 +431,7 @@ void tr_bitfieldConstruct(tr_bitfield* b, size_t bit_count)
 {
     b->bit_count = bit_count;
     b->true_count = 0;
-    b->bits = NULL;
+    b->words = NULL;
     b->alloc_count = 0;
     b->have_all_hint = false;
     b->have_none_hint = false;
@@ -353,12 +471,27 @@ void tr_bitfieldSetFromBitfield(tr_bitfield* b, tr_bitfield const* src)
     }
     else
     {
-        tr_bitfieldSetRaw(b, src->bits, src->alloc_count, true);
+        size_t const word_count = MIN(src->alloc_count, get_words_needed(b->bit_count));
+
+        tr_bitfieldFreeArray(b);
+        b->words = tr_memdup(src->words, word_count * sizeof(uint64_t));
+        b->alloc_count = word_count;
+
+        /* ensure the excess bits are set to '0' */
+        if (word_count != 0 && word_count * WORD_BITS > b->bit_count)
+        {
+            b->words[word_count - 1] &= rangeMask(0, b->bit_count - (word_count - 1) * WORD_BITS);
+        }
+
+        tr_bitfieldRebuildTrueCount(b);
     }
 }
 
 void tr_bitfieldSetRaw(tr_bitfield* b, void const* bits, size_t byte_count, bool bounded)
 {
+    uint8_t const* bytes = bits;
+    size_t i = 0;
+
     tr_bitfieldFreeArray(b);
     b->true_count = 0;
 
@@ -367,21 +500,23 @@ void tr_bitfieldSetRaw(tr_bitfield* b, void const* bits, size_t byte_count, bool
         byte_count = MIN(byte_count, get_bytes_needed(b->bit_count));
     }
 
-    b->bits = tr_memdup(bits, byte_count);
-    b->alloc_count = byte_count;
+    b->alloc_count = get_words_needed(byte_count * 8);
+    b->words = tr_new0(uint64_t, b->alloc_count);
 
-    if (bounded)
+    for (; i + 8 <= byte_count; i += 8)
     {
-        /* ensure the excess bits are set to '0' */
-        int const excess_bit_count = byte_count * 8 - b->bit_count;
+        b->words[i >> 3] = loadWord(bytes + i);
+    }
 
-        TR_ASSERT(excess_bit_count >= 0);
-        TR_ASSERT(excess_bit_count <= 7);
+    for (; i < byte_count; ++i)
+    {
+        b->words[i >> 3] |= (uint64_t)bytes[i] << (56 - 8 * (i & 7));
+    }
 
-        if (excess_bit_count != 0)
-        {
-            b->bits[b->alloc_count - 1] &= 0xff << excess_bit_count;
-        }
+    if (bounded && b->alloc_count != 0 && b->alloc_count * WORD_BITS > b->bit_count)
+    {
+        /* ensure the excess bits are set to '0' */
+        b->words[b->alloc_count - 1] &= rangeMask(0, b->bit_count - (b->alloc_count - 1) * WORD_BITS);
     }
 
     tr_bitfieldRebuildTrueCount(b);
@@ -399,7 +534,7 @@ void tr_bitfieldSetFromFlags(tr_bitfield* b, bool const* flags, size_t n)
         if (flags[i])
         {
             ++trueCount;
-            b->bits[i >> 3U] |= (0x80 >> (i & 7U));
+            b->words[wordIndex(i)] |= bitMask(i);
         }
     }
 
@@ -410,7 +545,7 @@ void tr_bitfieldAdd(tr_bitfield* b, size_t nth)
 {
     if (!tr_bitfieldHas(b, nth) && tr_bitfieldEnsureNthBitAlloced(b, nth))
     {
-        b->bits[nth >> 3U] |= 0x80 >> (nth & 7U);
+        b->words[wordIndex(nth)] |= bitMask(nth);
         tr_bitfieldIncTrueCount(b, 1);
     }
 }
@@ -418,13 +553,9 @@ void tr_bitfieldAdd(tr_bitfield* b, size_t nth)
 /* Sets bit range [begin, end) to 1 */
 void tr_bitfieldAddRange(tr_bitfield* b, size_t begin, size_t end)
 {
-    size_t sb;
-    size_t eb;
-    unsigned char sm;
-    unsigned char em;
-    size_t const diff = (end - begin) - tr_bitfieldCountRange(b, begin, end);
+    size_t diff = 0;
 
-    if (diff == 0)
+    if (tr_bitfieldHasAll(b))
     {
         return;
     }
@@ -436,32 +567,26 @@ void tr_bitfieldAddRange(tr_bitfield* b, size_t begin, size_t end)
         return;
     }
 
-    sb = begin >> 3;
-    sm = ~(0xff << (8 - (begin & 7)));
-    eb = end >> 3;
-    em = 0xff << (7 - (end & 7));
-
     if (!tr_bitfieldEnsureNthBitAlloced(b, end))
     {
         return;
     }
 
-    if (sb == eb)
-    {
-        b->bits[sb] |= sm & em;
-    }
-    else
+    size_t const sw = wordIndex(begin);
+    size_t const ew = wordIndex(end);
+
+    for (size_t i = sw; i <= ew; ++i)
     {
-        b->bits[sb] |= sm;
-        b->bits[eb] |= em;
+        uint64_t const mask = rangeMask(i == sw ? begin & 63U : 0, i == ew ? (end & 63U) + 1 : WORD_BITS);
 
-        if (++sb < eb)
-        {
-            memset(b->bits + sb, 0xff, eb - sb);
-        }
+        diff += popcount64(mask & ~b->words[i]);
+        b->words[i] |= mask;
     }
 
-    tr_bitfieldIncTrueCount(b, diff);
+    if (diff != 0)
+    {
+        tr_bitfieldIncTrueCount(b, diff);
+    }
 }
 
 void tr_bitfieldRem(tr_bitfield* b, size_t nth)
@@ -470,7 +595,7 @@ void tr_bitfieldRem(tr_bitfield* b, size_t nth)
 
     if (tr_bitfieldHas(b, nth) && tr_bitfieldEnsureNthBitAlloced(b, nth))
     {
-        b->bits[nth >> 3U] &= 0xff7f >> (nth & 7U);
+        b->words[wordIndex(nth)] &= ~bitMask(nth);
         tr_bitfieldDecTrueCount(b, 1);
     }
 }
@@ -478,13 +603,9 @@ void tr_bitfieldRem(tr_bitfield* b, size_t nth)
 /* Clears bit range [begin, end) to 0 */
 void tr_bitfieldRemRange(tr_bitfield* b, size_t begin, size_t end)
 {
-    size_t sb;
-    size_t eb;
-    unsigned char sm;
-    unsigned char em;
-    size_t const diff = tr_bitfieldCountRange(b, begin, end);
+    size_t diff = 0;
 
-    if (diff == 0)
+    if (tr_bitfieldHasNone(b))
     {
         return;
     }
@@ -496,30 +617,24 @@ void tr_bitfieldRemRange(tr_bitfield* b, size_t begin, size_t end)
         return;
     }
 
-    sb = begin >> 3;
-    sm = 0xff << (8 - (begin & 7));
-    eb = end >> 3;
-    em = ~(0xff << (7 - (end & 7)));
-
     if (!tr_bitfieldEnsureNthBitAlloced(b, end))
     {
         return;
     }
 
-    if (sb == eb)
-    {
-        b->bits[sb] &= sm | em;
-    }
-    else
+    size_t const sw = wordIndex(begin);
+    size_t const ew = wordIndex(end);
+
+    for (size_t i = sw; i <= ew; ++i)
     {
-        b->bits[sb] &= sm;
-        b->bits[eb] &= em;
+        uint64_t const mask = rangeMask(i == sw ? begin & 63U : 0, i == ew ? (end & 63U) + 1 : WORD_BITS);
 
-        if (++sb < eb)
-        {
-            memset(b->bits + sb, 0, eb - sb);
-        }
+        diff += popcount64(mask & b->words[i]);
+        b->words[i] &= ~mask;
     }
 
-    tr_bitfieldDecTrueCount(b, diff);
+    if (diff != 0)
+    {
+        tr_bitfieldDecTrueCount(b, diff);
+    }
 }
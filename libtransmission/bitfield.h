@@ -17,7 +17,9 @@
 /** @brief Implementation of the BitTorrent spec's Bitfield array of bits */
 typedef struct tr_bitfield
 {
-    uint8_t* bits;
+    /* bit n is in words[n / 64], counting from the word's most significant bit.
+       That's the wire format's bit order, so each word is eight of its bytes. */
+    uint64_t* words;
     size_t alloc_count;
 
     size_t bit_count;
@@ -80,6 +82,13 @@ size_t tr_bitfieldCountRange(tr_bitfield const*, size_t begin, size_t end);
 
 size_t tr_bitfieldCountTrueBits(tr_bitfield const* b);
 
+/** @brief Count the bits that are set in `a' but not in `b' */
+size_t tr_bitfieldCountAndNot(tr_bitfield const* a, tr_bitfield const* b);
+
+/** @brief Find the first set bit at or after `begin'
+    @return the bit's index, or SIZE_MAX if there isn't one */
+size_t tr_bitfieldNextSet(tr_bitfield const* b, size_t begin);
+
 static inline bool tr_bitfieldHasAll(tr_bitfield const* b)
 {
     return b->bit_count != 0 ? (b->true_count == b->bit_count) : b->have_all_hint;
@@ -0,0 +1,825 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <stdio.h> /* fprintf() */
+#include <string.h> /* memcmp(), memset() */
+#include <time.h> /* clock() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h"
+#include "crypto-utils.h" /* tr_rand_int_weak(), tr_sha1() */
+#include "file.h"
+#include "inout.h"
+#include "platform.h" /* tr_threadNew(), tr_wait_msec() */
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+#include "variant.h"
+
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
+#include "libtransmission-test.h"
+
+struct cache_test_data
+{
+    tr_torrent* tor;
+    int64_t cache_bytes;
+    bool results[5];
+    bool done;
+};
+
+static void fill_block(uint8_t* buf, size_t len, int seed)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        buf[i] = (uint8_t)(seed + i * 7);
+    }
+}
+
+static void run_and_wait(tr_session* session, void (* func)(void*), struct cache_test_data* data)
+{
+    data->done = false;
+    tr_runInEventThread(session, func, data);
+
+    while (!data->done)
+    {
+        tr_wait_msec(10);
+    }
+}
+
+/* writes every block of the torrent, out of order */
+static void write_blocks(void* vdata)
+{
+    struct cache_test_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    tr_cache* cache = tor->session->cache;
+    uint8_t* block = tr_new(uint8_t, tor->blockSize);
+    struct evbuffer* buf = evbuffer_new();
+
+    tr_cacheSetLimit(cache, data->cache_bytes);
+
+    /* the stride has to be coprime to the block count to hit every block */
+    TR_ASSERT(tor->blockCount % 7 != 0);
+
+    for (tr_block_index_t i = 0; i < tor->blockCount; ++i)
+    {
+        tr_block_index_t const b = (i * 7) % tor->blockCount;
+        uint32_t const len = tr_torBlockCountBytes(tor, b);
+        uint64_t const offset = (uint64_t)b * tor->blockSize;
+        tr_piece_index_t const piece = offset / tor->info.pieceSize;
+
+        fill_block(block, len, b);
+        evbuffer_add(buf, block, len);
+        tr_cacheWriteBlock(cache, tor, piece, offset - (uint64_t)piece * tor->info.pieceSize, len, buf);
+    }
+
+    evbuffer_free(buf);
+    tr_free(block);
+    data->done = true;
+}
+
+static void flush_torrent(void* vdata)
+{
+    struct cache_test_data* data = vdata;
+
+    tr_cacheFlushTorrent(data->tor->session->cache, data->tor);
+    data->done = true;
+}
+
+static int check_blocks(tr_torrent* tor)
+{
+    uint8_t* expected = tr_new(uint8_t, tor->blockSize);
+    uint8_t* block = tr_new(uint8_t, tor->blockSize);
+
+    for (tr_block_index_t b = 0; b < tor->blockCount; ++b)
+    {
+        uint32_t const len = tr_torBlockCountBytes(tor, b);
+        uint64_t const offset = (uint64_t)b * tor->blockSize;
+        tr_piece_index_t const piece = offset / tor->info.pieceSize;
+        uint32_t const piece_offset = offset - (uint64_t)piece * tor->info.pieceSize;
+
+        fill_block(expected, len, b);
+        check_int(tr_cacheReadBlock(tor->session->cache, tor, piece, piece_offset, len, block), ==, 0);
+        check_mem(block, ==, expected, len);
+    }
+
+    tr_free(block);
+    tr_free(expected);
+    return 0;
+}
+
+static int test_write_and_flush_impl(int64_t cache_bytes)
+{
+    int ret;
+    tr_session* session;
+    tr_torrent* tor;
+    struct cache_test_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, false);
+
+    data.tor = tor;
+    data.cache_bytes = cache_bytes;
+    run_and_wait(session, write_blocks, &data);
+
+    /* whatever's in memory and on disk reads back the same */
+    tr_sessionLock(session);
+    ret = check_blocks(tor);
+    tr_sessionUnlock(session);
+    check_int(ret, ==, 0);
+
+    /* and everything on disk, once the rest is flushed */
+    run_and_wait(session, flush_torrent, &data);
+
+    for (tr_block_index_t b = 0; b < tor->blockCount; ++b)
+    {
+        uint64_t const offset = (uint64_t)b * tor->blockSize;
+        tr_piece_index_t const piece = offset / tor->info.pieceSize;
+
+        check(!tr_cacheHasBlock(session->cache, tor, piece, offset - (uint64_t)piece * tor->info.pieceSize));
+    }
+
+    tr_sessionLock(session);
+    ret = check_blocks(tor);
+    tr_sessionUnlock(session);
+    check_int(ret, ==, 0);
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_write_and_flush(void)
+{
+    int ret;
+
+    /* everything fits */
+    if ((ret = test_write_and_flush_impl(4 * 1024 * 1024)) != 0)
+    {
+        return ret;
+    }
+
+    /* runs have to be flushed to make room */
+    return test_write_and_flush_impl(8 * 16384);
+}
+
+static void write_piece_block(tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint8_t fill)
+{
+    uint32_t const len = MIN(tor->blockSize, tr_torPieceCountBytes(tor, piece) - offset);
+    uint8_t* block = tr_new(uint8_t, len);
+    struct evbuffer* buf = evbuffer_new();
+
+    memset(block, fill, len);
+    evbuffer_add(buf, block, len);
+    tr_cacheWriteBlock(tor->session->cache, tor, piece, offset, len, buf);
+
+    evbuffer_free(buf);
+    tr_free(block);
+}
+
+/* like write_piece_block(), but the block arrives in many small chains, as it does off the network */
+static void write_chained_block(tr_torrent* tor, tr_piece_index_t piece, uint32_t offset)
+{
+    uint32_t const len = MIN(tor->blockSize, tr_torPieceCountBytes(tor, piece) - offset);
+    uint32_t const chain_len = 1024;
+    uint8_t* block = tr_new0(uint8_t, len);
+    struct evbuffer* buf = evbuffer_new();
+
+    for (uint32_t o = 0; o < len; o += chain_len)
+    {
+        evbuffer_add_reference(buf, block + o, MIN(chain_len, len - o), NULL, NULL);
+    }
+
+    tr_cacheWriteBlock(tor->session->cache, tor, piece, offset, len, buf);
+
+    evbuffer_free(buf);
+    tr_free(block);
+}
+
+/* the zero torrent has two blocks per piece, and its pieces should be all zeroes */
+static void hash_pieces(void* vdata)
+{
+    struct cache_test_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    uint32_t const block_size = tor->blockSize;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint32_t hashed = 0;
+    tr_sha1_ctx_t sha;
+
+    /* a block that arrives early is hashed when the gap before it fills */
+    write_piece_block(tor, 1, block_size, 0);
+    write_piece_block(tor, 1, 0, 0);
+    sha = tr_cacheTakePieceHash(tor->session->cache, tor, 1, &hashed);
+    data->results[0] = sha != NULL && hashed == tor->info.pieceSize && tr_sha1_final(sha, hash) &&
+        memcmp(hash, tor->info.pieces[1].hash, SHA_DIGEST_LENGTH) == 0;
+
+    /* the check uses what's been hashed */
+    write_piece_block(tor, 2, 0, 0);
+    write_piece_block(tor, 2, block_size, 0);
+    data->results[1] = tr_ioTestPiece(tor, 2);
+
+    /* rewriting a block that's been hashed starts over */
+    write_piece_block(tor, 3, 0, 0xff);
+    write_piece_block(tor, 3, block_size, 0);
+    write_piece_block(tor, 3, 0, 0);
+    data->results[2] = tr_ioTestPiece(tor, 3);
+
+    /* and bad data is still caught */
+    write_piece_block(tor, 4, block_size, 0xff);
+    write_piece_block(tor, 4, 0, 0);
+    data->results[3] = !tr_ioTestPiece(tor, 4);
+
+    /* every chain of a block gets hashed */
+    write_chained_block(tor, 5, 0);
+    write_chained_block(tor, 5, block_size);
+    sha = tr_cacheTakePieceHash(tor->session->cache, tor, 5, &hashed);
+    data->results[4] = sha != NULL && hashed == tor->info.pieceSize && tr_sha1_final(sha, hash) &&
+        memcmp(hash, tor->info.pieces[5].hash, SHA_DIGEST_LENGTH) == 0;
+
+    data->done = true;
+}
+
+static int test_piece_hash(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    struct cache_test_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, false);
+    check_uint(tor->info.pieceSize, ==, 2 * tor->blockSize);
+
+    data.tor = tor;
+    run_and_wait(session, hash_pieces, &data);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data.results); ++i)
+    {
+        check(data.results[i]);
+    }
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static bool has_piece_hash(tr_torrent* tor, tr_piece_index_t piece)
+{
+    uint32_t hashed;
+    tr_sha1_ctx_t sha = tr_cacheTakePieceHash(tor->session->cache, tor, piece, &hashed);
+
+    if (sha == NULL)
+    {
+        return false;
+    }
+
+    tr_sha1_final(sha, NULL);
+    return true;
+}
+
+/* pieces that won't be finished shouldn't keep their hashers */
+static void abandon_pieces(void* vdata)
+{
+    struct cache_test_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    tr_file_index_t const file = 0;
+    time_t const now = tr_time();
+
+    /* the first file is pieces 0 through 31, and no other file shares them */
+    write_piece_block(tor, 1, 0, 0);
+    write_piece_block(tor, 2, 0, 0);
+    tr_torrentSetFileDLs(tor, &file, 1, false);
+    data->results[0] = !has_piece_hash(tor, 1);
+    tr_torrentSetFileDLs(tor, &file, 1, true);
+
+    /* a piece that nothing's been written to in a while gives way to new ones */
+    write_piece_block(tor, 3, 0, 0);
+    tr_timeUpdate(now + 3600);
+    write_piece_block(tor, 4, 0, 0);
+    data->results[1] = !has_piece_hash(tor, 3);
+    data->results[2] = has_piece_hash(tor, 4);
+    tr_timeUpdate(now);
+
+    /* and the ones that are still going are kept */
+    write_piece_block(tor, 5, 0, 0);
+    write_piece_block(tor, 6, 0, 0);
+    data->results[3] = has_piece_hash(tor, 5);
+    data->results[4] = has_piece_hash(tor, 6);
+
+    data->done = true;
+}
+
+static int test_piece_hash_lifetime(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    struct cache_test_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, false);
+
+    data.tor = tor;
+    run_and_wait(session, abandon_pieces, &data);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data.results); ++i)
+    {
+        check(data.results[i]);
+    }
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+#if SPEED_TEST
+
+/* how many bytes this process has read, or 0 if that can't be told */
+static uint64_t get_bytes_read(void)
+{
+    uint64_t rchar = 0;
+    FILE* fp = fopen("/proc/self/io", "r");
+
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "rchar: %" SCNu64, &rchar) != 1)
+        {
+            rchar = 0;
+        }
+
+        fclose(fp);
+    }
+
+    return rchar;
+}
+
+static tr_torrent* big_torrent_init(tr_session* session, uint64_t size, uint32_t piece_size)
+{
+    size_t const piece_count = (size + piece_size - 1) / piece_size;
+    char* pieces = tr_new(char, piece_count * SHA_DIGEST_LENGTH);
+    uint8_t* zeroes = tr_new0(uint8_t, piece_size);
+    char* metainfo;
+    size_t metainfo_len;
+    tr_variant top;
+    tr_variant* info;
+    tr_ctor* ctor;
+    tr_torrent* tor;
+    int err = 0;
+
+    /* the torrent's pieces are all zeroes */
+    for (size_t i = 0; i < piece_count; ++i)
+    {
+        uint32_t const len = i + 1 < piece_count ? piece_size : size - (uint64_t)i * piece_size;
+        tr_sha1((uint8_t*)pieces + i * SHA_DIGEST_LENGTH, zeroes, (int)len, NULL);
+    }
+
+    tr_variantInitDict(&top, 1);
+    info = tr_variantDictAddDict(&top, TR_KEY_info, 4);
+    tr_variantDictAddInt(info, TR_KEY_length, size);
+    tr_variantDictAddStr(info, TR_KEY_name, "cache-speed-test");
+    tr_variantDictAddInt(info, TR_KEY_piece_length, piece_size);
+    tr_variantDictAddRaw(info, TR_KEY_pieces, pieces, piece_count * SHA_DIGEST_LENGTH);
+    metainfo = tr_variantToStr(&top, TR_VARIANT_FMT_BENC, &metainfo_len);
+
+    ctor = tr_ctorNew(session);
+    tr_ctorSetMetainfo(ctor, (uint8_t*)metainfo, metainfo_len);
+    tr_ctorSetPaused(ctor, TR_FORCE, true);
+    tor = tr_torrentNew(ctor, &err, NULL);
+    TR_ASSERT(err == 0);
+
+    tr_ctorFree(ctor);
+    tr_free(metainfo);
+    tr_variantFree(&top);
+    tr_free(zeroes);
+    tr_free(pieces);
+    return tor;
+}
+
+/* fills the cache the way a swarm does, a few pieces at a time in random order */
+static void fill_cache(void* vdata)
+{
+    enum
+    {
+        ACTIVE_PIECES = 16
+    };
+
+    struct cache_test_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    tr_cache* cache = tor->session->cache;
+    uint8_t* block = tr_new0(uint8_t, tor->blockSize);
+    struct evbuffer* buf = evbuffer_new();
+    tr_piece_index_t* order = tr_new(tr_piece_index_t, tor->info.pieceCount);
+    tr_piece_index_t next = 0;
+    tr_piece_index_t active[ACTIVE_PIECES];
+    uint32_t offsets[ACTIVE_PIECES];
+    int n_active = 0;
+    tr_piece_index_t n_passed = 0;
+    uint64_t bytes_read;
+    clock_t start;
+
+    tr_cacheSetLimit(cache, data->cache_bytes);
+
+    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+    {
+        order[i] = i;
+    }
+
+    for (tr_piece_index_t i = tor->info.pieceCount - 1; i > 0; --i)
+    {
+        tr_piece_index_t const j = tr_rand_int_weak(i + 1);
+        tr_piece_index_t const tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    start = clock();
+    bytes_read = get_bytes_read();
+
+    while (next < tor->info.pieceCount || n_active > 0)
+    {
+        int i;
+        uint32_t len;
+
+        while (n_active < ACTIVE_PIECES && next < tor->info.pieceCount)
+        {
+            active[n_active] = order[next++];
+            offsets[n_active++] = 0;
+        }
+
+        i = tr_rand_int_weak(n_active);
+        len = MIN(tor->blockSize, tr_torPieceCountBytes(tor, active[i]) - offsets[i]);
+        evbuffer_add(buf, block, len);
+        tr_cacheWriteBlock(cache, tor, active[i], offsets[i], len, buf);
+        offsets[i] += len;
+
+        if (offsets[i] == tr_torPieceCountBytes(tor, active[i]))
+        {
+            n_passed += tr_ioTestPiece(tor, active[i]) ? 1 : 0;
+            active[i] = active[--n_active];
+            offsets[i] = offsets[n_active];
+        }
+    }
+
+    bytes_read = get_bytes_read() - bytes_read;
+    fprintf(stderr, "%" PRId64 " MiB cache: %zu blocks written and %zu pieces checked in %.2f s\n", data->cache_bytes >> 20,
+        (size_t)tor->blockCount, (size_t)n_passed, (double)(clock() - start) / CLOCKS_PER_SEC);
+    fprintf(stderr, "%" PRId64 " MiB cache: %.3f bytes read per byte downloaded\n", data->cache_bytes >> 20,
+        (double)bytes_read / tor->info.totalSize);
+
+    start = clock();
+
+    for (tr_block_index_t b = 0; b < tor->blockCount; ++b)
+    {
+        uint64_t const offset = (uint64_t)b * tor->blockSize;
+        tr_piece_index_t const piece = offset / tor->info.pieceSize;
+
+        tr_cacheHasBlock(cache, tor, piece, offset - (uint64_t)piece * tor->info.pieceSize);
+    }
+
+    fprintf(stderr, "%" PRId64 " MiB cache: %zu lookups in %.2f s\n", data->cache_bytes >> 20, (size_t)tor->blockCount,
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+
+    start = clock();
+    tr_cacheFlushTorrent(cache, tor);
+    fprintf(stderr, "%" PRId64 " MiB cache: flushed to disk in %.2f s\n", data->cache_bytes >> 20,
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+
+    tr_free(order);
+    evbuffer_free(buf);
+    tr_free(block);
+    data->done = true;
+}
+
+struct latency_data
+{
+    tr_torrent* tor;
+    tr_piece_index_t piece;
+    bool done;
+};
+
+/* downloads one piece into the cache */
+static void write_piece(void* vdata)
+{
+    struct latency_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    uint32_t const pieceLen = tr_torPieceCountBytes(tor, data->piece);
+    uint8_t* block = tr_new0(uint8_t, tor->blockSize);
+    struct evbuffer* buf = evbuffer_new();
+
+    for (uint32_t offset = 0; offset < pieceLen; offset += tor->blockSize)
+    {
+        uint32_t const len = MIN(tor->blockSize, pieceLen - offset);
+
+        evbuffer_add(buf, block, len);
+        tr_cacheWriteBlock(tor->session->cache, tor, data->piece, offset, len, buf);
+    }
+
+    evbuffer_free(buf);
+    tr_free(block);
+    data->done = true;
+}
+
+struct disk_hog
+{
+    char* path;
+    bool stop;
+    bool stopped;
+};
+
+/* keeps the disk busy with synced writes, the way another program would */
+static void disk_hog_func(void* vhog)
+{
+    struct disk_hog* hog = vhog;
+    size_t const len = 4 * 1024 * 1024;
+    uint8_t* buf = tr_new0(uint8_t, len);
+    tr_sys_file_t fd = tr_sys_file_open(hog->path, TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE | TR_SYS_FILE_TRUNCATE, 0600, NULL);
+
+    for (uint64_t offset = 0; fd != TR_BAD_SYS_FILE && !hog->stop; offset = (offset + len) % (256 * len))
+    {
+        tr_sys_file_write_at(fd, buf, len, offset, NULL, NULL);
+        tr_sys_file_flush(fd, NULL);
+    }
+
+    if (fd != TR_BAD_SYS_FILE)
+    {
+        tr_sys_file_close(fd, NULL);
+    }
+
+    tr_free(buf);
+    hog->stopped = true;
+}
+
+/* How long the libtransmission thread is tied up while a torrent downloads
+ * as fast as the disk can take it. Each piece is handed to the thread on
+ * its own, so the time it takes is how long other work would have waited. */
+static int test_flush_latency(void)
+{
+    uint64_t const size = 2048 * 1024 * 1024LL;
+    tr_variant settings;
+    tr_session* session;
+    struct latency_data data;
+    struct disk_hog hog;
+    uint64_t start;
+    uint64_t total = 0;
+    uint64_t longest = 0;
+    size_t slow = 0;
+
+    tr_variantInitDict(&settings, 1);
+    tr_variantDictAddInt(&settings, TR_KEY_cache_size_mb, 4);
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+
+    data.tor = big_torrent_init(session, size, 1024 * 1024);
+
+    hog.path = tr_buildPath(tr_sessionGetDownloadDir(session), "disk-hog", NULL);
+    hog.stop = hog.stopped = false;
+    tr_threadNew(disk_hog_func, &hog);
+
+    start = tr_time_msec();
+
+    for (data.piece = 0; data.piece < data.tor->info.pieceCount; ++data.piece)
+    {
+        uint64_t const pieceStart = tr_time_msec();
+        uint64_t elapsed;
+
+        data.done = false;
+        tr_runInEventThread(session, write_piece, &data);
+
+        while (!data.done)
+        {
+            tr_wait_msec(1);
+        }
+
+        elapsed = tr_time_msec() - pieceStart;
+        total += elapsed;
+        longest = MAX(longest, elapsed);
+        slow += elapsed >= 100 ? 1 : 0;
+    }
+
+    fprintf(stderr, "%" PRIu64 " MiB downloaded in %.2f s\n", size >> 20, (tr_time_msec() - start) / 1000.0);
+    fprintf(stderr, "libtransmission thread held %.1f ms per 1 MiB piece on average, %" PRIu64 " ms at most, "
+        "%zu pieces took 100 ms or more\n", (double)total / data.tor->info.pieceCount, longest, slow);
+
+    hog.stop = true;
+
+    while (!hog.stopped)
+    {
+        tr_wait_msec(10);
+    }
+
+    tr_sys_path_remove(hog.path, NULL);
+    tr_free(hog.path);
+
+    tr_torrentRemove(data.tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+/* This needs as much free memory and disk space as the biggest cache */
+static int test_speed(void)
+{
+    int64_t const sizes[] = { 256 * 1024 * 1024LL, 256 * 1024 * 1024LL, 2048 * 1024 * 1024LL, 8192 * 1024 * 1024LL };
+    int64_t const cache_sizes[] = { 4 * 1024 * 1024LL, 256 * 1024 * 1024LL, 2048 * 1024 * 1024LL, 8192 * 1024 * 1024LL };
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(sizes); ++i)
+    {
+        tr_session* session = libttest_session_init(NULL);
+        struct cache_test_data data;
+
+        data.tor = big_torrent_init(session, sizes[i], 1024 * 1024);
+        data.cache_bytes = cache_sizes[i];
+        run_and_wait(session, fill_cache, &data);
+
+        tr_torrentRemove(data.tor, true, NULL);
+        libttest_session_close(session);
+    }
+
+    return 0;
+}
+
+struct read_speed_data
+{
+    tr_torrent* tor;
+    uint8_t* buffers[64];
+    int free_buffers[64];
+    int n_free;
+    tr_piece_index_t piece;
+    uint32_t offset;
+    size_t issued;
+    size_t completed;
+    size_t total;
+    int err;
+    bool issuing;
+    bool done;
+};
+
+struct read_speed_request
+{
+    struct read_speed_data* data;
+    int buffer;
+};
+
+static void issue_reads(struct read_speed_data* data);
+
+static void onSpeedReadDone(tr_session* session UNUSED, int torrent_id UNUSED, int err, void* vreq)
+{
+    struct read_speed_request* req = vreq;
+    struct read_speed_data* data = req->data;
+
+    data->err |= err;
+    data->free_buffers[data->n_free++] = req->buffer;
+    ++data->completed;
+    tr_free(req);
+
+    /* hits are called back right away, so let the loop in issue_reads() send the next one */
+    if (!data->issuing)
+    {
+        issue_reads(data);
+    }
+}
+
+/* asks for pieces the way a swarm does when a few of them are popular:
+ * nine in ten are from the first 12 MiB of the torrent, the rest from anywhere */
+static void issue_reads(struct read_speed_data* data)
+{
+    tr_torrent* tor = data->tor;
+    tr_piece_index_t const hot_pieces = MAX(1, 12 * 1024 * 1024 / tor->info.pieceSize);
+
+    data->issuing = true;
+
+    while (data->n_free > 0 && data->issued < data->total)
+    {
+        struct read_speed_request* req = tr_new(struct read_speed_request, 1);
+        uint32_t const len = MIN(tor->blockSize, tr_torPieceCountBytes(tor, data->piece) - data->offset);
+
+        req->data = data;
+        req->buffer = data->free_buffers[--data->n_free];
+        ++data->issued;
+        tr_cacheReadBlockAsync(tor->session->cache, tor, data->piece, data->offset, len, data->buffers[req->buffer],
+            onSpeedReadDone, req);
+
+        data->offset += len;
+
+        if (data->offset == tr_torPieceCountBytes(tor, data->piece))
+        {
+            data->piece = tr_rand_int_weak(10) != 0 ? tr_rand_int_weak(hot_pieces) :
+                tr_rand_int_weak(tor->info.pieceCount);
+            data->offset = 0;
+        }
+    }
+
+    data->issuing = false;
+    data->done = data->completed == data->total;
+}
+
+static void start_reads(void* vdata)
+{
+    issue_reads(vdata);
+}
+
+/* How well the read cache serves a seeding torrent, for a few piece sizes.
+ * The pieces are read back from the page cache, so this measures the reads
+ * and copies that the cache saves, not the disk. */
+static int test_read_speed(void)
+{
+    uint64_t const size = 256 * 1024 * 1024;
+    uint32_t const piece_sizes[] = { 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(piece_sizes); ++i)
+    {
+        tr_session* session = libttest_session_init(NULL);
+        struct read_speed_data data;
+        uint8_t* zeroes = tr_new0(uint8_t, piece_sizes[i]);
+        uint64_t bytes_read;
+        uint64_t start;
+        uint64_t elapsed;
+        uint64_t hits;
+        uint64_t misses;
+
+        tr_sessionSetReadCacheLimit_MB(session, 16);
+        data.tor = big_torrent_init(session, size, piece_sizes[i]);
+
+        for (tr_piece_index_t piece = 0; piece < data.tor->info.pieceCount; ++piece)
+        {
+            check_int(tr_ioWrite(data.tor, NULL, piece, 0, tr_torPieceCountBytes(data.tor, piece), zeroes), ==, 0);
+        }
+
+        libttest_blockingTorrentVerify(data.tor);
+        check(tr_torrentIsSeed(data.tor));
+
+        for (int j = 0; j < (int)TR_N_ELEMENTS(data.buffers); ++j)
+        {
+            data.buffers[j] = tr_new(uint8_t, data.tor->blockSize);
+            data.free_buffers[j] = j;
+        }
+
+        data.n_free = TR_N_ELEMENTS(data.buffers);
+        data.piece = 0;
+        data.offset = 0;
+        data.issued = data.completed = 0;
+        data.total = 65536;
+        data.err = 0;
+        data.issuing = data.done = false;
+
+        start = tr_time_msec();
+        bytes_read = get_bytes_read();
+        tr_runInEventThread(session, start_reads, &data);
+
+        while (!data.done)
+        {
+            tr_wait_msec(1);
+        }
+
+        check_int(data.err, ==, 0);
+        elapsed = MAX(tr_time_msec() - start, 1);
+        bytes_read = get_bytes_read() - bytes_read;
+        tr_cacheGetReadStats(session->cache, &hits, &misses);
+        fprintf(stderr, "%u MiB pieces: %zu blocks served in %.2f s (%.0f MiB/s), %.1f%% from memory, "
+            "%.2f bytes read per byte served\n", piece_sizes[i] >> 20, data.total, elapsed / 1000.0,
+            (double)data.total * data.tor->blockSize / (1024 * 1024) / (elapsed / 1000.0), 100.0 * hits / (hits + misses),
+            (double)bytes_read / ((double)data.total * data.tor->blockSize));
+
+        for (size_t j = 0; j < TR_N_ELEMENTS(data.buffers); ++j)
+        {
+            tr_free(data.buffers[j]);
+        }
+
+        tr_free(zeroes);
+        tr_torrentRemove(data.tor, true, NULL);
+        libttest_session_close(session);
+    }
+
+    return 0;
+}
+
+#endif
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_write_and_flush,
+        test_piece_hash,
+        test_piece_hash_lifetime,
+#if SPEED_TEST
+        test_flush_latency,
+        test_speed,
+        test_read_speed
+#endif
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
@@ -7,11 +7,14 @@
  */
 
 #include <stdlib.h> /* qsort() */
+#include <string.h> /* memcpy() */
 
 #include <event2/buffer.h>
 
 #include "transmission.h"
 #include "cache.h"
+#include "crypto-utils.h" /* tr_sha1_init(), tr_sha1_update() */
+#include "disk-io.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
@@ -41,11 +44,117 @@ struct cache_block
     tr_block_index_t block;
 
     struct evbuffer* evbuf;
+
+    struct cache_block* hash_next;
+
+    /* the run that this block is in. This is only kept
+     * up to date for the first and last blocks of a run. */
+    struct cache_run* run;
+};
+
+/* A stretch of contiguous blocks from one torrent, which can be written
+ * to disk together. Runs are grown and merged as blocks arrive, and are
+ * kept in a heap with the one that should be flushed first on top. */
+struct cache_run
+{
+    tr_torrent* tor;
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    time_t time; /* when the run last grew */
+    bool is_piece_done;
+    bool is_multi_piece;
+
+    int heap_pos;
+};
+
+/* The SHA1 of a piece being downloaded, worked out as its blocks arrive so
+ * that checking the piece needn't read it back from disk. Blocks are hashed
+ * in order, so one that arrives early is hashed when the gap before it fills,
+ * as long as it's still in the cache by then. */
+struct piece_hasher
+{
+    int torrent_id;
+    tr_piece_index_t piece;
+    uint32_t hashed; /* how many bytes from the start of the piece have been hashed */
+    tr_sha1_ctx_t sha;
+    time_t time; /* when a block of the piece was last written */
+
+    struct piece_hasher* hash_next;
+
+    /* in the idle list, most recently written first */
+    struct piece_hasher* prev;
+    struct piece_hasher* next;
+};
+
+/* A piece that's been read from disk to upload to peers. Pieces that are
+ * too big to cache whole are cached in block-aligned spans instead.
+ *
+ * The read cache keeps these with the 2Q replacement policy: pieces that
+ * have been asked for once go into a FIFO that gets a quarter of the cache,
+ * and pieces that get asked for again after they've fallen out of it go
+ * into an LRU list that gets the rest. The pieces that fell out are kept
+ * for a while as "ghosts", without their data, to notice the second ask.
+ * This way one pass over a big torrent can't push out the popular pieces. */
+struct read_piece
+{
+    tr_torrent* tor; /* NULL if the torrent was flushed while it was loading */
+    int torrent_id;
+    tr_piece_index_t piece;
+    uint32_t offset; /* where the span starts in the piece */
+    uint32_t length;
+
+    uint8_t* data; /* NULL for ghosts */
+    bool loading;
+    bool hot; /* for loading pieces: whether it goes to the hot list once it's loaded */
+    int list; /* READ_LIST_* */
+
+    /* requests waiting for it to load */
+    tr_ptrArray waiters;
+
+    struct read_piece* hash_next;
+
+    struct read_piece* prev;
+    struct read_piece* next;
+};
+
+enum
+{
+    READ_LIST_NONE,
+    READ_LIST_NEW, /* asked for once, FIFO */
+    READ_LIST_HOT, /* asked for again, LRU */
+    READ_LIST_GHOSTS, /* evicted from NEW, no data, FIFO */
+    READ_LIST_COUNT
+};
+
+struct read_list
+{
+    struct read_piece* head;
+    struct read_piece* tail;
+    size_t bytes;
+};
+
+struct read_waiter
+{
+    uint32_t offset;
+    uint32_t length;
+    uint8_t* setme;
+    tr_disk_io_done_func callback;
+    void* user_data;
 };
 
 struct tr_cache
 {
-    tr_ptrArray blocks;
+    /* the blocks, hashed by torrent and block index */
+    struct cache_block** buckets;
+    size_t bucket_count; /* a power of two */
+    int block_count;
+
+    /* the runs of blocks, as a binary heap */
+    struct cache_run** runs;
+    int run_count;
+    int run_alloc;
+
     int max_blocks;
     size_t max_bytes;
 
@@ -53,276 +162,1186 @@ struct tr_cache
     size_t disk_write_bytes;
     size_t cache_writes;
     size_t cache_write_bytes;
+
+    /* the read cache's pieces and spans, hashed by torrent and piece index */
+    struct read_piece** read_buckets;
+    size_t read_bucket_count; /* a power of two */
+    int read_piece_count;
+
+    struct read_list read_lists[READ_LIST_COUNT];
+    size_t read_max_bytes;
+    size_t read_loading_bytes; /* being read from disk, not in any list yet */
+    uint64_t read_hits;
+    uint64_t read_misses;
+
+    /* the piece hashers, hashed by torrent and piece index */
+    struct piece_hasher** hasher_buckets;
+    size_t hasher_bucket_count; /* a power of two */
+    int hasher_count;
+
+    /* and listed by when they were last fed, so the idle ones can be dropped from the end */
+    struct piece_hasher* hashers_newest;
+    struct piece_hasher* hashers_oldest;
 };
 
 /****
 *****
 ****/
 
-struct run_info
+enum
+{
+    /* a minimum bucket count for the block hash */
+    MIN_BUCKETS = 256,
+    /* a minimum bucket count for the read cache's and the piece hashers' hashes */
+    MIN_READ_BUCKETS = 64,
+    /* a long run is split into writes of at most this many bytes,
+     * so that it doesn't tie up its disk-io queue for too long */
+    MAX_FLUSH_BYTES = (2 * 1024 * 1024),
+    /* how many pieces can be hashed as they arrive at once. Pieces
+     * past this are checked by reading them back, as usual */
+    MAX_PIECE_HASHERS = 1024,
+    /* a piece that's gone this long without a block written to it was
+     * probably abandoned, so its hasher gives up its place to others */
+    PIECE_HASHER_IDLE_SECS = 120
+};
+
+static inline size_t hashIndex(size_t bucket_count, int torrent_id, uint32_t index)
+{
+    uint32_t const h = (uint32_t)torrent_id * 2654435761U ^ index * 2246822519U;
+
+    return (h ^ (h >> 16)) & (bucket_count - 1);
+}
+
+static inline size_t blockHash(tr_cache const* cache, int torrent_id, tr_block_index_t block)
+{
+    return hashIndex(cache->bucket_count, torrent_id, block);
+}
+
+static void rehashBlocks(tr_cache* cache, size_t bucket_count)
+{
+    struct cache_block** old = cache->buckets;
+    size_t const old_count = cache->bucket_count;
+
+    cache->bucket_count = bucket_count;
+    cache->buckets = tr_new0(struct cache_block*, bucket_count);
+
+    for (size_t i = 0; i < old_count; ++i)
+    {
+        struct cache_block* next;
+
+        for (struct cache_block* b = old[i]; b != NULL; b = next)
+        {
+            size_t const h = blockHash(cache, b->tor->uniqueId, b->block);
+            next = b->hash_next;
+            b->hash_next = cache->buckets[h];
+            cache->buckets[h] = b;
+        }
+    }
+
+    tr_free(old);
+}
+
+static struct cache_block* findBlockByIndex(tr_cache const* cache, tr_torrent const* torrent, tr_block_index_t block)
+{
+    for (struct cache_block* b = cache->buckets[blockHash(cache, torrent->uniqueId, block)]; b != NULL; b = b->hash_next)
+    {
+        if (b->block == block && b->tor == torrent)
+        {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+static struct cache_block* findBlock(tr_cache const* cache, tr_torrent const* torrent, tr_piece_index_t piece,
+    uint32_t offset)
+{
+    return findBlockByIndex(cache, torrent, _tr_block(torrent, piece, offset));
+}
+
+static void insertBlock(tr_cache* cache, struct cache_block* b)
+{
+    size_t h;
+
+    if ((size_t)cache->block_count >= cache->bucket_count)
+    {
+        rehashBlocks(cache, cache->bucket_count * 2);
+    }
+
+    h = blockHash(cache, b->tor->uniqueId, b->block);
+    b->hash_next = cache->buckets[h];
+    cache->buckets[h] = b;
+    ++cache->block_count;
+}
+
+static void removeBlock(tr_cache* cache, struct cache_block* b)
+{
+    struct cache_block** walk = &cache->buckets[blockHash(cache, b->tor->uniqueId, b->block)];
+
+    while (*walk != b)
+    {
+        walk = &(*walk)->hash_next;
+    }
+
+    *walk = b->hash_next;
+    --cache->block_count;
+}
+
+/***
+****  Runs
+***/
+
+/* This is 32 times the run's length plus its age in minutes times ~2, minus
+ * 32 times the current time. Leaving out the current time means that the
+ * runs' order doesn't change as they sit in the heap. */
+static int64_t getRunScore(struct cache_run const* run)
+{
+    return 32 * (int64_t)(run->last - run->first + 1) - run->time;
+}
+
+/* whether `a' should be flushed before `b' */
+static bool runOutranks(struct cache_run const* a, struct cache_run const* b)
+{
+    /* Flushing stale blocks should be a top priority as the probability of them
+     * growing is very small, for blocks on piece boundaries, and nonexistant for
+     * blocks inside pieces. */
+    if (a->is_piece_done != b->is_piece_done)
+    {
+        return a->is_piece_done;
+    }
+
+    /* Move the multi piece runs higher */
+    if (a->is_multi_piece != b->is_multi_piece)
+    {
+        return a->is_multi_piece;
+    }
+
+    /* Then the longest runs, and the ones that have languished in the cache */
+    return getRunScore(a) > getRunScore(b);
+}
+
+static void heapSet(tr_cache* cache, int pos, struct cache_run* run)
+{
+    cache->runs[pos] = run;
+    run->heap_pos = pos;
+}
+
+static void heapSiftUp(tr_cache* cache, int pos)
+{
+    struct cache_run* run = cache->runs[pos];
+
+    while (pos > 0)
+    {
+        int const parent = (pos - 1) / 2;
+
+        if (!runOutranks(run, cache->runs[parent]))
+        {
+            break;
+        }
+
+        heapSet(cache, pos, cache->runs[parent]);
+        pos = parent;
+    }
+
+    heapSet(cache, pos, run);
+}
+
+static void heapSiftDown(tr_cache* cache, int pos)
+{
+    struct cache_run* run = cache->runs[pos];
+
+    for (;;)
+    {
+        int child = pos * 2 + 1;
+
+        if (child >= cache->run_count)
+        {
+            break;
+        }
+
+        if (child + 1 < cache->run_count && runOutranks(cache->runs[child + 1], cache->runs[child]))
+        {
+            ++child;
+        }
+
+        if (!runOutranks(cache->runs[child], run))
+        {
+            break;
+        }
+
+        heapSet(cache, pos, cache->runs[child]);
+        pos = child;
+    }
+
+    heapSet(cache, pos, run);
+}
+
+/* call this when a run's rank has changed */
+static void heapUpdate(tr_cache* cache, struct cache_run* run)
+{
+    heapSiftUp(cache, run->heap_pos);
+    heapSiftDown(cache, run->heap_pos);
+}
+
+static void heapPush(tr_cache* cache, struct cache_run* run)
+{
+    if (cache->run_count == cache->run_alloc)
+    {
+        cache->run_alloc = MAX(64, cache->run_alloc * 2);
+        cache->runs = tr_renew(struct cache_run*, cache->runs, cache->run_alloc);
+    }
+
+    heapSet(cache, cache->run_count++, run);
+    heapSiftUp(cache, run->heap_pos);
+}
+
+static void heapRemove(tr_cache* cache, struct cache_run* run)
+{
+    int const pos = run->heap_pos;
+    struct cache_run* moved = cache->runs[--cache->run_count];
+
+    if (moved != run)
+    {
+        heapSet(cache, pos, moved);
+        heapUpdate(cache, moved);
+    }
+}
+
+static void updateRunFlags(struct cache_run* run)
+{
+    tr_piece_index_t const last_piece = tr_torBlockPiece(run->tor, run->last);
+
+    run->is_piece_done = tr_torrentPieceIsComplete(run->tor, last_piece);
+    run->is_multi_piece = tr_torBlockPiece(run->tor, run->first) != last_piece;
+}
+
+/* adds a new block to the run that it extends, or gives it a run of its own */
+static void addBlockToRuns(tr_cache* cache, struct cache_block* cb)
+{
+    struct cache_block* prev = cb->block > 0 ? findBlockByIndex(cache, cb->tor, cb->block - 1) : NULL;
+    struct cache_block* next = findBlockByIndex(cache, cb->tor, cb->block + 1);
+    struct cache_run* run;
+
+    if (prev != NULL && next != NULL)
+    {
+        /* it fills the gap between two runs, so they become one */
+        struct cache_run* gone = next->run;
+        run = prev->run;
+        run->last = gone->last;
+        findBlockByIndex(cache, cb->tor, run->last)->run = run;
+        heapRemove(cache, gone);
+        tr_free(gone);
+    }
+    else if (prev != NULL)
+    {
+        run = prev->run;
+        run->last = cb->block;
+    }
+    else if (next != NULL)
+    {
+        run = next->run;
+        run->first = cb->block;
+    }
+    else
+    {
+        run = tr_new0(struct cache_run, 1);
+        run->tor = cb->tor;
+        run->first = run->last = cb->block;
+        run->heap_pos = -1;
+    }
+
+    cb->run = run;
+    run->time = cb->time;
+    updateRunFlags(run);
+
+    if (run->heap_pos < 0)
+    {
+        heapPush(cache, run);
+    }
+    else
+    {
+        heapUpdate(cache, run);
+    }
+}
+
+static int cacheTrim(tr_cache* cache);
+
+/* called in the libtransmission thread once a flushed run has been written */
+static void onRunWritten(tr_session* session, int torrent_id, int err, void* user_data UNUSED)
+{
+    tr_torrent* tor;
+
+    if (err != 0 && (tor = tr_torrentFindFromId(session, torrent_id)) != NULL && tor->error != TR_STAT_LOCAL_ERROR)
+    {
+        tr_torrentSetLocalError(tor, "%s (%s)", tr_strerror(err), tr_torrentGetCurrentDir(tor));
+    }
+
+    /* if the cache was left full while the disk caught up, pick up where it stopped */
+    cacheTrim(session->cache);
+}
+
+/* Queues writes of the run's blocks. If `mayDefer' is true and the disk
+ * falls behind, this stops early and leaves the rest of the run cached. */
+static int flushRun(tr_cache* cache, struct cache_run* run, bool mayDefer)
+{
+    int err = 0;
+    tr_torrent* tor = run->tor;
+    tr_disk_io* io = tor->session->diskIo;
+    tr_block_index_t const last = run->last;
+    tr_block_index_t block = run->first;
+
+    heapRemove(cache, run);
+    tr_free(run);
+
+    while (block <= last)
+    {
+        struct cache_block* b = findBlockByIndex(cache, tor, block);
+        tr_piece_index_t const piece = b->piece;
+        uint32_t const offset = b->offset;
+        struct evbuffer* buf;
+        size_t len;
+
+        if (mayDefer && tr_diskIoIsBacklogged(io))
+        {
+            /* put what's left back as a run of its own */
+            run = tr_new0(struct cache_run, 1);
+            run->tor = tor;
+            run->first = block;
+            run->last = last;
+            run->time = b->time;
+            run->heap_pos = -1;
+            b->run = run;
+            findBlockByIndex(cache, tor, last)->run = run;
+            updateRunFlags(run);
+            heapPush(cache, run);
+            break;
+        }
+
+        buf = evbuffer_new();
+
+        for (; block <= last && evbuffer_get_length(buf) < MAX_FLUSH_BYTES; ++block)
+        {
+            b = findBlockByIndex(cache, tor, block);
+
+            TR_ASSERT(b != NULL);
+
+            removeBlock(cache, b);
+            evbuffer_add_buffer(buf, b->evbuf); /* by reference, not a copy */
+            evbuffer_free(b->evbuf);
+            tr_free(b);
+        }
+
+        /* the disk-io queue writes the blocks straight from their evbuffer
+           chains and frees buf when it's done */
+        len = evbuffer_get_length(buf);
+        tr_diskIoWrite(tor, piece, offset, buf, onRunWritten, NULL);
+
+        ++cache->disk_writes;
+        cache->disk_write_bytes += len;
+    }
+
+    return err;
+}
+
+/* Makes room in the cache. This is called from the peers' block handling,
+ * so it mustn't wait for the disk: if the disk-io queue is backlogged, the
+ * blocks stay in the cache until a write finishes and calls this again. */
+static int cacheTrim(tr_cache* cache)
+{
+    int err = 0;
+
+    if (cache->block_count > cache->max_blocks)
+    {
+        /* Amount of cache that should be removed by the flush. This influences how large
+         * runs can grow as well as how often flushes will happen. */
+        int const cacheCutoff = 1 + cache->max_blocks / 4;
+        int const oldCount = cache->block_count;
+
+        while (err == 0 && oldCount - cache->block_count < cacheCutoff && cache->run_count > 0)
+        {
+            struct cache_run* run = cache->runs[0];
+
+            if (tr_diskIoIsBacklogged(run->tor->session->diskIo))
+            {
+                break;
+            }
+
+            err = flushRun(cache, run, true);
+        }
+    }
+
+    return err;
+}
+
+/***
+****
+***/
+
+static int getMaxBlocks(int64_t max_bytes)
+{
+    return max_bytes / (double)MAX_BLOCK_SIZE;
+}
+
+int tr_cacheSetLimit(tr_cache* cache, int64_t max_bytes)
+{
+    char buf[128];
+
+    cache->max_bytes = max_bytes;
+    cache->max_blocks = getMaxBlocks(max_bytes);
+
+    tr_formatter_mem_B(buf, cache->max_bytes, sizeof(buf));
+    tr_logAddNamedDbg(MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
+
+    return cacheTrim(cache);
+}
+
+int64_t tr_cacheGetLimit(tr_cache const* cache)
+{
+    return cache->max_bytes;
+}
+
+static void dropReadPieces(tr_cache* cache, tr_torrent const* torrent);
+
+static void trimReadCache(tr_cache* cache);
+
+static void dropPieceHasher(tr_cache* cache, struct piece_hasher* ph);
+
+int tr_cacheSetReadLimit(tr_cache* cache, int64_t max_bytes)
+{
+    char buf[128];
+
+    if (cache->read_max_bytes == (size_t)max_bytes)
+    {
+        return 0;
+    }
+
+    cache->read_max_bytes = max_bytes;
+
+    tr_formatter_mem_B(buf, cache->read_max_bytes, sizeof(buf));
+    tr_logAddNamedDbg(MY_NAME, "Maximum read cache size set to %s", buf);
+
+    /* the span size depends on the limit, so start over */
+    dropReadPieces(cache, NULL);
+
+    return 0;
+}
+
+int64_t tr_cacheGetReadLimit(tr_cache const* cache)
+{
+    return cache->read_max_bytes;
+}
+
+void tr_cacheGetReadStats(tr_cache const* cache, uint64_t* setme_hits, uint64_t* setme_misses)
+{
+    *setme_hits = cache->read_hits;
+    *setme_misses = cache->read_misses;
+}
+
+tr_cache* tr_cacheNew(int64_t max_bytes)
+{
+    tr_cache* cache = tr_new0(tr_cache, 1);
+    cache->bucket_count = MIN_BUCKETS;
+    cache->buckets = tr_new0(struct cache_block*, cache->bucket_count);
+    cache->max_bytes = max_bytes;
+    cache->max_blocks = getMaxBlocks(max_bytes);
+    cache->read_bucket_count = MIN_READ_BUCKETS;
+    cache->read_buckets = tr_new0(struct read_piece*, cache->read_bucket_count);
+    cache->hasher_bucket_count = MIN_READ_BUCKETS;
+    cache->hasher_buckets = tr_new0(struct piece_hasher*, cache->hasher_bucket_count);
+    return cache;
+}
+
+void tr_cacheFree(tr_cache* cache)
+{
+    TR_ASSERT(cache->block_count == 0);
+    TR_ASSERT(cache->run_count == 0);
+
+    dropReadPieces(cache, NULL);
+    tr_free(cache->read_buckets);
+
+    while (cache->hashers_oldest != NULL)
+    {
+        dropPieceHasher(cache, cache->hashers_oldest);
+    }
+
+    tr_free(cache->hasher_buckets);
+    tr_free(cache->runs);
+    tr_free(cache->buckets);
+    tr_free(cache);
+}
+
+/***
+****
+***/
+
+/***
+****  Read cache
+***/
+
+static inline size_t readPieceHash(tr_cache const* cache, int torrent_id, tr_piece_index_t piece)
+{
+    return hashIndex(cache->read_bucket_count, torrent_id, piece);
+}
+
+static void rehashReadPieces(tr_cache* cache, size_t bucket_count)
+{
+    struct read_piece** old = cache->read_buckets;
+    size_t const old_count = cache->read_bucket_count;
+
+    cache->read_bucket_count = bucket_count;
+    cache->read_buckets = tr_new0(struct read_piece*, bucket_count);
+
+    for (size_t i = 0; i < old_count; ++i)
+    {
+        struct read_piece* next;
+
+        for (struct read_piece* rp = old[i]; rp != NULL; rp = next)
+        {
+            size_t const h = readPieceHash(cache, rp->torrent_id, rp->piece);
+            next = rp->hash_next;
+            rp->hash_next = cache->read_buckets[h];
+            cache->read_buckets[h] = rp;
+        }
+    }
+
+    tr_free(old);
+}
+
+static void insertReadPiece(tr_cache* cache, struct read_piece* rp)
+{
+    size_t h;
+
+    if ((size_t)cache->read_piece_count >= cache->read_bucket_count)
+    {
+        rehashReadPieces(cache, cache->read_bucket_count * 2);
+    }
+
+    h = readPieceHash(cache, rp->torrent_id, rp->piece);
+    rp->hash_next = cache->read_buckets[h];
+    cache->read_buckets[h] = rp;
+    ++cache->read_piece_count;
+}
+
+static void removeReadPiece(tr_cache* cache, struct read_piece* rp)
+{
+    struct read_piece** walk = &cache->read_buckets[readPieceHash(cache, rp->torrent_id, rp->piece)];
+
+    while (*walk != rp)
+    {
+        walk = &(*walk)->hash_next;
+    }
+
+    *walk = rp->hash_next;
+    --cache->read_piece_count;
+}
+
+/* Pieces up to an eighth of the cache are cached whole, so that one of them
+ * can't crowd out the others. Bigger ones are cached in spans of that size,
+ * rounded down to whole blocks. */
+static uint32_t getReadSpanSize(tr_cache const* cache, tr_torrent const* torrent)
+{
+    size_t const cutoff = cache->read_max_bytes / 8;
+
+    if (torrent->info.pieceSize <= cutoff)
+    {
+        return torrent->info.pieceSize;
+    }
+
+    return MAX(torrent->blockSize, cutoff - cutoff % torrent->blockSize);
+}
+
+static struct read_piece* findReadPiece(tr_cache const* cache, tr_torrent const* torrent, tr_piece_index_t piece,
+    uint32_t offset)
+{
+    for (struct read_piece* rp = cache->read_buckets[readPieceHash(cache, torrent->uniqueId, piece)]; rp != NULL;
+        rp = rp->hash_next)
+    {
+        if (rp->piece == piece && rp->offset == offset && rp->torrent_id == torrent->uniqueId)
+        {
+            return rp;
+        }
+    }
+
+    return NULL;
+}
+
+static void readListRemove(tr_cache* cache, struct read_piece* rp)
+{
+    struct read_list* list = &cache->read_lists[rp->list];
+
+    if (rp->list == READ_LIST_NONE)
+    {
+        return;
+    }
+
+    if (rp->prev != NULL)
+    {
+        rp->prev->next = rp->next;
+    }
+    else
+    {
+        list->head = rp->next;
+    }
+
+    if (rp->next != NULL)
+    {
+        rp->next->prev = rp->prev;
+    }
+    else
+    {
+        list->tail = rp->prev;
+    }
+
+    list->bytes -= rp->length;
+    rp->list = READ_LIST_NONE;
+    rp->prev = rp->next = NULL;
+}
+
+static void readListPush(tr_cache* cache, struct read_piece* rp, int which)
+{
+    struct read_list* list = &cache->read_lists[which];
+
+    TR_ASSERT(rp->list == READ_LIST_NONE);
+
+    rp->list = which;
+    rp->prev = NULL;
+    rp->next = list->head;
+
+    if (list->head != NULL)
+    {
+        list->head->prev = rp;
+    }
+    else
+    {
+        list->tail = rp;
+    }
+
+    list->head = rp;
+    list->bytes += rp->length;
+}
+
+static void freeReadPiece(struct read_piece* rp)
+{
+    TR_ASSERT(tr_ptrArrayEmpty(&rp->waiters));
+
+    tr_ptrArrayDestruct(&rp->waiters, NULL);
+    tr_free(rp->data);
+    tr_free(rp);
+}
+
+static void dropReadPiece(tr_cache* cache, struct read_piece* rp)
+{
+    removeReadPiece(cache, rp);
+    readListRemove(cache, rp);
+
+    if (rp->loading)
+    {
+        /* the disk-io thread is still reading into it; onReadPieceLoaded() frees it */
+        rp->tor = NULL;
+    }
+    else
+    {
+        freeReadPiece(rp);
+    }
+}
+
+/* drops the read pieces of `torrent', or of every torrent if it's NULL */
+static void dropReadPieces(tr_cache* cache, tr_torrent const* torrent)
 {
-    int pos;
-    int rank;
-    time_t last_block_time;
-    bool is_multi_piece;
-    bool is_piece_done;
-    unsigned int len;
-};
+    for (size_t i = 0; i < cache->read_bucket_count; ++i)
+    {
+        struct read_piece* next;
+
+        for (struct read_piece* rp = cache->read_buckets[i]; rp != NULL; rp = next)
+        {
+            next = rp->hash_next;
+
+            if (torrent == NULL || rp->torrent_id == torrent->uniqueId)
+            {
+                dropReadPiece(cache, rp);
+            }
+        }
+    }
+}
 
-/* return a count of how many contiguous blocks there are starting at this pos */
-static int getBlockRun(tr_cache const* cache, int pos, struct run_info* info)
+static void trimReadCache(tr_cache* cache)
 {
-    int const n = tr_ptrArraySize(&cache->blocks);
-    struct cache_block const* const* blocks = (struct cache_block const* const*)tr_ptrArrayBase(&cache->blocks);
-    struct cache_block const* ref = blocks[pos];
-    tr_block_index_t block = ref->block;
-    int len = 0;
+    struct read_list* fresh = &cache->read_lists[READ_LIST_NEW];
+    struct read_list* hot = &cache->read_lists[READ_LIST_HOT];
+    struct read_list* ghosts = &cache->read_lists[READ_LIST_GHOSTS];
 
-    for (int i = pos; i < n; ++i, ++block, ++len)
+    while (fresh->bytes + hot->bytes + cache->read_loading_bytes > cache->read_max_bytes)
     {
-        struct cache_block const* b = blocks[i];
-
-        if (b->block != block)
+        if (fresh->tail != NULL && (fresh->bytes > cache->read_max_bytes / 4 || hot->tail == NULL))
         {
-            break;
+            /* keep the piece's key around to notice if it gets asked for again */
+            struct read_piece* rp = fresh->tail;
+            readListRemove(cache, rp);
+            tr_free(rp->data);
+            rp->data = NULL;
+            readListPush(cache, rp, READ_LIST_GHOSTS);
         }
-
-        if (b->tor != ref->tor)
+        else if (hot->tail != NULL)
+        {
+            dropReadPiece(cache, hot->tail);
+        }
+        else
         {
             break;
         }
+    }
+
+    while (ghosts->tail != NULL && ghosts->bytes > cache->read_max_bytes / 2)
+    {
+        dropReadPiece(cache, ghosts->tail);
+    }
+}
+
+/* a span is worth reading if it's small enough to not crowd out the others,
+ * if there's room for it next to the ones still loading,
+ * and if the disk has the latest version of all of it */
+static bool isReadCacheable(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t length)
+{
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    if (length > cache->read_max_bytes / 8 || cache->read_loading_bytes + length > cache->read_max_bytes)
+    {
+        return false;
+    }
 
-        // fprintf(stderr, "pos %d tor %d block %zu time %zu\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
+    if (!tr_torrentPieceIsComplete(torrent, piece) || tr_diskIoIsWriting(torrent))
+    {
+        return false;
     }
 
-    // fprintf(stderr, "run is %d long from [%d to %d)\n", len, pos, pos + len);
+    first = _tr_block(torrent, piece, offset);
+    last = _tr_block(torrent, piece, offset + length - 1);
 
-    if (info != NULL)
+    for (tr_block_index_t i = first; i <= last; ++i)
     {
-        struct cache_block const* b = blocks[pos + len - 1];
-        info->last_block_time = b->time;
-        info->is_piece_done = tr_torrentPieceIsComplete(b->tor, b->piece);
-        info->is_multi_piece = b->piece != blocks[pos]->piece;
-        info->len = len;
-        info->pos = pos;
+        if (findBlockByIndex(cache, torrent, i) != NULL)
+        {
+            return false;
+        }
     }
 
-    return len;
+    return true;
 }
 
-/* higher rank comes before lower rank */
-static int compareRuns(void const* va, void const* vb)
+/* @return the offset of the span that holds [offset, offset + len), or -1 if it straddles two */
+static int64_t getReadSpan(tr_cache const* cache, tr_torrent const* torrent, uint32_t offset, uint32_t len)
 {
-    struct run_info const* a = va;
-    struct run_info const* b = vb;
-    return b->rank - a->rank;
+    uint32_t const span_size = getReadSpanSize(cache, torrent);
+    uint32_t const span_offset = offset - offset % span_size;
+
+    return len == 0 || offset + len - span_offset <= span_size ? (int64_t)span_offset : -1;
 }
 
-enum
+/* @return the span holding [offset, offset + len) if it's in memory and ready to be read */
+static struct read_piece* getReadPiece(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset,
+    uint32_t len)
 {
-    MULTIFLAG = 0x1000,
-    DONEFLAG = 0x2000,
-    SESSIONFLAG = 0x4000
-};
+    int64_t const span_offset = getReadSpan(cache, torrent, offset, len);
+    struct read_piece* rp = span_offset >= 0 ? findReadPiece(cache, torrent, piece, span_offset) : NULL;
 
-/* Calculte runs
- *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
- *     Returns number of runs.
- */
-static int calcRuns(tr_cache* cache, struct run_info* runs)
+    return rp != NULL && rp->data != NULL && !rp->loading ? rp : NULL;
+}
+
+static void readFromReadPiece(tr_cache* cache, struct read_piece* rp, uint32_t offset, uint32_t len, uint8_t* setme)
 {
-    int const n = tr_ptrArraySize(&cache->blocks);
-    int i = 0;
-    time_t const now = tr_time();
+    TR_ASSERT(offset >= rp->offset);
+    TR_ASSERT(offset + len <= rp->offset + rp->length);
+
+    memcpy(setme, rp->data + (offset - rp->offset), len);
+    ++cache->read_hits;
 
-    for (int pos = 0; pos < n; pos += runs[i++].len)
+    if (rp->list == READ_LIST_HOT)
     {
-        int rank = getBlockRun(cache, pos, &runs[i]);
+        readListRemove(cache, rp);
+        readListPush(cache, rp, READ_LIST_HOT);
+    }
+}
+
+static void onReadPieceLoaded(tr_session* session, int torrent_id, int err, void* vrp)
+{
+    struct read_piece* rp = vrp;
+    tr_cache* cache = session->cache;
+    int n;
+    struct read_waiter** waiters = (struct read_waiter**)tr_ptrArrayPeek(&rp->waiters, &n);
 
-        /* This adds ~2 to the relative length of a run for every minute it has
-         * languished in the cache. */
-        rank += (now - runs[i].last_block_time) / 32;
+    rp->loading = false;
+    cache->read_loading_bytes -= rp->length;
 
-        /* Flushing stale blocks should be a top priority as the probability of them
-         * growing is very small, for blocks on piece boundaries, and nonexistant for
-         * blocks inside pieces. */
-        rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+    /* fill in the requests before the piece can be evicted... */
+    for (int i = 0; err == 0 && i < n; ++i)
+    {
+        memcpy(waiters[i]->setme, rp->data + (waiters[i]->offset - rp->offset), waiters[i]->length);
+    }
 
-        /* Move the multi piece runs higher */
-        rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+    rp->waiters = TR_PTR_ARRAY_INIT;
 
-        runs[i].rank = rank;
+    if (rp->tor == NULL)
+    {
+        freeReadPiece(rp);
+    }
+    else if (err != 0)
+    {
+        dropReadPiece(cache, rp);
+    }
+    else
+    {
+        readListPush(cache, rp, rp->hot ? READ_LIST_HOT : READ_LIST_NEW);
+        trimReadCache(cache);
+    }
 
-        // fprintf(stderr, "block run at pos %d of length %d and age %ld adjusted +%d\n", runs[i].pos, runs[i].len,
-        //     now - runs[i].last_block_time, rank - runs[i].len);
+    /* ...and tell them about it after, since they may ask for more */
+    for (int i = 0; i < n; ++i)
+    {
+        (*waiters[i]->callback)(session, torrent_id, err, waiters[i]->user_data);
+        tr_free(waiters[i]);
     }
 
-    // fprintf(stderr, "%d block runs\n", i);
-    qsort(runs, i, sizeof(struct run_info), compareRuns);
-    return i;
+    tr_free(waiters);
 }
 
-static int flushContiguous(tr_cache* cache, int pos, int n)
+void tr_cacheReadBlockAsync(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    uint8_t* setme, tr_disk_io_done_func callback, void* user_data)
 {
-    int err = 0;
-    uint8_t* buf = tr_new(uint8_t, n * MAX_BLOCK_SIZE);
-    uint8_t* walk = buf;
-    struct cache_block** blocks = (struct cache_block**)tr_ptrArrayBase(&cache->blocks);
+    TR_ASSERT(tr_amInEventThread(torrent->session));
 
-    struct cache_block* b = blocks[pos];
-    tr_torrent* tor = b->tor;
-    tr_piece_index_t const piece = b->piece;
-    uint32_t const offset = b->offset;
+    struct read_waiter* w;
+    struct read_piece* rp;
+    int64_t const span_offset = getReadSpan(cache, torrent, offset, len);
 
-    for (int i = 0; i < n; ++i)
+    if (span_offset < 0)
+    {
+        ++cache->read_misses;
+        tr_diskIoRead(torrent, piece, offset, len, setme, callback, user_data);
+        return;
+    }
+
+    if ((rp = getReadPiece(cache, torrent, piece, offset, len)) != NULL)
     {
-        b = blocks[pos + i];
-        evbuffer_copyout(b->evbuf, walk, b->length);
-        walk += b->length;
-        evbuffer_free(b->evbuf);
-        tr_free(b);
+        readFromReadPiece(cache, rp, offset, len, setme);
+        (*callback)(torrent->session, tr_torrentId(torrent), 0, user_data);
+        return;
     }
 
-    tr_ptrArrayErase(&cache->blocks, pos, pos + n);
+    rp = findReadPiece(cache, torrent, piece, span_offset);
+
+    if (rp == NULL || !rp->loading)
+    {
+        uint32_t const span_length = MIN(getReadSpanSize(cache, torrent),
+            tr_torPieceCountBytes(torrent, piece) - (uint32_t)span_offset);
 
-    err = tr_ioWrite(tor, piece, offset, walk - buf, buf);
-    tr_free(buf);
+        ++cache->read_misses;
 
-    ++cache->disk_writes;
-    cache->disk_write_bytes += walk - buf;
-    return err;
+        if (!isReadCacheable(cache, torrent, piece, span_offset, span_length))
+        {
+            tr_diskIoRead(torrent, piece, offset, len, setme, callback, user_data);
+            return;
+        }
+
+        if (rp == NULL)
+        {
+            rp = tr_new0(struct read_piece, 1);
+            rp->tor = torrent;
+            rp->torrent_id = torrent->uniqueId;
+            rp->piece = piece;
+            rp->offset = span_offset;
+            rp->length = span_length;
+            rp->waiters = TR_PTR_ARRAY_INIT;
+            insertReadPiece(cache, rp);
+        }
+        else
+        {
+            /* it's a ghost, so it's been asked for before */
+            readListRemove(cache, rp);
+            rp->hot = true;
+        }
+
+        /* read the whole span, since peers usually ask for all of it */
+        rp->data = tr_malloc(rp->length);
+        rp->loading = true;
+        cache->read_loading_bytes += rp->length;
+        trimReadCache(cache);
+        tr_diskIoRead(torrent, piece, rp->offset, rp->length, rp->data, onReadPieceLoaded, rp);
+    }
+    else
+    {
+        /* it's on the way */
+        ++cache->read_hits;
+    }
+
+    w = tr_new(struct read_waiter, 1);
+    w->offset = offset;
+    w->length = len;
+    w->setme = setme;
+    w->callback = callback;
+    w->user_data = user_data;
+    tr_ptrArrayAppend(&rp->waiters, w);
 }
 
-static int flushRuns(tr_cache* cache, struct run_info* runs, int n)
+void tr_cacheDropReadPiece(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece)
 {
-    int err = 0;
+    struct read_piece* next;
 
-    for (int i = 0; err == 0 && i < n; i++)
+    /* every span of the piece is in the same bucket */
+    for (struct read_piece* rp = cache->read_buckets[readPieceHash(cache, torrent->uniqueId, piece)]; rp != NULL; rp = next)
     {
-        err = flushContiguous(cache, runs[i].pos, runs[i].len);
+        next = rp->hash_next;
 
-        for (int j = i + 1; j < n; j++)
+        if (rp->piece == piece && rp->torrent_id == torrent->uniqueId)
         {
-            if (runs[j].pos > runs[i].pos)
-            {
-                runs[j].pos -= runs[i].len;
-            }
+            dropReadPiece(cache, rp);
         }
     }
+}
 
-    return err;
+/***
+****  Piece hashes
+***/
+
+static inline size_t pieceHasherHash(tr_cache const* cache, int torrent_id, tr_piece_index_t piece)
+{
+    return hashIndex(cache->hasher_bucket_count, torrent_id, piece);
 }
 
-static int cacheTrim(tr_cache* cache)
+static void rehashPieceHashers(tr_cache* cache, size_t bucket_count)
 {
-    int err = 0;
+    tr_free(cache->hasher_buckets);
+    cache->hasher_bucket_count = bucket_count;
+    cache->hasher_buckets = tr_new0(struct piece_hasher*, bucket_count);
 
-    if (tr_ptrArraySize(&cache->blocks) > cache->max_blocks)
+    /* every hasher is in the idle list, so there's no need to walk the old buckets */
+    for (struct piece_hasher* ph = cache->hashers_newest; ph != NULL; ph = ph->next)
     {
-        /* Amount of cache that should be removed by the flush. This influences how large
-         * runs can grow as well as how often flushes will happen. */
-        int const cacheCutoff = 1 + cache->max_blocks / 4;
-        struct run_info* runs = tr_new(struct run_info, tr_ptrArraySize(&cache->blocks));
-        int i = 0;
-        int j = 0;
-
-        calcRuns(cache, runs);
+        size_t const h = pieceHasherHash(cache, ph->torrent_id, ph->piece);
+        ph->hash_next = cache->hasher_buckets[h];
+        cache->hasher_buckets[h] = ph;
+    }
+}
 
-        while (j < cacheCutoff)
+static struct piece_hasher* findPieceHasher(tr_cache const* cache, tr_torrent const* torrent, tr_piece_index_t piece)
+{
+    for (struct piece_hasher* ph = cache->hasher_buckets[pieceHasherHash(cache, torrent->uniqueId, piece)]; ph != NULL;
+        ph = ph->hash_next)
+    {
+        if (ph->piece == piece && ph->torrent_id == torrent->uniqueId)
         {
-            j += runs[i++].len;
+            return ph;
         }
-
-        err = flushRuns(cache, runs, i);
-        tr_free(runs);
     }
 
-    return err;
+    return NULL;
 }
 
-/***
-****
-***/
-
-static int getMaxBlocks(int64_t max_bytes)
+static void hasherListRemove(tr_cache* cache, struct piece_hasher* ph)
 {
-    return max_bytes / (double)MAX_BLOCK_SIZE;
+    if (ph->prev != NULL)
+    {
+        ph->prev->next = ph->next;
+    }
+    else
+    {
+        cache->hashers_newest = ph->next;
+    }
+
+    if (ph->next != NULL)
+    {
+        ph->next->prev = ph->prev;
+    }
+    else
+    {
+        cache->hashers_oldest = ph->prev;
+    }
+
+    ph->prev = ph->next = NULL;
 }
 
-int tr_cacheSetLimit(tr_cache* cache, int64_t max_bytes)
+static void hasherListPush(tr_cache* cache, struct piece_hasher* ph)
 {
-    char buf[128];
+    ph->prev = NULL;
+    ph->next = cache->hashers_newest;
 
-    cache->max_bytes = max_bytes;
-    cache->max_blocks = getMaxBlocks(max_bytes);
+    if (cache->hashers_newest != NULL)
+    {
+        cache->hashers_newest->prev = ph;
+    }
+    else
+    {
+        cache->hashers_oldest = ph;
+    }
 
-    tr_formatter_mem_B(buf, cache->max_bytes, sizeof(buf));
-    tr_logAddNamedDbg(MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
+    cache->hashers_newest = ph;
+}
 
-    return cacheTrim(cache);
+static void insertPieceHasher(tr_cache* cache, struct piece_hasher* ph)
+{
+    size_t h;
+
+    if ((size_t)cache->hasher_count >= cache->hasher_bucket_count)
+    {
+        rehashPieceHashers(cache, cache->hasher_bucket_count * 2);
+    }
+
+    hasherListPush(cache, ph);
+    h = pieceHasherHash(cache, ph->torrent_id, ph->piece);
+    ph->hash_next = cache->hasher_buckets[h];
+    cache->hasher_buckets[h] = ph;
+    ++cache->hasher_count;
 }
 
-int64_t tr_cacheGetLimit(tr_cache const* cache)
+/* takes the hasher out of the cache without freeing it */
+static void removePieceHasher(tr_cache* cache, struct piece_hasher* ph)
 {
-    return cache->max_bytes;
+    struct piece_hasher** walk = &cache->hasher_buckets[pieceHasherHash(cache, ph->torrent_id, ph->piece)];
+
+    while (*walk != ph)
+    {
+        walk = &(*walk)->hash_next;
+    }
+
+    *walk = ph->hash_next;
+    --cache->hasher_count;
+    hasherListRemove(cache, ph);
 }
 
-tr_cache* tr_cacheNew(int64_t max_bytes)
+static void dropPieceHasher(tr_cache* cache, struct piece_hasher* ph)
 {
-    tr_cache* cache = tr_new0(tr_cache, 1);
-    cache->blocks = TR_PTR_ARRAY_INIT;
-    cache->max_bytes = max_bytes;
-    cache->max_blocks = getMaxBlocks(max_bytes);
-    return cache;
+    removePieceHasher(cache, ph);
+    tr_sha1_final(ph->sha, NULL);
+    tr_free(ph);
 }
 
-void tr_cacheFree(tr_cache* cache)
+static void hashBlock(tr_sha1_ctx_t sha, struct evbuffer* buf)
 {
-    TR_ASSERT(tr_ptrArrayEmpty(&cache->blocks));
+    struct evbuffer_iovec vec[4];
+    /* an explicit length makes evbuffer_peek() count every chain;
+       with -1 it stops counting once `vec' is full */
+    int n = evbuffer_peek(buf, evbuffer_get_length(buf), NULL, vec, TR_N_ELEMENTS(vec));
 
-    tr_ptrArrayDestruct(&cache->blocks, NULL);
-    tr_free(cache);
+    if (n > (int)TR_N_ELEMENTS(vec))
+    {
+        vec[0].iov_len = evbuffer_get_length(buf);
+        vec[0].iov_base = evbuffer_pullup(buf, -1);
+        n = 1;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+        tr_sha1_update(sha, vec[i].iov_base, vec[i].iov_len);
+    }
 }
 
-/***
-****
-***/
+static void dropIdlePieceHashers(tr_cache* cache)
+{
+    time_t const oldest = tr_time() - PIECE_HASHER_IDLE_SECS;
+
+    while (cache->hashers_oldest != NULL && cache->hashers_oldest->time < oldest)
+    {
+        dropPieceHasher(cache, cache->hashers_oldest);
+    }
+}
 
-static int cache_block_compare(void const* va, void const* vb)
+/* called after the block at `offset' has been written to the cache */
+static void feedPieceHasher(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset)
 {
-    struct cache_block const* a = va;
-    struct cache_block const* b = vb;
+    struct cache_block* cb;
+    struct piece_hasher* ph = findPieceHasher(cache, torrent, piece);
+    uint32_t const piece_length = tr_torPieceCountBytes(torrent, piece);
+
+    /* a block that's already been hashed was written again */
+    if (ph != NULL && offset < ph->hashed)
+    {
+        dropPieceHasher(cache, ph);
+        ph = NULL;
+    }
+
+    if (ph == NULL)
+    {
+        if (offset != 0)
+        {
+            return;
+        }
 
-    /* primary key: torrent id */
-    if (a->tor->uniqueId != b->tor->uniqueId)
+        dropIdlePieceHashers(cache);
+
+        if (cache->hasher_count >= MAX_PIECE_HASHERS)
+        {
+            return;
+        }
+
+        ph = tr_new0(struct piece_hasher, 1);
+        ph->torrent_id = torrent->uniqueId;
+        ph->piece = piece;
+        ph->hashed = 0;
+        ph->sha = tr_sha1_init();
+        insertPieceHasher(cache, ph);
+    }
+    else if (ph != cache->hashers_newest)
     {
-        return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+        hasherListRemove(cache, ph);
+        hasherListPush(cache, ph);
     }
 
-    /* secondary key: block # */
-    if (a->block != b->block)
+    ph->time = tr_time();
+
+    if (offset != ph->hashed)
     {
-        return a->block < b->block ? -1 : 1;
+        return;
     }
 
-    /* they're equal */
-    return 0;
+    while (ph->hashed < piece_length && (cb = findBlock(cache, torrent, piece, ph->hashed)) != NULL)
+    {
+        hashBlock(ph->sha, cb->evbuf);
+        ph->hashed += cb->length;
+    }
+}
+
+tr_sha1_ctx_t tr_cacheTakePieceHash(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t* setme_hashed)
+{
+    tr_sha1_ctx_t sha = NULL;
+    struct piece_hasher* ph = findPieceHasher(cache, torrent, piece);
+
+    if (ph != NULL)
+    {
+        sha = ph->sha;
+        *setme_hashed = ph->hashed;
+        removePieceHasher(cache, ph);
+        tr_free(ph);
+    }
+
+    return sha;
 }
 
-static struct cache_block* findBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset)
+void tr_cacheDropPieceHash(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece)
 {
-    struct cache_block key;
-    key.tor = torrent;
-    key.block = _tr_block(torrent, piece, offset);
-    return tr_ptrArrayFindSorted(&cache->blocks, &key, cache_block_compare);
+    struct piece_hasher* ph = findPieceHasher(cache, torrent, piece);
+
+    if (ph != NULL)
+    {
+        dropPieceHasher(cache, ph);
+    }
 }
 
+/***
+****
+***/
+
 int tr_cacheWriteBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t length,
     struct evbuffer* writeme)
 {
     TR_ASSERT(tr_amInEventThread(torrent->session));
 
-    struct cache_block* cb = findBlock(cache, torrent, piece, offset);
+    struct cache_block* cb;
+
+    /* the piece is changing, so what's been read of it is stale */
+    tr_cacheDropReadPiece(cache, torrent, piece);
+
+    cb = findBlock(cache, torrent, piece, offset);
 
     if (cb == NULL)
     {
@@ -333,15 +1352,20 @@ int tr_cacheWriteBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t pi
         cb->length = length;
         cb->block = _tr_block(torrent, piece, offset);
         cb->evbuf = evbuffer_new();
-        tr_ptrArrayInsertSorted(&cache->blocks, cb, cache_block_compare);
+        cb->time = tr_time();
+        insertBlock(cache, cb);
+        addBlockToRuns(cache, cb);
+    }
+    else
+    {
+        cb->time = tr_time();
     }
 
     TR_ASSERT(cb->length == length);
 
-    cb->time = tr_time();
-
     evbuffer_drain(cb->evbuf, evbuffer_get_length(cb->evbuf));
     evbuffer_remove_buffer(writeme, cb->evbuf, cb->length);
+    feedPieceHasher(cache, torrent, piece, offset);
 
     cache->cache_writes++;
     cache->cache_write_bytes += cb->length;
@@ -353,120 +1377,170 @@ int tr_cacheReadBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t pie
     uint8_t* setme)
 {
     int err = 0;
+    struct read_piece* rp;
     struct cache_block* cb = findBlock(cache, torrent, piece, offset);
 
     if (cb != NULL)
     {
         evbuffer_copyout(cb->evbuf, setme, len);
     }
+    else if ((rp = getReadPiece(cache, torrent, piece, offset, len)) != NULL)
+    {
+        readFromReadPiece(cache, rp, offset, len, setme);
+    }
     else
     {
-        err = tr_ioRead(torrent, piece, offset, len, setme);
+        err = tr_ioRead(torrent, NULL, piece, offset, len, setme);
     }
 
     return err;
 }
 
+bool tr_cacheHasBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset)
+{
+    return findBlock(cache, torrent, piece, offset) != NULL || getReadPiece(cache, torrent, piece, offset, 1) != NULL;
+}
+
 int tr_cachePrefetchBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len)
 {
-    int err = 0;
     struct cache_block* cb = findBlock(cache, torrent, piece, offset);
 
     if (cb == NULL)
     {
-        err = tr_ioPrefetch(torrent, piece, offset, len);
+        tr_diskIoPrefetch(torrent, piece, offset, len);
     }
 
-    return err;
+    return 0;
 }
 
 /***
 ****
 ***/
 
-static int findBlockPos(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t block)
+static int compareRunsByFirst(void const* va, void const* vb)
 {
-    struct cache_block key;
-    key.tor = torrent;
-    key.block = block;
-    return tr_ptrArrayLowerBound(&cache->blocks, &key, cache_block_compare, NULL);
+    struct cache_run const* a = *(struct cache_run const* const*)va;
+    struct cache_run const* b = *(struct cache_run const* const*)vb;
+
+    return a->first < b->first ? -1 : (a->first > b->first ? 1 : 0);
 }
 
-int tr_cacheFlushDone(tr_cache* cache)
+/* flushes the torrent's runs that have any blocks in [first...last] */
+static int flushBlockRange(tr_cache* cache, tr_torrent* torrent, tr_block_index_t first, tr_block_index_t last)
 {
     int err = 0;
+    int n = 0;
+    struct cache_run** runs = tr_new(struct cache_run*, cache->run_count);
 
-    if (tr_ptrArraySize(&cache->blocks) > 0)
+    for (int i = 0; i < cache->run_count; ++i)
     {
-        int i;
-        int n;
-        struct run_info* runs;
+        struct cache_run* run = cache->runs[i];
 
-        runs = tr_new(struct run_info, tr_ptrArraySize(&cache->blocks));
-        i = 0;
-        n = calcRuns(cache, runs);
-
-        while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
+        if (run->tor == torrent && run->first <= last && run->last >= first)
         {
-            runs[i++].rank |= SESSIONFLAG;
+            runs[n++] = run;
         }
+    }
 
-        err = flushRuns(cache, runs, i);
-        tr_free(runs);
+    /* write them in the order they're in on disk */
+    qsort(runs, n, sizeof(struct cache_run*), compareRunsByFirst);
+
+    for (int i = 0; err == 0 && i < n; ++i)
+    {
+        err = flushRun(cache, runs[i], false);
     }
 
+    tr_free(runs);
     return err;
 }
 
-int tr_cacheFlushFile(tr_cache* cache, tr_torrent* torrent, tr_file_index_t i)
+int tr_cacheFlushDone(tr_cache* cache)
 {
-    int pos;
     int err = 0;
+
+    /* the heap has the runs of completed pieces on top, then the multi piece runs */
+    while (err == 0 && cache->run_count > 0 && (cache->runs[0]->is_piece_done || cache->runs[0]->is_multi_piece))
+    {
+        err = flushRun(cache, cache->runs[0], false);
+    }
+
+    return err;
+}
+
+void tr_cachePieceChecked(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece)
+{
     tr_block_index_t first;
     tr_block_index_t last;
 
-    tr_torGetFileBlockRange(torrent, i, &first, &last);
-    pos = findBlockPos(cache, torrent, first);
-    dbgmsg("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
+    tr_torGetPieceBlockRange(torrent, piece, &first, &last);
 
-    /* flush out all the blocks in that file */
-    while (err == 0 && pos < tr_ptrArraySize(&cache->blocks))
+    /* a run's rank depends on whether the piece that it ends in is complete */
+    for (tr_block_index_t i = first; i <= last; ++i)
     {
-        struct cache_block const* b = tr_ptrArrayNth(&cache->blocks, pos);
+        struct cache_block* b = findBlockByIndex(cache, torrent, i);
 
-        if (b->tor != torrent)
+        if (b != NULL && findBlockByIndex(cache, torrent, i + 1) == NULL)
         {
-            break;
+            updateRunFlags(b->run);
+            heapUpdate(cache, b->run);
         }
+    }
+}
 
-        if (b->block < first || b->block > last)
-        {
-            break;
-        }
+int tr_cacheFlushPiece(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece)
+{
+    tr_block_index_t first;
+    tr_block_index_t last;
 
-        err = flushContiguous(cache, pos, getBlockRun(cache, pos, NULL));
-    }
+    tr_torGetPieceBlockRange(torrent, piece, &first, &last);
+    dbgmsg("flushing piece %zu from cache to disk: blocks [%zu...%zu]", (size_t)piece, (size_t)first, (size_t)last);
+
+    /* the writes are only queued, so unlike the other flushes this doesn't wait for them */
+    return flushBlockRange(cache, torrent, first, last);
+}
+
+int tr_cacheFlushFile(tr_cache* cache, tr_torrent* torrent, tr_file_index_t i)
+{
+    int err;
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    tr_torGetFileBlockRange(torrent, i, &first, &last);
+    dbgmsg("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
+
+    /* flush out all the blocks in that file */
+    err = flushBlockRange(cache, torrent, first, last);
+
+    /* callers expect the file to be up-to-date on disk when this returns */
+    tr_diskIoWaitForTorrent(torrent);
 
     return err;
 }
 
 int tr_cacheFlushTorrent(tr_cache* cache, tr_torrent* torrent)
 {
-    int err = 0;
-    int const pos = findBlockPos(cache, torrent, 0);
+    int err;
+    struct piece_hasher* next;
 
-    /* flush out all the blocks in that torrent */
-    while (err == 0 && pos < tr_ptrArraySize(&cache->blocks))
+    /* forget what's been read, too */
+    dropReadPieces(cache, torrent);
+
+    /* and what's been hashed */
+    for (struct piece_hasher* ph = cache->hashers_newest; ph != NULL; ph = next)
     {
-        struct cache_block const* b = tr_ptrArrayNth(&cache->blocks, pos);
+        next = ph->next;
 
-        if (b->tor != torrent)
+        if (ph->torrent_id == torrent->uniqueId)
         {
-            break;
+            dropPieceHasher(cache, ph);
         }
-
-        err = flushContiguous(cache, pos, getBlockRun(cache, pos, NULL));
     }
 
+    /* flush out all the blocks in that torrent */
+    err = flushBlockRange(cache, torrent, 0, torrent->blockCount - 1);
+
+    /* callers expect the files to be up-to-date on disk when this returns */
+    tr_diskIoWaitForTorrent(torrent);
+
     return err;
 }
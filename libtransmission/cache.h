@@ -12,8 +12,16 @@
 #error only libtransmission should #include this header.
 #endif
 
+#include "crypto-utils.h" /* tr_sha1_ctx_t */
+#include "disk-io.h" /* tr_disk_io_done_func */
+
 struct evbuffer;
 
+/**
+ * The cache holds blocks that have been downloaded until they're written
+ * to disk, and a separately-sized read cache of pieces, or spans of the
+ * bigger ones, that have been read from disk to upload to peers.
+ */
 typedef struct tr_cache tr_cache;
 
 /***
@@ -32,12 +40,46 @@ int tr_cacheSetLimit(tr_cache* cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit(tr_cache const*);
 
+int tr_cacheSetReadLimit(tr_cache* cache, int64_t max_bytes);
+
+int64_t tr_cacheGetReadLimit(tr_cache const*);
+
+/** @brief how many reads were served by the read cache, and how many went to disk */
+void tr_cacheGetReadStats(tr_cache const* cache, uint64_t* setme_hits, uint64_t* setme_misses);
+
 int tr_cacheWriteBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
     struct evbuffer* writeme);
 
 int tr_cacheReadBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
     uint8_t* setme);
 
+/** @return true if the block can be read from memory with tr_cacheReadBlock() */
+bool tr_cacheHasBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset);
+
+/**
+ * Reads a block in the background, through the read cache.
+ * On a miss, the whole piece (or the span of it holding the block, if the
+ * piece is big next to the read cache) may be read so that the rest is on hand
+ * when it's asked for. `callback' is called when `setme' has been filled in,
+ * which is before this returns if the block's already in memory.
+ */
+void tr_cacheReadBlockAsync(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len,
+    uint8_t* setme, tr_disk_io_done_func callback, void* user_data);
+
+/**
+ * @brief hands over the SHA1 context of a piece that's been hashed as its blocks were written
+ *
+ * @param setme_hashed how many bytes from the start of the piece the context has been fed
+ * @return the context, which the caller then owns, or NULL if the piece wasn't being hashed
+ */
+tr_sha1_ctx_t tr_cacheTakePieceHash(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t* setme_hashed);
+
+/** @brief forgets what's been hashed of a piece, e.g. because it's no longer wanted */
+void tr_cacheDropPieceHash(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece);
+
+/** @brief forgets what's been read of a piece, so that the next read of it goes to disk */
+void tr_cacheDropReadPiece(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece);
+
 int tr_cachePrefetchBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece, uint32_t offset, uint32_t len);
 
 /***
@@ -46,6 +88,12 @@ int tr_cachePrefetchBlock(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t
 
 int tr_cacheFlushDone(tr_cache* cache);
 
+/** @brief call this when a piece has been checked, since the blocks of complete pieces get flushed first */
+void tr_cachePieceChecked(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece);
+
 int tr_cacheFlushTorrent(tr_cache* cache, tr_torrent* torrent);
 
+/** @brief queues the writes of a piece's blocks, so that disk jobs queued after them see the piece on disk */
+int tr_cacheFlushPiece(tr_cache* cache, tr_torrent* torrent, tr_piece_index_t piece);
+
 int tr_cacheFlushFile(tr_cache* cache, tr_torrent* torrent, tr_file_index_t file);
@@ -6,8 +6,11 @@
  *
  */
 
+#include <string.h> /* memset() */
+
 #include "transmission.h"
 #include "completion.h"
+#include "inout.h" /* tr_ioFindFileLocation() */
 #include "torrent.h"
 #include "tr-assert.h"
 #include "utils.h"
@@ -22,15 +25,101 @@ static void tr_cpReset(tr_completion* cp)
     cp->sizeWhenDoneIsDirty = true;
     cp->haveValidIsDirty = true;
     tr_bitfieldSetHasNone(&cp->blockBitfield);
+
+    if (cp->tor->info.fileCount != 0)
+    {
+        memset(cp->fileBytesCompleted, 0, sizeof(uint64_t) * cp->tor->info.fileCount);
+    }
 }
 
 void tr_cpConstruct(tr_completion* cp, tr_torrent* tor)
 {
     cp->tor = tor;
     tr_bitfieldConstruct(&cp->blockBitfield, tor->blockCount);
+    cp->fileBytesCompleted = tr_new(uint64_t, tor->info.fileCount);
     tr_cpReset(cp);
 }
 
+static uint64_t countFileBytesCompleted(tr_completion const* cp, tr_file_index_t index)
+{
+    uint64_t total = 0;
+    tr_torrent const* tor = cp->tor;
+    tr_file const* f = &tor->info.files[index];
+
+    if (f->length != 0)
+    {
+        tr_block_index_t first;
+        tr_block_index_t last;
+        tr_torGetFileBlockRange(tor, index, &first, &last);
+
+        if (first == last)
+        {
+            if (tr_cpBlockIsComplete(cp, first))
+            {
+                total = f->length;
+            }
+        }
+        else
+        {
+            /* the first block */
+            if (tr_cpBlockIsComplete(cp, first))
+            {
+                total += tor->blockSize - f->offset % tor->blockSize;
+            }
+
+            /* the middle blocks */
+            if (first + 1 < last)
+            {
+                uint64_t u = tr_bitfieldCountRange(&cp->blockBitfield, first + 1, last);
+                u *= tor->blockSize;
+                total += u;
+            }
+
+            /* the last block */
+            if (tr_cpBlockIsComplete(cp, last))
+            {
+                total += f->offset + f->length - (uint64_t)tor->blockSize * last;
+            }
+        }
+    }
+
+    return total;
+}
+
+/* add or subtract a block's bytes from the files it overlaps */
+static void updateFileBytesCompleted(tr_completion* cp, tr_block_index_t block, bool add)
+{
+    tr_file_index_t fileIndex;
+    uint64_t fileOffset;
+    tr_torrent const* tor = cp->tor;
+    tr_piece_index_t const piece = tr_torBlockPiece(tor, block);
+    uint32_t const pieceOffset = (uint64_t)block * tor->blockSize - (uint64_t)piece * tor->info.pieceSize;
+    uint64_t left = tr_torBlockCountBytes(tor, block);
+
+    tr_ioFindFileLocation(tor, piece, pieceOffset, &fileIndex, &fileOffset);
+
+    while (left != 0)
+    {
+        uint64_t const n = MIN(left, tor->info.files[fileIndex].length - fileOffset);
+
+        if (add)
+        {
+            cp->fileBytesCompleted[fileIndex] += n;
+        }
+        else
+        {
+            TR_ASSERT(cp->fileBytesCompleted[fileIndex] >= n);
+            cp->fileBytesCompleted[fileIndex] -= n;
+        }
+
+        TR_ASSERT(cp->fileBytesCompleted[fileIndex] <= tor->info.files[fileIndex].length);
+
+        left -= n;
+        ++fileIndex;
+        fileOffset = 0;
+    }
+}
+
 void tr_cpBlockInit(tr_completion* cp, tr_bitfield const* b)
 {
     tr_cpReset(cp);
@@ -49,6 +138,12 @@ void tr_cpBlockInit(tr_completion* cp, tr_bitfield const* b)
     }
 
     TR_ASSERT(cp->sizeNow <= cp->tor->info.totalSize);
+
+    /* set fileBytesCompleted */
+    for (tr_file_index_t i = 0; i < cp->tor->info.fileCount; ++i)
+    {
+        cp->fileBytesCompleted[i] = countFileBytesCompleted(cp, i);
+    }
 }
 
 /***
@@ -88,6 +183,7 @@ void tr_cpPieceRem(tr_completion* cp, tr_piece_index_t piece)
         if (tr_cpBlockIsComplete(cp, i))
         {
             cp->sizeNow -= tr_torBlockCountBytes(tor, i);
+            updateFileBytesCompleted(cp, i, false);
         }
     }
 
@@ -118,6 +214,7 @@ void tr_cpBlockAdd(tr_completion* cp, tr_block_index_t block)
 
         tr_bitfieldAdd(&cp->blockBitfield, block);
         cp->sizeNow += tr_torBlockCountBytes(tor, block);
+        updateFileBytesCompleted(cp, block, true);
 
         cp->haveValidIsDirty = true;
         cp->sizeWhenDoneIsDirty = cp->sizeWhenDoneIsDirty || tor->info.pieces[piece].dnd;
@@ -287,17 +384,7 @@ size_t tr_cpMissingBytesInPiece(tr_completion const* cp, tr_piece_index_t piece)
 
 bool tr_cpFileIsComplete(tr_completion const* cp, tr_file_index_t i)
 {
-    if (cp->tor->info.files[i].length == 0)
-    {
-        return true;
-    }
-    else
-    {
-        tr_block_index_t f;
-        tr_block_index_t l;
-        tr_torGetFileBlockRange(cp->tor, i, &f, &l);
-        return tr_bitfieldCountRange(&cp->blockBitfield, f, l + 1) == (l + 1 - f);
-    }
+    return cp->fileBytesCompleted[i] == cp->tor->info.files[i].length;
 }
 
 void* tr_cpCreatePieceBitfield(tr_completion const* cp, size_t* byte_count)
@@ -311,21 +398,20 @@ void* tr_cpCreatePieceBitfield(tr_completion const* cp, size_t* byte_count)
     n = cp->tor->info.pieceCount;
     tr_bitfieldConstruct(&pieces, n);
 
-    if (tr_cpHasAll(cp))
+    if (tr_torrentHasAll(cp->tor))
     {
         tr_bitfieldSetHasAll(&pieces);
     }
     else if (!tr_cpHasNone(cp))
     {
-        bool* flags = tr_new(bool, n);
-
+        /* leave out pieces that haven't passed their checks yet */
         for (tr_piece_index_t i = 0; i < n; ++i)
         {
-            flags[i] = tr_cpPieceIsComplete(cp, i);
+            if (tr_cpPieceIsComplete(cp, i) && !tr_torrentPieceIsChecking(cp->tor, i))
+            {
+                tr_bitfieldAdd(&pieces, i);
+            }
         }
-
-        tr_bitfieldSetFromFlags(&pieces, flags, n);
-        tr_free(flags);
     }
 
     ret = tr_bitfieldGetRaw(&pieces, byte_count);
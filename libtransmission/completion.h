@@ -40,6 +40,10 @@ typedef struct tr_completion
 
     /* number of bytes we want or have now. [0..sizeWhenDone] */
     uint64_t sizeNow;
+
+    /* number of bytes we have of each file. [0..file.length]
+       kept up to date as blocks are added and pieces removed */
+    uint64_t* fileBytesCompleted;
 }
 tr_completion;
 
@@ -53,6 +57,7 @@ void tr_cpBlockInit(tr_completion* cp, tr_bitfield const* blocks);
 
 static inline void tr_cpDestruct(tr_completion* cp)
 {
+    tr_free(cp->fileBytesCompleted);
     tr_bitfieldDestruct(&cp->blockBitfield);
 }
 
@@ -123,6 +128,11 @@ static inline bool tr_cpBlockIsComplete(tr_completion const* cp, tr_block_index_
 
 bool tr_cpFileIsComplete(tr_completion const* cp, tr_file_index_t);
 
+static inline uint64_t tr_cpFileBytesCompleted(tr_completion const* cp, tr_file_index_t i)
+{
+    return cp->fileBytesCompleted[i];
+}
+
 void* tr_cpCreatePieceBitfield(tr_completion const* cp, size_t* byte_count);
 
 static inline void tr_cpInvalidateDND(tr_completion* cp)
@@ -39,6 +39,10 @@
 #define tr_sha1_init tr_sha1_init_
 #define tr_sha1_update tr_sha1_update_
 #define tr_sha1_final tr_sha1_final_
+#define tr_sha1_reset tr_sha1_reset_
+#define tr_sha1_job tr_sha1_job_
+#define tr_sha1_multi tr_sha1_multi_
+#define tr_sha1_multi_width tr_sha1_multi_width_
 #define tr_rc4_new tr_rc4_new_
 #define tr_rc4_free tr_rc4_free_
 #define tr_rc4_set_key tr_rc4_set_key_
@@ -103,6 +107,10 @@
 #undef tr_sha1_init
 #undef tr_sha1_update
 #undef tr_sha1_final
+#undef tr_sha1_reset
+#undef tr_sha1_job
+#undef tr_sha1_multi
+#undef tr_sha1_multi_width
 #undef tr_rc4_new
 #undef tr_rc4_free
 #undef tr_rc4_set_key
@@ -160,6 +168,10 @@
 #define tr_sha1_init_ tr_sha1_init
 #define tr_sha1_update_ tr_sha1_update
 #define tr_sha1_final_ tr_sha1_final
+#define tr_sha1_reset_ tr_sha1_reset
+#define tr_sha1_job_ tr_sha1_job
+#define tr_sha1_multi_ tr_sha1_multi
+#define tr_sha1_multi_width_ tr_sha1_multi_width
 #define tr_rc4_new_ tr_rc4_new
 #define tr_rc4_free_ tr_rc4_free
 #define tr_rc4_set_key_ tr_rc4_set_key
@@ -6,13 +6,21 @@
  *
  */
 
+#include <stdio.h> /* fprintf() */
 #include <string.h>
+#include <time.h> /* clock() */
 
 #include "transmission.h"
 #include "crypto.h"
 #include "crypto-utils.h"
 #include "utils.h"
 
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
 #include "libtransmission-test.h"
 
 #include "crypto-test-ref.h"
@@ -118,6 +126,132 @@ static int test_sha1(void)
     return 0;
 }
 
+static int test_sha1_reset(void)
+{
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    uint8_t hash_[SHA_DIGEST_LENGTH];
+    tr_sha1_ctx_t sha = tr_sha1_init();
+    tr_sha1_ctx_t sha_ = tr_sha1_init_();
+
+    /* the same context gives the same answers, one hash after another */
+    check(tr_sha1_update(sha, "test", 4));
+    check(tr_sha1_reset(sha, hash));
+    check_mem(hash, ==, "\xa9\x4a\x8f\xe5\xcc\xb1\x9b\xa6\x1c\x4c\x08\x73\xd3\x91\xe9\x87\x98\x2f\xbb\xd3", SHA_DIGEST_LENGTH);
+
+    check(tr_sha1_reset(sha, hash));
+    check_mem(hash, ==, "\xda\x39\xa3\xee\x5e\x6b\x4b\x0d\x32\x55\xbf\xef\x95\x60\x18\x90\xaf\xd8\x07\x09", SHA_DIGEST_LENGTH);
+
+    /* data that isn't exported is thrown away */
+    check(tr_sha1_update(sha, "garbage", 7));
+    check(tr_sha1_reset(sha, NULL));
+
+    check(tr_sha1_update(sha, "1", 1));
+    check(tr_sha1_update(sha, "22", 2));
+    check(tr_sha1_update(sha, "333", 3));
+    check(tr_sha1_reset(sha, hash));
+    check_mem(hash, ==, "\x1f\x74\x64\x8e\x50\xa6\xa6\x70\x8e\xc5\x4a\xb3\x27\xa1\x63\xd5\x53\x6b\x7c\xed", SHA_DIGEST_LENGTH);
+
+    /* and agrees with the reference implementation */
+    for (size_t len = 1; len < 200; len += 13)
+    {
+        uint8_t* buf = tr_new(uint8_t, len);
+
+        tr_rand_buffer(buf, len);
+        check(tr_sha1_update(sha, buf, len));
+        check(tr_sha1_reset(sha, hash));
+        check(tr_sha1_update_(sha_, buf, len));
+        check(tr_sha1_reset_(sha_, hash_));
+        check_mem(hash, ==, hash_, SHA_DIGEST_LENGTH);
+
+        tr_free(buf);
+    }
+
+    check(tr_sha1_final(sha, NULL));
+    check(tr_sha1_final_(sha_, NULL));
+    return 0;
+}
+
+static int test_sha1_multi(void)
+{
+    size_t const big_length = 1024 * 1024 + 55;
+    uint8_t* big = tr_new(uint8_t, big_length);
+    uint8_t hashes[40][SHA_DIGEST_LENGTH];
+    uint8_t hash_[SHA_DIGEST_LENGTH];
+    tr_sha1_ctx_t sha = tr_sha1_init();
+    tr_sha1_job jobs[40];
+
+    check_uint(tr_sha1_multi_width(), >=, 1);
+    check(tr_sha1_multi(sha, NULL, 0));
+
+    /* known vectors, including the empty string */
+    jobs[0].data = "abc";
+    jobs[0].data_length = 3;
+    jobs[0].hash = hashes[0];
+    jobs[1].data = NULL;
+    jobs[1].data_length = 0;
+    jobs[1].hash = hashes[1];
+    jobs[2].data = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    jobs[2].data_length = 56;
+    jobs[2].hash = hashes[2];
+    check(tr_sha1_multi(sha, jobs, 3));
+    check_mem(hashes[0], ==, "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e\x25\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d",
+        SHA_DIGEST_LENGTH);
+    check_mem(hashes[1], ==, "\xda\x39\xa3\xee\x5e\x6b\x4b\x0d\x32\x55\xbf\xef\x95\x60\x18\x90\xaf\xd8\x07\x09",
+        SHA_DIGEST_LENGTH);
+    check_mem(hashes[2], ==, "\x84\x98\x3e\x44\x1c\x3b\xd2\x6e\xba\xae\x4a\xa1\xf9\x51\x29\xe5\xe5\x46\x70\xf1",
+        SHA_DIGEST_LENGTH);
+
+    /* buffers of every length around the block boundaries, in batches that
+     * fill the CPU's lanes, don't, or spill over into a second round */
+    tr_rand_buffer(big, big_length);
+
+    for (size_t len = 0; len < 300; ++len)
+    {
+        size_t const job_count = 1 + len * 7 % TR_N_ELEMENTS(jobs);
+
+        for (size_t i = 0; i < job_count; ++i)
+        {
+            jobs[i].data = big + i * 7;
+            jobs[i].data_length = len + i * 31;
+            jobs[i].hash = hashes[i];
+        }
+
+        check(tr_sha1_multi(sha, jobs, job_count));
+
+        for (size_t i = 0; i < job_count; ++i)
+        {
+            check(tr_sha1_(hash_, jobs[i].data, (int)jobs[i].data_length, NULL));
+            check_mem(hashes[i], ==, hash_, SHA_DIGEST_LENGTH);
+        }
+    }
+
+    /* a piece-sized buffer alongside short ones */
+    for (size_t i = 0; i < TR_N_ELEMENTS(jobs); ++i)
+    {
+        jobs[i].data = big + i;
+        jobs[i].data_length = i == 0 ? big_length : 1000 + i;
+        jobs[i].hash = hashes[i];
+    }
+
+    check(tr_sha1_multi(sha, jobs, TR_N_ELEMENTS(jobs)));
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(jobs); ++i)
+    {
+        check(tr_sha1_(hash_, jobs[i].data, (int)jobs[i].data_length, NULL));
+        check_mem(hashes[i], ==, hash_, SHA_DIGEST_LENGTH);
+    }
+
+    /* the context is still usable afterwards */
+    check(tr_sha1_update(sha, "test", 4));
+    check(tr_sha1_reset(sha, hashes[0]));
+    check_mem(hashes[0], ==, "\xa9\x4a\x8f\xe5\xcc\xb1\x9b\xa6\x1c\x4c\x08\x73\xd3\x91\xe9\x87\x98\x2f\xbb\xd3",
+        SHA_DIGEST_LENGTH);
+
+    check(tr_sha1_final(sha, NULL));
+    tr_free(big);
+    return 0;
+}
+
 static int test_ssha1(void)
 {
     struct
@@ -301,6 +435,82 @@ static int test_base64(void)
     return 0;
 }
 
+#if SPEED_TEST
+
+/* hashes 1 GiB on one core, spread over as many pieces as tr_sha1_multi() takes at once */
+static int test_sha1_speed(void)
+{
+    uint32_t const piece_sizes[] = { 16 * 1024, 256 * 1024, 4 * 1024 * 1024 };
+    uint64_t const total = 1024 * 1024 * 1024;
+    size_t const width = tr_sha1_multi_width();
+    uint8_t hashes[16][SHA_DIGEST_LENGTH];
+    tr_sha1_job jobs[16];
+
+    check_uint(width, <=, TR_N_ELEMENTS(jobs));
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(piece_sizes); ++i)
+    {
+        uint32_t const piece_size = piece_sizes[i];
+        uint8_t* buf = tr_new(uint8_t, (size_t)piece_size * width);
+        tr_sha1_ctx_t sha;
+        clock_t start;
+        double seconds;
+
+        tr_rand_buffer(buf, (size_t)piece_size * width);
+
+        for (size_t j = 0; j < width; ++j)
+        {
+            jobs[j].data = buf + (size_t)piece_size * j;
+            jobs[j].data_length = piece_size;
+            jobs[j].hash = hashes[j];
+        }
+
+        /* a new context for every piece */
+        start = clock();
+
+        for (uint64_t n = 0; n < total; n += piece_size)
+        {
+            tr_sha1_job const* job = &jobs[n / piece_size % width];
+            check(tr_sha1(job->hash, job->data, (int)piece_size, NULL));
+        }
+
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        fprintf(stderr, "%u KiB pieces, new contexts: %.2f GB/s\n", piece_size / 1024, total / seconds / 1e9);
+
+        /* one context for all of them */
+        sha = tr_sha1_init();
+        start = clock();
+
+        for (uint64_t n = 0; n < total; n += piece_size)
+        {
+            tr_sha1_job const* job = &jobs[n / piece_size % width];
+            check(tr_sha1_update(sha, job->data, piece_size));
+            check(tr_sha1_reset(sha, job->hash));
+        }
+
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        fprintf(stderr, "%u KiB pieces, reused context: %.2f GB/s\n", piece_size / 1024, total / seconds / 1e9);
+
+        /* all of them at once */
+        start = clock();
+
+        for (uint64_t n = 0; n < total; n += (uint64_t)piece_size * width)
+        {
+            check(tr_sha1_multi(sha, jobs, width));
+        }
+
+        seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+        fprintf(stderr, "%u KiB pieces, %zu at a time: %.2f GB/s\n", piece_size / 1024, width, total / seconds / 1e9);
+
+        tr_sha1_final(sha, NULL);
+        tr_free(buf);
+    }
+
+    return 0;
+}
+
+#endif
+
 int main(void)
 {
     testFunc const tests[] =
@@ -308,9 +518,14 @@ int main(void)
         test_torrent_hash,
         test_encrypt_decrypt,
         test_sha1,
+        test_sha1_reset,
+        test_sha1_multi,
         test_ssha1,
         test_random,
-        test_base64
+        test_base64,
+#if SPEED_TEST
+        test_sha1_speed
+#endif
     };
 
     return runTests(tests, NUM_TESTS(tests));
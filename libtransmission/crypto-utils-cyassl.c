@@ -163,6 +163,18 @@ bool tr_sha1_final(tr_sha1_ctx_t handle, uint8_t* hash)
     return ret;
 }
 
+bool tr_sha1_reset(tr_sha1_ctx_t handle, uint8_t* hash)
+{
+    TR_ASSERT(handle != NULL);
+
+    if (hash != NULL && !check_result(API(ShaFinal)(handle, hash)))
+    {
+        return false;
+    }
+
+    return check_result(API(InitSha)(handle));
+}
+
 /***
 ****
 ***/
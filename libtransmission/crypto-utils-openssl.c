@@ -148,6 +148,26 @@ bool tr_sha1_final(tr_sha1_ctx_t handle, uint8_t* hash)
     return ret;
 }
 
+bool tr_sha1_reset(tr_sha1_ctx_t handle, uint8_t* hash)
+{
+    TR_ASSERT(handle != NULL);
+
+    if (hash != NULL)
+    {
+        unsigned int hash_length;
+
+        if (!check_result(EVP_DigestFinal_ex(handle, hash, &hash_length)))
+        {
+            return false;
+        }
+
+        TR_ASSERT(hash_length == SHA_DIGEST_LENGTH);
+    }
+
+    /* keeps the digest that's already been looked up */
+    return check_result(EVP_DigestInit_ex(handle, NULL, NULL));
+}
+
 /***
 ****
 ***/
@@ -182,6 +182,19 @@ bool tr_sha1_final(tr_sha1_ctx_t handle, uint8_t* hash)
     return true;
 }
 
+bool tr_sha1_reset(tr_sha1_ctx_t handle, uint8_t* hash)
+{
+    TR_ASSERT(handle != NULL);
+
+    if (hash != NULL)
+    {
+        API(sha1_finish)(handle, hash);
+    }
+
+    API(sha1_starts)(handle);
+    return true;
+}
+
 /***
 ****
 ***/
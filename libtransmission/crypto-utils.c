@@ -10,6 +10,12 @@
 #include <stdlib.h> /* abs(), srand(), rand() */
 #include <string.h> /* memcpy(), memmove(), memset(), strcmp(), strlen() */
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TR_SHA1_MB
+#include <cpuid.h> /* __get_cpuid() */
+#include <immintrin.h>
+#endif
+
 #include <b64/cdecode.h>
 #include <b64/cencode.h>
 
@@ -81,6 +87,445 @@ bool tr_sha1(uint8_t* hash, void const* data1, int data1_length, ...)
     return false;
 }
 
+/***
+****  Hashing several buffers at once
+***/
+
+/* SHA1 is serial within a buffer, but a vector unit can run the same
+ * rounds on several independent buffers at once, one per 32-bit lane. */
+
+#ifdef TR_SHA1_MB
+
+static uint32_t const sha1MbInitialState[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+/* compresses block_count blocks per lane; lane i reads them from blocks[i] on */
+typedef void (* sha1_mb_compress_func)(uint32_t (* state)[TR_SHA1_MULTI_MAX], uint8_t const* const* blocks,
+    size_t block_count);
+
+/* t is the round number; W holds the last 16 words of the message schedule */
+#define SHA1_MB_WORD(W, t, xor3, rol) \
+    ((t) < 16 ? W[t] : (W[(t) & 15] = rol(xor3(W[((t) - 3) & 15], W[((t) - 8) & 15], W[((t) - 14) & 15], W[(t) & 15]), 1)))
+
+#define SHA1_MB_ROUND(f, k, w, add, rol) \
+    do \
+    { \
+        tmp = add(add(rol(a, 5), f), add(add(e, k), w)); \
+        e = d; \
+        d = c; \
+        c = rol(b, 30); \
+        b = a; \
+        a = tmp; \
+    } \
+    while (0)
+
+/* the zero-masking forms avoid GCC 12's uninitialized warnings about the plain ones' unused merge source */
+#define SHA1_AVX512_ROL(x, n) _mm512_maskz_rol_epi32(0xFFFF, (x), (n))
+#define SHA1_AVX512_XOR4(w, x, y, z) _mm512_ternarylogic_epi32((w), (x), _mm512_xor_si512((y), (z)), 0x96)
+
+__attribute__((target("avx512f,avx512bw")))
+static void sha1Avx512Compress(uint32_t (* state)[TR_SHA1_MULTI_MAX], uint8_t const* const* blocks, size_t block_count)
+{
+    __m512i const bswap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b, 0x04050607, 0x00010203);
+    uint8_t const* const base = blocks[0];
+    int64_t offsets[16];
+    __m512i lo;
+    __m512i hi;
+    __m512i a = _mm512_loadu_si512(state[0]);
+    __m512i b = _mm512_loadu_si512(state[1]);
+    __m512i c = _mm512_loadu_si512(state[2]);
+    __m512i d = _mm512_loadu_si512(state[3]);
+    __m512i e = _mm512_loadu_si512(state[4]);
+    __m512i tmp;
+    __m512i W[16];
+
+    /* the lanes' buffers are gathered from relative to the first one's */
+    for (int i = 0; i < 16; ++i)
+    {
+        offsets[i] = (int64_t)((intptr_t)blocks[i] - (intptr_t)base);
+    }
+
+    lo = _mm512_loadu_si512(offsets);
+    hi = _mm512_loadu_si512(offsets + 8);
+
+    for (size_t n = 0; n < block_count; ++n)
+    {
+        uint8_t const* const p = base + n * 64;
+        __m512i const a0 = a;
+        __m512i const b0 = b;
+        __m512i const c0 = c;
+        __m512i const d0 = d;
+        __m512i const e0 = e;
+
+        for (int t = 0; t < 16; ++t)
+        {
+            __m512i words = _mm512_setzero_si512();
+            words = _mm512_maskz_inserti64x4(0xFF, words, _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), 0xFF, lo,
+                p + 4 * t, 1), 0);
+            words = _mm512_maskz_inserti64x4(0xFF, words, _mm512_mask_i64gather_epi32(_mm256_setzero_si256(), 0xFF, hi,
+                p + 4 * t, 1), 1);
+            W[t] = _mm512_shuffle_epi8(words, bswap);
+        }
+
+        for (int t = 0; t < 20; ++t)
+        {
+            __m512i const f = _mm512_ternarylogic_epi32(b, c, d, 0xCA); /* b ? c : d */
+            SHA1_MB_ROUND(f, _mm512_set1_epi32(0x5A827999), SHA1_MB_WORD(W, t, SHA1_AVX512_XOR4, SHA1_AVX512_ROL),
+                _mm512_add_epi32, SHA1_AVX512_ROL);
+        }
+
+        for (int t = 20; t < 40; ++t)
+        {
+            __m512i const f = _mm512_ternarylogic_epi32(b, c, d, 0x96); /* b ^ c ^ d */
+            SHA1_MB_ROUND(f, _mm512_set1_epi32(0x6ED9EBA1), SHA1_MB_WORD(W, t, SHA1_AVX512_XOR4, SHA1_AVX512_ROL),
+                _mm512_add_epi32, SHA1_AVX512_ROL);
+        }
+
+        for (int t = 40; t < 60; ++t)
+        {
+            __m512i const f = _mm512_ternarylogic_epi32(b, c, d, 0xE8); /* majority */
+            SHA1_MB_ROUND(f, _mm512_set1_epi32((int)0x8F1BBCDC), SHA1_MB_WORD(W, t, SHA1_AVX512_XOR4, SHA1_AVX512_ROL),
+                _mm512_add_epi32, SHA1_AVX512_ROL);
+        }
+
+        for (int t = 60; t < 80; ++t)
+        {
+            __m512i const f = _mm512_ternarylogic_epi32(b, c, d, 0x96);
+            SHA1_MB_ROUND(f, _mm512_set1_epi32((int)0xCA62C1D6), SHA1_MB_WORD(W, t, SHA1_AVX512_XOR4, SHA1_AVX512_ROL),
+                _mm512_add_epi32, SHA1_AVX512_ROL);
+        }
+
+        a = _mm512_add_epi32(a, a0);
+        b = _mm512_add_epi32(b, b0);
+        c = _mm512_add_epi32(c, c0);
+        d = _mm512_add_epi32(d, d0);
+        e = _mm512_add_epi32(e, e0);
+    }
+
+    _mm512_storeu_si512(state[0], a);
+    _mm512_storeu_si512(state[1], b);
+    _mm512_storeu_si512(state[2], c);
+    _mm512_storeu_si512(state[3], d);
+    _mm512_storeu_si512(state[4], e);
+}
+
+#define SHA1_AVX2_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+#define SHA1_AVX2_XOR4(w, x, y, z) _mm256_xor_si256(_mm256_xor_si256((w), (x)), _mm256_xor_si256((y), (z)))
+
+__attribute__((target("avx2")))
+static void sha1Avx2Compress(uint32_t (* state)[TR_SHA1_MULTI_MAX], uint8_t const* const* blocks, size_t block_count)
+{
+    __m256i const bswap = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8, 9, 10, 11,
+        4, 5, 6, 7, 0, 1, 2, 3);
+    uint8_t const* const base = blocks[0];
+    int64_t offsets[8];
+    __m256i lo;
+    __m256i hi;
+    __m256i a = _mm256_loadu_si256((__m256i const*)state[0]);
+    __m256i b = _mm256_loadu_si256((__m256i const*)state[1]);
+    __m256i c = _mm256_loadu_si256((__m256i const*)state[2]);
+    __m256i d = _mm256_loadu_si256((__m256i const*)state[3]);
+    __m256i e = _mm256_loadu_si256((__m256i const*)state[4]);
+    __m256i tmp;
+    __m256i W[16];
+
+    for (int i = 0; i < 8; ++i)
+    {
+        offsets[i] = (int64_t)((intptr_t)blocks[i] - (intptr_t)base);
+    }
+
+    lo = _mm256_loadu_si256((__m256i const*)offsets);
+    hi = _mm256_loadu_si256((__m256i const*)(offsets + 4));
+
+    for (size_t n = 0; n < block_count; ++n)
+    {
+        uint8_t const* const p = base + n * 64;
+        __m256i const a0 = a;
+        __m256i const b0 = b;
+        __m256i const c0 = c;
+        __m256i const d0 = d;
+        __m256i const e0 = e;
+
+        for (int t = 0; t < 16; ++t)
+        {
+            __m256i const words = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm256_i64gather_epi32(
+                (int const*)(p + 4 * t), lo, 1)), _mm256_i64gather_epi32((int const*)(p + 4 * t), hi, 1), 1);
+            W[t] = _mm256_shuffle_epi8(words, bswap);
+        }
+
+        for (int t = 0; t < 20; ++t)
+        {
+            __m256i const f = _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+            SHA1_MB_ROUND(f, _mm256_set1_epi32(0x5A827999), SHA1_MB_WORD(W, t, SHA1_AVX2_XOR4, SHA1_AVX2_ROL),
+                _mm256_add_epi32, SHA1_AVX2_ROL);
+        }
+
+        for (int t = 20; t < 40; ++t)
+        {
+            __m256i const f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+            SHA1_MB_ROUND(f, _mm256_set1_epi32(0x6ED9EBA1), SHA1_MB_WORD(W, t, SHA1_AVX2_XOR4, SHA1_AVX2_ROL),
+                _mm256_add_epi32, SHA1_AVX2_ROL);
+        }
+
+        for (int t = 40; t < 60; ++t)
+        {
+            __m256i const f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            SHA1_MB_ROUND(f, _mm256_set1_epi32((int)0x8F1BBCDC), SHA1_MB_WORD(W, t, SHA1_AVX2_XOR4, SHA1_AVX2_ROL),
+                _mm256_add_epi32, SHA1_AVX2_ROL);
+        }
+
+        for (int t = 60; t < 80; ++t)
+        {
+            __m256i const f = _mm256_xor_si256(b, _mm256_xor_si256(c, d));
+            SHA1_MB_ROUND(f, _mm256_set1_epi32((int)0xCA62C1D6), SHA1_MB_WORD(W, t, SHA1_AVX2_XOR4, SHA1_AVX2_ROL),
+                _mm256_add_epi32, SHA1_AVX2_ROL);
+        }
+
+        a = _mm256_add_epi32(a, a0);
+        b = _mm256_add_epi32(b, b0);
+        c = _mm256_add_epi32(c, c0);
+        d = _mm256_add_epi32(d, d0);
+        e = _mm256_add_epi32(e, e0);
+    }
+
+    _mm256_storeu_si256((__m256i*)state[0], a);
+    _mm256_storeu_si256((__m256i*)state[1], b);
+    _mm256_storeu_si256((__m256i*)state[2], c);
+    _mm256_storeu_si256((__m256i*)state[3], d);
+    _mm256_storeu_si256((__m256i*)state[4], e);
+}
+
+/* where one lane is in its job */
+struct sha1_mb_lane
+{
+    tr_sha1_job const* job;
+    uint8_t const* next;
+    size_t blocks_left;
+    bool padded;
+    uint8_t tail[128];
+};
+
+/* moves a lane on from its job's whole blocks to the padded last one or two */
+static void sha1MbPad(struct sha1_mb_lane* lane)
+{
+    tr_sha1_job const* job = lane->job;
+    size_t const tail_length = job->data_length % 64;
+    size_t const tail_size = tail_length < 56 ? 64 : 128;
+    uint64_t const bit_length = (uint64_t)job->data_length * 8;
+
+    if (tail_length > 0)
+    {
+        memcpy(lane->tail, (uint8_t const*)job->data + (job->data_length - tail_length), tail_length);
+    }
+
+    lane->tail[tail_length] = 0x80;
+    memset(lane->tail + tail_length + 1, 0, tail_size - tail_length - 1);
+
+    for (int i = 0; i < 8; ++i)
+    {
+        lane->tail[tail_size - 1 - i] = (uint8_t)(bit_length >> (8 * i));
+    }
+
+    lane->next = lane->tail;
+    lane->blocks_left = tail_size / 64;
+    lane->padded = true;
+}
+
+/* hashes up to `width` jobs, one per lane */
+static void sha1MbRun(sha1_mb_compress_func compress, size_t width, tr_sha1_job const* jobs, size_t job_count)
+{
+    uint32_t state[5][TR_SHA1_MULTI_MAX];
+    struct sha1_mb_lane lanes[TR_SHA1_MULTI_MAX];
+    uint8_t const* blocks[TR_SHA1_MULTI_MAX];
+    size_t active = job_count;
+
+    TR_ASSERT(job_count <= width);
+
+    for (size_t i = 0; i < width; ++i)
+    {
+        for (int j = 0; j < 5; ++j)
+        {
+            state[j][i] = sha1MbInitialState[j];
+        }
+
+        lanes[i].job = i < job_count ? &jobs[i] : NULL;
+    }
+
+    for (size_t i = 0; i < job_count; ++i)
+    {
+        lanes[i].next = jobs[i].data;
+        lanes[i].blocks_left = jobs[i].data_length / 64;
+        lanes[i].padded = false;
+
+        if (lanes[i].blocks_left == 0)
+        {
+            sha1MbPad(&lanes[i]);
+        }
+    }
+
+    while (active > 0)
+    {
+        size_t run = SIZE_MAX;
+        uint8_t const* spare = NULL;
+
+        /* run every lane until the first of them needs to move on;
+         * idle lanes rehash that one's blocks and their results are ignored */
+        for (size_t i = 0; i < job_count; ++i)
+        {
+            if (lanes[i].job != NULL && lanes[i].blocks_left < run)
+            {
+                run = lanes[i].blocks_left;
+                spare = lanes[i].next;
+            }
+        }
+
+        for (size_t i = 0; i < width; ++i)
+        {
+            blocks[i] = lanes[i].job != NULL ? lanes[i].next : spare;
+        }
+
+        compress(state, blocks, run);
+
+        for (size_t i = 0; i < job_count; ++i)
+        {
+            struct sha1_mb_lane* lane = &lanes[i];
+
+            if (lane->job == NULL)
+            {
+                continue;
+            }
+
+            lane->next += run * 64;
+            lane->blocks_left -= run;
+
+            if (lane->blocks_left > 0)
+            {
+                continue;
+            }
+
+            if (!lane->padded)
+            {
+                sha1MbPad(lane);
+                continue;
+            }
+
+            for (int j = 0; j < 5; ++j)
+            {
+                lane->job->hash[4 * j + 0] = (uint8_t)(state[j][i] >> 24);
+                lane->job->hash[4 * j + 1] = (uint8_t)(state[j][i] >> 16);
+                lane->job->hash[4 * j + 2] = (uint8_t)(state[j][i] >> 8);
+                lane->job->hash[4 * j + 3] = (uint8_t)state[j][i];
+            }
+
+            lane->job = NULL;
+            --active;
+        }
+    }
+}
+
+static size_t sha1MbDetectWidth(void)
+{
+    unsigned int eax;
+    unsigned int ebx;
+    unsigned int ecx;
+    unsigned int edx;
+    unsigned int xcr0;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & bit_OSXSAVE) == 0 || __get_cpuid_max(0, NULL) < 7)
+    {
+        return 1;
+    }
+
+    /* which vector registers the OS saves */
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+    if ((xcr0 & 0xE6) == 0xE6 && (ebx & bit_AVX512F) != 0 && (ebx & bit_AVX512BW) != 0)
+    {
+        return 16;
+    }
+
+    /* where there are SHA instructions, the crypto backend's one-at-a-time hashing uses them,
+     * and eight AVX2 lanes don't reliably beat that */
+    if ((xcr0 & 0x06) == 0x06 && (ebx & bit_AVX2) != 0 && (ebx & bit_SHA) == 0)
+    {
+        return 8;
+    }
+
+    return 1;
+}
+
+static size_t sha1MbGetWidth(sha1_mb_compress_func* setme_compress)
+{
+    /* 0 if we haven't asked the CPU yet */
+    static size_t width = 0;
+    size_t ret = __atomic_load_n(&width, __ATOMIC_RELAXED);
+
+    if (ret == 0)
+    {
+        ret = sha1MbDetectWidth();
+        __atomic_store_n(&width, ret, __ATOMIC_RELAXED);
+    }
+
+    if (setme_compress != NULL)
+    {
+        *setme_compress = ret == 16 ? sha1Avx512Compress : sha1Avx2Compress;
+    }
+
+    return ret;
+}
+
+#endif /* TR_SHA1_MB */
+
+bool tr_sha1_multi(tr_sha1_ctx_t handle, tr_sha1_job const* jobs, size_t job_count)
+{
+    TR_ASSERT(handle != NULL);
+    TR_ASSERT(jobs != NULL || job_count == 0);
+
+#ifdef TR_SHA1_MB
+
+    sha1_mb_compress_func compress;
+    size_t const width = sha1MbGetWidth(&compress);
+
+    /* a batch with most of its lanes idle is slower than hashing its jobs one at a time */
+    while (width > 1 && job_count >= width / 2)
+    {
+        size_t const n = MIN(job_count, width);
+
+        sha1MbRun(compress, width, jobs, n);
+        jobs += n;
+        job_count -= n;
+    }
+
+#endif
+
+    for (size_t i = 0; i < job_count; ++i)
+    {
+        /* reset the hasher even if this fails, so the next job starts afresh */
+        bool const hashed = tr_sha1_update(handle, jobs[i].data, jobs[i].data_length);
+
+        if (!tr_sha1_reset(handle, hashed ? jobs[i].hash : NULL) || !hashed)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+size_t tr_sha1_multi_width(void)
+{
+#ifdef TR_SHA1_MB
+
+    return sha1MbGetWidth(NULL);
+
+#else
+
+    return 1;
+
+#endif
+}
+
 /***
 ****
 ***/
@@ -60,6 +60,37 @@ bool tr_sha1_update(tr_sha1_ctx_t handle, void const* data, size_t data_length);
  */
 bool tr_sha1_final(tr_sha1_ctx_t handle, uint8_t* hash);
 
+/**
+ * @brief Export SHA1 hash (unless @a hash is NULL) and reset hasher context so it can be reused.
+ */
+bool tr_sha1_reset(tr_sha1_ctx_t handle, uint8_t* hash);
+
+/** @brief One of the buffers for @ref tr_sha1_multi to hash. */
+typedef struct tr_sha1_job
+{
+    void const* data;
+    size_t data_length;
+    uint8_t* hash;
+}
+tr_sha1_job;
+
+/**
+ * @brief Generate the SHA1 hashes of several independent buffers.
+ *
+ * Where the CPU has wide enough vector units, the buffers are hashed side by
+ * side, one per lane. Otherwise they're hashed one after another with
+ * @a handle, which is left reset either way.
+ */
+bool tr_sha1_multi(tr_sha1_ctx_t handle, tr_sha1_job const* jobs, size_t job_count);
+
+/** @brief The most buffers @ref tr_sha1_multi can hash side by side. */
+#define TR_SHA1_MULTI_MAX 16
+
+/**
+ * @brief How many buffers @ref tr_sha1_multi hashes side by side on this CPU.
+ */
+size_t tr_sha1_multi_width(void);
+
 /**
  * @brief Allocate and initialize new RC4 cipher context.
  */
@@ -0,0 +1,588 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* strcmp() */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_sha1_update(), tr_sha1_final() */
+#include "disk-io.h"
+#include "inout.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_cond, tr_thread */
+#include "session.h"
+#include "torrent.h"
+#include "tr-assert.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+
+#define MY_NAME "Disk IO"
+
+#define dbgmsg(...) tr_logAddDeepNamed(MY_NAME, __VA_ARGS__)
+
+/***
+****
+***/
+
+enum
+{
+    /* at most this many worker threads, one per download directory */
+    MAX_QUEUES = 8,
+    /* once this many bytes have piled up in queued writes, stop adding more */
+    MAX_PENDING_WRITE_BYTES = (32 * 1024 * 1024),
+    /* how much of a piece is read at a time when hashing it */
+    HASH_READ_BYTES = (256 * 1024)
+};
+
+enum
+{
+    DISK_IO_READ,
+    DISK_IO_PREFETCH,
+    DISK_IO_WRITE,
+    DISK_IO_HASH
+};
+
+struct disk_job
+{
+    struct disk_job* next;
+
+    int type;
+    tr_torrent* tor;
+    int torrent_id;
+    tr_io_dirs* dirs; /* where the torrent's files were when the job was queued */
+    tr_piece_index_t piece;
+    uint32_t offset;
+    uint32_t length;
+    uint8_t* buf;
+    struct evbuffer* evbuf; /* what to write, for writes */
+    tr_sha1_ctx_t sha; /* what's been hashed so far, for hashes */
+
+    int err;
+    tr_disk_io_done_func callback;
+    void* user_data;
+};
+
+/* Jobs for the torrents in one download directory, done in order by one
+ * worker thread. Keeping the directory on its own thread means that a slow
+ * disk only holds up the torrents that are on it. */
+struct tr_disk_queue
+{
+    char* dir;
+    struct disk_job* head;
+    struct disk_job* tail;
+    tr_thread* thread; /* NULL when the queue is idle */
+    tr_disk_io* io;
+
+    /* only used by the worker thread */
+    tr_io_batch* batch;
+    bool batchFailed;
+};
+
+struct tr_disk_io
+{
+    tr_session* session;
+    tr_lock* lock;
+
+    /* broadcast whenever a job finishes or a worker goes idle */
+    tr_cond* cond;
+
+    struct tr_disk_queue queues[MAX_QUEUES];
+    int queueCount;
+
+    /* finished jobs waiting for their callbacks to be called */
+    struct disk_job* doneHead;
+    struct disk_job* doneTail;
+
+    size_t pendingWriteBytes;
+};
+
+/***
+****
+***/
+
+static void deliverCompletions(void* vsession)
+{
+    tr_session* session = vsession;
+    tr_disk_io* io = session->diskIo;
+    struct disk_job* job;
+
+    if (io == NULL)
+    {
+        return;
+    }
+
+    tr_lockLock(io->lock);
+    job = io->doneHead;
+    io->doneHead = io->doneTail = NULL;
+    tr_lockUnlock(io->lock);
+
+    while (job != NULL)
+    {
+        struct disk_job* next = job->next;
+
+        (*job->callback)(session, job->torrent_id, job->err, job->user_data);
+
+        tr_free(job);
+        job = next;
+    }
+}
+
+/* called by the worker when it's done with a job */
+static void finishJob(tr_disk_io* io, struct disk_job* job)
+{
+    bool notify = false;
+
+    if (job->type == DISK_IO_WRITE)
+    {
+        evbuffer_free(job->evbuf);
+        job->evbuf = NULL;
+        job->buf = NULL;
+    }
+
+    tr_free(job->dirs);
+    job->dirs = NULL;
+
+    tr_lockLock(io->lock);
+
+    if (job->type == DISK_IO_WRITE)
+    {
+        --job->tor->diskIoPendingWrites;
+        io->pendingWriteBytes -= job->length;
+    }
+
+    /* after this, the torrent may be freed at any time */
+    --job->tor->diskIoPending;
+    job->tor = NULL;
+
+    /* wake up anyone waiting for the torrent's jobs */
+    tr_condBroadcast(io->cond);
+
+    if (job->callback != NULL)
+    {
+        notify = io->doneHead == NULL;
+        job->next = NULL;
+
+        if (io->doneTail != NULL)
+        {
+            io->doneTail->next = job;
+        }
+        else
+        {
+            io->doneHead = job;
+        }
+
+        io->doneTail = job;
+        job = NULL;
+    }
+
+    tr_lockUnlock(io->lock);
+
+    tr_free(job);
+
+    /* one wakeup per batch of finished jobs */
+    if (notify)
+    {
+        tr_runInEventThread(io->session, deliverCompletions, io->session);
+    }
+}
+
+static void onBatchJobDone(void* vjob, int err)
+{
+    struct disk_job* job = vjob;
+
+    job->err = err;
+    finishJob(job->tor->session->diskIo, job);
+}
+
+static int hashPiece(struct disk_job* job)
+{
+    TR_ASSERT(job->length > 0);
+
+    int err = 0;
+    uint8_t* buf = tr_valloc(MIN(job->length, HASH_READ_BYTES));
+
+    for (uint32_t done = 0; err == 0 && done < job->length;)
+    {
+        uint32_t const len = MIN(job->length - done, HASH_READ_BYTES);
+
+        if ((err = tr_ioRead(job->tor, job->dirs, job->piece, job->offset + done, len, buf)) == 0)
+        {
+            tr_sha1_update(job->sha, buf, len);
+            done += len;
+        }
+    }
+
+    tr_sha1_final(job->sha, err == 0 ? job->buf : NULL);
+    job->sha = NULL;
+
+    tr_free(buf);
+    return err;
+}
+
+static void runJob(struct disk_job* job)
+{
+    switch (job->type)
+    {
+    case DISK_IO_READ:
+        job->err = tr_ioRead(job->tor, job->dirs, job->piece, job->offset, job->length, job->buf);
+        break;
+
+    case DISK_IO_PREFETCH:
+        job->err = tr_ioPrefetch(job->tor, job->dirs, job->piece, job->offset, job->length);
+        break;
+
+    case DISK_IO_WRITE:
+        job->err = job->buf != NULL ? tr_ioWrite(job->tor, job->dirs, job->piece, job->offset, job->length, job->buf) :
+            tr_ioWriteBuffer(job->tor, job->dirs, job->piece, job->offset, job->evbuf);
+        break;
+
+    case DISK_IO_HASH:
+        job->err = hashPiece(job);
+        break;
+
+    default:
+        TR_ASSERT_MSG(false, "unhandled disk job type %d", job->type);
+        break;
+    }
+}
+
+static tr_io_batch* getBatch(struct tr_disk_queue* q)
+{
+    if (!q->io->session->isIoUringEnabled)
+    {
+        return NULL;
+    }
+
+    if (q->batch == NULL && !q->batchFailed)
+    {
+        if ((q->batch = tr_ioBatchNew()) == NULL)
+        {
+            tr_logAddNamedInfo(MY_NAME, "io_uring isn't available; using regular reads and writes");
+            q->batchFailed = true;
+        }
+    }
+
+    return q->batch;
+}
+
+static void workerFunc(void* vqueue)
+{
+    struct tr_disk_queue* q = vqueue;
+    tr_disk_io* io = q->io;
+
+    for (;;)
+    {
+        struct disk_job* jobs;
+        tr_io_batch* batch;
+
+        /* take everything that's queued */
+        tr_lockLock(io->lock);
+
+        if ((jobs = q->head) == NULL)
+        {
+            q->thread = NULL;
+            tr_condBroadcast(io->cond);
+            tr_lockUnlock(io->lock);
+            break;
+        }
+
+        q->head = q->tail = NULL;
+
+        tr_lockUnlock(io->lock);
+
+        batch = getBatch(q);
+
+        while (jobs != NULL)
+        {
+            struct disk_job* job = jobs;
+            bool const canBatch = batch != NULL && (job->type == DISK_IO_READ || job->type == DISK_IO_WRITE);
+
+            jobs = job->next;
+
+            /* The blocks came off the network in pieces. io_uring wants them
+             * gathered into one run of memory, and that's the only copy made
+             * of them since they were read from the socket. Otherwise they're
+             * written straight from the evbuffer with vectored writes. */
+            if (canBatch && job->type == DISK_IO_WRITE)
+            {
+                job->buf = evbuffer_pullup(job->evbuf, -1);
+            }
+
+            if (canBatch && tr_ioBatchAdd(batch, job->tor, job->dirs, job->type == DISK_IO_WRITE, job->piece,
+                job->offset, job->length, job->buf, job))
+            {
+                continue;
+            }
+
+            /* keep the jobs in order */
+            if (batch != NULL)
+            {
+                tr_ioBatchRun(batch, onBatchJobDone);
+            }
+
+            if (canBatch && tr_ioBatchAdd(batch, job->tor, job->dirs, job->type == DISK_IO_WRITE, job->piece,
+                job->offset, job->length, job->buf, job))
+            {
+                continue;
+            }
+
+            runJob(job);
+            finishJob(io, job);
+        }
+
+        if (batch != NULL)
+        {
+            tr_ioBatchRun(batch, onBatchJobDone);
+        }
+    }
+}
+
+static struct tr_disk_queue* getQueue(tr_disk_io* io, tr_torrent* tor)
+{
+    char const* dir;
+
+    TR_ASSERT(tr_lockHave(io->lock));
+
+    /* keep all of a torrent's unfinished jobs in the same queue so they stay in order */
+    if (tor->diskQueue != NULL && tor->diskIoPending > 0)
+    {
+        return tor->diskQueue;
+    }
+
+    dir = tr_torrentGetCurrentDir(tor);
+
+    if (dir == NULL)
+    {
+        dir = "";
+    }
+
+    for (int i = 0; i < io->queueCount; ++i)
+    {
+        if (strcmp(io->queues[i].dir, dir) == 0)
+        {
+            return io->queues + i;
+        }
+    }
+
+    if (io->queueCount < MAX_QUEUES)
+    {
+        struct tr_disk_queue* q = io->queues + io->queueCount++;
+        q->dir = tr_strdup(dir);
+        q->io = io;
+        dbgmsg("new queue for \"%s\"", dir);
+        return q;
+    }
+
+    /* out of threads, so share with another directory */
+    uint32_t hash = 0;
+
+    for (char const* walk = dir; *walk != '\0'; ++walk)
+    {
+        hash = hash * 31 + (uint8_t)*walk;
+    }
+
+    return io->queues + hash % MAX_QUEUES;
+}
+
+static void enqueue(tr_torrent* tor, struct disk_job* job)
+{
+    tr_disk_io* io = tor->session->diskIo;
+    struct tr_disk_queue* q;
+
+    TR_ASSERT(io != NULL);
+
+    job->tor = tor;
+    job->torrent_id = tr_torrentId(tor);
+    job->dirs = tr_ioDirsNew(tor);
+    job->next = NULL;
+
+    tr_lockLock(io->lock);
+
+    if (job->type == DISK_IO_WRITE)
+    {
+        io->pendingWriteBytes += job->length;
+    }
+
+    q = getQueue(io, tor);
+    tor->diskQueue = q;
+    ++tor->diskIoPending;
+
+    if (job->type == DISK_IO_WRITE)
+    {
+        ++tor->diskIoPendingWrites;
+    }
+
+    if (q->tail != NULL)
+    {
+        q->tail->next = job;
+    }
+    else
+    {
+        q->head = job;
+    }
+
+    q->tail = job;
+
+    if (q->thread == NULL)
+    {
+        q->thread = tr_threadNew(workerFunc, q);
+    }
+
+    tr_lockUnlock(io->lock);
+}
+
+static struct disk_job* jobNew(int type, tr_piece_index_t piece, uint32_t offset, uint32_t len, uint8_t* buf,
+    tr_disk_io_done_func callback, void* user_data)
+{
+    struct disk_job* job = tr_new0(struct disk_job, 1);
+    job->type = type;
+    job->piece = piece;
+    job->offset = offset;
+    job->length = len;
+    job->buf = buf;
+    job->callback = callback;
+    job->user_data = user_data;
+    return job;
+}
+
+void tr_diskIoRead(tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len, uint8_t* setme,
+    tr_disk_io_done_func callback, void* user_data)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(callback != NULL);
+
+    enqueue(tor, jobNew(DISK_IO_READ, piece, offset, len, setme, callback, user_data));
+}
+
+void tr_diskIoWrite(tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, struct evbuffer* writeme,
+    tr_disk_io_done_func callback, void* user_data)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    struct disk_job* job = jobNew(DISK_IO_WRITE, piece, offset, evbuffer_get_length(writeme), NULL, callback, user_data);
+    job->evbuf = writeme;
+    enqueue(tor, job);
+}
+
+void tr_diskIoHashPiece(tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, tr_sha1_ctx_t sha, uint8_t* setme,
+    tr_disk_io_done_func callback, void* user_data)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(callback != NULL);
+    TR_ASSERT(offset < tr_torPieceCountBytes(tor, piece));
+
+    struct disk_job* job = jobNew(DISK_IO_HASH, piece, offset, tr_torPieceCountBytes(tor, piece) - offset, setme, callback,
+        user_data);
+    job->sha = sha;
+    enqueue(tor, job);
+}
+
+void tr_diskIoPrefetch(tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    enqueue(tor, jobNew(DISK_IO_PREFETCH, piece, offset, len, NULL, NULL, NULL));
+}
+
+bool tr_diskIoIsBacklogged(tr_disk_io* io)
+{
+    bool ret;
+
+    tr_lockLock(io->lock);
+    ret = io->pendingWriteBytes >= MAX_PENDING_WRITE_BYTES;
+    tr_lockUnlock(io->lock);
+
+    return ret;
+}
+
+bool tr_diskIoIsWriting(tr_torrent* tor)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    bool ret;
+    tr_disk_io* io = tor->session->diskIo;
+
+    tr_lockLock(io->lock);
+    ret = tor->diskIoPendingWrites > 0;
+    tr_lockUnlock(io->lock);
+
+    return ret;
+}
+
+void tr_diskIoWaitForTorrent(tr_torrent* tor)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    tr_disk_io* io = tor->session->diskIo;
+
+    if (io == NULL)
+    {
+        return;
+    }
+
+    tr_lockLock(io->lock);
+
+    /* the torrent's own worker doesn't need to wait for itself */
+    if (tor->diskIoPending > 0 && !tr_amInThread(tor->diskQueue->thread))
+    {
+        while (tor->diskIoPending > 0)
+        {
+            tr_condWait(io->cond, io->lock);
+        }
+    }
+
+    tr_lockUnlock(io->lock);
+}
+
+/***
+****
+***/
+
+tr_disk_io* tr_diskIoNew(tr_session* session)
+{
+    tr_disk_io* io = tr_new0(tr_disk_io, 1);
+    io->session = session;
+    io->lock = tr_lockNew();
+    io->cond = tr_condNew();
+    return io;
+}
+
+void tr_diskIoFree(tr_disk_io* io)
+{
+    tr_session* session = io->session;
+
+    TR_ASSERT(session->diskIo == io);
+
+    /* wait for the workers to finish */
+    tr_lockLock(io->lock);
+
+    for (int i = 0; i < io->queueCount; ++i)
+    {
+        while (io->queues[i].thread != NULL)
+        {
+            tr_condWait(io->cond, io->lock);
+        }
+    }
+
+    tr_lockUnlock(io->lock);
+
+    /* call the callbacks that haven't been called yet */
+    deliverCompletions(session);
+    session->diskIo = NULL;
+
+    for (int i = 0; i < io->queueCount; ++i)
+    {
+        tr_ioBatchFree(io->queues[i].batch);
+        tr_free(io->queues[i].dir);
+    }
+
+    tr_condFree(io->cond);
+    tr_lockFree(io->lock);
+    tr_free(io);
+}
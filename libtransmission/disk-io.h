@@ -0,0 +1,85 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#include "crypto-utils.h" /* tr_sha1_ctx_t */
+
+struct evbuffer;
+struct tr_torrent;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+typedef struct tr_disk_io tr_disk_io;
+
+/**
+ * Called from the libtransmission thread when a queued read or write is done.
+ * @param err 0 on success, or an errno value on failure
+ */
+typedef void (* tr_disk_io_done_func)(tr_session* session, int torrent_id, int err, void* user_data);
+
+tr_disk_io* tr_diskIoNew(tr_session* session);
+
+/** @brief waits for the queued jobs to finish, then frees the worker pool */
+void tr_diskIoFree(tr_disk_io* io);
+
+/**
+ * Queues a read of the block specified by the piece index, offset, and length.
+ * `setme' must stay valid until `callback' is called.
+ */
+void tr_diskIoRead(struct tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len, uint8_t* setme,
+    tr_disk_io_done_func callback, void* user_data);
+
+/**
+ * Queues a write of `writeme' at the specified piece index and offset.
+ * The queue takes ownership of `writeme' and frees it when it's written.
+ * `callback' may be NULL.
+ */
+void tr_diskIoWrite(struct tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, struct evbuffer* writeme,
+    tr_disk_io_done_func callback, void* user_data);
+
+/**
+ * Queues the hashing of a piece, after the reads and writes that were queued before it.
+ * `sha' has been fed the first `offset' bytes of the piece already, and the rest are read from disk.
+ * The queue takes ownership of `sha'. The hash is put in `setme', which must stay valid
+ * until `callback' is called.
+ */
+void tr_diskIoHashPiece(struct tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, tr_sha1_ctx_t sha, uint8_t* setme,
+    tr_disk_io_done_func callback, void* user_data);
+
+/** @brief queues a hint that the specified bytes will be read soon */
+void tr_diskIoPrefetch(struct tr_torrent* tor, tr_piece_index_t piece, uint32_t offset, uint32_t len);
+
+/**
+ * @return true if so many bytes are waiting to be written that no more
+ * should be queued for now. Writes are never refused, so until this is
+ * false again the cache holds on to its blocks and no new blocks are
+ * requested from peers, instead of making the libtransmission thread wait.
+ */
+bool tr_diskIoIsBacklogged(tr_disk_io* io);
+
+/**
+ * @return true if any of the torrent's queued writes haven't been done yet.
+ * Until they are, its files may not have the data that the cache says it has.
+ */
+bool tr_diskIoIsWriting(struct tr_torrent* tor);
+
+/**
+ * Blocks until all of the torrent's queued reads and writes are done.
+ * Use this before touching the torrent's files from the libtransmission thread.
+ */
+void tr_diskIoWaitForTorrent(struct tr_torrent* tor);
+
+/* @} */
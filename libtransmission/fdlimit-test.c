@@ -0,0 +1,288 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h> /* fprintf() */
+#include <time.h> /* clock() */
+
+#ifndef _WIN32
+#include <sys/resource.h> /* getrlimit() */
+#endif
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_rand_int_weak() */
+#include "fdlimit.h"
+#include "file.h"
+#include "session.h"
+#include "utils.h"
+
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
+#include "libtransmission-test.h"
+
+#define TEST_TORRENT_ID 1
+#define FILE_COUNT 12
+
+static char* file_path(char const* sandbox, tr_file_index_t i)
+{
+    char name[32];
+
+    tr_snprintf(name, sizeof(name), "file-%u", (unsigned int)i);
+    return tr_buildPath(sandbox, name, NULL);
+}
+
+static void create_files(char const* sandbox, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        char* path = file_path(sandbox, i);
+        libtest_create_file_with_string_contents(path, "hello");
+        tr_free(path);
+    }
+}
+
+static tr_sys_file_t checkout(tr_session* session, int torrent_id, char const* sandbox, tr_file_index_t i, bool writable)
+{
+    char* path = file_path(sandbox, i);
+    tr_sys_file_t const fd = tr_fdFileCheckout(session, torrent_id, i, path, writable, TR_PREALLOCATE_NONE, 5);
+
+    tr_free(path);
+    return fd;
+}
+
+static bool is_cached(tr_session* session, int torrent_id, tr_file_index_t i, bool writable)
+{
+    tr_sys_file_t const fd = tr_fdFileGetCached(session, torrent_id, i, writable);
+
+    if (fd == TR_BAD_SYS_FILE)
+    {
+        return false;
+    }
+
+    tr_fdFileReturn(session, torrent_id, i, fd);
+    return true;
+}
+
+static int test_lru(void)
+{
+    tr_session* session;
+    char* sandbox;
+    tr_sys_file_t fd;
+    tr_sys_file_t fds[FILE_COUNT];
+
+    session = libttest_session_init(NULL);
+    sandbox = libtest_sandbox_create();
+    create_files(sandbox, FILE_COUNT);
+
+    /* 6 files for reading, 2 for writing */
+    session->openFileLimit = 8;
+
+    for (tr_file_index_t i = 0; i < 10; ++i)
+    {
+        fd = checkout(session, TEST_TORRENT_ID, sandbox, i, false);
+        check(fd != TR_BAD_SYS_FILE);
+        tr_fdFileReturn(session, TEST_TORRENT_ID, i, fd);
+    }
+
+    /* only the most recently used ones are still open */
+    for (tr_file_index_t i = 0; i < 4; ++i)
+    {
+        check(!is_cached(session, TEST_TORRENT_ID, i, false));
+    }
+
+    for (tr_file_index_t i = 4; i < 10; ++i)
+    {
+        check(is_cached(session, TEST_TORRENT_ID, i, false));
+        check(!is_cached(session, TEST_TORRENT_ID, i, true));
+    }
+
+    /* using a file moves it to the back of the line */
+    check(is_cached(session, TEST_TORRENT_ID, 4, false));
+    fd = checkout(session, TEST_TORRENT_ID, sandbox, 0, false);
+    check(fd != TR_BAD_SYS_FILE);
+    tr_fdFileReturn(session, TEST_TORRENT_ID, 0, fd);
+    check(is_cached(session, TEST_TORRENT_ID, 4, false));
+    check(!is_cached(session, TEST_TORRENT_ID, 5, false));
+
+    /* writing doesn't push out the files that are being read */
+    for (tr_file_index_t i = 0; i < 3; ++i)
+    {
+        fd = checkout(session, TEST_TORRENT_ID + 1, sandbox, i, true);
+        check(fd != TR_BAD_SYS_FILE);
+        tr_fdFileReturn(session, TEST_TORRENT_ID + 1, i, fd);
+    }
+
+    check(!is_cached(session, TEST_TORRENT_ID + 1, 0, true));
+    check(is_cached(session, TEST_TORRENT_ID + 1, 1, true));
+    check(is_cached(session, TEST_TORRENT_ID + 1, 2, true));
+    check(is_cached(session, TEST_TORRENT_ID + 1, 2, false));
+    check(is_cached(session, TEST_TORRENT_ID, 0, false));
+    check(is_cached(session, TEST_TORRENT_ID, 4, false));
+
+    /* reopening a file for writing moves it to the other set */
+    fd = checkout(session, TEST_TORRENT_ID, sandbox, 9, true);
+    check(fd != TR_BAD_SYS_FILE);
+    tr_fdFileReturn(session, TEST_TORRENT_ID, 9, fd);
+    check(is_cached(session, TEST_TORRENT_ID, 9, true));
+
+    /* files that are in use don't get closed */
+    for (tr_file_index_t i = 0; i < 6; ++i)
+    {
+        fds[i] = checkout(session, TEST_TORRENT_ID + 2, sandbox, i, false);
+        check(fds[i] != TR_BAD_SYS_FILE);
+    }
+
+    fd = checkout(session, TEST_TORRENT_ID + 2, sandbox, 6, false);
+    check(fd == TR_BAD_SYS_FILE);
+    check_int(errno, ==, EMFILE);
+
+    for (tr_file_index_t i = 0; i < 6; ++i)
+    {
+        tr_fdFileReturn(session, TEST_TORRENT_ID + 2, i, fds[i]);
+    }
+
+    fd = checkout(session, TEST_TORRENT_ID + 2, sandbox, 6, false);
+    check(fd != TR_BAD_SYS_FILE);
+    tr_fdFileReturn(session, TEST_TORRENT_ID + 2, 6, fd);
+
+    /* closing a torrent closes all of its files */
+    tr_sessionLock(session);
+    tr_fdTorrentClose(session, TEST_TORRENT_ID + 2);
+    tr_sessionUnlock(session);
+
+    for (tr_file_index_t i = 0; i < 7; ++i)
+    {
+        check(!is_cached(session, TEST_TORRENT_ID + 2, i, false));
+    }
+
+    check(is_cached(session, TEST_TORRENT_ID + 1, 2, true));
+
+    tr_fdClose(session);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_large_limit(void)
+{
+#ifndef _WIN32
+
+    int const n_files = 3000;
+    tr_session* session;
+    char* sandbox;
+    struct rlimit limit;
+
+    /* the fd limit can't be raised past the hard limit */
+    check_int(getrlimit(RLIMIT_NOFILE, &limit), ==, 0);
+
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < 16384)
+    {
+        return 0;
+    }
+
+    session = libttest_session_init(NULL);
+    sandbox = libtest_sandbox_create();
+    create_files(sandbox, n_files);
+
+    /* left to itself, more than FD_SETSIZE files can be kept open */
+    for (tr_file_index_t i = 0; i < 1500; ++i)
+    {
+        tr_sys_file_t const fd = checkout(session, TEST_TORRENT_ID, sandbox, i, false);
+        check(fd != TR_BAD_SYS_FILE);
+        tr_fdFileReturn(session, TEST_TORRENT_ID, i, fd);
+    }
+
+    for (tr_file_index_t i = 0; i < 1500; ++i)
+    {
+        check(is_cached(session, TEST_TORRENT_ID, i, false));
+    }
+
+    /* and the setting can raise the limit further */
+    session->openFileLimit = 5000;
+
+    for (tr_file_index_t i = 0; i < (tr_file_index_t)n_files; ++i)
+    {
+        tr_sys_file_t const fd = checkout(session, TEST_TORRENT_ID + 1, sandbox, i, false);
+        check(fd != TR_BAD_SYS_FILE);
+        tr_fdFileReturn(session, TEST_TORRENT_ID + 1, i, fd);
+    }
+
+    for (tr_file_index_t i = 0; i < (tr_file_index_t)n_files; ++i)
+    {
+        check(is_cached(session, TEST_TORRENT_ID + 1, i, false));
+    }
+
+    check_int(getrlimit(RLIMIT_NOFILE, &limit), ==, 0);
+    check_uint(limit.rlim_cur, >=, 10000);
+
+    tr_fdClose(session);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    libttest_session_close(session);
+
+#endif
+
+    return 0;
+}
+
+#if SPEED_TEST
+
+/* random reads from a seed of many small files, like seeding a photo archive */
+static int test_speed(void)
+{
+    int const n_files = 20000;
+    int const n_reads = 1000000;
+    tr_session* session;
+    char* sandbox;
+    clock_t start;
+
+    session = libttest_session_init(NULL);
+    sandbox = libtest_sandbox_create();
+    create_files(sandbox, n_files);
+
+    start = clock();
+
+    for (int i = 0; i < n_reads; ++i)
+    {
+        tr_file_index_t const file_index = tr_rand_int_weak(n_files);
+        tr_sys_file_t const fd = checkout(session, TEST_TORRENT_ID, sandbox, file_index, false);
+
+        check(fd != TR_BAD_SYS_FILE);
+        tr_fdFileReturn(session, TEST_TORRENT_ID, file_index, fd);
+    }
+
+    fprintf(stderr, "%d random checkouts of %d files: %.2f s\n", n_reads, n_files,
+        (double)(clock() - start) / CLOCKS_PER_SEC);
+
+    tr_fdClose(session);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    libttest_session_close(session);
+    return 0;
+}
+
+#endif
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_lru,
+        test_large_limit,
+#if SPEED_TEST
+        test_speed
+#endif
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
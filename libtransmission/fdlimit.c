@@ -8,25 +8,38 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h> /* INT_MAX */
 #include <string.h>
 
 #ifndef _WIN32
+#include <fcntl.h> /* fcntl() */
+#include <sys/mman.h> /* mmap(), mincore() */
 #include <sys/time.h> /* getrlimit */
 #include <sys/resource.h> /* getrlimit */
+#include <unistd.h> /* dup() */
 #endif
 
+#include <event2/buffer.h>
+#include <event2/event.h> /* LIBEVENT_VERSION_NUMBER */
+
 #include "transmission.h"
 #include "error.h"
 #include "error-types.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "log.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent() */
 #include "tr-assert.h"
 
 #define dbgmsg(...) tr_logAddDeepNamed(NULL, __VA_ARGS__)
 
+/* libevent can send file segments with sendfile() since 2.1.1 */
+#if !defined(_WIN32) && LIBEVENT_VERSION_NUMBER >= 0x02010100
+#define USE_FILE_SEGMENTS
+#endif
+
 /***
 ****
 ****  Local Files
@@ -125,7 +138,12 @@ struct tr_cached_file
     tr_sys_file_t fd;
     int torrent_id;
     tr_file_index_t file_index;
-    time_t used_at;
+    int busy; /* how many threads are reading or writing it right now */
+    struct evbuffer_file_segment* segment; /* for sending the file to peers, or NULL */
+
+    struct tr_cached_file* hash_next;
+    struct tr_cached_file* lru_prev; /* more recently used */
+    struct tr_cached_file* lru_next; /* less recently used */
 };
 
 static inline bool cached_file_is_open(struct tr_cached_file const* o)
@@ -138,6 +156,18 @@ static inline bool cached_file_is_open(struct tr_cached_file const* o)
 static void cached_file_close(struct tr_cached_file* o)
 {
     TR_ASSERT(cached_file_is_open(o));
+    TR_ASSERT(o->busy == 0);
+
+#ifdef USE_FILE_SEGMENTS
+
+    /* buffers that still hold parts of the segment keep its fd open */
+    if (o->segment != NULL)
+    {
+        evbuffer_file_segment_free(o->segment);
+        o->segment = NULL;
+    }
+
+#endif
 
     tr_sys_file_close(o->fd, NULL);
     o->fd = TR_BAD_SYS_FILE;
@@ -257,111 +287,196 @@ fail:
 ****
 ***/
 
+/* A set of open files, indexed by torrent id and file index,
+ * and kept in least-recently-used order for recycling. */
 struct tr_fileset
 {
-    struct tr_cached_file* begin;
-    struct tr_cached_file const* end;
+    struct tr_cached_file** buckets;
+    size_t bucket_count; /* a power of two */
+    int count;
+
+    struct tr_cached_file* lru_head;
+    struct tr_cached_file* lru_tail;
 };
 
-static void fileset_construct(struct tr_fileset* set, int n)
+static inline size_t fileset_hash(struct tr_fileset const* set, int torrent_id, tr_file_index_t i)
+{
+    uint32_t const h = (uint32_t)torrent_id * 2654435761U ^ (uint32_t)i * 2246822519U;
+
+    return (h ^ (h >> 16)) & (set->bucket_count - 1);
+}
+
+static void fileset_construct(struct tr_fileset* set)
 {
-    struct tr_cached_file const TR_CACHED_FILE_INIT =
+    set->bucket_count = 64;
+    set->buckets = tr_new0(struct tr_cached_file*, set->bucket_count);
+    set->count = 0;
+    set->lru_head = NULL;
+    set->lru_tail = NULL;
+}
+
+static void fileset_rehash(struct tr_fileset* set, size_t bucket_count)
+{
+    tr_free(set->buckets);
+    set->bucket_count = bucket_count;
+    set->buckets = tr_new0(struct tr_cached_file*, bucket_count);
+
+    for (struct tr_cached_file* o = set->lru_head; o != NULL; o = o->lru_next)
     {
-        .is_writable = false,
-        .fd = TR_BAD_SYS_FILE,
-        .torrent_id = 0,
-        .file_index = 0,
-        .used_at = 0
-    };
+        size_t const h = fileset_hash(set, o->torrent_id, o->file_index);
+        o->hash_next = set->buckets[h];
+        set->buckets[h] = o;
+    }
+}
 
-    set->begin = tr_new(struct tr_cached_file, n);
-    set->end = set->begin + n;
+static void fileset_lru_unlink(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    if (o->lru_prev != NULL)
+    {
+        o->lru_prev->lru_next = o->lru_next;
+    }
+    else
+    {
+        set->lru_head = o->lru_next;
+    }
 
-    for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+    if (o->lru_next != NULL)
     {
-        *o = TR_CACHED_FILE_INIT;
+        o->lru_next->lru_prev = o->lru_prev;
+    }
+    else
+    {
+        set->lru_tail = o->lru_prev;
     }
 }
 
+static void fileset_lru_push(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    o->lru_prev = NULL;
+    o->lru_next = set->lru_head;
+
+    if (set->lru_head != NULL)
+    {
+        set->lru_head->lru_prev = o;
+    }
+    else
+    {
+        set->lru_tail = o;
+    }
+
+    set->lru_head = o;
+}
+
+/* marks a file as the most recently used one */
+static void fileset_touch(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    if (set->lru_head != o)
+    {
+        fileset_lru_unlink(set, o);
+        fileset_lru_push(set, o);
+    }
+}
+
+static void fileset_insert(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    size_t h;
+
+    if ((size_t)set->count >= set->bucket_count)
+    {
+        fileset_rehash(set, set->bucket_count * 2);
+    }
+
+    h = fileset_hash(set, o->torrent_id, o->file_index);
+    o->hash_next = set->buckets[h];
+    set->buckets[h] = o;
+    fileset_lru_push(set, o);
+    ++set->count;
+}
+
+/* closes a file and removes it from the set */
+static void fileset_remove(struct tr_fileset* set, struct tr_cached_file* o)
+{
+    struct tr_cached_file** walk = &set->buckets[fileset_hash(set, o->torrent_id, o->file_index)];
+
+    while (*walk != o)
+    {
+        walk = &(*walk)->hash_next;
+    }
+
+    *walk = o->hash_next;
+    fileset_lru_unlink(set, o);
+    --set->count;
+
+    cached_file_close(o);
+    tr_free(o);
+}
+
 static void fileset_close_all(struct tr_fileset* set)
 {
-    if (set != NULL)
+    while (set->lru_head != NULL)
     {
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
-        {
-            if (cached_file_is_open(o))
-            {
-                cached_file_close(o);
-            }
-        }
+        fileset_remove(set, set->lru_head);
     }
 }
 
 static void fileset_destruct(struct tr_fileset* set)
 {
     fileset_close_all(set);
-    tr_free(set->begin);
-    set->end = set->begin = NULL;
+    tr_free(set->buckets);
+    set->buckets = NULL;
+    set->bucket_count = 0;
 }
 
 static void fileset_close_torrent(struct tr_fileset* set, int torrent_id)
 {
-    if (set != NULL)
+    struct tr_cached_file* next;
+
+    for (struct tr_cached_file* o = set->lru_head; o != NULL; o = next)
     {
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+        next = o->lru_next;
+
+        if (o->torrent_id == torrent_id)
         {
-            if (o->torrent_id == torrent_id && cached_file_is_open(o))
-            {
-                cached_file_close(o);
-            }
+            fileset_remove(set, o);
         }
     }
 }
 
 static struct tr_cached_file* fileset_lookup(struct tr_fileset* set, int torrent_id, tr_file_index_t i)
 {
-    if (set != NULL)
+    for (struct tr_cached_file* o = set->buckets[fileset_hash(set, torrent_id, i)]; o != NULL; o = o->hash_next)
     {
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+        if (torrent_id == o->torrent_id && i == o->file_index)
         {
-            if (torrent_id == o->torrent_id && i == o->file_index && cached_file_is_open(o))
-            {
-                return o;
-            }
+            return o;
         }
     }
 
     return NULL;
 }
 
-static struct tr_cached_file* fileset_get_empty_slot(struct tr_fileset* set)
+/**
+ * Closes the least recently used files that no other thread
+ * is using until there's room for another one.
+ * @return false if every file is in use
+ */
+static bool fileset_make_room(struct tr_fileset* set, int limit)
 {
-    struct tr_cached_file* cull = NULL;
+    struct tr_cached_file* o = set->lru_tail;
 
-    if (set->begin != NULL)
+    while (set->count >= limit && o != NULL)
     {
-        /* try to find an unused slot */
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
-        {
-            if (!cached_file_is_open(o))
-            {
-                return o;
-            }
-        }
+        struct tr_cached_file* prev = o->lru_prev;
 
-        /* all slots are full... recycle the least recently used */
-        for (struct tr_cached_file* o = set->begin; o != set->end; ++o)
+        if (o->busy == 0)
         {
-            if (cull == NULL || o->used_at < cull->used_at)
-            {
-                cull = o;
-            }
+            fileset_remove(set, o);
         }
 
-        cached_file_close(cull);
+        o = prev;
     }
 
-    return cull;
+    return set->count < limit;
 }
 
 /***
@@ -373,77 +488,217 @@ static struct tr_cached_file* fileset_get_empty_slot(struct tr_fileset* set)
 struct tr_fdInfo
 {
     int peerCount;
-    struct tr_fileset fileset;
+    int fdLimit; /* RLIMIT_NOFILE */
+    int fdLimitWanted; /* the most we've asked RLIMIT_NOFILE to be raised to */
+
+    /* Files opened for reading and files opened for writing are kept
+     * apart, so that seeding lots of files doesn't close the ones
+     * that are being downloaded into, and vice versa. A file is only
+     * in one of the two; files in `writers' are used for reading too. */
+    struct tr_fileset readers;
+    struct tr_fileset writers;
 };
 
-static void ensureSessionFdInfoExists(tr_session* session)
+/* the fewest files we keep open, no matter what the fd limit is */
+#define MIN_OPEN_FILES 32
+
+/* fds set aside for peers, listening sockets, and everything else */
+#define RESERVED_FDS 64
+
+/* the fd limit that's asked for, and used, unless the open-file-limit setting
+ * wants more. Nothing here uses select(), so this can go past FD_SETSIZE */
+#define DEFAULT_FD_LIMIT 8192
+
+/* each open file may have a second fd for sending it with sendfile() */
+#ifdef USE_FILE_SEGMENTS
+#define FDS_PER_OPEN_FILE 2
+#else
+#define FDS_PER_OPEN_FILE 1
+#endif
+
+/* The file cache is shared by the libtransmission thread and the disk-io
+ * workers. Files are pinned with `busy' while they're being read or written
+ * so that they aren't closed out from under the thread that's using them. */
+static tr_lock* getFileLock(void)
 {
-    TR_ASSERT(tr_isSession(session));
+    static tr_lock* lock = NULL;
 
-    if (session->fdInfo == NULL)
+    if (lock == NULL)
     {
-        struct tr_fdInfo* i;
-        int const FILE_CACHE_SIZE = 32;
+        lock = tr_lockNew();
+    }
 
-        /* Create the local file cache */
-        i = tr_new0(struct tr_fdInfo, 1);
-        fileset_construct(&i->fileset, FILE_CACHE_SIZE);
-        session->fdInfo = i;
+    return lock;
+}
+
+/* raises RLIMIT_NOFILE to `wanted', or as close to it as the hard limit allows */
+static void raise_fd_limit(struct tr_fdInfo* i, int wanted)
+{
+    i->fdLimitWanted = wanted;
 
 #ifndef _WIN32
 
-        /* set the open-file limit to the largest safe size wrt FD_SETSIZE */
-        struct rlimit limit;
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        rlim_t const old_limit = limit.rlim_cur;
+        rlim_t new_limit = (rlim_t)wanted;
 
-        if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+        if (limit.rlim_max != RLIM_INFINITY && new_limit > limit.rlim_max)
         {
-            int const old_limit = (int)limit.rlim_cur;
-            int const new_limit = MIN(limit.rlim_max, FD_SETSIZE);
+            new_limit = limit.rlim_max;
+        }
 
-            if (new_limit != old_limit)
-            {
-                limit.rlim_cur = new_limit;
-                setrlimit(RLIMIT_NOFILE, &limit);
-                getrlimit(RLIMIT_NOFILE, &limit);
-                tr_logAddInfo("Changed open file limit from %d to %d", old_limit, (int)limit.rlim_cur);
-            }
+        if (old_limit != RLIM_INFINITY && new_limit > old_limit)
+        {
+            limit.rlim_cur = new_limit;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+            tr_logAddInfo("Changed open file limit from %d to %d", (int)old_limit, (int)limit.rlim_cur);
         }
 
+        i->fdLimit = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > INT_MAX ? INT_MAX : (int)limit.rlim_cur;
+    }
+
 #endif
+}
+
+static void ensureSessionFdInfoExists(tr_session* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_lockLock(getFileLock());
+
+    if (session->fdInfo == NULL)
+    {
+        struct tr_fdInfo* i;
+
+        /* Create the local file cache */
+        i = tr_new0(struct tr_fdInfo, 1);
+        fileset_construct(&i->readers);
+        fileset_construct(&i->writers);
+        i->fdLimit = 1024;
+        session->fdInfo = i;
+
+        raise_fd_limit(i, DEFAULT_FD_LIMIT);
     }
+
+    tr_lockUnlock(getFileLock());
 }
 
 void tr_fdClose(tr_session* session)
 {
+    tr_lockLock(getFileLock());
+
     if (session != NULL && session->fdInfo != NULL)
     {
         struct tr_fdInfo* i = session->fdInfo;
-        fileset_destruct(&i->fileset);
+        fileset_destruct(&i->readers);
+        fileset_destruct(&i->writers);
         tr_free(i);
         session->fdInfo = NULL;
     }
+
+    tr_lockUnlock(getFileLock());
 }
 
 /***
 ****
 ***/
 
-static struct tr_fileset* get_fileset(tr_session* session)
+static struct tr_fdInfo* get_fd_info(tr_session* session)
 {
-    if (session == NULL)
+    ensureSessionFdInfoExists(session);
+    return session->fdInfo;
+}
+
+/* how many files can be kept open for reading and for writing */
+static void get_open_file_limits(tr_session* session, int* setme_readers, int* setme_writers)
+{
+    struct tr_fdInfo* i = session->fdInfo;
+    int const other_fds = session->peerLimit + RESERVED_FDS;
+    int fd_limit = MIN(i->fdLimit, DEFAULT_FD_LIMIT);
+    int limit;
+
+    /* the setting can ask for more fds than we would on our own */
+    if (session->openFileLimit > 0)
     {
-        return NULL;
+        if (session->openFileLimit <= (INT_MAX - other_fds) / FDS_PER_OPEN_FILE)
+        {
+            int const wanted = session->openFileLimit * FDS_PER_OPEN_FILE + other_fds;
+
+            if (wanted > i->fdLimit && wanted > i->fdLimitWanted)
+            {
+                raise_fd_limit(i, wanted);
+            }
+        }
+
+        fd_limit = i->fdLimit;
     }
 
-    ensureSessionFdInfoExists(session);
-    return &session->fdInfo->fileset;
+    limit = (fd_limit - other_fds) / FDS_PER_OPEN_FILE;
+    limit = MAX(limit, MIN_OPEN_FILES);
+
+    if (session->openFileLimit > 0)
+    {
+        limit = MIN(limit, session->openFileLimit);
+    }
+
+    /* most of them go to seeding, where files are read at random */
+    *setme_writers = MAX(limit / 4, 1);
+    *setme_readers = MAX(limit - *setme_writers, 1);
+}
+
+/* finds an open file, and the set it's in */
+static struct tr_cached_file* lookup(struct tr_fdInfo* i, int torrent_id, tr_file_index_t file_index,
+    struct tr_fileset** setme_set)
+{
+    struct tr_fileset* set = &i->writers;
+    struct tr_cached_file* o = fileset_lookup(set, torrent_id, file_index);
+
+    if (o == NULL)
+    {
+        set = &i->readers;
+        o = fileset_lookup(set, torrent_id, file_index);
+    }
+
+    if (setme_set != NULL)
+    {
+        *setme_set = set;
+    }
+
+    return o;
+}
+
+/* finds the open file that a checked-out fd belongs to */
+static struct tr_cached_file* lookup_checked_out(struct tr_fdInfo* i, int torrent_id, tr_file_index_t file_index,
+    tr_sys_file_t fd)
+{
+    struct tr_cached_file* o;
+
+    /* if the file was reopened for writing while a reader had it,
+     * the reader's copy is still in the read set */
+    if ((o = fileset_lookup(&i->writers, torrent_id, file_index)) == NULL || o->fd != fd)
+    {
+        o = fileset_lookup(&i->readers, torrent_id, file_index);
+    }
+
+    TR_ASSERT(o != NULL);
+    TR_ASSERT(o->fd == fd);
+    TR_ASSERT(o->busy > 0);
+
+    return o != NULL && o->fd == fd ? o : NULL;
 }
 
 void tr_fdFileClose(tr_session* s, tr_torrent const* tor, tr_file_index_t i)
 {
+    struct tr_fileset* set;
     struct tr_cached_file* o;
 
-    if ((o = fileset_lookup(get_fileset(s), tr_torrentId(tor), i)) != NULL)
+    tr_lockLock(getFileLock());
+
+    while ((o = lookup(get_fd_info(s), tr_torrentId(tor), i, &set)) != NULL)
     {
         /* flush writable files so that their mtimes will be
          * up-to-date when this function returns to the caller... */
@@ -452,34 +707,151 @@ void tr_fdFileClose(tr_session* s, tr_torrent const* tor, tr_file_index_t i)
             tr_sys_file_flush(o->fd, NULL);
         }
 
-        cached_file_close(o);
+        fileset_remove(set, o);
     }
+
+    tr_lockUnlock(getFileLock());
 }
 
 tr_sys_file_t tr_fdFileGetCached(tr_session* s, int torrent_id, tr_file_index_t i, bool writable)
 {
-    struct tr_cached_file* o = fileset_lookup(get_fileset(s), torrent_id, i);
+    tr_sys_file_t fd = TR_BAD_SYS_FILE;
+    struct tr_fileset* set;
+    struct tr_cached_file* o;
+
+    tr_lockLock(getFileLock());
 
-    if (o == NULL || (writable && !o->is_writable))
+    o = lookup(get_fd_info(s), torrent_id, i, &set);
+
+    if (o != NULL && (!writable || o->is_writable))
     {
-        return TR_BAD_SYS_FILE;
+        fileset_touch(set, o);
+        ++o->busy;
+        fd = o->fd;
     }
 
-    o->used_at = tr_time();
-    return o->fd;
+    tr_lockUnlock(getFileLock());
+    return fd;
+}
+
+void tr_fdFileReturn(tr_session* s, int torrent_id, tr_file_index_t i, tr_sys_file_t fd)
+{
+    struct tr_cached_file* o;
+
+    tr_lockLock(getFileLock());
+
+    if ((o = lookup_checked_out(get_fd_info(s), torrent_id, i, fd)) != NULL)
+    {
+        --o->busy;
+    }
+
+    tr_lockUnlock(getFileLock());
+}
+
+#ifdef USE_FILE_SEGMENTS
+
+/* true if all of the bytes are in the page cache, so that sending
+ * them won't have to wait for the disk */
+static bool isResident(tr_sys_file_t fd, uint64_t offset, size_t len)
+{
+    bool ret = false;
+    long const pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t const begin = offset - offset % pageSize;
+    size_t const mapLen = offset + len - begin;
+    size_t const pageCount = (mapLen + pageSize - 1) / pageSize;
+    void* map;
+
+    /* mapping the file doesn't read it */
+    if ((map = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fd, begin)) != MAP_FAILED)
+    {
+        char* vec = tr_new(char, pageCount);
+
+        if (mincore(map, mapLen, (void*)vec) == 0)
+        {
+            ret = true;
+
+            for (size_t i = 0; ret && i < pageCount; ++i)
+            {
+                ret = (vec[i] & 1) != 0;
+            }
+        }
+
+        tr_free(vec);
+        munmap(map, mapLen);
+    }
+
+    return ret;
+}
+
+bool tr_fdFileAddSegment(tr_session* s, int torrent_id, tr_file_index_t i, tr_sys_file_t fd, uint64_t file_size,
+    uint64_t offset, size_t len, struct evbuffer* buf)
+{
+    bool ok = false;
+    struct tr_cached_file* o;
+
+    tr_lockLock(getFileLock());
+
+    o = lookup_checked_out(get_fd_info(s), torrent_id, i, fd);
+
+    /* cold pages would have sendfile() block the libtransmission thread */
+    if (o != NULL && !isResident(fd, offset, len))
+    {
+        o = NULL;
+    }
+
+    if (o != NULL && o->segment == NULL)
+    {
+        /* The segment gets its own fd, since peers' buffers can hold on to it
+         * after we've closed ours. One segment covers the whole file, so it
+         * costs one fd per cached file rather than one per block. */
+        int const segment_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+        if (segment_fd != -1)
+        {
+            o->segment = evbuffer_file_segment_new(segment_fd, 0, file_size, EVBUF_FS_CLOSE_ON_FREE);
+
+            if (o->segment == NULL)
+            {
+                close(segment_fd);
+            }
+        }
+    }
+
+    if (o != NULL && o->segment != NULL)
+    {
+        ok = evbuffer_add_file_segment(buf, o->segment, offset, len) == 0;
+    }
+
+    tr_lockUnlock(getFileLock());
+    return ok;
+}
+
+#else
+
+bool tr_fdFileAddSegment(tr_session* s UNUSED, int torrent_id UNUSED, tr_file_index_t i UNUSED, tr_sys_file_t fd UNUSED,
+    uint64_t file_size UNUSED, uint64_t offset UNUSED, size_t len UNUSED, struct evbuffer* buf UNUSED)
+{
+    return false;
 }
 
+#endif
+
 bool tr_fdFileGetCachedMTime(tr_session* s, int torrent_id, tr_file_index_t i, time_t* mtime)
 {
     bool success;
     tr_sys_path_info info;
-    struct tr_cached_file* o = fileset_lookup(get_fileset(s), torrent_id, i);
+    struct tr_cached_file* o;
+
+    tr_lockLock(getFileLock());
+
+    o = lookup(get_fd_info(s), torrent_id, i, NULL);
 
     if ((success = o != NULL && tr_sys_file_get_info(o->fd, &info, NULL)))
     {
         *mtime = info.last_modified_at;
     }
 
+    tr_lockUnlock(getFileLock());
     return success;
 }
 
@@ -487,43 +859,77 @@ void tr_fdTorrentClose(tr_session* session, int torrent_id)
 {
     TR_ASSERT(tr_sessionIsLocked(session));
 
-    fileset_close_torrent(get_fileset(session), torrent_id);
+    tr_lockLock(getFileLock());
+    fileset_close_torrent(&get_fd_info(session)->readers, torrent_id);
+    fileset_close_torrent(&get_fd_info(session)->writers, torrent_id);
+    tr_lockUnlock(getFileLock());
 }
 
 /* returns an fd on success, or a TR_BAD_SYS_FILE on failure and sets errno */
 tr_sys_file_t tr_fdFileCheckout(tr_session* session, int torrent_id, tr_file_index_t i, char const* filename, bool writable,
     tr_preallocation_mode allocation, uint64_t file_size)
 {
-    struct tr_fileset* set = get_fileset(session);
-    struct tr_cached_file* o = fileset_lookup(set, torrent_id, i);
+    int err;
+    int limits[2];
+    struct tr_fdInfo* info;
+    struct tr_fileset* set;
+    struct tr_cached_file* o;
+
+    tr_lockLock(getFileLock());
+
+    info = get_fd_info(session);
+    o = lookup(info, torrent_id, i, &set);
 
     if (o != NULL && writable && !o->is_writable)
     {
-        cached_file_close(o); /* close it so we can reopen in rw mode */
+        /* reopen it in rw mode. If another thread is still reading
+         * the old one, it gets closed when it's recycled instead. */
+        if (o->busy == 0)
+        {
+            fileset_remove(set, o);
+        }
+
+        o = NULL;
     }
-    else if (o == NULL)
+
+    if (o != NULL)
     {
-        o = fileset_get_empty_slot(set);
+        fileset_touch(set, o);
+        ++o->busy;
+        tr_lockUnlock(getFileLock());
+        return o->fd;
     }
 
-    if (!cached_file_is_open(o))
+    get_open_file_limits(session, &limits[0], &limits[1]);
+    set = writable ? &info->writers : &info->readers;
+
+    if (!fileset_make_room(set, limits[writable ? 1 : 0]))
     {
-        int const err = cached_file_open(o, filename, writable, allocation, file_size);
+        /* every file in the set is in use by another thread */
+        tr_lockUnlock(getFileLock());
+        errno = EMFILE;
+        return TR_BAD_SYS_FILE;
+    }
 
-        if (err != 0)
-        {
-            errno = err;
-            return TR_BAD_SYS_FILE;
-        }
+    o = tr_new0(struct tr_cached_file, 1);
+    o->fd = TR_BAD_SYS_FILE;
 
-        dbgmsg("opened '%s' writable %c", filename, writable ? 'y' : 'n');
-        o->is_writable = writable;
+    if ((err = cached_file_open(o, filename, writable, allocation, file_size)) != 0)
+    {
+        tr_free(o);
+        tr_lockUnlock(getFileLock());
+        errno = err;
+        return TR_BAD_SYS_FILE;
     }
 
-    dbgmsg("checking out '%s'", filename);
+    dbgmsg("opened '%s' writable %c", filename, writable ? 'y' : 'n');
+    o->is_writable = writable;
     o->torrent_id = torrent_id;
     o->file_index = i;
-    o->used_at = tr_time();
+    o->busy = 1;
+    fileset_insert(set, o);
+
+    tr_lockUnlock(getFileLock());
     return o->fd;
 }
 
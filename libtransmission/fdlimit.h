@@ -16,6 +16,8 @@
 #include "file.h"
 #include "net.h"
 
+struct evbuffer;
+
 /**
  * @addtogroup file_io File IO
  * @{
@@ -38,13 +40,34 @@
  * on success, a file descriptor >= 0 is returned.
  * on failure, a TR_BAD_SYS_FILE is returned and errno is set.
  *
+ * The file stays open until it's given back with tr_fdFileReturn().
+ *
  * @see tr_fdFileClose
  */
 tr_sys_file_t tr_fdFileCheckout(tr_session* session, int torrent_id, tr_file_index_t file_num, char const* filename,
     bool do_write, tr_preallocation_mode preallocation_mode, uint64_t preallocation_file_size);
 
+/**
+ * Like tr_fdFileCheckout(), but only if the file's already open.
+ * On success, the file must be given back with tr_fdFileReturn().
+ */
 tr_sys_file_t tr_fdFileGetCached(tr_session* session, int torrent_id, tr_file_index_t file_num, bool doWrite);
 
+/** @brief gives back a file from tr_fdFileCheckout() or tr_fdFileGetCached() */
+void tr_fdFileReturn(tr_session* session, int torrent_id, tr_file_index_t file_num, tr_sys_file_t fd);
+
+/**
+ * Adds `len' bytes at `offset' in a checked-out file to `buf' by reference,
+ * so that they can be sent to a socket with sendfile() instead of being
+ * copied through memory. The file doesn't need to stay checked out after
+ * this returns. This is only done if the bytes are in the page cache.
+ *
+ * @return true on success, or false if the bytes aren't in memory or
+ *         this isn't supported here
+ */
+bool tr_fdFileAddSegment(tr_session* session, int torrent_id, tr_file_index_t file_num, tr_sys_file_t fd, uint64_t file_size,
+    uint64_t offset, size_t len, struct evbuffer* buf);
+
 bool tr_fdFileGetCachedMTime(tr_session* session, int torrent_id, tr_file_index_t file_num, time_t* mtime);
 
 /**
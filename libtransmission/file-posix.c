@@ -21,6 +21,9 @@
 #include <sys/file.h> /* flock() */
 #include <sys/mman.h> /* mmap(), munmap() */
 #include <sys/stat.h>
+#ifdef HAVE_PWRITEV
+#include <sys/uio.h> /* pwritev() */
+#endif
 #include <unistd.h> /* lseek(), write(), ftruncate(), pread(), pwrite(), pathconf(), etc */
 
 #ifdef HAVE_XFS_XFS_H
@@ -106,6 +109,8 @@ static void stat_to_sys_path_info(struct stat const* sb, tr_sys_path_info* info)
 
     info->size = (uint64_t)sb->st_size;
     info->last_modified_at = sb->st_mtime;
+    info->device = (uint64_t)sb->st_dev;
+    info->inode = (uint64_t)sb->st_ino;
 }
 
 static void set_file_for_single_pass(tr_sys_file_t handle)
@@ -756,6 +761,78 @@ bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t siz
     return ret;
 }
 
+bool tr_sys_file_write_at_v(tr_sys_file_t handle, tr_sys_iovec const* buffers, size_t count, uint64_t offset,
+    uint64_t* bytes_written, tr_error** error)
+{
+    TR_ASSERT(handle != TR_BAD_SYS_FILE);
+    TR_ASSERT(buffers != NULL || count == 0);
+    /* seek requires signed offset, so it should be in mod range */
+    TR_ASSERT(offset < UINT64_MAX / 2);
+
+    bool ret = true;
+    uint64_t total = 0;
+
+#ifdef HAVE_PWRITEV
+
+    struct iovec iov[64];
+    size_t i = 0;
+    size_t skip = 0; /* how much of buffers[i] has been written */
+
+    while (ret && i < count)
+    {
+        int n = 0;
+        ssize_t my_bytes_written;
+
+        for (size_t j = i; j < count && n < (int)TR_N_ELEMENTS(iov); ++j, ++n)
+        {
+            size_t const done = j == i ? skip : 0;
+            iov[n].iov_base = (char*)buffers[j].base + done;
+            iov[n].iov_len = buffers[j].len - done;
+        }
+
+        if ((my_bytes_written = pwritev(handle, iov, n, offset + total)) == -1)
+        {
+            set_system_error(error, errno);
+            ret = false;
+            break;
+        }
+
+        total += my_bytes_written;
+        skip += my_bytes_written;
+
+        while (i < count && skip >= buffers[i].len)
+        {
+            skip -= buffers[i].len;
+            ++i;
+        }
+
+        if (my_bytes_written == 0 && i < count)
+        {
+            set_system_error(error, EIO);
+            ret = false;
+        }
+    }
+
+#else
+
+    for (size_t i = 0; ret && i < count; ++i)
+    {
+        uint64_t my_bytes_written = 0;
+
+        ret = tr_sys_file_write_at(handle, buffers[i].base, buffers[i].len, offset + total, &my_bytes_written, error);
+        total += my_bytes_written;
+    }
+
+#endif
+
+    if (bytes_written != NULL)
+    {
+        *bytes_written = total;
+    }
+
+    return ret;
+}
+
 bool tr_sys_file_flush(tr_sys_file_t handle, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
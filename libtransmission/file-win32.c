@@ -105,6 +105,8 @@ static void stat_to_sys_path_info(DWORD attributes, DWORD size_low, DWORD size_h
     info->size |= size_low;
 
     info->last_modified_at = filetime_to_unix_time(mtime);
+    info->device = 0;
+    info->inode = 0;
 }
 
 static inline bool is_slash(char c)
@@ -928,6 +930,11 @@ bool tr_sys_file_get_info(tr_sys_file_t handle, tr_sys_path_info* info, tr_error
     {
         stat_to_sys_path_info(attributes.dwFileAttributes, attributes.nFileSizeLow, attributes.nFileSizeHigh,
             &attributes.ftLastWriteTime, info);
+
+        info->device = attributes.dwVolumeSerialNumber;
+        info->inode = attributes.nFileIndexHigh;
+        info->inode <<= 32;
+        info->inode |= attributes.nFileIndexLow;
     }
     else
     {
@@ -1107,6 +1114,31 @@ bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t siz
     return ret;
 }
 
+bool tr_sys_file_write_at_v(tr_sys_file_t handle, tr_sys_iovec const* buffers, size_t count, uint64_t offset,
+    uint64_t* bytes_written, tr_error** error)
+{
+    TR_ASSERT(handle != TR_BAD_SYS_FILE);
+    TR_ASSERT(buffers != NULL || count == 0);
+
+    bool ret = true;
+    uint64_t total = 0;
+
+    for (size_t i = 0; ret && i < count; ++i)
+    {
+        uint64_t my_bytes_written = 0;
+
+        ret = tr_sys_file_write_at(handle, buffers[i].base, buffers[i].len, offset + total, &my_bytes_written, error);
+        total += my_bytes_written;
+    }
+
+    if (bytes_written != NULL)
+    {
+        *bytes_written = total;
+    }
+
+    return ret;
+}
+
 bool tr_sys_file_flush(tr_sys_file_t handle, tr_error** error)
 {
     TR_ASSERT(handle != TR_BAD_SYS_FILE);
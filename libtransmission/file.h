@@ -128,9 +128,19 @@ typedef struct tr_sys_path_info
     tr_sys_path_type_t type;
     uint64_t size;
     time_t last_modified_at;
+    /* together these identify the file on its system, or are 0 if that's unknown */
+    uint64_t device;
+    uint64_t inode;
 }
 tr_sys_path_info;
 
+typedef struct tr_sys_iovec
+{
+    void const* base;
+    size_t len;
+}
+tr_sys_iovec;
+
 /**
  * @name Platform-specific wrapper functions
  *
@@ -427,6 +437,25 @@ bool tr_sys_file_write(tr_sys_file_t handle, void const* buffer, uint64_t size,
 bool tr_sys_file_write_at(tr_sys_file_t handle, void const* buffer, uint64_t size, uint64_t offset, uint64_t* bytes_written,
     struct tr_error** error);
 
+/**
+ * @brief Like `pwritev()`, except that it keeps writing until all of the
+ *        buffers have been written, and the position is undefined afterwards.
+ *        Not thread-safe.
+ *
+ * @param[in]  handle        Valid file descriptor.
+ * @param[in]  buffers       Buffers to get data being written from, in order.
+ * @param[in]  count         Number of buffers.
+ * @param[in]  offset        File offset in bytes to start writing from.
+ * @param[out] bytes_written Number of bytes actually written. Optional, pass
+ *                           `NULL` if you are not interested.
+ * @param[out] error         Pointer to error object. Optional, pass `NULL` if you
+ *                           are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool tr_sys_file_write_at_v(tr_sys_file_t handle, tr_sys_iovec const* buffers, size_t count, uint64_t offset,
+    uint64_t* bytes_written, struct tr_error** error);
+
 /**
  * @brief Portability wrapper for `fsync()`.
  *
@@ -0,0 +1,987 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memset() */
+
+#ifndef _WIN32
+#include <sys/socket.h> /* socketpair() */
+#include <unistd.h> /* read() */
+#endif
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "cache.h"
+#include "crypto-utils.h" /* tr_rand_int_weak() */
+#include "fdlimit.h" /* tr_fdTorrentClose() */
+#include "file.h" /* tr_sys_path_rename() */
+#include "inout.h"
+#include "platform.h" /* tr_wait_msec() */
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+static void onBatchDone(void* user_data, int err)
+{
+    *(int*)user_data = err;
+}
+
+static void fill_block(uint8_t* buf, size_t len, int seed)
+{
+    for (size_t i = 0; i < len; ++i)
+    {
+        buf[i] = (uint8_t)(seed + i * 7);
+    }
+}
+
+static int test_batch(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_io_batch* batch;
+    uint32_t const len = 16384;
+    uint32_t const tailLen = 4096 + 512;
+    tr_piece_index_t tailPiece;
+    uint8_t* first;
+    uint8_t* tail;
+    uint8_t* readback;
+    int errs[2];
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+
+    /* the last piece holds the last two files */
+    tailPiece = tor->info.pieceCount - 1;
+    check_uint(tr_torPieceCountBytes(tor, tailPiece), ==, tailLen);
+
+    if ((batch = tr_ioBatchNew()) == NULL)
+    {
+        /* batched IO isn't supported on this system */
+        tr_torrentRemove(tor, false, NULL);
+        libttest_session_close(session);
+        return 0;
+    }
+
+    first = tr_new(uint8_t, len);
+    tail = tr_new(uint8_t, tailLen);
+    readback = tr_new(uint8_t, len);
+    fill_block(first, len, 1);
+    fill_block(tail, tailLen, 2);
+
+    /* write a block, and one that spans two files */
+    errs[0] = errs[1] = -1;
+    check(tr_ioBatchAdd(batch, tor, NULL, true, 0, 0, len, first, &errs[0]));
+    check(tr_ioBatchAdd(batch, tor, NULL, true, tailPiece, 0, tailLen, tail, &errs[1]));
+
+    /* reads and overlapping writes have to wait for the next batch */
+    check(!tr_ioBatchAdd(batch, tor, NULL, false, 1, 0, len, readback, NULL));
+    check(!tr_ioBatchAdd(batch, tor, NULL, true, 0, len / 2, len, readback, NULL));
+
+    tr_ioBatchRun(batch, onBatchDone);
+    check_int(errs[0], ==, 0);
+    check_int(errs[1], ==, 0);
+
+    check_int(tr_ioRead(tor, NULL, 0, 0, len, readback), ==, 0);
+    check_mem(readback, ==, first, len);
+    check_int(tr_ioRead(tor, NULL, tailPiece, 0, tailLen, readback), ==, 0);
+    check_mem(readback, ==, tail, tailLen);
+
+    /* read them back in a batch */
+    memset(first, 0, len);
+    memset(readback, 0, len);
+    errs[0] = errs[1] = -1;
+    check(tr_ioBatchAdd(batch, tor, NULL, false, 0, 0, len, first, &errs[0]));
+    check(tr_ioBatchAdd(batch, tor, NULL, false, tailPiece, 0, tailLen, readback, &errs[1]));
+    tr_ioBatchRun(batch, onBatchDone);
+    check_int(errs[0], ==, 0);
+    check_int(errs[1], ==, 0);
+    check_mem(readback, ==, tail, tailLen);
+    fill_block(readback, len, 1);
+    check_mem(first, ==, readback, len);
+
+    tr_ioBatchFree(batch);
+    tr_free(readback);
+    tr_free(tail);
+    tr_free(first);
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static void set_flag(void* vflag)
+{
+    *(bool*)vflag = true;
+}
+
+/* the file paths that were found are passed back to the libtransmission
+ * thread, so let it catch up before looking at them */
+static void sync_event_thread(tr_session* session)
+{
+    bool done = false;
+
+    tr_runInEventThread(session, set_flag, &done);
+
+    while (!done)
+    {
+        tr_wait_msec(10);
+    }
+}
+
+static int test_known_file_path(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    uint32_t const len = 16384;
+    uint8_t* block;
+    uint8_t* readback;
+    char* path;
+    char* partial;
+    char* known;
+    unsigned int generation;
+    unsigned int oldGeneration;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+
+    block = tr_new(uint8_t, len);
+    readback = tr_new(uint8_t, len);
+    fill_block(block, len, 4);
+    check_int(tr_ioWrite(tor, NULL, 0, 0, len, block), ==, 0);
+    sync_event_thread(session);
+
+    /* opening the file remembers where it is */
+    path = tr_torrentFindFile(tor, 0);
+    known = tr_torrentGetKnownFilePath(tor, 0, &oldGeneration);
+    check_str(known, ==, path);
+    tr_free(known);
+
+    /* move it behind the torrent's back, and it gets found again */
+    tr_sessionLock(session);
+    tr_fdTorrentClose(session, tr_torrentId(tor));
+    tr_sessionUnlock(session);
+    partial = tr_strdup_printf("%s.part", path);
+    check(tr_sys_path_rename(path, partial, NULL));
+
+    check_int(tr_ioRead(tor, NULL, 0, 0, len, readback), ==, 0);
+    check_mem(readback, ==, block, len);
+    sync_event_thread(session);
+    known = tr_torrentGetKnownFilePath(tor, 0, &generation);
+    check_str(known, ==, partial);
+    tr_free(known);
+
+    /* paths that were looked up before the files moved aren't kept */
+    check_uint(generation, ==, oldGeneration);
+    tr_torrentForgetFilePaths(tor);
+    tr_torrentSetKnownFilePath(tor, 0, path, oldGeneration);
+    known = tr_torrentGetKnownFilePath(tor, 0, &generation);
+    check_str(known, ==, NULL);
+    check_uint(generation, !=, oldGeneration);
+
+    tr_free(partial);
+    tr_free(path);
+    tr_free(readback);
+    tr_free(block);
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+/* a job's copy of the torrent's directories is used even if the torrent moves */
+static int test_io_dirs(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    uint32_t const len = 16384;
+    uint8_t* block;
+    uint8_t* readback;
+    tr_io_dirs* dirs;
+    char* oldDir;
+    char* newDir;
+    char const* base;
+    char* subpath;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    block = tr_new(uint8_t, len);
+    readback = tr_new(uint8_t, len);
+    fill_block(block, len, 5);
+
+    tr_sessionLock(session);
+    dirs = tr_ioDirsNew(tor);
+    oldDir = tr_strdup(tr_torrentGetCurrentDir(tor));
+    newDir = tr_buildPath(oldDir, "moved", NULL);
+    check(tr_sys_dir_create(newDir, 0, 0700, NULL));
+    tr_torrentSetDownloadDir(tor, newDir);
+    tr_sessionUnlock(session);
+
+    /* the file is created where the torrent was */
+    check_int(tr_ioWrite(tor, dirs, 0, 0, len, block), ==, 0);
+    check(tr_torrentFindFileIn(tor, oldDir, NULL, 0, &base, &subpath, NULL));
+    check_str(base, ==, oldDir);
+    tr_free(subpath);
+    check(!tr_torrentFindFileIn(tor, newDir, NULL, 0, NULL, NULL, NULL));
+
+    check_int(tr_ioRead(tor, dirs, 0, 0, len, readback), ==, 0);
+    check_mem(readback, ==, block, len);
+    sync_event_thread(session);
+
+    tr_free(dirs);
+    tr_free(newDir);
+    tr_free(oldDir);
+    tr_free(readback);
+    tr_free(block);
+    tr_torrentRemove(tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+struct read_cache_data
+{
+    tr_torrent* tor;
+    uint8_t* blocks[10];
+    int pending;
+    int err;
+};
+
+static void onCacheReadDone(tr_session* session UNUSED, int torrent_id UNUSED, int err, void* vdata)
+{
+    struct read_cache_data* data = vdata;
+
+    data->err |= err;
+    --data->pending;
+}
+
+static void read_blocks_async(void* vdata)
+{
+    struct read_cache_data* data = vdata;
+    tr_torrent* tor = data->tor;
+
+    /* the first read loads the piece, and the second waits for it */
+    data->pending = 3;
+    tr_cacheReadBlockAsync(tor->session->cache, tor, 0, 0, tor->blockSize, data->blocks[0], onCacheReadDone, data);
+    tr_cacheReadBlockAsync(tor->session->cache, tor, 0, tor->blockSize, tor->blockSize, data->blocks[1], onCacheReadDone,
+        data);
+
+    /* the third one is on another piece */
+    tr_cacheReadBlockAsync(tor->session->cache, tor, 1, 0, tor->blockSize, data->blocks[2], onCacheReadDone, data);
+}
+
+static void read_block_again(void* vdata)
+{
+    struct read_cache_data* data = vdata;
+    tr_torrent* tor = data->tor;
+
+    data->pending = 1;
+    memset(data->blocks[0], 0, tor->blockSize);
+    tr_cacheReadBlockAsync(tor->session->cache, tor, 0, 0, tor->blockSize, data->blocks[0], onCacheReadDone, data);
+}
+
+static void read_many_pieces(void* vdata)
+{
+    struct read_cache_data* data = vdata;
+    tr_torrent* tor = data->tor;
+
+    /* these all start loading before any of them is done */
+    data->pending = TR_N_ELEMENTS(data->blocks);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data->blocks); ++i)
+    {
+        tr_cacheReadBlockAsync(tor->session->cache, tor, 2 + i, 0, tor->blockSize, data->blocks[i], onCacheReadDone, data);
+    }
+}
+
+static void wait_for_reads(tr_session* session, void (* func)(void*), struct read_cache_data* data)
+{
+    data->pending = -1;
+    tr_runInEventThread(session, func, data);
+
+    while (data->pending != 0)
+    {
+        tr_wait_msec(10);
+    }
+}
+
+static int test_read_cache(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    uint8_t* expected;
+    uint64_t hits;
+    uint64_t misses;
+    struct read_cache_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+    tr_sessionSetReadCacheLimit_MB(session, 1);
+    check_uint(tor->info.pieceSize, >=, tor->blockSize * 2);
+
+    expected = tr_new(uint8_t, tor->blockSize * 2);
+    fill_block(expected, tor->blockSize * 2, 5);
+    check_int(tr_ioWrite(tor, NULL, 0, 0, tor->blockSize * 2, expected), ==, 0);
+
+    data.tor = tor;
+    data.err = 0;
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data.blocks); ++i)
+    {
+        data.blocks[i] = tr_new0(uint8_t, tor->blockSize);
+    }
+
+    wait_for_reads(session, read_blocks_async, &data);
+    check_int(data.err, ==, 0);
+    check_mem(data.blocks[0], ==, expected, tor->blockSize);
+    check_mem(data.blocks[1], ==, expected + tor->blockSize, tor->blockSize);
+    tr_cacheGetReadStats(session->cache, &hits, &misses);
+    check_uint(hits, ==, 1);
+    check_uint(misses, ==, 2);
+
+    /* the piece is in memory now */
+    check(tr_cacheHasBlock(session->cache, tor, 0, 0));
+    wait_for_reads(session, read_block_again, &data);
+    check_mem(data.blocks[0], ==, expected, tor->blockSize);
+    tr_cacheGetReadStats(session->cache, &hits, &misses);
+    check_uint(hits, ==, 2);
+    check_uint(misses, ==, 2);
+
+    /* rechecking the piece drops it */
+    tr_sessionLock(session);
+    tr_cacheDropReadPiece(session->cache, tor, 0);
+    tr_sessionUnlock(session);
+    check(!tr_cacheHasBlock(session->cache, tor, 0, 0));
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data.blocks); ++i)
+    {
+        tr_free(data.blocks[i]);
+    }
+
+    tr_free(expected);
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_read_cache_spans(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    uint8_t* expected;
+    uint64_t hits;
+    uint64_t misses;
+    struct read_cache_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+    check_uint(tor->info.pieceSize, ==, tor->blockSize * 2);
+    check_uint(tor->info.pieceCount, >=, 2 + TR_N_ELEMENTS(data.blocks));
+
+    /* a piece is a quarter of the cache, too big to cache whole, so it's cached a block at a time */
+    tr_sessionLock(session);
+    tr_cacheSetReadLimit(session->cache, tor->info.pieceSize * 4);
+    tr_sessionUnlock(session);
+
+    expected = tr_new(uint8_t, tor->blockSize * 2);
+    fill_block(expected, tor->blockSize * 2, 6);
+    check_int(tr_ioWrite(tor, NULL, 0, 0, tor->blockSize * 2, expected), ==, 0);
+
+    data.tor = tor;
+    data.err = 0;
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data.blocks); ++i)
+    {
+        data.blocks[i] = tr_new0(uint8_t, tor->blockSize);
+    }
+
+    /* so the two blocks of the first piece are loaded separately */
+    wait_for_reads(session, read_blocks_async, &data);
+    check_int(data.err, ==, 0);
+    check_mem(data.blocks[0], ==, expected, tor->blockSize);
+    check_mem(data.blocks[1], ==, expected + tor->blockSize, tor->blockSize);
+    tr_cacheGetReadStats(session->cache, &hits, &misses);
+    check_uint(hits, ==, 0);
+    check_uint(misses, ==, 3);
+    check(tr_cacheHasBlock(session->cache, tor, 0, 0));
+    check(tr_cacheHasBlock(session->cache, tor, 0, tor->blockSize));
+
+    wait_for_reads(session, read_block_again, &data);
+    check_mem(data.blocks[0], ==, expected, tor->blockSize);
+    tr_cacheGetReadStats(session->cache, &hits, &misses);
+    check_uint(hits, ==, 1);
+
+    /* rechecking the piece drops all of it */
+    tr_sessionLock(session);
+    tr_cacheDropReadPiece(session->cache, tor, 0);
+    tr_sessionUnlock(session);
+    check(!tr_cacheHasBlock(session->cache, tor, 0, 0));
+    check(!tr_cacheHasBlock(session->cache, tor, 0, tor->blockSize));
+
+    /* the spans that are still loading count toward the limit, which is eight of them,
+     * so the last read goes straight to disk instead of pushing out the first one */
+    wait_for_reads(session, read_many_pieces, &data);
+    check_int(data.err, ==, 0);
+    check(tr_cacheHasBlock(session->cache, tor, 2, 0));
+    check(tr_cacheHasBlock(session->cache, tor, 9, 0));
+    check(!tr_cacheHasBlock(session->cache, tor, 2 + TR_N_ELEMENTS(data.blocks) - 1, 0));
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(data.blocks); ++i)
+    {
+        tr_free(data.blocks[i]);
+    }
+
+    tr_free(expected);
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+struct download_piece_data
+{
+    tr_torrent* tor;
+    uint8_t fill;
+    bool inOrder;
+    bool seedWhileChecking;
+    bool advertisedWhileChecking;
+    bool done;
+};
+
+static void gotBlock(tr_torrent* tor, tr_block_index_t block, uint8_t fill)
+{
+    struct evbuffer* buf = evbuffer_new();
+    uint32_t const len = tr_torBlockCountBytes(tor, block);
+    uint8_t* data = tr_new(uint8_t, len);
+
+    memset(data, fill, len);
+    evbuffer_add(buf, data, len);
+    tr_cacheWriteBlock(tor->session->cache, tor, tr_torBlockPiece(tor, block),
+        (uint32_t)(block * tor->blockSize - tr_torBlockPiece(tor, block) * tor->info.pieceSize), len, buf);
+    tr_torrentGotBlock(tor, block);
+
+    evbuffer_free(buf);
+    tr_free(data);
+}
+
+static void download_piece(void* vdata)
+{
+    struct download_piece_data* data = vdata;
+    tr_torrent* tor = data->tor;
+    tr_block_index_t first;
+    tr_block_index_t last;
+
+    tr_torGetPieceBlockRange(tor, 0, &first, &last);
+
+    if (data->inOrder)
+    {
+        /* the piece gets hashed as it arrives, so it can be checked right away */
+        for (tr_block_index_t b = first; b <= last; ++b)
+        {
+            gotBlock(tor, b, data->fill);
+        }
+    }
+    else
+    {
+        /* the rest of the piece isn't in memory when its first block arrives,
+         * so it has to be read back and checked in the background */
+        for (tr_block_index_t b = first + 1; b <= last; ++b)
+        {
+            gotBlock(tor, b, data->fill);
+        }
+
+        tr_cacheFlushTorrent(tor->session->cache, tor);
+        gotBlock(tor, first, data->fill);
+
+        /* the check can't finish until this returns, so the piece is still unproven here */
+        if (tr_torrentPieceIsChecking(tor, 0))
+        {
+            size_t byte_count;
+            uint8_t* bits;
+
+            tr_torrentRecheckCompleteness(tor);
+            data->seedWhileChecking = tr_torrentIsSeed(tor);
+
+            bits = tr_torrentCreatePieceBitfield(tor, &byte_count);
+            data->advertisedWhileChecking = (bits[0] & 0x80) != 0;
+            tr_free(bits);
+        }
+    }
+
+    data->done = true;
+}
+
+static bool isCheckingPiece(tr_torrent* tor, tr_piece_index_t piece)
+{
+    bool checking;
+
+    tr_sessionLock(tor->session);
+    checking = tr_bitfieldHas(&tor->checkingPieces, piece);
+    tr_sessionUnlock(tor->session);
+
+    return checking;
+}
+
+static int test_check_downloaded_piece(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    struct download_piece_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, false);
+    check(!tr_torrentPieceIsComplete(tor, 0));
+    check_uint(tor->info.pieceSize, >=, tor->blockSize * 2);
+
+    /* a bad piece is thrown out */
+    data.tor = tor;
+    data.fill = 1;
+    data.inOrder = true;
+    data.done = false;
+    tr_runInEventThread(session, download_piece, &data);
+
+    while (!data.done || isCheckingPiece(tor, 0))
+    {
+        tr_wait_msec(10);
+    }
+
+    check(!tr_torrentPieceIsComplete(tor, 0));
+    check_uint(tr_torrentStat(tor)->corruptEver, ==, tor->info.pieceSize);
+
+    /* and a good one is kept, but the torrent isn't done until it's been checked */
+    data.fill = 0;
+    data.inOrder = false;
+    data.seedWhileChecking = true;
+    data.advertisedWhileChecking = true;
+    data.done = false;
+    tr_runInEventThread(session, download_piece, &data);
+
+    while (!data.done || isCheckingPiece(tor, 0))
+    {
+        tr_wait_msec(10);
+    }
+
+    check(!data.seedWhileChecking);
+    check(!data.advertisedWhileChecking);
+    check(tr_torrentPieceIsComplete(tor, 0));
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+    tr_torrentRecheckCompleteness(tor);
+    check(tr_torrentIsSeed(tor));
+    check_uint(tr_torrentStat(tor)->corruptEver, ==, tor->info.pieceSize);
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+/* makes a torrent with lots of small files, and with
+ * empty ones at its start, its end, and on piece boundaries */
+static tr_torrent* small_files_torrent_init(tr_session* session, uint32_t pieceSize)
+{
+    uint64_t const lengths[] = { 0, 100, 0, 16284, 0, 16384, 1, 0, 0, 40000, 3000 };
+    size_t const smallCount = 64;
+    uint64_t totalSize = 0;
+    tr_variant top;
+    tr_variant* info;
+    tr_variant* files;
+    size_t pieceCount;
+    uint8_t* pieces;
+    char* metainfo;
+    size_t metainfo_len;
+    tr_ctor* ctor;
+    tr_torrent* tor;
+    int err = 0;
+
+    tr_variantInitDict(&top, 1);
+    info = tr_variantDictAddDict(&top, TR_KEY_info, 4);
+    tr_variantDictAddStr(info, TR_KEY_name, "small-files");
+    tr_variantDictAddInt(info, TR_KEY_piece_length, pieceSize);
+    files = tr_variantDictAddList(info, TR_KEY_files, TR_N_ELEMENTS(lengths) + smallCount + 1);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(lengths) + smallCount + 1; ++i)
+    {
+        tr_variant* file = tr_variantListAddDict(files, 2);
+        uint64_t length = 0;
+        char name[32];
+
+        if (i < TR_N_ELEMENTS(lengths))
+        {
+            length = lengths[i];
+        }
+        else if (i < TR_N_ELEMENTS(lengths) + smallCount)
+        {
+            length = 300;
+        }
+
+        tr_snprintf(name, sizeof(name), "%zu", i);
+        tr_variantDictAddInt(file, TR_KEY_length, length);
+        tr_variantListAddStr(tr_variantDictAddList(file, TR_KEY_path, 1), name);
+        totalSize += length;
+    }
+
+    pieceCount = (totalSize + pieceSize - 1) / pieceSize;
+    pieces = tr_new0(uint8_t, pieceCount * SHA_DIGEST_LENGTH);
+    tr_variantDictAddRaw(info, TR_KEY_pieces, pieces, pieceCount * SHA_DIGEST_LENGTH);
+    metainfo = tr_variantToStr(&top, TR_VARIANT_FMT_BENC, &metainfo_len);
+
+    ctor = tr_ctorNew(session);
+    tr_ctorSetMetainfo(ctor, (uint8_t*)metainfo, metainfo_len);
+    tr_ctorSetPaused(ctor, TR_FORCE, true);
+    tor = tr_torrentNew(ctor, &err, NULL);
+    TR_ASSERT(err == 0);
+
+    /* wait out the verify that new torrents get */
+    libttest_blockingTorrentVerify(tor);
+
+    tr_ctorFree(ctor);
+    tr_free(metainfo);
+    tr_free(pieces);
+    tr_variantFree(&top);
+    return tor;
+}
+
+static int test_find_file_location(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_info const* inf;
+
+    session = libttest_session_init(NULL);
+    tor = small_files_torrent_init(session, 16384);
+    inf = tr_torrentInfo(tor);
+    check_uint(inf->fileCount, ==, 76);
+    check_uint(inf->pieceCount, ==, 6);
+
+    /* each piece's span should hold exactly the files that touch that piece */
+    for (tr_piece_index_t p = 0; p < inf->pieceCount; ++p)
+    {
+        tr_piece_span const* span = &tor->pieceSpans[p];
+
+        check_uint(span->fileCount, >, 0);
+
+        for (tr_file_index_t f = 0; f < inf->fileCount; ++f)
+        {
+            bool const inSpan = span->firstFile <= f && f < span->firstFile + span->fileCount;
+            bool const hasFile = inf->files[f].firstPiece <= p && p <= inf->files[f].lastPiece;
+            check_bool(inSpan, ==, hasFile);
+        }
+    }
+
+    /* every byte should map to the one nonempty file that holds it */
+    for (tr_piece_index_t p = 0; p < inf->pieceCount; ++p)
+    {
+        for (uint32_t offset = 0; offset < tr_torPieceCountBytes(tor, p); ++offset)
+        {
+            uint64_t const byte = (uint64_t)p * inf->pieceSize + offset;
+            tr_file_index_t expected = 0;
+            tr_file_index_t fileIndex;
+            uint64_t fileOffset;
+
+            while (byte >= inf->files[expected].offset + inf->files[expected].length)
+            {
+                ++expected;
+            }
+
+            tr_ioFindFileLocation(tor, p, offset, &fileIndex, &fileOffset);
+            check_uint(fileIndex, ==, expected);
+            check_uint(fileOffset, ==, byte - inf->files[expected].offset);
+        }
+    }
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static uint64_t count_file_bytes(tr_torrent const* tor, tr_file_index_t i)
+{
+    uint64_t total = 0;
+    tr_file const* file = &tor->info.files[i];
+
+    for (tr_block_index_t b = 0; b < tor->blockCount; ++b)
+    {
+        uint64_t const begin = MAX((uint64_t)b * tor->blockSize, file->offset);
+        uint64_t const end = MIN((uint64_t)b * tor->blockSize + tr_torBlockCountBytes(tor, b), file->offset + file->length);
+
+        if (begin < end && tr_torrentBlockIsComplete(tor, b))
+        {
+            total += end - begin;
+        }
+    }
+
+    return total;
+}
+
+static int check_file_bytes(tr_torrent const* tor)
+{
+    tr_file_index_t n;
+    tr_file_stat* files = tr_torrentFiles(tor, &n);
+
+    for (tr_file_index_t i = 0; i < n; ++i)
+    {
+        uint64_t const expected = count_file_bytes(tor, i);
+
+        check_uint(files[i].bytesCompleted, ==, expected);
+        check_bool(tr_cpFileIsComplete(&tor->completion, i), ==, expected == tor->info.files[i].length);
+    }
+
+    tr_torrentFilesFree(files, n);
+    return 0;
+}
+
+static int test_file_bytes_completed(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_bitfield blocks;
+
+    session = libttest_session_init(NULL);
+    tor = small_files_torrent_init(session, 32768);
+    check_uint(tor->blockCount, ==, 6);
+
+    /* add blocks and remove pieces at random */
+    for (int i = 0; i < 200; ++i)
+    {
+        if (tr_rand_int_weak(4) != 0)
+        {
+            tr_cpBlockAdd(&tor->completion, tr_rand_int_weak(tor->blockCount));
+        }
+        else
+        {
+            tr_cpPieceRem(&tor->completion, tr_rand_int_weak(tor->info.pieceCount));
+        }
+
+        if (check_file_bytes(tor) != 0)
+        {
+            return 1;
+        }
+    }
+
+    /* the counts should also be right after loading the blocks at once */
+    for (tr_piece_index_t p = 0; p < tor->info.pieceCount; ++p)
+    {
+        tr_cpPieceAdd(&tor->completion, p);
+    }
+
+    tr_cpPieceRem(&tor->completion, 1);
+    tr_bitfieldConstruct(&blocks, tor->blockCount);
+    tr_bitfieldSetFromBitfield(&blocks, &tor->completion.blockBitfield);
+    tr_cpBlockInit(&tor->completion, &blocks);
+    tr_bitfieldDestruct(&blocks);
+
+    if (check_file_bytes(tor) != 0)
+    {
+        return 1;
+    }
+
+    check(!tr_cpFileIsComplete(&tor->completion, 9));
+    check(tr_cpFileIsComplete(&tor->completion, tor->info.fileCount - 1));
+
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+/* what a piece's dnd flag and priority should be, going by all the files */
+static void get_expected_piece_state(tr_torrent const* tor, tr_piece_index_t p, bool* dnd, tr_priority_t* priority)
+{
+    *dnd = true;
+    *priority = TR_PRI_LOW;
+
+    for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+    {
+        tr_file const* file = &tor->info.files[i];
+
+        if (file->firstPiece <= p && p <= file->lastPiece)
+        {
+            *dnd = *dnd && file->dnd;
+            *priority = MAX(*priority, file->priority);
+
+            if (file->priority >= TR_PRI_NORMAL && (file->firstPiece == p || file->lastPiece == p))
+            {
+                *priority = TR_PRI_HIGH;
+            }
+        }
+    }
+}
+
+static int test_piece_state(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    tr_file_index_t* files;
+
+    session = libttest_session_init(NULL);
+    tor = small_files_torrent_init(session, 16384);
+    files = tr_new(tr_file_index_t, tor->info.fileCount);
+
+    /* change random sets of files and make sure their pieces keep up */
+    for (int i = 0; i < 200; ++i)
+    {
+        tr_file_index_t n = 0;
+
+        for (tr_file_index_t f = 0; f < tor->info.fileCount; ++f)
+        {
+            if (tr_rand_int_weak(3) == 0)
+            {
+                files[n++] = f;
+            }
+        }
+
+        if (tr_rand_int_weak(2) == 0)
+        {
+            tr_torrentSetFileDLs(tor, files, n, tr_rand_int_weak(2) == 0);
+        }
+        else
+        {
+            tr_torrentSetFilePriorities(tor, files, n, tr_rand_int_weak(3) - 1);
+        }
+
+        for (tr_piece_index_t p = 0; p < tor->info.pieceCount; ++p)
+        {
+            bool dnd;
+            tr_priority_t priority;
+
+            get_expected_piece_state(tor, p, &dnd, &priority);
+            check_bool(tor->info.pieces[p].dnd, ==, dnd);
+            check_int(tor->info.pieces[p].priority, ==, priority);
+        }
+    }
+
+    tr_free(files);
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+#ifndef _WIN32
+
+struct file_segment_data
+{
+    tr_torrent* tor;
+    struct evbuffer* buf;
+    bool spanning;
+    bool ok;
+    bool done;
+};
+
+static void add_file_segments(void* vdata)
+{
+    struct file_segment_data* data = vdata;
+    tr_piece_index_t const tailPiece = data->tor->info.pieceCount - 1;
+
+    data->spanning = tr_ioAddFileSegment(data->tor, tailPiece, 0, tr_torPieceCountBytes(data->tor, tailPiece), data->buf);
+    data->ok = tr_ioAddFileSegment(data->tor, 0, 0, data->tor->blockSize, data->buf);
+    data->done = true;
+}
+
+static int test_file_segment(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    uint8_t* block;
+    uint8_t* readback;
+    size_t len;
+    size_t got = 0;
+    int sv[2];
+    struct file_segment_data data;
+
+    session = libttest_session_init(NULL);
+    tor = libttest_zero_torrent_init(session);
+    libttest_zero_torrent_populate(tor, true);
+
+    len = tor->blockSize;
+    block = tr_new(uint8_t, len);
+    readback = tr_new(uint8_t, len);
+    fill_block(block, len, 3);
+    check_int(tr_ioWrite(tor, NULL, 0, 0, len, block), ==, 0);
+
+    data.tor = tor;
+    data.buf = evbuffer_new();
+    data.done = false;
+    tr_runInEventThread(session, add_file_segments, &data);
+
+    while (!data.done)
+    {
+        tr_wait_msec(10);
+    }
+
+    /* blocks that span files have to be read the usual way */
+    check(!data.spanning);
+
+    if (data.ok)
+    {
+        /* send it through a socket and see if it comes out the same */
+        check_int(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+        check_uint(evbuffer_get_length(data.buf), ==, len);
+
+        while (evbuffer_get_length(data.buf) > 0)
+        {
+            check_int(evbuffer_write(data.buf, sv[0]), >, 0);
+        }
+
+        while (got < len)
+        {
+            ssize_t const n = read(sv[1], readback + got, len - got);
+            check_int(n, >, 0);
+            got += n;
+        }
+
+        check_mem(readback, ==, block, len);
+        close(sv[0]);
+        close(sv[1]);
+    }
+
+    /* the libtransmission thread doesn't open files itself */
+    tr_sessionLock(session);
+    tr_fdTorrentClose(session, tr_torrentId(tor));
+    tr_sessionUnlock(session);
+    data.done = false;
+    tr_runInEventThread(session, add_file_segments, &data);
+
+    while (!data.done)
+    {
+        tr_wait_msec(10);
+    }
+
+    check(!data.ok);
+
+    evbuffer_free(data.buf);
+    tr_free(readback);
+    tr_free(block);
+    tr_torrentRemove(tor, false, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+#endif
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_batch,
+        test_known_file_path,
+        test_io_dirs,
+        test_read_cache,
+        test_read_cache_spans,
+        test_check_downloaded_piece,
+        test_find_file_location,
+        test_file_bytes_completed,
+        test_piece_state,
+#ifndef _WIN32
+        test_file_segment
+#endif
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
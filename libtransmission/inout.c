@@ -8,20 +8,25 @@
 
 #include <errno.h>
 #include <stdlib.h> /* bsearch() */
-#include <string.h> /* memcmp() */
+#include <string.h> /* memcmp(), memcpy(), strlen() */
+
+#include <event2/buffer.h>
 
 #include "transmission.h"
-#include "cache.h" /* tr_cacheReadBlock() */
+#include "cache.h" /* tr_cacheReadBlock(), tr_cacheDropReadPiece() */
 #include "crypto-utils.h"
+#include "disk-io.h" /* tr_diskIoWaitForTorrent() */
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "inout.h"
+#include "io-uring.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "stats.h" /* tr_statsFileCreated() */
 #include "torrent.h"
 #include "tr-assert.h"
+#include "trevent.h" /* tr_amInEventThread() */
 #include "utils.h"
 
 /****
@@ -33,79 +38,291 @@ enum
     TR_IO_READ,
     TR_IO_PREFETCH,
     /* Any operations that require write access must follow TR_IO_WRITE. */
-    TR_IO_WRITE
+    TR_IO_WRITE,
+    /* like TR_IO_WRITE, but from an evbuffer */
+    TR_IO_WRITE_BUFFER
 };
 
-/* returns 0 on success, or an errno on failure */
-static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr_file_index_t fileIndex, uint64_t fileOffset,
-    void* buf, size_t buflen)
+struct tr_io_dirs
+{
+    char const* downloadDir;
+    char const* incompleteDir; /* NULL if the torrent doesn't have one */
+    char const* currentDir; /* where new files are created */
+    bool partialNames; /* whether new files get a ".part" suffix */
+};
+
+static void ioDirsInit(tr_io_dirs* dirs, tr_torrent const* tor)
+{
+    dirs->downloadDir = tor->downloadDir;
+    dirs->incompleteDir = tor->incompleteDir;
+    dirs->currentDir = tr_torrentGetCurrentDir(tor);
+    dirs->partialNames = tr_sessionIsIncompleteFileNamingEnabled(tor->session);
+}
+
+/* copies `dir' to `*walk' and moves `*walk' past it */
+static char const* ioDirsCopy(char** walk, char const* dir)
+{
+    char* ret = NULL;
+
+    if (dir != NULL)
+    {
+        size_t const len = strlen(dir) + 1;
+
+        ret = memcpy(*walk, dir, len);
+        *walk += len;
+    }
+
+    return ret;
+}
+
+tr_io_dirs* tr_ioDirsNew(tr_torrent const* tor)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    tr_io_dirs dirs;
+    size_t size = sizeof(tr_io_dirs);
+    tr_io_dirs* ret;
+    char* walk;
+
+    ioDirsInit(&dirs, tor);
+
+    /* the strings go right after the struct, so that it's one allocation */
+    size += dirs.downloadDir != NULL ? strlen(dirs.downloadDir) + 1 : 0;
+    size += dirs.incompleteDir != NULL ? strlen(dirs.incompleteDir) + 1 : 0;
+    size += dirs.currentDir != NULL ? strlen(dirs.currentDir) + 1 : 0;
+
+    ret = tr_malloc(size);
+    walk = (char*)(ret + 1);
+    ret->downloadDir = ioDirsCopy(&walk, dirs.downloadDir);
+    ret->incompleteDir = ioDirsCopy(&walk, dirs.incompleteDir);
+    ret->currentDir = ioDirsCopy(&walk, dirs.currentDir);
+    ret->partialNames = dirs.partialNames;
+
+    return ret;
+}
+
+/* Figures out where a file is, or where it should be created.
+ * returns a newly-allocated filename, or NULL if it doesn't exist and !doWrite */
+static char* findFile(tr_torrent* tor, tr_io_dirs const* dirs, tr_file_index_t fileIndex, bool doWrite)
+{
+    char* subpath;
+    char const* base;
+    char* filename;
+    tr_io_dirs own;
+
+    if (dirs == NULL)
+    {
+        ioDirsInit(&own, tor);
+        dirs = &own;
+    }
+
+    /* see if the file exists... */
+    if (!tr_torrentFindFileIn(tor, dirs->downloadDir, dirs->incompleteDir, fileIndex, &base, &subpath, NULL))
+    {
+        /* we can't read a file that doesn't exist... */
+        if (!doWrite)
+        {
+            return NULL;
+        }
+
+        /* figure out where the file should go, so we can create it.
+         * its name can't change until the torrent's queued jobs are done */
+        base = dirs->currentDir;
+        subpath = dirs->partialNames ? tr_torrentBuildPartial(tor, fileIndex) : tr_strdup(tor->info.files[fileIndex].name);
+    }
+
+    filename = tr_buildPath(base, subpath, NULL);
+    tr_free(subpath);
+    return filename;
+}
+
+/* What a disk-io worker learned about a file while opening it.
+ * The torrent's state is only changed in the libtransmission thread,
+ * so this is passed back there rather than applied by the worker. */
+struct file_note
+{
+    tr_session* session;
+    int torrent_id;
+    tr_file_index_t fileIndex;
+    unsigned int generation;
+    bool pathChanged;
+    char* path; /* where the file is now, or NULL if it wasn't found */
+    bool created;
+};
+
+static void applyFileNote(void* vnote)
+{
+    struct file_note* note = vnote;
+    tr_torrent* tor;
+
+    tr_sessionLock(note->session);
+
+    if ((tor = tr_torrentFindFromId(note->session, note->torrent_id)) != NULL)
+    {
+        if (note->pathChanged)
+        {
+            tr_torrentSetKnownFilePath(tor, note->fileIndex, note->path, note->generation);
+        }
+
+        if (note->created)
+        {
+            /* make a note that we just created a file */
+            tr_statsFileCreated(tor->session);
+        }
+    }
+
+    tr_sessionUnlock(note->session);
+
+    tr_free(note->path);
+    tr_free(note);
+}
+
+/* Finds the file's cached fd, or opens (and maybe creates) the file.
+ * On success, the fd is pinned until tr_fdFileReturn() is called.
+ * returns 0 on success, or an errno on failure */
+static int checkoutFile(tr_session* session, tr_torrent* tor, tr_io_dirs const* dirs, tr_file_index_t fileIndex, bool doWrite,
+    tr_sys_file_t* setme)
 {
     tr_sys_file_t fd;
     int err = 0;
-    bool const doWrite = ioMode >= TR_IO_WRITE;
-    tr_info const* const info = &tor->info;
-    tr_file const* const file = &info->files[fileIndex];
+    tr_file const* const file = &tor->info.files[fileIndex];
+    int const prealloc = (file->dnd || !doWrite) ? TR_PREALLOCATE_NONE : tor->session->preallocationMode;
+    unsigned int generation;
+    char* filename;
+    bool pathChanged = false;
 
-    TR_ASSERT(fileIndex < info->fileCount);
-    TR_ASSERT(file->length == 0 || fileOffset < file->length);
-    TR_ASSERT(fileOffset + buflen <= file->length);
+    fd = tr_fdFileGetCached(session, tr_torrentId(tor), fileIndex, doWrite);
 
-    if (file->length == 0)
+    if (fd != TR_BAD_SYS_FILE)
     {
+        *setme = fd;
         return 0;
     }
 
-    /***
-    ****  Find the fd
-    ***/
-
-    fd = tr_fdFileGetCached(session, tr_torrentId(tor), fileIndex, doWrite);
+    /* it's not cached, so open/create it now.
+     * Try wherever it was the last time before looking for it. */
+    filename = tr_torrentGetKnownFilePath(tor, fileIndex, &generation);
 
-    if (fd == TR_BAD_SYS_FILE)
+    if (filename != NULL)
     {
-        /* it's not cached, so open/create it now */
-        char* subpath;
-        char const* base;
+        fd = tr_fdFileCheckout(session, tor->uniqueId, fileIndex, filename, doWrite, prealloc, file->length);
 
-        /* see if the file exists... */
-        if (!tr_torrentFindFile2(tor, fileIndex, &base, &subpath, NULL))
+        if (fd == TR_BAD_SYS_FILE)
         {
-            /* we can't read a file that doesn't exist... */
-            if (!doWrite)
+            err = errno;
+
+            /* it was moved or deleted behind our back, so go look for it */
+            if (err == ENOENT)
             {
-                err = ENOENT;
+                tr_free(filename);
+                filename = NULL;
+                pathChanged = true;
+                err = 0;
             }
-
-            /* figure out where the file should go, so we can create it */
-            base = tr_torrentGetCurrentDir(tor);
-            subpath = tr_sessionIsIncompleteFileNamingEnabled(tor->session) ? tr_torrentBuildPartial(tor, fileIndex) :
-                tr_strdup(file->name);
         }
+    }
 
-        if (err == 0)
+    if (fd == TR_BAD_SYS_FILE && err == 0)
+    {
+        if ((filename = findFile(tor, dirs, fileIndex, doWrite)) == NULL)
+        {
+            err = ENOENT;
+        }
+        else if ((fd = tr_fdFileCheckout(session, tor->uniqueId, fileIndex, filename, doWrite, prealloc,
+            file->length)) == TR_BAD_SYS_FILE)
         {
-            /* open (and maybe create) the file */
-            char* filename = tr_buildPath(base, subpath, NULL);
-            int const prealloc = (file->dnd || !doWrite) ? TR_PREALLOCATE_NONE : tor->session->preallocationMode;
+            err = errno;
+        }
+        else
+        {
+            pathChanged = true;
+        }
+    }
 
-            if ((fd = tr_fdFileCheckout(session, tor->uniqueId, fileIndex, filename, doWrite, prealloc,
-                file->length)) == TR_BAD_SYS_FILE)
-            {
-                err = errno;
-                tr_logAddTorErr(tor, "tr_fdFileCheckout failed for \"%s\": %s", filename, tr_strerror(err));
-            }
-            else if (doWrite)
-            {
-                /* make a note that we just created a file */
-                tr_statsFileCreated(tor->session);
-            }
+    if (err != 0 && filename != NULL)
+    {
+        tr_logAddTorErr(tor, "tr_fdFileCheckout failed for \"%s\": %s", filename, tr_strerror(err));
+    }
 
-            tr_free(filename);
+    /* if the file wasn't where we thought it was, or was just opened for
+     * writing, let the libtransmission thread know */
+    if (pathChanged || (fd != TR_BAD_SYS_FILE && doWrite))
+    {
+        struct file_note* note = tr_new0(struct file_note, 1);
+        note->session = session;
+        note->torrent_id = tr_torrentId(tor);
+        note->fileIndex = fileIndex;
+        note->generation = generation;
+        note->pathChanged = pathChanged;
+        note->created = fd != TR_BAD_SYS_FILE && doWrite;
+
+        if (pathChanged && fd != TR_BAD_SYS_FILE)
+        {
+            note->path = filename;
+            filename = NULL;
         }
 
-        tr_free(subpath);
+        tr_runInEventThread(session, applyFileNote, note);
     }
 
+    tr_free(filename);
+
+    *setme = fd;
+    return err;
+}
+
+/* writes the first `len' bytes of `buf' with one vectored write, then drains them */
+static bool writeFromBuffer(tr_sys_file_t fd, struct evbuffer* buf, size_t len, uint64_t offset, tr_error** error)
+{
+    bool ret;
+    int const n = evbuffer_peek(buf, len, NULL, NULL, 0);
+    struct evbuffer_iovec* chains = tr_new(struct evbuffer_iovec, n);
+    tr_sys_iovec* iov = tr_new(tr_sys_iovec, n);
+    size_t left = len;
+
+    evbuffer_peek(buf, len, NULL, chains, n);
+
+    for (int i = 0; i < n; ++i)
+    {
+        /* the last chain may hold more than we want */
+        iov[i].base = chains[i].iov_base;
+        iov[i].len = MIN(chains[i].iov_len, left);
+        left -= iov[i].len;
+    }
+
+    ret = tr_sys_file_write_at_v(fd, iov, n, offset, NULL, error);
+    evbuffer_drain(buf, len);
+
+    tr_free(iov);
+    tr_free(chains);
+    return ret;
+}
+
+/* returns 0 on success, or an errno on failure */
+static int readOrWriteBytes(tr_session* session, tr_torrent* tor, tr_io_dirs const* dirs, int ioMode, tr_file_index_t fileIndex,
+    uint64_t fileOffset, void* buf, size_t buflen)
+{
+    tr_sys_file_t fd;
+    int err;
+    bool const doWrite = ioMode >= TR_IO_WRITE;
+    tr_info const* const info = &tor->info;
+    tr_file const* const file = &info->files[fileIndex];
+
+    TR_ASSERT(fileIndex < info->fileCount);
+    TR_ASSERT(file->length == 0 || fileOffset < file->length);
+    TR_ASSERT(fileOffset + buflen <= file->length);
+
+    if (file->length == 0)
+    {
+        return 0;
+    }
+
+    /***
+    ****  Find the fd
+    ***/
+
+    err = checkoutFile(session, tor, dirs, fileIndex, doWrite, &fd);
+
     /***
     ****  Use the fd
     ***/
@@ -123,9 +340,12 @@ static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr
                 tr_error_free(error);
             }
         }
-        else if (ioMode == TR_IO_WRITE)
+        else if (ioMode == TR_IO_WRITE || ioMode == TR_IO_WRITE_BUFFER)
         {
-            if (!tr_sys_file_write_at(fd, buf, buflen, fileOffset, NULL, &error))
+            bool const ok = ioMode == TR_IO_WRITE ? tr_sys_file_write_at(fd, buf, buflen, fileOffset, NULL, &error) :
+                writeFromBuffer(fd, buf, buflen, fileOffset, &error);
+
+            if (!ok)
             {
                 err = error->code;
                 tr_logAddTorErr(tor, "write failed for \"%s\": %s", file->name, error->message);
@@ -140,6 +360,8 @@ static int readOrWriteBytes(tr_session* session, tr_torrent* tor, int ioMode, tr
         {
             abort();
         }
+
+        tr_fdFileReturn(session, tr_torrentId(tor), fileIndex, fd);
     }
 
     return err;
@@ -167,12 +389,17 @@ void tr_ioFindFileLocation(tr_torrent const* tor, tr_piece_index_t pieceIndex, u
     uint64_t* fileOffset)
 {
     TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(pieceIndex < tor->info.pieceCount);
+    TR_ASSERT(pieceOffset < tr_torPieceCountBytes(tor, pieceIndex));
 
     uint64_t const offset = tr_pieceOffset(tor, pieceIndex, pieceOffset, 0);
+    tr_piece_span const* span = &tor->pieceSpans[pieceIndex];
 
     TR_ASSERT(offset < tor->info.totalSize);
 
-    tr_file const* file = bsearch(&offset, tor->info.files, tor->info.fileCount, sizeof(tr_file), compareOffsetToFile);
+    /* only the piece's own files can hold the offset */
+    tr_file const* file = bsearch(&offset, tor->info.files + span->firstFile, span->fileCount, sizeof(tr_file),
+        compareOffsetToFile);
 
     TR_ASSERT(file != NULL);
 
@@ -184,9 +411,10 @@ void tr_ioFindFileLocation(tr_torrent const* tor, tr_piece_index_t pieceIndex, u
     TR_ASSERT(tor->info.files[*fileIndex].offset + *fileOffset == offset);
 }
 
-/* returns 0 on success, or an errno on failure */
-static int readOrWritePiece(tr_torrent* tor, int ioMode, tr_piece_index_t pieceIndex, uint32_t pieceOffset, uint8_t* buf,
-    size_t buflen)
+/* For TR_IO_WRITE_BUFFER, `buf' is the evbuffer to write from.
+ * returns 0 on success, or an errno on failure */
+static int readOrWritePiece(tr_torrent* tor, tr_io_dirs const* dirs, int ioMode, tr_piece_index_t pieceIndex,
+    uint32_t pieceOffset, void* buf, size_t buflen)
 {
     int err = 0;
     tr_file_index_t fileIndex;
@@ -205,36 +433,335 @@ static int readOrWritePiece(tr_torrent* tor, int ioMode, tr_piece_index_t pieceI
         tr_file const* file = &info->files[fileIndex];
         uint64_t const bytesThisPass = MIN(buflen, file->length - fileOffset);
 
-        err = readOrWriteBytes(tor->session, tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass);
-        buf += bytesThisPass;
+        err = readOrWriteBytes(tor->session, tor, dirs, ioMode, fileIndex, fileOffset, buf, bytesThisPass);
         buflen -= bytesThisPass;
         fileIndex++;
         fileOffset = 0;
 
-        if (err != 0 && ioMode == TR_IO_WRITE && tor->error != TR_STAT_LOCAL_ERROR)
+        /* an evbuffer is drained as it's written */
+        if (ioMode != TR_IO_WRITE_BUFFER)
         {
-            char* path = tr_buildPath(tor->downloadDir, file->name, NULL);
-            tr_torrentSetLocalError(tor, "%s (%s)", tr_strerror(err), path);
-            tr_free(path);
+            buf = (uint8_t*)buf + bytesThisPass;
         }
     }
 
     return err;
 }
 
-int tr_ioRead(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len, uint8_t* buf)
+/* The synchronous IO functions wait for the torrent's queued jobs first,
+ * so that they don't race the disk-io workers for the same files. */
+
+int tr_ioRead(tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len, uint8_t* buf)
 {
-    return readOrWritePiece(tor, TR_IO_READ, pieceIndex, begin, buf, len);
+    tr_diskIoWaitForTorrent(tor);
+
+    return readOrWritePiece(tor, dirs, TR_IO_READ, pieceIndex, begin, buf, len);
 }
 
-int tr_ioPrefetch(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len)
+int tr_ioPrefetch(tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len)
 {
-    return readOrWritePiece(tor, TR_IO_PREFETCH, pieceIndex, begin, NULL, len);
+    tr_diskIoWaitForTorrent(tor);
+
+    return readOrWritePiece(tor, dirs, TR_IO_PREFETCH, pieceIndex, begin, NULL, len);
 }
 
-int tr_ioWrite(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len, uint8_t const* buf)
+int tr_ioWrite(tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len,
+    uint8_t const* buf)
 {
-    return readOrWritePiece(tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
+    tr_diskIoWaitForTorrent(tor);
+
+    return readOrWritePiece(tor, dirs, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
+}
+
+int tr_ioWriteBuffer(tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t begin,
+    struct evbuffer* buf)
+{
+    tr_diskIoWaitForTorrent(tor);
+
+    return readOrWritePiece(tor, dirs, TR_IO_WRITE_BUFFER, pieceIndex, begin, buf, evbuffer_get_length(buf));
+}
+
+bool tr_ioAddFileSegment(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len, struct evbuffer* buf)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(tr_amInEventThread(tor->session));
+
+    bool ok = false;
+    tr_sys_file_t fd;
+    tr_file_index_t fileIndex;
+    uint64_t fileOffset;
+    tr_file const* file;
+
+    /* if a write is queued, the file may not have the block yet.
+     * the workers only get new jobs from this thread, so no new
+     * write can be queued while we're here */
+    if (pieceIndex >= tor->info.pieceCount || len == 0 || tr_diskIoIsWriting(tor))
+    {
+        return false;
+    }
+
+    tr_ioFindFileLocation(tor, pieceIndex, begin, &fileIndex, &fileOffset);
+    file = &tor->info.files[fileIndex];
+
+    /* opening the file could block, so leave that to the disk-io workers */
+    if (fileOffset + len <= file->length &&
+        (fd = tr_fdFileGetCached(tor->session, tr_torrentId(tor), fileIndex, false)) != TR_BAD_SYS_FILE)
+    {
+        ok = tr_fdFileAddSegment(tor->session, tr_torrentId(tor), fileIndex, fd, file->length, fileOffset, len, buf);
+        tr_fdFileReturn(tor->session, tr_torrentId(tor), fileIndex, fd);
+    }
+
+    return ok;
+}
+
+/****
+*****  Batches
+****/
+
+enum
+{
+    /* how many blocks to read or write per batch */
+    IO_BATCH_OPS = 32,
+    /* how many file reads or writes those blocks can be split into */
+    IO_BATCH_SEGMENTS = 128
+};
+
+struct io_batch_op
+{
+    tr_torrent* tor;
+    tr_io_dirs const* dirs;
+    tr_piece_index_t piece;
+    uint32_t offset;
+    uint32_t length;
+    uint8_t* buf;
+    void* user_data;
+
+    /* if anything went wrong, do it again the slow way */
+    bool redo;
+};
+
+/* the part of a block that falls in one file */
+struct io_batch_segment
+{
+    int op;
+    int torrent_id;
+    tr_file_index_t fileIndex;
+    tr_sys_file_t fd;
+    uint32_t length;
+    bool done;
+};
+
+struct tr_io_batch
+{
+    tr_io_ring* ring;
+    bool doWrite;
+
+    struct io_batch_op ops[IO_BATCH_OPS];
+    int opCount;
+
+    struct io_batch_segment segments[IO_BATCH_SEGMENTS];
+    int segmentCount;
+};
+
+tr_io_batch* tr_ioBatchNew(void)
+{
+    tr_io_ring* ring = tr_ioRingNew(IO_BATCH_SEGMENTS);
+    tr_io_batch* batch = NULL;
+
+    if (ring != NULL)
+    {
+        batch = tr_new0(tr_io_batch, 1);
+        batch->ring = ring;
+    }
+
+    return batch;
+}
+
+void tr_ioBatchFree(tr_io_batch* batch)
+{
+    if (batch != NULL)
+    {
+        TR_ASSERT(batch->opCount == 0);
+
+        tr_ioRingFree(batch->ring);
+        tr_free(batch);
+    }
+}
+
+static bool batchOverlaps(tr_io_batch const* batch, tr_torrent const* tor, tr_piece_index_t piece, uint32_t offset,
+    uint32_t len)
+{
+    for (int i = 0; i < batch->opCount; ++i)
+    {
+        struct io_batch_op const* op = &batch->ops[i];
+
+        if (op->tor == tor && op->piece == piece && op->offset < offset + len && offset < op->offset + op->length)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool tr_ioBatchAdd(tr_io_batch* batch, tr_torrent* tor, tr_io_dirs const* dirs, bool doWrite, tr_piece_index_t pieceIndex,
+    uint32_t begin, uint32_t len, uint8_t* buf, void* user_data)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    int segmentCount = 0;
+    tr_file_index_t fileIndex = 0;
+    uint64_t fileOffset = 0;
+    tr_info const* const info = &tor->info;
+    struct io_batch_op* op;
+
+    if (batch->ring == NULL || batch->opCount == IO_BATCH_OPS)
+    {
+        return false;
+    }
+
+    /* Keep reads and writes in separate batches, and don't batch anything
+     * that touches the same bytes as something already in the batch. The
+     * kernel may do a batch's reads and writes in any order. */
+    if (batch->opCount > 0 && (batch->doWrite != doWrite || batchOverlaps(batch, tor, pieceIndex, begin, len)))
+    {
+        return false;
+    }
+
+    if (pieceIndex < info->pieceCount && len > 0)
+    {
+        uint32_t left = len;
+
+        tr_ioFindFileLocation(tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+        for (tr_file_index_t i = fileIndex; left > 0; ++i)
+        {
+            uint64_t const fileLeft = info->files[i].length - (i == fileIndex ? fileOffset : 0);
+
+            if (fileLeft > 0)
+            {
+                ++segmentCount;
+            }
+
+            left -= MIN(left, fileLeft);
+        }
+    }
+
+    if (segmentCount > (int)tr_ioRingSpace(batch->ring) || batch->segmentCount + segmentCount > IO_BATCH_SEGMENTS)
+    {
+        /* if it won't fit in an empty batch, let tr_ioBatchRun() do it the slow way */
+        if (batch->opCount > 0)
+        {
+            return false;
+        }
+
+        segmentCount = 0;
+    }
+
+    op = &batch->ops[batch->opCount];
+    op->tor = tor;
+    op->dirs = dirs;
+    op->piece = pieceIndex;
+    op->offset = begin;
+    op->length = len;
+    op->buf = buf;
+    op->user_data = user_data;
+    op->redo = segmentCount == 0;
+
+    for (uint32_t done = 0; done < len && segmentCount > 0; ++fileIndex, fileOffset = 0)
+    {
+        tr_file const* const file = &info->files[fileIndex];
+        uint32_t const segmentLength = (uint32_t)MIN(len - done, file->length - fileOffset);
+        struct io_batch_segment* seg;
+
+        if (segmentLength == 0)
+        {
+            continue;
+        }
+
+        seg = &batch->segments[batch->segmentCount];
+
+        if (checkoutFile(tor->session, tor, dirs, fileIndex, doWrite, &seg->fd) != 0)
+        {
+            op->redo = true;
+            break;
+        }
+
+        seg->op = batch->opCount;
+        seg->torrent_id = tr_torrentId(tor);
+        seg->fileIndex = fileIndex;
+        seg->length = segmentLength;
+        seg->done = false;
+
+        tr_ioRingQueue(batch->ring, doWrite, seg->fd, buf + done, segmentLength, fileOffset, batch->segmentCount);
+
+        ++batch->segmentCount;
+        done += segmentLength;
+    }
+
+    batch->doWrite = doWrite;
+    ++batch->opCount;
+    return true;
+}
+
+static void onSegmentDone(uint64_t user_data, int result, void* vbatch)
+{
+    tr_io_batch* batch = vbatch;
+    struct io_batch_segment* seg = &batch->segments[user_data];
+
+    TR_ASSERT(user_data < (uint64_t)batch->segmentCount);
+
+    seg->done = true;
+
+    /* errors and short reads or writes get redone in tr_ioBatchRun() so
+       that they're retried, logged, and reported the same way as always */
+    if (result != (int)seg->length)
+    {
+        batch->ops[seg->op].redo = true;
+    }
+}
+
+void tr_ioBatchRun(tr_io_batch* batch, tr_io_batch_done_func callback)
+{
+    int const ioMode = batch->doWrite ? TR_IO_WRITE : TR_IO_READ;
+
+    if (batch->segmentCount > 0)
+    {
+        if (tr_ioRingSubmitAndWait(batch->ring, onSegmentDone, batch) != 0)
+        {
+            /* the ring broke, so stop using it */
+            tr_ioRingFree(batch->ring);
+            batch->ring = NULL;
+        }
+
+        for (int i = 0; i < batch->segmentCount; ++i)
+        {
+            struct io_batch_segment const* seg = &batch->segments[i];
+
+            if (!seg->done)
+            {
+                batch->ops[seg->op].redo = true;
+            }
+
+            tr_fdFileReturn(batch->ops[seg->op].tor->session, seg->torrent_id, seg->fileIndex, seg->fd);
+        }
+    }
+
+    for (int i = 0; i < batch->opCount; ++i)
+    {
+        struct io_batch_op const* op = &batch->ops[i];
+        int err = 0;
+
+        if (op->redo)
+        {
+            err = readOrWritePiece(op->tor, op->dirs, ioMode, op->piece, op->offset, op->buf, op->length);
+        }
+
+        (*callback)(op->user_data, err);
+    }
+
+    batch->opCount = 0;
+    batch->segmentCount = 0;
 }
 
 /****
@@ -251,16 +778,32 @@ static bool recalculateHash(tr_torrent* tor, tr_piece_index_t pieceIndex, uint8_
     uint32_t offset = 0;
     bool success = true;
     size_t const buflen = tor->blockSize;
-    void* buffer = tr_valloc(buflen);
+    void* buffer;
     tr_sha1_ctx_t sha;
 
-    TR_ASSERT(buffer != NULL);
     TR_ASSERT(buflen > 0);
 
-    sha = tr_sha1_init();
-    bytesLeft = tr_torPieceCountBytes(tor, pieceIndex);
+    /* most of a just-downloaded piece has been hashed already as it came in */
+    if ((sha = tr_cacheTakePieceHash(tor->session->cache, tor, pieceIndex, &offset)) == NULL)
+    {
+        sha = tr_sha1_init();
+        offset = 0;
+    }
+
+    bytesLeft = tr_torPieceCountBytes(tor, pieceIndex) - offset;
+
+    if (bytesLeft == 0)
+    {
+        return tr_sha1_final(sha, setme);
+    }
+
+    buffer = tr_valloc(buflen);
+    TR_ASSERT(buffer != NULL);
+
+    /* check what's on disk, not what was read from it before */
+    tr_cacheDropReadPiece(tor->session->cache, tor, pieceIndex);
 
-    tr_ioPrefetch(tor, pieceIndex, offset, bytesLeft);
+    tr_ioPrefetch(tor, NULL, pieceIndex, offset, bytesLeft);
 
     while (bytesLeft != 0)
     {
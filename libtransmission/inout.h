@@ -12,6 +12,7 @@
 #error only libtransmission should #include this header.
 #endif
 
+struct evbuffer;
 struct tr_torrent;
 
 /**
@@ -19,19 +20,85 @@ struct tr_torrent;
  * @{
  */
 
+/**
+ * A copy of the directories that a torrent's files are looked for and
+ * created in. The torrent's own are changed and freed in the libtransmission
+ * thread, so the disk-io workers use a copy taken when their job was queued.
+ *
+ * The IO functions below take one of these, or NULL to use the torrent's own,
+ * which only the libtransmission thread may do.
+ */
+typedef struct tr_io_dirs tr_io_dirs;
+
+/**
+ * @brief Copies the torrent's directories. Call this with the session locked.
+ * @return a new tr_io_dirs, to be freed with tr_free()
+ */
+tr_io_dirs* tr_ioDirsNew(struct tr_torrent const* tor);
+
 /**
  * Reads the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
  */
-int tr_ioRead(struct tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len, uint8_t* setme);
+int tr_ioRead(struct tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len,
+    uint8_t* setme);
 
-int tr_ioPrefetch(tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len);
+int tr_ioPrefetch(tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len);
 
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
  */
-int tr_ioWrite(struct tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len, uint8_t const* writeme);
+int tr_ioWrite(struct tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len,
+    uint8_t const* writeme);
+
+/**
+ * Like tr_ioWrite(), but writes all of `writeme' straight from its chains,
+ * without gathering it into one run of memory first. `writeme' is drained.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWriteBuffer(struct tr_torrent* tor, tr_io_dirs const* dirs, tr_piece_index_t pieceIndex, uint32_t offset,
+    struct evbuffer* writeme);
+
+/**
+ * A set of block reads or writes that are done together. Where io_uring
+ * is available, a batch is handed to the kernel with one system call.
+ * A batch must only be used by one thread at a time.
+ */
+typedef struct tr_io_batch tr_io_batch;
+
+typedef void (* tr_io_batch_done_func)(void* user_data, int err);
+
+/** @return a new batch, or NULL if batched IO isn't supported here */
+tr_io_batch* tr_ioBatchNew(void);
+
+void tr_ioBatchFree(tr_io_batch* batch);
+
+/**
+ * Adds a read or write of the block specified by the piece index, offset,
+ * and length. `buf' and `dirs' must stay valid until tr_ioBatchRun() returns.
+ * @return false if the batch is full and should be run first
+ */
+bool tr_ioBatchAdd(tr_io_batch* batch, struct tr_torrent* tor, tr_io_dirs const* dirs, bool doWrite,
+    tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len, uint8_t* buf, void* user_data);
+
+/**
+ * Does everything in the batch, calls `callback' for each block with
+ * 0 or an errno value, and empties the batch.
+ */
+void tr_ioBatchRun(tr_io_batch* batch, tr_io_batch_done_func callback);
+
+/**
+ * Adds the block specified by the piece index, offset, and length to `buf'
+ * as a reference to the file that holds it, so that it can be sent to a socket
+ * with sendfile() instead of being copied through memory. This only works
+ * for blocks that lie within one file whose fd is already open and whose
+ * bytes are already in the page cache, and only on platforms that support it.
+ * Only the libtransmission thread may call this.
+ * @return true on success
+ */
+bool tr_ioAddFileSegment(struct tr_torrent* tor, tr_piece_index_t pieceIndex, uint32_t offset, uint32_t len,
+    struct evbuffer* buf);
 
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
@@ -0,0 +1,322 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <string.h> /* memset() */
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "transmission.h"
+#include "io-uring.h"
+#include "log.h"
+#include "tr-assert.h"
+#include "utils.h"
+
+#define MY_NAME "io_uring"
+
+#define dbgmsg(...) tr_logAddDeepNamed(MY_NAME, __VA_ARGS__)
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* glibc has no wrappers for these, and we don't want to depend on liburing
+   for three system calls */
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+struct tr_io_ring
+{
+    int fd;
+
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    unsigned int sqEntries;
+    unsigned int* sqTail;
+    unsigned int* sqMask;
+    unsigned int* sqArray;
+
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int* cqMask;
+    struct io_uring_cqe* cqes;
+
+    /* queued but not yet submitted */
+    unsigned int queued;
+
+    /* submitted but not yet completed */
+    unsigned int inFlight;
+};
+
+static bool ringSupportsReadWrite(int fd)
+{
+    size_t const probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = tr_malloc0(probeSize);
+    bool ret = false;
+
+    /* IORING_OP_READ and IORING_OP_WRITE are newer than io_uring itself */
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        ret = probe->last_op >= IORING_OP_WRITE &&
+            (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0 &&
+            (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    tr_free(probe);
+    return ret;
+}
+
+tr_io_ring* tr_ioRingNew(unsigned int entries)
+{
+    struct io_uring_params p;
+    tr_io_ring* ring;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+
+    if ((fd = io_uring_setup(entries, &p)) == -1)
+    {
+        dbgmsg("io_uring_setup failed: %s", tr_strerror(errno));
+        return NULL;
+    }
+
+    if (!ringSupportsReadWrite(fd))
+    {
+        dbgmsg("kernel is too old for io_uring reads and writes");
+        close(fd);
+        return NULL;
+    }
+
+    ring = tr_new0(tr_io_ring, 1);
+    ring->fd = fd;
+    ring->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    {
+        ring->sqMapSize = ring->cqMapSize = MAX(ring->sqMapSize, ring->cqMapSize);
+    }
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+    if (ring->sqMap != MAP_FAILED)
+    {
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+        {
+            ring->cqMap = ring->sqMap;
+        }
+        else
+        {
+            ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_CQ_RING);
+        }
+    }
+
+    if (ring->sqMap != MAP_FAILED && ring->cqMap != MAP_FAILED)
+    {
+        ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+
+    if (ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        dbgmsg("mapping the rings failed: %s", tr_strerror(errno));
+
+        if (ring->cqMap != MAP_FAILED && ring->cqMap != NULL && ring->cqMap != ring->sqMap)
+        {
+            munmap(ring->cqMap, ring->cqMapSize);
+        }
+
+        if (ring->sqMap != MAP_FAILED)
+        {
+            munmap(ring->sqMap, ring->sqMapSize);
+        }
+
+        close(fd);
+        tr_free(ring);
+        return NULL;
+    }
+
+    ring->sqEntries = p.sq_entries;
+    ring->sqTail = (unsigned int*)((char*)ring->sqMap + p.sq_off.tail);
+    ring->sqMask = (unsigned int*)((char*)ring->sqMap + p.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*)((char*)ring->sqMap + p.sq_off.array);
+    ring->cqHead = (unsigned int*)((char*)ring->cqMap + p.cq_off.head);
+    ring->cqTail = (unsigned int*)((char*)ring->cqMap + p.cq_off.tail);
+    ring->cqMask = (unsigned int*)((char*)ring->cqMap + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)((char*)ring->cqMap + p.cq_off.cqes);
+
+    dbgmsg("new ring with %u entries", ring->sqEntries);
+    return ring;
+}
+
+void tr_ioRingFree(tr_io_ring* ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    munmap(ring->sqes, ring->sqesSize);
+
+    if (ring->cqMap != ring->sqMap)
+    {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+    tr_free(ring);
+}
+
+unsigned int tr_ioRingSpace(tr_io_ring const* ring)
+{
+    /* every submit waits for its completions, so the kernel has always
+       consumed the whole submission queue before we fill it again */
+    return ring->sqEntries - ring->queued - ring->inFlight;
+}
+
+bool tr_ioRingQueue(tr_io_ring* ring, bool doWrite, tr_sys_file_t fd, void* buf, uint32_t len, uint64_t offset,
+    uint64_t user_data)
+{
+    unsigned int tail;
+    unsigned int index;
+    struct io_uring_sqe* sqe;
+
+    if (tr_ioRingSpace(ring) == 0)
+    {
+        return false;
+    }
+
+    /* we're the only one who moves the tail */
+    tail = *ring->sqTail;
+    index = tail & *ring->sqMask;
+    sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = doWrite ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+
+    ring->sqArray[index] = index;
+
+    /* make the entry visible to the kernel before the new tail is */
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    ++ring->queued;
+    return true;
+}
+
+static void reapCompletions(tr_io_ring* ring, tr_io_ring_done_func callback, void* user_arg)
+{
+    unsigned int head = *ring->cqHead;
+    unsigned int const tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe const* cqe = &ring->cqes[head & *ring->cqMask];
+
+        (*callback)(cqe->user_data, cqe->res, user_arg);
+
+        ++head;
+        --ring->inFlight;
+    }
+
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+int tr_ioRingSubmitAndWait(tr_io_ring* ring, tr_io_ring_done_func callback, void* user_arg)
+{
+    TR_ASSERT(ring != NULL);
+    TR_ASSERT(callback != NULL);
+
+    while (ring->queued > 0 || ring->inFlight > 0)
+    {
+        int const n = io_uring_enter(ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS);
+
+        if (n >= 0)
+        {
+            ring->queued -= n;
+            ring->inFlight += n;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else if ((errno != EAGAIN && errno != EBUSY) || ring->inFlight == 0)
+        {
+            /* the ring is unusable; the caller should free it */
+            int const err = errno;
+            dbgmsg("io_uring_enter failed: %s", tr_strerror(err));
+            return err;
+        }
+
+        reapCompletions(ring, callback, user_arg);
+    }
+
+    return 0;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct tr_io_ring
+{
+    int unused;
+};
+
+tr_io_ring* tr_ioRingNew(unsigned int entries UNUSED)
+{
+    return NULL;
+}
+
+void tr_ioRingFree(tr_io_ring* ring)
+{
+    TR_ASSERT(ring == NULL);
+}
+
+unsigned int tr_ioRingSpace(tr_io_ring const* ring UNUSED)
+{
+    return 0;
+}
+
+bool tr_ioRingQueue(tr_io_ring* ring UNUSED, bool doWrite UNUSED, tr_sys_file_t fd UNUSED, void* buf UNUSED,
+    uint32_t len UNUSED, uint64_t offset UNUSED, uint64_t user_data UNUSED)
+{
+    return false;
+}
+
+int tr_ioRingSubmitAndWait(tr_io_ring* ring UNUSED, tr_io_ring_done_func callback UNUSED, void* user_arg UNUSED)
+{
+    return ENOSYS;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
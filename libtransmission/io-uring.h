@@ -0,0 +1,57 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#pragma once
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#include "file.h" /* tr_sys_file_t */
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * A Linux io_uring submission/completion queue pair, used to do many
+ * reads and writes with one system call. A ring must only be used by
+ * one thread at a time.
+ */
+typedef struct tr_io_ring tr_io_ring;
+
+typedef void (* tr_io_ring_done_func)(uint64_t user_data, int result, void* user_arg);
+
+/**
+ * @return a new ring with room for `entries' operations, or NULL if
+ *         io_uring isn't available on this system
+ */
+tr_io_ring* tr_ioRingNew(unsigned int entries);
+
+void tr_ioRingFree(tr_io_ring* ring);
+
+/** @return the number of operations that can still be queued before the next submit */
+unsigned int tr_ioRingSpace(tr_io_ring const* ring);
+
+/**
+ * Queues a read or write of `len' bytes at `offset' in `fd'.
+ * @return false if the ring is full
+ */
+bool tr_ioRingQueue(tr_io_ring* ring, bool doWrite, tr_sys_file_t fd, void* buf, uint32_t len, uint64_t offset,
+    uint64_t user_data);
+
+/**
+ * Submits the queued operations and waits for all of them to finish,
+ * calling `callback' for each one with the byte count it transferred
+ * or with a negative errno value.
+ * @return 0 on success, or an errno value if the ring itself failed
+ */
+int tr_ioRingSubmitAndWait(tr_io_ring* ring, tr_io_ring_done_func callback, void* user_arg);
+
+/* @} */
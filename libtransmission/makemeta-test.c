@@ -6,13 +6,21 @@
  *
  */
 
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
 #include "libtransmission-test.h"
 
 #include "transmission.h"
 #include "crypto-utils.h"
 #include "file.h"
 #include "makemeta.h"
+#include "platform.h" /* tr_wait_msec(), tr_getProcessorCount() */
 
+#include <stdio.h> /* fprintf() */
 #include <stdlib.h> /* mktemp() */
 #include <string.h> /* strlen() */
 
@@ -276,12 +284,207 @@ static int test_single_directory_random_payload(void)
     return 0;
 }
 
+/* 32 KiB pieces, so a few MiB is enough to need several chunks */
+#define PIECE_SIZE (32 * 1024)
+
+static void wait_for_builder(tr_metainfo_builder const* builder)
+{
+    while (!builder->isDone)
+    {
+        tr_wait_msec(10);
+    }
+}
+
+static int check_piece_hashes(char const* torrent_file, uint8_t const* payload, uint64_t payloadSize)
+{
+    tr_ctor* ctor = tr_ctorNew(NULL);
+    tr_info inf;
+
+    libttest_sync();
+    tr_ctorSetMetainfoFromFile(ctor, torrent_file);
+    check_int(tr_torrentParse(ctor, &inf), ==, TR_PARSE_OK);
+    check_uint(inf.totalSize, ==, payloadSize);
+    check_uint(inf.pieceCount, ==, (payloadSize + PIECE_SIZE - 1) / PIECE_SIZE);
+
+    for (tr_piece_index_t i = 0; i < inf.pieceCount; ++i)
+    {
+        uint64_t const offset = (uint64_t)i * PIECE_SIZE;
+        uint8_t hash[SHA_DIGEST_LENGTH];
+
+        tr_sha1(hash, payload + offset, (int)MIN(PIECE_SIZE, payloadSize - offset), NULL);
+        check_mem(inf.pieces[i].hash, ==, hash, SHA_DIGEST_LENGTH);
+    }
+
+    tr_metainfoFree(&inf);
+    tr_ctorFree(ctor);
+    return 0;
+}
+
+static int test_concurrent_builders(void)
+{
+    enum
+    {
+        N_BUILDERS = 3
+    };
+
+    /* files that don't line up with the pieces, and one that's smaller than a piece */
+    size_t const sizes[] = { 3 * 1024 * 1024 + 17, 5, 6 * 1024 * 1024 + 1234 };
+    int const hashThreads[N_BUILDERS] = { 1, 3, 0 };
+    uint64_t payloadSize = 0;
+    uint8_t* payload;
+    char* sandbox;
+    char* top;
+    char* torrent_files[N_BUILDERS];
+    tr_metainfo_builder* builders[N_BUILDERS];
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(sizes); ++i)
+    {
+        payloadSize += sizes[i];
+    }
+
+    payload = tr_new(uint8_t, payloadSize);
+    tr_rand_buffer(payload, payloadSize);
+
+    sandbox = libtest_sandbox_create();
+    top = tr_buildPath(sandbox, "folder", NULL);
+    tr_sys_dir_create(top, 0, 0700, NULL);
+
+    for (size_t i = 0, offset = 0; i < TR_N_ELEMENTS(sizes); offset += sizes[i], ++i)
+    {
+        char name[32];
+        char* path;
+
+        tr_snprintf(name, sizeof(name), "file-%zu", i);
+        path = tr_buildPath(top, name, NULL);
+        libtest_create_file_with_contents(path, payload + offset, sizes[i]);
+        tr_free(path);
+    }
+
+    for (int i = 0; i < N_BUILDERS; ++i)
+    {
+        builders[i] = tr_metaInfoBuilderCreate(top);
+        check_uint(builders[i]->totalSize, ==, payloadSize);
+        check(tr_metaInfoBuilderSetPieceSize(builders[i], PIECE_SIZE));
+        builders[i]->hashThreads = hashThreads[i];
+        torrent_files[i] = tr_strdup_printf("%s-%d.torrent", top, i);
+    }
+
+    /* build them all at once */
+    for (int i = 0; i < N_BUILDERS; ++i)
+    {
+        tr_makeMetaInfo(builders[i], torrent_files[i], NULL, 0, NULL, false);
+    }
+
+    for (int i = 0; i < N_BUILDERS; ++i)
+    {
+        wait_for_builder(builders[i]);
+        check_int(builders[i]->result, ==, TR_MAKEMETA_OK);
+        check_uint(builders[i]->pieceIndex, ==, builders[i]->pieceCount);
+
+        if (check_piece_hashes(torrent_files[i], payload, payloadSize) != 0)
+        {
+            return 1;
+        }
+
+        tr_metaInfoBuilderFree(builders[i]);
+        tr_free(torrent_files[i]);
+    }
+
+    libtest_sandbox_destroy(sandbox);
+    tr_free(sandbox);
+    tr_free(top);
+    tr_free(payload);
+    return 0;
+}
+
+static int test_file_shrinks(void)
+{
+    size_t const size = 1024 * 1024;
+    uint8_t* payload = tr_new(uint8_t, size);
+    char* sandbox = libtest_sandbox_create();
+    char* path = tr_buildPath(sandbox, "shrinking", NULL);
+    char* torrent_file = tr_strdup_printf("%s.torrent", path);
+    tr_metainfo_builder* builder;
+
+    tr_rand_buffer(payload, size);
+    libtest_create_file_with_contents(path, payload, size);
+    builder = tr_metaInfoBuilderCreate(path);
+    tr_metaInfoBuilderSetPieceSize(builder, PIECE_SIZE);
+
+    /* the file's cut short after its size has been taken */
+    libtest_create_file_with_contents(path, payload, size / 2);
+    tr_makeMetaInfo(builder, torrent_file, NULL, 0, NULL, false);
+    wait_for_builder(builder);
+    check_int(builder->result, ==, TR_MAKEMETA_IO_READ);
+    check_str(builder->errfile, ==, path);
+    check(!tr_sys_path_exists(torrent_file, NULL));
+
+    tr_metaInfoBuilderFree(builder);
+    libtest_sandbox_destroy(sandbox);
+    tr_free(torrent_file);
+    tr_free(path);
+    tr_free(sandbox);
+    tr_free(payload);
+    return 0;
+}
+
+#if SPEED_TEST
+
+/* The data set is still in the page cache after it's been written,
+ * so this measures hashing more than it does the disk */
+static int test_speed(void)
+{
+    size_t const size = 1024 * 1024 * 1024;
+    int const threads[] = { 1, 2, 4, 0 };
+    uint8_t* payload = tr_new(uint8_t, size);
+    char* sandbox = libtest_sandbox_create();
+    char* path = tr_buildPath(sandbox, "speed", NULL);
+    char* torrent_file = tr_strdup_printf("%s.torrent", path);
+
+    tr_rand_buffer(payload, size);
+    libtest_create_file_with_contents(path, payload, size);
+    tr_free(payload);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(threads); ++i)
+    {
+        tr_metainfo_builder* builder = tr_metaInfoBuilderCreate(path);
+        uint64_t start;
+        uint64_t msec;
+
+        builder->hashThreads = threads[i];
+        start = tr_time_msec();
+        tr_makeMetaInfo(builder, torrent_file, NULL, 0, NULL, false);
+        wait_for_builder(builder);
+        msec = MAX(tr_time_msec() - start, 1);
+        check_int(builder->result, ==, TR_MAKEMETA_OK);
+
+        fprintf(stderr, "%d hashing threads: hashed %zu MiB in %.2f s (%.0f MiB/s)\n",
+            threads[i] > 0 ? threads[i] : (int)tr_getProcessorCount(), size >> 20, msec / 1000.0,
+            (size >> 20) * 1000.0 / msec);
+
+        tr_metaInfoBuilderFree(builder);
+    }
+
+    libtest_sandbox_destroy(sandbox);
+    tr_free(torrent_file);
+    tr_free(path);
+    tr_free(sandbox);
+    return 0;
+}
+
+#endif
+
 int main(void)
 {
     testFunc const tests[] =
     {
         test_single_file,
-        test_single_directory_random_payload
+        test_single_directory_random_payload,
+        test_concurrent_builders,
+        test_file_shrinks,
+#if SPEED_TEST
+        test_speed
+#endif
     };
 
     return runTests(tests, NUM_TESTS(tests));
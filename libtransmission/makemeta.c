@@ -13,7 +13,7 @@
 #include <event2/util.h> /* evutil_ascii_strcasecmp() */
 
 #include "transmission.h"
-#include "crypto-utils.h" /* tr_sha1 */
+#include "crypto-utils.h" /* tr_sha1_init(), tr_sha1_multi() */
 #include "error.h"
 #include "file.h"
 #include "log.h"
@@ -249,103 +249,360 @@ void tr_metaInfoBuilderFree(tr_metainfo_builder* builder)
 *****
 ****/
 
-static uint8_t* getHashInfo(tr_metainfo_builder* b)
+enum
 {
-    uint32_t fileIndex = 0;
-    uint8_t* ret = tr_new0(uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
-    uint8_t* walk = ret;
+    /* how much is read in one go. It's rounded down to whole pieces, and bigger
+     * pieces get bigger chunks so every hashing thread has a batch of pieces to work on */
+    HASH_CHUNK_BYTES = (4 * 1024 * 1024),
+    MAX_HASH_CHUNK_BYTES = (64 * 1024 * 1024)
+};
+
+/* a run of whole pieces that's been read into memory */
+struct hash_chunk
+{
+    struct hash_chunk* next;
     uint8_t* buf;
-    uint64_t totalRemain;
-    uint64_t off = 0;
+    uint32_t first_piece;
+    uint32_t piece_count;
+    uint32_t next_to_hash;
+    uint32_t pending;
+};
+
+/* the hashing threads working on one builder's pieces */
+struct hash_pool
+{
+    tr_metainfo_builder const* b;
+    uint8_t* hashes;
+    struct hash_chunk* queue;
+    struct hash_chunk* queueTail;
+    int threadLimit;
+    int threadCount;
+    tr_lock* lock;
+};
+
+/* must be called with the pool's lock held */
+static struct hash_chunk* claimPieces(struct hash_pool* pool, uint32_t* setme_index, uint32_t* setme_count)
+{
+    struct hash_chunk* chunk = pool->queue;
+
+    if (chunk != NULL)
+    {
+        /* as many as tr_sha1_multi() hashes at once, unless that would leave other threads idle */
+        uint32_t const batch = MIN((uint32_t)tr_sha1_multi_width(), MAX(chunk->piece_count / (uint32_t)pool->threadLimit, 1));
+
+        *setme_index = chunk->next_to_hash;
+        *setme_count = MIN(batch, chunk->piece_count - chunk->next_to_hash);
+        chunk->next_to_hash += *setme_count;
+
+        if (chunk->next_to_hash == chunk->piece_count)
+        {
+            pool->queue = chunk->next;
+
+            if (pool->queue == NULL)
+            {
+                pool->queueTail = NULL;
+            }
+        }
+    }
+
+    return chunk;
+}
+
+static void hashPieces(struct hash_pool* pool, tr_sha1_ctx_t sha, struct hash_chunk* chunk, uint32_t first, uint32_t count)
+{
+    tr_metainfo_builder const* b = pool->b;
+    tr_sha1_job jobs[TR_SHA1_MULTI_MAX];
+
+    TR_ASSERT(count <= TR_SHA1_MULTI_MAX);
+
+    for (uint32_t j = 0; j < count; ++j)
+    {
+        uint32_t const i = first + j;
+        uint32_t const piece = chunk->first_piece + i;
+
+        jobs[j].data = chunk->buf + (size_t)i * b->pieceSize;
+        jobs[j].data_length = (size_t)MIN(b->pieceSize, b->totalSize - (uint64_t)piece * b->pieceSize);
+        jobs[j].hash = pool->hashes + (size_t)piece * SHA_DIGEST_LENGTH;
+    }
+
+    tr_sha1_multi(sha, jobs, count);
+
+    tr_lockLock(pool->lock);
+    chunk->pending -= count;
+    tr_lockUnlock(pool->lock);
+}
+
+static void hashThreadFunc(void* vpool)
+{
+    struct hash_pool* pool = vpool;
+    tr_sha1_ctx_t sha = tr_sha1_init();
+
+    for (;;)
+    {
+        struct hash_chunk* chunk;
+        uint32_t i;
+        uint32_t n;
+
+        tr_lockLock(pool->lock);
+
+        if ((chunk = claimPieces(pool, &i, &n)) == NULL)
+        {
+            --pool->threadCount;
+            tr_lockUnlock(pool->lock);
+            break;
+        }
+
+        tr_lockUnlock(pool->lock);
+
+        hashPieces(pool, sha, chunk, i, n);
+    }
+
+    tr_sha1_final(sha, NULL);
+}
+
+static void enqueueChunk(struct hash_pool* pool, struct hash_chunk* chunk)
+{
+    chunk->next = NULL;
+    chunk->next_to_hash = 0;
+    chunk->pending = chunk->piece_count;
+
+    tr_lockLock(pool->lock);
+
+    if (pool->queueTail != NULL)
+    {
+        pool->queueTail->next = chunk;
+    }
+    else
+    {
+        pool->queue = chunk;
+    }
+
+    pool->queueTail = chunk;
+
+    while (pool->threadCount < pool->threadLimit)
+    {
+        ++pool->threadCount;
+        tr_threadNew(hashThreadFunc, pool);
+    }
+
+    tr_lockUnlock(pool->lock);
+}
+
+/* waits for a chunk to be hashed, helping out in the meantime */
+static void waitForChunk(struct hash_pool* pool, tr_sha1_ctx_t sha, struct hash_chunk* chunk)
+{
+    for (;;)
+    {
+        bool done;
+        uint32_t i;
+        uint32_t n;
+        struct hash_chunk* other = NULL;
+
+        tr_lockLock(pool->lock);
+        done = chunk->pending == 0;
+
+        if (!done)
+        {
+            other = claimPieces(pool, &i, &n);
+        }
+
+        tr_lockUnlock(pool->lock);
+
+        if (done)
+        {
+            break;
+        }
+
+        if (other != NULL)
+        {
+            hashPieces(pool, sha, other, i, n);
+        }
+        else
+        {
+            tr_wait_msec(1);
+        }
+    }
+}
+
+/* where the builder is reading from */
+struct hash_reader
+{
+    uint32_t fileIndex;
+    uint64_t fileOffset;
     tr_sys_file_t fd;
+};
+
+static bool readChunk(tr_metainfo_builder* b, struct hash_reader* reader, struct hash_chunk* chunk)
+{
+    uint64_t const begin = (uint64_t)chunk->first_piece * b->pieceSize;
+    uint64_t const len = MIN((uint64_t)chunk->piece_count * b->pieceSize, b->totalSize - begin);
     tr_error* error = NULL;
 
-    if (b->totalSize == 0)
+    for (uint64_t pos = 0; pos < len;)
     {
-        return ret;
-    }
+        uint64_t n_read = 0;
+        tr_metainfo_builder_file const* file = &b->files[reader->fileIndex];
 
-    buf = tr_valloc(b->pieceSize);
-    b->pieceIndex = 0;
-    totalRemain = b->totalSize;
-    fd = tr_sys_file_open(b->files[fileIndex].filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, &error);
+        if (reader->fileOffset == file->size)
+        {
+            /* on to the next file */
+            if (reader->fd != TR_BAD_SYS_FILE)
+            {
+                tr_sys_file_close(reader->fd, NULL);
+                reader->fd = TR_BAD_SYS_FILE;
+            }
+
+            ++reader->fileIndex;
+            reader->fileOffset = 0;
+            continue;
+        }
+
+        if (reader->fd == TR_BAD_SYS_FILE &&
+            (reader->fd = tr_sys_file_open(file->filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, &error)) ==
+            TR_BAD_SYS_FILE)
+        {
+            break;
+        }
+
+        if (!tr_sys_file_read(reader->fd, chunk->buf + pos, MIN(len - pos, file->size - reader->fileOffset), &n_read, &error))
+        {
+            break;
+        }
 
-    if (fd == TR_BAD_SYS_FILE)
+        if (n_read == 0)
+        {
+            /* the file's shorter than it was when the builder was created */
+            tr_error_set_literal(&error, EIO, tr_strerror(EIO));
+            break;
+        }
+
+        pos += n_read;
+        reader->fileOffset += n_read;
+    }
+
+    if (error != NULL)
     {
         b->my_errno = error->code;
-        tr_strlcpy(b->errfile, b->files[fileIndex].filename, sizeof(b->errfile));
+        tr_strlcpy(b->errfile, b->files[reader->fileIndex].filename, sizeof(b->errfile));
         b->result = TR_MAKEMETA_IO_READ;
-        tr_free(buf);
-        tr_free(ret);
         tr_error_free(error);
-        return NULL;
+        return false;
     }
 
-    while (totalRemain != 0)
+    return true;
+}
+
+/* Reads the files a chunk at a time, and hands each chunk to the
+ * hashing threads while it goes on to read the next one. */
+static uint8_t* getHashInfo(tr_metainfo_builder* b)
+{
+    bool ok = true;
+    uint8_t* ret = tr_new0(uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
+    uint32_t pieceIndex = 0;
+    struct hash_chunk chunks[2];
+    struct hash_chunk* prev = NULL;
+    struct hash_pool pool;
+    struct hash_reader reader;
+    tr_sha1_ctx_t sha;
+    uint64_t chunkBytes;
+    uint32_t piecesPerChunk;
+
+    if (b->totalSize == 0)
     {
-        TR_ASSERT(b->pieceIndex < b->pieceCount);
+        return ret;
+    }
+
+    pool.b = b;
+    pool.hashes = ret;
+    pool.queue = NULL;
+    pool.queueTail = NULL;
+    pool.threadLimit = b->hashThreads > 0 ? b->hashThreads : (int)tr_getProcessorCount();
+    pool.threadCount = 0;
+    pool.lock = tr_lockNew();
 
-        uint8_t* bufptr = buf;
-        uint32_t const thisPieceSize = (uint32_t)MIN(b->pieceSize, totalRemain);
-        uint64_t leftInPiece = thisPieceSize;
+    chunkBytes = MIN(MAX((uint64_t)HASH_CHUNK_BYTES, (uint64_t)pool.threadLimit * tr_sha1_multi_width() * b->pieceSize),
+        (uint64_t)MAX_HASH_CHUNK_BYTES);
+    piecesPerChunk = MAX(chunkBytes / b->pieceSize, 1);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        chunks[i].buf = tr_valloc((size_t)piecesPerChunk * b->pieceSize);
+    }
 
-        while (leftInPiece != 0)
+    reader.fileIndex = 0;
+    reader.fileOffset = 0;
+    reader.fd = TR_BAD_SYS_FILE;
+    sha = tr_sha1_init();
+    b->pieceIndex = 0;
+
+    while (ok && pieceIndex < b->pieceCount)
+    {
+        struct hash_chunk* chunk = prev == &chunks[0] ? &chunks[1] : &chunks[0];
+
+        chunk->first_piece = pieceIndex;
+        chunk->piece_count = MIN(piecesPerChunk, b->pieceCount - pieceIndex);
+
+        if ((ok = readChunk(b, &reader, chunk)))
         {
-            uint64_t const n_this_pass = MIN(b->files[fileIndex].size - off, leftInPiece);
-            uint64_t n_read = 0;
-            tr_sys_file_read(fd, bufptr, n_this_pass, &n_read, NULL);
-            bufptr += n_read;
-            off += n_read;
-            leftInPiece -= n_read;
-
-            if (off == b->files[fileIndex].size)
-            {
-                off = 0;
-                tr_sys_file_close(fd, NULL);
-                fd = TR_BAD_SYS_FILE;
+            enqueueChunk(&pool, chunk);
+        }
 
-                if (++fileIndex < b->fileCount)
-                {
-                    fd = tr_sys_file_open(b->files[fileIndex].filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, &error);
-
-                    if (fd == TR_BAD_SYS_FILE)
-                    {
-                        b->my_errno = error->code;
-                        tr_strlcpy(b->errfile, b->files[fileIndex].filename, sizeof(b->errfile));
-                        b->result = TR_MAKEMETA_IO_READ;
-                        tr_free(buf);
-                        tr_free(ret);
-                        tr_error_free(error);
-                        return NULL;
-                    }
-                }
-            }
+        if (prev != NULL)
+        {
+            waitForChunk(&pool, sha, prev);
+            b->pieceIndex = prev->first_piece + prev->piece_count;
         }
 
-        TR_ASSERT(bufptr - buf == (int)thisPieceSize);
-        TR_ASSERT(leftInPiece == 0);
-        tr_sha1(walk, buf, (int)thisPieceSize, NULL);
-        walk += SHA_DIGEST_LENGTH;
+        prev = ok ? chunk : NULL;
+        pieceIndex += chunk->piece_count;
 
         if (b->abortFlag)
         {
             b->result = TR_MAKEMETA_CANCELLED;
             break;
         }
+    }
 
-        totalRemain -= thisPieceSize;
-        ++b->pieceIndex;
+    if (prev != NULL)
+    {
+        waitForChunk(&pool, sha, prev);
+        b->pieceIndex = prev->first_piece + prev->piece_count;
     }
 
-    TR_ASSERT(b->abortFlag || walk - ret == (int)(SHA_DIGEST_LENGTH * b->pieceCount));
-    TR_ASSERT(b->abortFlag || !totalRemain);
+    TR_ASSERT(!ok || b->abortFlag || b->pieceIndex == b->pieceCount);
+
+    /* the hashing threads still use the pool until they notice there's nothing left to do */
+    tr_lockLock(pool.lock);
 
-    if (fd != TR_BAD_SYS_FILE)
+    while (pool.threadCount > 0)
     {
-        tr_sys_file_close(fd, NULL);
+        tr_lockUnlock(pool.lock);
+        tr_wait_msec(1);
+        tr_lockLock(pool.lock);
+    }
+
+    tr_lockUnlock(pool.lock);
+
+    /* cleanup */
+    if (reader.fd != TR_BAD_SYS_FILE)
+    {
+        tr_sys_file_close(reader.fd, NULL);
+    }
+
+    tr_sha1_final(sha, NULL);
+    tr_lockFree(pool.lock);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        free(chunks[i].buf);
+    }
+
+    if (!ok)
+    {
+        tr_free(ret);
+        ret = NULL;
     }
 
-    tr_free(buf);
     return ret;
 }
 
@@ -514,61 +771,18 @@ static void tr_realMakeMetaInfo(tr_metainfo_builder* builder)
 
 /***
 ****
-****  A threaded builder queue
+****  Threaded builders
 ****
 ***/
 
-static tr_metainfo_builder* queue = NULL;
-
-static tr_thread* workerThread = NULL;
-
-static tr_lock* getQueueLock(void)
-{
-    static tr_lock* lock = NULL;
-
-    if (lock == NULL)
-    {
-        lock = tr_lockNew();
-    }
-
-    return lock;
-}
-
-static void makeMetaWorkerFunc(void* unused UNUSED)
+static void makeMetaWorkerFunc(void* vbuilder)
 {
-    for (;;)
-    {
-        tr_metainfo_builder* builder = NULL;
-
-        /* find the next builder to process */
-        tr_lock* lock = getQueueLock();
-        tr_lockLock(lock);
-
-        if (queue != NULL)
-        {
-            builder = queue;
-            queue = queue->nextBuilder;
-        }
-
-        tr_lockUnlock(lock);
-
-        /* if no builders, this worker thread is done */
-        if (builder == NULL)
-        {
-            break;
-        }
-
-        tr_realMakeMetaInfo(builder);
-    }
-
-    workerThread = NULL;
+    tr_realMakeMetaInfo(vbuilder);
 }
 
 void tr_makeMetaInfo(tr_metainfo_builder* builder, char const* outputFile, tr_tracker_info const* trackers, int trackerCount,
     char const* comment, bool isPrivate)
 {
-    tr_lock* lock;
-
     /* free any variables from a previous run */
     for (int i = 0; i < builder->trackerCount; ++i)
     {
@@ -605,16 +819,6 @@ void tr_makeMetaInfo(tr_metainfo_builder* builder, char const* outputFile, tr_tr
         builder->outputFile = tr_strdup_printf("%s.torrent", builder->top);
     }
 
-    /* enqueue the builder */
-    lock = getQueueLock();
-    tr_lockLock(lock);
-    builder->nextBuilder = queue;
-    queue = builder;
-
-    if (workerThread == NULL)
-    {
-        workerThread = tr_threadNew(makeMetaWorkerFunc, NULL);
-    }
-
-    tr_lockUnlock(lock);
+    /* each builder gets a thread of its own, so that several can run at once */
+    tr_threadNew(makeMetaWorkerFunc, builder);
 }
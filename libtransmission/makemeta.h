@@ -45,6 +45,10 @@ typedef struct tr_metainfo_builder
     uint32_t pieceCount;
     bool isFolder;
 
+    /* How many threads hash the pieces, or 0 for one per processor.
+     * This can be changed before tr_makeMetaInfo() is called. */
+    int hashThreads;
+
     /**
     ***  These are set inside tr_makeMetaInfo()
     ***  by copying the arguments passed to it,
@@ -75,13 +79,6 @@ typedef struct tr_metainfo_builder
 
     /* errno encountered when result was set to _IO_READ or _IO_WRITE */
     int my_errno;
-
-    /**
-    ***  This is an implementation detail.
-    ***  The client should never use these fields.
-    **/
-
-    struct tr_metainfo_builder* nextBuilder;
 }
 tr_metainfo_builder;
 
@@ -102,6 +99,7 @@ void tr_metaInfoBuilderFree(tr_metainfo_builder*);
  *
  * This is actually done in a worker thread, not the main thread!
  * Otherwise the client's interface would lock up while this runs.
+ * Each builder has a thread of its own, so several can run at once.
  *
  * It is the caller's responsibility to poll builder->isDone
  * from time to time!  When the worker thread sets that flag,
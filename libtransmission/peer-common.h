@@ -151,6 +151,10 @@ typedef struct tr_swarm_stats
     int activeWebseedCount;
     int peerCount;
     int peerFromCount[TR_PEER_FROM__MAX];
+
+    /* how many peer addresses we know of, and how much memory they use */
+    int atomCount;
+    size_t atomBytes;
 }
 tr_swarm_stats;
 
@@ -252,6 +252,12 @@ static inline bool tr_peerIoIsEncrypted(tr_peerIo const* io)
     return io != NULL && io->encryption_type == PEER_ENCRYPTION_RC4;
 }
 
+/* file segments can only be sent as they are, straight to a TCP socket */
+static inline bool tr_peerIoSupportsSendfile(tr_peerIo const* io)
+{
+    return io->socket.type == TR_PEER_SOCKET_TYPE_TCP && io->encryption_type == PEER_ENCRYPTION_NONE;
+}
+
 void evbuffer_add_uint8(struct evbuffer* outbuf, uint8_t byte);
 void evbuffer_add_uint16(struct evbuffer* outbuf, uint16_t hs);
 void evbuffer_add_uint32(struct evbuffer* outbuf, uint32_t hl);
@@ -0,0 +1,692 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <string.h> /* memcmp(), memcpy(), memset() */
+#include <time.h> /* time() */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "crypto-utils.h" /* tr_rand_buffer(), tr_rand_int_weak() */
+#include "net.h"
+#include "peer-mgr.h"
+#include "platform.h" /* tr_wait_msec() */
+#include "tr-assert.h"
+#include "utils.h"
+#include "variant.h"
+
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
+#include "libtransmission-test.h"
+
+static int test_super_seed_pick(void)
+{
+    size_t const pieceCount = 8;
+    uint16_t replication[] = { 0, 0, 1, 0, 2, 0, 0, 0 };
+    uint16_t offers[] = { 1, 0, 0, 0, 0, 0, 0, 0 };
+    tr_bitfield have;
+    tr_bitfield revealed;
+    tr_piece_index_t piece;
+
+    tr_bitfieldConstruct(&have, pieceCount);
+    tr_bitfieldConstruct(&revealed, pieceCount);
+
+    /* piece 0 was already offered to someone else, so piece 1 is the rarest */
+    check(tr_peerMgrGetNextSuperSeedPiece(pieceCount, replication, offers, &have, &revealed, &piece));
+    check_uint(piece, ==, 1);
+
+    /* don't offer pieces the peer has or was already shown */
+    tr_bitfieldAdd(&have, 1);
+    tr_bitfieldAdd(&revealed, 3);
+    check(tr_peerMgrGetNextSuperSeedPiece(pieceCount, replication, offers, &have, &revealed, &piece));
+    check_uint(piece, ==, 5);
+
+    /* when everything has been seen, fall back to the least replicated */
+    tr_bitfieldAddRange(&revealed, 5, 8);
+    check(tr_peerMgrGetNextSuperSeedPiece(pieceCount, replication, offers, &have, &revealed, &piece));
+    check_uint(piece, ==, 0);
+
+    /* no replication info means every unrevealed piece is equally rare */
+    check(tr_peerMgrGetNextSuperSeedPiece(pieceCount, NULL, NULL, &have, &revealed, &piece));
+    check_uint(piece, ==, 0);
+
+    /* nothing left to reveal */
+    tr_bitfieldAddRange(&revealed, 0, 8);
+    check(!tr_peerMgrGetNextSuperSeedPiece(pieceCount, replication, offers, &have, &revealed, &piece));
+
+    tr_bitfieldDestruct(&revealed);
+    tr_bitfieldDestruct(&have);
+    return 0;
+}
+
+/***
+****  A bare-bones BitTorrent peer that talks to the session over loopback
+***/
+
+/* Makes a single-file torrent. If `data' isn't NULL, the pieces are its hashes,
+ * and if `populate' is true it's written to the torrent's file too. */
+static tr_torrent* peer_torrent_init_full(tr_session* session, int n, uint32_t pieceSize, size_t pieceCount,
+    uint8_t const* data, bool populate)
+{
+    uint8_t* pieces = tr_new0(uint8_t, pieceCount * SHA_DIGEST_LENGTH);
+    char name[32];
+    tr_variant top;
+    tr_variant* info;
+    char* metainfo;
+    size_t metainfo_len;
+    tr_ctor* ctor;
+    tr_torrent* tor;
+    int err = 0;
+
+    tr_snprintf(name, sizeof(name), "peer-mgr-test-%d", n);
+
+    for (size_t i = 0; data != NULL && i < pieceCount; ++i)
+    {
+        tr_sha1(pieces + i * SHA_DIGEST_LENGTH, data + i * pieceSize, (int)pieceSize, NULL);
+    }
+
+    if (populate)
+    {
+        char* path = tr_buildPath(tr_sessionGetDownloadDir(session), name, NULL);
+        libtest_create_file_with_contents(path, data, (size_t)pieceSize * pieceCount);
+        tr_free(path);
+    }
+
+    tr_variantInitDict(&top, 1);
+    info = tr_variantDictAddDict(&top, TR_KEY_info, 4);
+    tr_variantDictAddStr(info, TR_KEY_name, name);
+    tr_variantDictAddInt(info, TR_KEY_piece_length, pieceSize);
+    tr_variantDictAddInt(info, TR_KEY_length, (int64_t)pieceSize * pieceCount);
+    tr_variantDictAddRaw(info, TR_KEY_pieces, pieces, pieceCount * SHA_DIGEST_LENGTH);
+    metainfo = tr_variantToStr(&top, TR_VARIANT_FMT_BENC, &metainfo_len);
+
+    ctor = tr_ctorNew(session);
+    tr_ctorSetMetainfo(ctor, (uint8_t*)metainfo, metainfo_len);
+    tr_ctorSetPaused(ctor, TR_FORCE, true);
+    tor = tr_torrentNew(ctor, &err, NULL);
+    TR_ASSERT(err == 0);
+
+    libttest_blockingTorrentVerify(tor);
+
+    tr_ctorFree(ctor);
+    tr_free(metainfo);
+    tr_variantFree(&top);
+    tr_free(pieces);
+    return tor;
+}
+
+static tr_torrent* peer_torrent_init(tr_session* session, int n)
+{
+    return peer_torrent_init_full(session, n, 32768, 2, NULL, false);
+}
+
+static bool wait_for(bool (* test)(tr_torrent*), tr_torrent* tor)
+{
+    time_t const deadline = time(NULL) + 10;
+
+    while (!test(tor))
+    {
+        if (time(NULL) > deadline)
+        {
+            return false;
+        }
+
+        tr_wait_msec(10);
+    }
+
+    return true;
+}
+
+static bool torrent_is_running(tr_torrent* tor)
+{
+    return tr_torrentStat(tor)->activity != TR_STATUS_STOPPED;
+}
+
+static bool torrent_has_interested_peer(tr_torrent* tor)
+{
+    int peerCount;
+    tr_peer_stat* peers = tr_torrentPeers(tor, &peerCount);
+    bool ret = peerCount > 0 && peers[0].peerIsInterested;
+
+    tr_torrentPeersFree(peers, peerCount);
+    return ret;
+}
+
+static bool peer_wait_readable(tr_socket_t sock)
+{
+    fd_set fds;
+    struct timeval tv = { .tv_sec = 10, .tv_usec = 0 };
+
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+
+    return select(sock + 1, &fds, NULL, NULL, &tv) == 1;
+}
+
+static bool peer_recv(tr_socket_t sock, void* buf, size_t len)
+{
+    for (size_t n = 0; n < len;)
+    {
+        int r;
+
+        if (!peer_wait_readable(sock) || (r = recv(sock, (char*)buf + n, len - n, 0)) <= 0)
+        {
+            return false;
+        }
+
+        n += r;
+    }
+
+    return true;
+}
+
+static bool peer_send(tr_socket_t sock, void const* buf, size_t len)
+{
+    return send(sock, buf, len, 0) == (int)len;
+}
+
+/* connect to the session, do a plaintext handshake for tor, and say we're interested */
+static tr_socket_t peer_connect(tr_session* session, tr_torrent* tor)
+{
+    static uint8_t const interested[] = { 0, 0, 0, 1, 2 };
+    uint8_t handshake[68];
+    uint8_t reply[68];
+    struct sockaddr_in sin;
+    tr_socket_t sock;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(tr_sessionGetPeerPort(session));
+
+    handshake[0] = 19;
+    memcpy(handshake + 1, "BitTorrent protocol", 19);
+    memset(handshake + 20, 0, 8);
+    memcpy(handshake + 28, tr_torrentInfo(tor)->hash, SHA_DIGEST_LENGTH);
+    memcpy(handshake + 48, "-TT0000-", 8);
+    tr_rand_buffer(handshake + 56, 12);
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == TR_BAD_SOCKET)
+    {
+        return TR_BAD_SOCKET;
+    }
+
+    if (connect(sock, (struct sockaddr*)&sin, sizeof(sin)) != 0 ||
+        !peer_send(sock, handshake, sizeof(handshake)) ||
+        !peer_recv(sock, reply, sizeof(reply)) ||
+        memcmp(reply + 28, handshake + 28, SHA_DIGEST_LENGTH) != 0 ||
+        !peer_send(sock, interested, sizeof(interested)))
+    {
+        tr_netCloseSocket(sock);
+        return TR_BAD_SOCKET;
+    }
+
+    return sock;
+}
+
+static void peer_put_uint32(uint8_t* buf, uint32_t val)
+{
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+static uint32_t peer_get_uint32(uint8_t const* buf)
+{
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+}
+
+/* reads the next message that isn't a keepalive into `msg', which is grown as needed.
+ * returns the message's length, or 0 on error */
+static uint32_t peer_recv_message(tr_socket_t sock, uint8_t** msg, uint32_t* msg_alloc)
+{
+    uint8_t len[4];
+    uint32_t msglen = 0;
+
+    while (msglen == 0)
+    {
+        if (!peer_recv(sock, len, sizeof(len)))
+        {
+            return 0;
+        }
+
+        msglen = peer_get_uint32(len);
+    }
+
+    if (msglen > *msg_alloc)
+    {
+        *msg_alloc = msglen;
+        *msg = tr_renew(uint8_t, *msg, msglen);
+    }
+
+    return peer_recv(sock, *msg, msglen) ? msglen : 0;
+}
+
+/* read messages until an unchoke turns up */
+static bool peer_wait_for_unchoke(tr_socket_t sock)
+{
+    uint8_t* msg = NULL;
+    uint32_t msg_alloc = 0;
+    uint32_t msglen;
+
+    while ((msglen = peer_recv_message(sock, &msg, &msg_alloc)) != 0 && !(msglen == 1 && msg[0] == 1))
+    {
+    }
+
+    tr_free(msg);
+    return msglen != 0;
+}
+
+/* The session's upload slots are handed out from one array of every
+ * running torrent's peers. Put interested peers in several torrents,
+ * so that the array has to grow while it's being filled. */
+static int test_upload_slots_across_torrents(void)
+{
+    enum
+    {
+        TORRENT_COUNT = 3
+    };
+
+    tr_variant settings;
+    tr_session* session;
+    tr_torrent* tors[TORRENT_COUNT];
+    tr_socket_t socks[TORRENT_COUNT];
+    tr_torrent* spare;
+
+    tr_variantInitDict(&settings, 1);
+    tr_variantDictAddInt(&settings, TR_KEY_peer_port, 40000 + tr_rand_int_weak(20000));
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+
+    for (int i = 0; i < TORRENT_COUNT; ++i)
+    {
+        tors[i] = peer_torrent_init(session, i);
+        tr_torrentStart(tors[i]);
+        check(wait_for(torrent_is_running, tors[i]));
+    }
+
+    for (int i = 0; i < TORRENT_COUNT; ++i)
+    {
+        socks[i] = peer_connect(session, tors[i]);
+        check(socks[i] != TR_BAD_SOCKET);
+        check(wait_for(torrent_has_interested_peer, tors[i]));
+    }
+
+    /* starting a torrent rechokes the session, and
+     * there are slots enough for every interested peer */
+    spare = peer_torrent_init(session, TORRENT_COUNT);
+    tr_torrentStart(spare);
+
+    for (int i = 0; i < TORRENT_COUNT; ++i)
+    {
+        check(peer_wait_for_unchoke(socks[i]));
+        tr_netCloseSocket(socks[i]);
+    }
+
+    libttest_session_close(session);
+    return 0;
+}
+
+/* A super-seeding seed must only tell a leecher about the pieces it
+ * reveals to it, and must refuse requests for the others. */
+static int test_super_seed_reveal(void)
+{
+    enum
+    {
+        PIECE_SIZE = 32768,
+        PIECE_COUNT = 4,
+        BLOCK_SIZE = 16384
+    };
+
+    static uint8_t const no_pieces[] = { 0, 0, 0, 2, 5, 0 };
+    tr_variant settings;
+    tr_session* session;
+    uint8_t* data;
+    tr_torrent* tor;
+    tr_torrent* spare;
+    tr_socket_t sock;
+    uint8_t* msg = NULL;
+    uint32_t msg_alloc = 0;
+    uint32_t msglen;
+    bool unchoked = false;
+    int haveCount = 0;
+    tr_piece_index_t revealed = 0;
+    tr_piece_index_t hidden;
+    uint8_t req[17];
+
+    tr_variantInitDict(&settings, 1);
+    tr_variantDictAddInt(&settings, TR_KEY_peer_port, 40000 + tr_rand_int_weak(20000));
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+
+    data = tr_new(uint8_t, PIECE_SIZE * PIECE_COUNT);
+    tr_rand_buffer(data, PIECE_SIZE * PIECE_COUNT);
+    tor = peer_torrent_init_full(session, 0, PIECE_SIZE, PIECE_COUNT, data, true);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+    tr_torrentUseSuperSeeding(tor, true);
+    tr_torrentStart(tor);
+    check(wait_for(torrent_is_running, tor));
+    check(tr_torrentStat(tor)->isSuperSeeding);
+
+    /* tell the seed we have nothing, and wait to be unchoked and shown a piece */
+    sock = peer_connect(session, tor);
+    check(sock != TR_BAD_SOCKET);
+    check(peer_send(sock, no_pieces, sizeof(no_pieces)));
+    check(wait_for(torrent_has_interested_peer, tor));
+    spare = peer_torrent_init(session, 1);
+    tr_torrentStart(spare);
+
+    while (!unchoked || haveCount == 0)
+    {
+        check_uint((msglen = peer_recv_message(sock, &msg, &msg_alloc)), !=, 0);
+
+        /* no bitfield or HAVE_ALL */
+        check_uint(msg[0], !=, 5);
+        check_uint(msg[0], !=, 14);
+
+        if (msg[0] == 1)
+        {
+            unchoked = true;
+        }
+        else if (msg[0] == 4)
+        {
+            check_uint(msglen, ==, 5);
+            revealed = peer_get_uint32(msg + 1);
+            check_uint(revealed, <, PIECE_COUNT);
+            ++haveCount;
+        }
+    }
+
+    check_int(haveCount, ==, 1);
+    hidden = (revealed + 1) % PIECE_COUNT;
+
+    /* ask for a hidden piece first; only the revealed one comes back */
+    peer_put_uint32(req, 13);
+    req[4] = 6;
+    peer_put_uint32(req + 5, hidden);
+    peer_put_uint32(req + 9, 0);
+    peer_put_uint32(req + 13, BLOCK_SIZE);
+    check(peer_send(sock, req, sizeof(req)));
+    peer_put_uint32(req + 5, revealed);
+    check(peer_send(sock, req, sizeof(req)));
+
+    do
+    {
+        check_uint((msglen = peer_recv_message(sock, &msg, &msg_alloc)), !=, 0);
+        check_uint(msg[0], !=, 4);
+    }
+    while (msg[0] != 7);
+
+    check_uint(msglen, ==, 9 + BLOCK_SIZE);
+    check_uint(peer_get_uint32(msg + 1), ==, revealed);
+    check_mem(msg + 9, ==, data + revealed * PIECE_SIZE, BLOCK_SIZE);
+
+    /* turning super-seeding off reveals the rest */
+    tr_torrentUseSuperSeeding(tor, false);
+
+    for (haveCount = 1; haveCount < PIECE_COUNT;)
+    {
+        check_uint((msglen = peer_recv_message(sock, &msg, &msg_alloc)), !=, 0);
+
+        if (msg[0] == 4)
+        {
+            check_uint(peer_get_uint32(msg + 1), !=, revealed);
+            ++haveCount;
+        }
+    }
+
+    /* turning it back on drops us, since we already know about every piece */
+    tr_torrentUseSuperSeeding(tor, true);
+
+    while (peer_recv_message(sock, &msg, &msg_alloc) != 0)
+    {
+    }
+
+    check(!torrent_has_interested_peer(tor));
+
+    tr_netCloseSocket(sock);
+    tr_free(msg);
+    tr_free(data);
+    libttest_session_close(session);
+    return 0;
+}
+
+#if SPEED_TEST
+
+static double thread_cpu_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* how long a seed takes to upload a whole torrent to one peer over loopback,
+ * and how much of the session's CPU time that takes per GiB */
+static int test_seed_speed(void)
+{
+    enum
+    {
+        PIECE_SIZE = 256 * 1024,
+        PIECE_COUNT = 256,
+        BLOCK_SIZE = 16 * 1024,
+        PIPELINE = 500,
+        ROUNDS = 3
+    };
+
+    size_t const total = (size_t)PIECE_SIZE * PIECE_COUNT;
+    uint32_t const blockCount = total / BLOCK_SIZE;
+    tr_variant settings;
+    tr_session* session;
+    uint8_t* data;
+    tr_torrent* tor;
+    tr_torrent* spare;
+    tr_socket_t sock;
+    uint8_t* msg = NULL;
+    uint32_t msg_alloc = 0;
+
+    tr_variantInitDict(&settings, 1);
+    tr_variantDictAddInt(&settings, TR_KEY_peer_port, 40000 + tr_rand_int_weak(20000));
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+
+    data = tr_valloc(total);
+    tr_rand_buffer(data, total);
+    tor = peer_torrent_init_full(session, 0, PIECE_SIZE, PIECE_COUNT, data, true);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+    tr_torrentStart(tor);
+    check(wait_for(torrent_is_running, tor));
+
+    sock = peer_connect(session, tor);
+    check(sock != TR_BAD_SOCKET);
+    check(wait_for(torrent_has_interested_peer, tor));
+    spare = peer_torrent_init(session, 1);
+    tr_torrentStart(spare);
+    check(peer_wait_for_unchoke(sock));
+
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        uint64_t const startMsec = tr_time_msec();
+        clock_t const startCpu = clock();
+        double const startPeerCpu = thread_cpu_seconds();
+        uint32_t sent = 0;
+        uint32_t received = 0;
+        double wall;
+        double cpu;
+
+        while (received < blockCount)
+        {
+            uint32_t msglen;
+
+            for (; sent < blockCount && sent - received < PIPELINE; ++sent)
+            {
+                uint8_t req[17];
+
+                peer_put_uint32(req, 13);
+                req[4] = 6;
+                peer_put_uint32(req + 5, sent / (PIECE_SIZE / BLOCK_SIZE));
+                peer_put_uint32(req + 9, (sent % (PIECE_SIZE / BLOCK_SIZE)) * BLOCK_SIZE);
+                peer_put_uint32(req + 13, BLOCK_SIZE);
+                check(peer_send(sock, req, sizeof(req)));
+            }
+
+            check_uint((msglen = peer_recv_message(sock, &msg, &msg_alloc)), !=, 0);
+
+            if (msg[0] == 7)
+            {
+                check_uint(msglen, ==, 9 + BLOCK_SIZE);
+                ++received;
+            }
+        }
+
+        /* leave out the test peer's own work */
+        wall = (tr_time_msec() - startMsec) / 1000.0;
+        cpu = (double)(clock() - startCpu) / CLOCKS_PER_SEC - (thread_cpu_seconds() - startPeerCpu);
+        fprintf(stderr, "seeding %zu MiB over loopback: %.2f s, %.1f MiB/s, %.2f CPU s/GiB\n", total >> 20, wall,
+            (total >> 20) / wall, cpu * (1 << 30) / total);
+    }
+
+    tr_netCloseSocket(sock);
+    tr_free(msg);
+    tr_free(data);
+    libttest_session_close(session);
+    return 0;
+}
+
+static bool torrent_is_done(tr_torrent* tor)
+{
+    return tr_torrentStat(tor)->leftUntilDone == 0;
+}
+
+/* how much of the session's CPU time it takes to download a torrent
+ * from one peer over loopback, per GiB */
+static int test_download_speed(void)
+{
+    enum
+    {
+        PIECE_SIZE = 256 * 1024,
+        PIECE_COUNT = 256,
+        ROUNDS = 3
+    };
+
+    size_t const total = (size_t)PIECE_SIZE * PIECE_COUNT;
+    tr_variant settings;
+    tr_session* session;
+    uint8_t* data;
+    uint8_t* msg = NULL;
+    uint32_t msg_alloc = 0;
+
+    tr_variantInitDict(&settings, 1);
+    tr_variantDictAddInt(&settings, TR_KEY_peer_port, 40000 + tr_rand_int_weak(20000));
+    session = libttest_session_init(&settings);
+    tr_variantFree(&settings);
+
+    data = tr_valloc(total);
+    tr_rand_buffer(data, total);
+
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        uint8_t bitfield[5 + PIECE_COUNT / 8];
+        static uint8_t const unchoke[] = { 0, 0, 0, 1, 1 };
+        tr_torrent* tor = peer_torrent_init_full(session, round, PIECE_SIZE, PIECE_COUNT, data, false);
+        tr_socket_t sock;
+        uint64_t startMsec;
+        clock_t startCpu;
+        double startPeerCpu;
+        double wall;
+        double cpu;
+
+        check_uint(tr_torrentStat(tor)->leftUntilDone, ==, total);
+        tr_torrentStart(tor);
+        check(wait_for(torrent_is_running, tor));
+        check((sock = peer_connect(session, tor)) != TR_BAD_SOCKET);
+
+        startMsec = tr_time_msec();
+        startCpu = clock();
+        startPeerCpu = thread_cpu_seconds();
+
+        /* we have everything, and the session can ask for it */
+        peer_put_uint32(bitfield, 1 + PIECE_COUNT / 8);
+        bitfield[4] = 5;
+        memset(bitfield + 5, 0xff, PIECE_COUNT / 8);
+        check(peer_send(sock, bitfield, sizeof(bitfield)));
+        check(peer_send(sock, unchoke, sizeof(unchoke)));
+
+        while (!torrent_is_done(tor))
+        {
+            uint32_t msglen;
+            fd_set fds;
+            struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+
+            FD_ZERO(&fds);
+            FD_SET(sock, &fds);
+
+            if (select(sock + 1, &fds, NULL, NULL, &tv) != 1)
+            {
+                continue;
+            }
+
+            if ((msglen = peer_recv_message(sock, &msg, &msg_alloc)) == 0)
+            {
+                break;
+            }
+
+            if (msglen == 13 && msg[0] == 6)
+            {
+                uint32_t const index = peer_get_uint32(msg + 1);
+                uint32_t const begin = peer_get_uint32(msg + 5);
+                uint32_t const length = peer_get_uint32(msg + 9);
+                uint8_t header[13];
+
+                peer_put_uint32(header, 9 + length);
+                header[4] = 7;
+                peer_put_uint32(header + 5, index);
+                peer_put_uint32(header + 9, begin);
+                check(peer_send(sock, header, sizeof(header)));
+                check(peer_send(sock, data + (size_t)index * PIECE_SIZE + begin, length));
+            }
+        }
+
+        /* leave out the test peer's own work */
+        wall = (tr_time_msec() - startMsec) / 1000.0;
+        cpu = (double)(clock() - startCpu) / CLOCKS_PER_SEC - (thread_cpu_seconds() - startPeerCpu);
+        check(wait_for(torrent_is_done, tor));
+        fprintf(stderr, "downloading %zu MiB over loopback: %.2f s, %.1f MiB/s, %.2f CPU s/GiB\n", total >> 20, wall,
+            (total >> 20) / wall, cpu * (1 << 30) / total);
+
+        tr_netCloseSocket(sock);
+        tr_torrentRemove(tor, true, NULL);
+    }
+
+    tr_free(msg);
+    tr_free(data);
+    libttest_session_close(session);
+    return 0;
+}
+
+#endif
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_super_seed_pick,
+        test_upload_slots_across_torrents,
+        test_super_seed_reveal,
+#if SPEED_TEST
+        test_seed_speed,
+        test_download_speed
+#endif
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
@@ -23,6 +23,7 @@
 #include "clients.h"
 #include "completion.h"
 #include "crypto-utils.h"
+#include "disk-io.h" /* tr_diskIoIsBacklogged() */
 #include "handshake.h"
 #include "log.h"
 #include "net.h"
@@ -47,6 +48,12 @@ enum
     /* an optimistically unchoked peer is immune from rechoking
        for this many calls to rechokeUploads(). */
     OPTIMISTIC_UNCHOKE_MULTIPLIER = 4,
+    /* when our upload speed is limited, don't hand out more upload
+       slots than could each get this much of it */
+    UPLOAD_SLOT_MIN_SPEED_Bps = (8 * 1024),
+    /* added to a peer's rate when deciding whether to unchoke it,
+       so that idle peers still compete on need and priority */
+    UNCHOKE_RATE_FLOOR_Bps = 1024,
     /* how frequently to reallocate bandwidth */
     BANDWIDTH_PERIOD_MSEC = 500,
     /* how frequently to age out old piece request lists */
@@ -69,10 +76,6 @@ enum
     PIECE_LIST_SHELF_LIFE_SECS = 60,
     /* use for bitwise operations w/peer_atom.flags2 */
     MYFLAG_BANNED = 1,
-    /* use for bitwise operations w/peer_atom.flags2 */
-    /* unreachable for now... but not banned.
-     * if they try to connect to us it's okay */
-    MYFLAG_UNREACHABLE = 2,
     /* the minimum we'll wait before attempting to reconnect to a peer */
     MINIMUM_RECONNECT_INTERVAL_SECS = 5,
     /** how long we'll let requests we've made linger before we cancel them */
@@ -99,13 +102,62 @@ tr_swarm_stats const TR_SWARM_STATS_INIT =
     .activePeerCount = { 0, 0 },
     .activeWebseedCount = 0,
     .peerCount = 0,
-    .peerFromCount = { 0, 0, 0, 0, 0, 0, 0 }
+    .peerFromCount = { 0, 0, 0, 0, 0, 0, 0 },
+    .atomCount = 0,
+    .atomBytes = 0
 };
 
 /**
 ***
 **/
 
+/**
+ * A binary min-heap of peer_atoms, ordered by each atom's queueKey.
+ * @see atomQueueUpdate()
+ */
+struct atom_heap
+{
+    struct peer_atom** items;
+    int n;
+    int alloc;
+};
+
+/**
+ * An open-addressed hash table (with linear probing) of structs whose
+ * first member is the tr_address they're keyed by.
+ */
+struct addr_index
+{
+    void** items;
+    size_t size; /* zero or a power of two */
+    size_t count;
+};
+
+/**
+ * Facts about a remote address that don't depend on which torrent we're
+ * talking to it about. They're kept in a session-wide directory and shared
+ * by every swarm's atom for that address, so that e.g. finding out in one
+ * torrent that an address is unreachable makes the others back off too.
+ */
+struct peer_endpoint
+{
+    tr_address addr;
+
+    uint8_t flags; /* added_f flags we've learned by connecting to it */
+    int8_t blocklisted; /* -1 for unknown, true for blocklisted, false for not blocklisted */
+    bool utp_failed; /* We recently failed to connect over uTP */
+
+    /* unreachable for now... but not banned.
+     * if they try to connect to us it's okay */
+    bool unreachable;
+    uint32_t lastFailureAt;
+
+    tr_quark client; /* the client it was running the last time we connected */
+    uint32_t speed_Bps; /* how fast it was the last time we connected */
+
+    int refCount; /* how many atoms are using it */
+};
+
 /**
  * Peer information that should be kept even before we've connected and
  * after we've disconnected. These are kept in a pool of peer_atoms to decide
@@ -117,27 +169,56 @@ tr_swarm_stats const TR_SWARM_STATS_INIT =
  */
 struct peer_atom
 {
+    tr_address addr;
+    tr_port port;
+
     uint8_t fromFirst; /* where the peer was first found */
     uint8_t fromBest; /* the "best" value of where the peer has been found */
     uint8_t flags; /* these match the added_f flags */
     uint8_t flags2; /* flags that aren't defined in added_f */
     int8_t seedProbability; /* how likely is this to be a seed... [0..100] or -1 for unknown */
-    int8_t blocklisted; /* -1 for unknown, true for blocklisted, false for not blocklisted */
-
-    tr_port port;
-    bool utp_failed; /* We recently failed to connect over uTP */
     uint16_t numFails;
-    time_t time; /* when the peer's connection status last changed */
-    time_t piece_data_time;
 
-    time_t lastConnectionAttemptAt;
-    time_t lastConnectionAt;
+    /* timestamps are kept as 32-bit seconds since the epoch to keep atoms small */
+    uint32_t time; /* when the peer's connection status last changed */
+    uint32_t piece_data_time;
+
+    uint32_t lastConnectionAttemptAt;
+    uint32_t lastConnectionAt;
 
     /* similar to a TTL field, but less rigid --
      * if the swarm is small, the atom will be kept past this date. */
-    time_t shelf_date;
+    uint32_t shelf_date;
+
+    /* this atom's position in its swarm's atom_pool.atoms */
+    int poolPos;
+
+    /* the connection-candidate heap this atom is in, or NULL if none */
+    int queuePos;
+    struct atom_heap* queue;
+    uint64_t queueKey;
+
+    struct peer_endpoint* endpoint;
     tr_peer* peer; /* will be NULL if not connected */
-    tr_address addr;
+};
+
+/**
+ * A swarm's peer_atoms, indexed by address.
+ * @see atomPoolNew()
+ */
+struct atom_pool
+{
+    struct peer_atom** atoms; /* unordered */
+    int atomCount;
+    int atomAlloc;
+
+    struct addr_index index;
+
+    struct atom_slab* slabs;
+    size_t slabBytes;
+
+    struct peer_atom** freeAtoms; /* unused atoms in the slabs */
+    int freeCount;
 };
 
 #ifndef TR_ENABLE_ASSERTS
@@ -186,10 +267,17 @@ typedef struct tr_swarm
     tr_swarm_stats stats;
 
     tr_ptrArray outgoingHandshakes; /* tr_handshake */
-    tr_ptrArray pool; /* struct peer_atom */
+    struct atom_pool pool;
     tr_ptrArray peers; /* tr_peerMsgs */
     tr_ptrArray webseeds; /* tr_webseed */
 
+    /* atoms that we might want to connect to, split into the ones that
+       are still waiting out their reconnect interval (keyed by when it
+       ends) and the ones that are ready (keyed by candidate score) */
+    struct atom_heap waitingAtoms;
+    struct atom_heap candidateAtoms;
+    int candidateState;
+
     tr_torrent* tor;
     struct tr_peerMgr* manager;
 
@@ -214,6 +302,10 @@ typedef struct tr_swarm
     uint16_t* pieceReplication;
     size_t pieceReplicationSize;
 
+    /* An array of pieceCount items stating how many peers we've revealed
+       each piece to while super-seeding. NULL if we're not super-seeding. */
+    uint16_t* superSeedOffers;
+
     int interestedCount;
     int maxPeers;
     time_t lastCancel;
@@ -226,6 +318,14 @@ typedef struct tr_swarm
 }
 tr_swarm;
 
+static void atomQueueUpdate(tr_swarm* s, struct peer_atom* atom);
+
+static void atomQueueRemove(struct peer_atom* atom);
+
+static void swarmQueueRebuild(tr_swarm* s);
+
+static void swarmQueueFree(tr_swarm* s);
+
 struct tr_peerMgr
 {
     tr_session* session;
@@ -234,6 +334,14 @@ struct tr_peerMgr
     struct event* rechokeTimer;
     struct event* refillUpkeepTimer;
     struct event* atomTimer;
+    struct addr_index endpoints; /* struct peer_endpoint */
+
+    /* scratch space for rechokeUploads(), kept between calls */
+    struct ChokeData* choke;
+    struct ChokeData** contenders;
+    int chokeAlloc;
+
+    tr_upload_slot_stats uploadSlotStats;
 };
 
 #define tordbg(t, ...) tr_logAddDeepNamed(tr_torrentName((t)->tor), __VA_ARGS__)
@@ -361,47 +469,289 @@ static inline tr_handshake* getExistingHandshake(tr_ptrArray* handshakes, tr_add
     return tr_ptrArrayFindSorted(handshakes, addr, handshakeCompareToAddr);
 }
 
-static int comparePeerAtomToAddress(void const* va, void const* vb)
-{
-    struct peer_atom const* a = va;
+/**
+***
+**/
 
-    return tr_address_compare(&a->addr, vb);
+tr_address const* tr_peerAddress(tr_peer const* peer)
+{
+    return &peer->atom->addr;
 }
 
-static int compareAtomsByAddress(void const* va, void const* vb)
+static tr_swarm* getExistingSwarm(tr_peerMgr* manager, uint8_t const* hash)
 {
-    struct peer_atom const* b = vb;
+    tr_torrent* tor = tr_torrentFindFromHash(manager->session, hash);
 
-    TR_ASSERT(tr_isAtom(b));
+    return tor == NULL ? NULL : tor->swarm;
+}
 
-    return comparePeerAtomToAddress(va, &b->addr);
+static int peerCompare(void const* a, void const* b)
+{
+    return tr_address_compare(tr_peerAddress(a), tr_peerAddress(b));
 }
 
 /**
+***  Atom pools
 ***
+***  Atoms are carved out of slabs that never move, so pointers to them
+***  stay valid for as long as they're in the pool. The pool keeps an
+***  unordered array of them for iterating and an open-addressed hash
+***  index (linear probing) for looking them up by address.
 **/
 
-tr_address const* tr_peerAddress(tr_peer const* peer)
+struct atom_slab
 {
-    return &peer->atom->addr;
+    struct atom_slab* next;
+    int size;
+    struct peer_atom atoms[];
+};
+
+static size_t addrIndexHash(tr_address const* addr)
+{
+    uint8_t const* bytes;
+    size_t len;
+    uint32_t hash = 2166136261u; /* FNV-1a */
+
+    if (addr->type == TR_AF_INET)
+    {
+        bytes = (uint8_t const*)&addr->addr.addr4;
+        len = sizeof(addr->addr.addr4);
+    }
+    else
+    {
+        bytes = (uint8_t const*)&addr->addr.addr6;
+        len = sizeof(addr->addr.addr6);
+    }
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
 }
 
-static tr_swarm* getExistingSwarm(tr_peerMgr* manager, uint8_t const* hash)
+static inline tr_address const* addrIndexItemAddress(void const* item)
 {
-    tr_torrent* tor = tr_torrentFindFromHash(manager->session, hash);
+    return (tr_address const*)item;
+}
 
-    return tor == NULL ? NULL : tor->swarm;
+static size_t addrIndexFindSlot(void* const* items, size_t size, tr_address const* addr)
+{
+    size_t const mask = size - 1;
+    size_t i = addrIndexHash(addr) & mask;
+
+    while (items[i] != NULL && tr_address_compare(addrIndexItemAddress(items[i]), addr) != 0)
+    {
+        i = (i + 1) & mask;
+    }
+
+    return i;
 }
 
-static int peerCompare(void const* a, void const* b)
+static void* addrIndexFind(struct addr_index const* index, tr_address const* addr)
 {
-    return tr_address_compare(tr_peerAddress(a), tr_peerAddress(b));
+    return index->size != 0 ? index->items[addrIndexFindSlot(index->items, index->size, addr)] : NULL;
+}
+
+static void addrIndexInsert(struct addr_index* index, void* item)
+{
+    TR_ASSERT(addrIndexFind(index, addrIndexItemAddress(item)) == NULL);
+
+    /* keep the table at most half full */
+    if ((index->count + 1) * 2 > index->size)
+    {
+        size_t const size = index->size != 0 ? index->size * 2 : 16;
+        void** items = tr_new0(void*, size);
+
+        for (size_t i = 0; i < index->size; ++i)
+        {
+            if (index->items[i] != NULL)
+            {
+                items[addrIndexFindSlot(items, size, addrIndexItemAddress(index->items[i]))] = index->items[i];
+            }
+        }
+
+        tr_free(index->items);
+        index->items = items;
+        index->size = size;
+    }
+
+    index->items[addrIndexFindSlot(index->items, index->size, addrIndexItemAddress(item))] = item;
+    ++index->count;
+}
+
+static void addrIndexRemove(struct addr_index* index, void const* item)
+{
+    size_t const mask = index->size - 1;
+    size_t i = addrIndexFindSlot(index->items, index->size, addrIndexItemAddress(item));
+
+    TR_ASSERT(index->items[i] == item);
+
+    /* backward-shift deletion, so that lookups don't need tombstones */
+    for (size_t j = (i + 1) & mask; index->items[j] != NULL; j = (j + 1) & mask)
+    {
+        size_t const home = addrIndexHash(addrIndexItemAddress(index->items[j])) & mask;
+        bool const homeIsBetween = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+
+        if (!homeIsBetween)
+        {
+            index->items[i] = index->items[j];
+            i = j;
+        }
+    }
+
+    index->items[i] = NULL;
+    --index->count;
+}
+
+static void addrIndexDestruct(struct addr_index* index)
+{
+    tr_free(index->items);
+    memset(index, 0, sizeof(struct addr_index));
+}
+
+static struct peer_atom* atomPoolFind(struct atom_pool const* pool, tr_address const* addr)
+{
+    return addrIndexFind(&pool->index, addr);
 }
 
-static struct peer_atom* getExistingAtom(tr_swarm const* cswarm, tr_address const* addr)
+/* @return a new zeroed-out atom for `addr', which mustn't be in the pool yet */
+static struct peer_atom* atomPoolNew(struct atom_pool* pool, tr_address const* addr)
 {
-    tr_swarm* swarm = (tr_swarm*)cswarm;
-    return tr_ptrArrayFindSorted(&swarm->pool, addr, comparePeerAtomToAddress);
+    TR_ASSERT(atomPoolFind(pool, addr) == NULL);
+
+    struct peer_atom* atom;
+
+    if (pool->freeCount == 0)
+    {
+        /* grow the slabs geometrically so small swarms stay small */
+        int const size = pool->slabs == NULL ? 8 : MIN(pool->slabs->size * 2, 256);
+        struct atom_slab* slab = tr_malloc(sizeof(struct atom_slab) + size * sizeof(struct peer_atom));
+
+        slab->next = pool->slabs;
+        slab->size = size;
+        pool->slabs = slab;
+        pool->slabBytes += sizeof(struct atom_slab) + size * sizeof(struct peer_atom);
+        pool->freeAtoms = tr_renew(struct peer_atom*, pool->freeAtoms, pool->atomCount + size);
+
+        for (int i = size - 1; i >= 0; --i)
+        {
+            pool->freeAtoms[pool->freeCount++] = &slab->atoms[i];
+        }
+    }
+
+    atom = pool->freeAtoms[--pool->freeCount];
+    memset(atom, 0, sizeof(struct peer_atom));
+    atom->addr = *addr;
+    addrIndexInsert(&pool->index, atom);
+
+    if (pool->atomCount == pool->atomAlloc)
+    {
+        pool->atomAlloc = pool->atomAlloc != 0 ? pool->atomAlloc * 2 : 16;
+        pool->atoms = tr_renew(struct peer_atom*, pool->atoms, pool->atomAlloc);
+    }
+
+    atom->poolPos = pool->atomCount;
+    pool->atoms[pool->atomCount++] = atom;
+
+    return atom;
+}
+
+static void atomPoolRemove(struct atom_pool* pool, struct peer_atom* atom)
+{
+    TR_ASSERT(atom->queue == NULL);
+    TR_ASSERT(pool->atoms[atom->poolPos] == atom);
+
+    addrIndexRemove(&pool->index, atom);
+
+    /* swap-remove from the atoms array */
+    pool->atoms[atom->poolPos] = pool->atoms[--pool->atomCount];
+    pool->atoms[atom->poolPos]->poolPos = atom->poolPos;
+
+    pool->freeAtoms[pool->freeCount++] = atom;
+}
+
+static void atomPoolDestruct(struct atom_pool* pool)
+{
+    while (pool->slabs != NULL)
+    {
+        struct atom_slab* next = pool->slabs->next;
+        tr_free(pool->slabs);
+        pool->slabs = next;
+    }
+
+    tr_free(pool->freeAtoms);
+    addrIndexDestruct(&pool->index);
+    tr_free(pool->atoms);
+    memset(pool, 0, sizeof(struct atom_pool));
+}
+
+/* @return how many bytes the pool is using */
+static size_t atomPoolGetMemory(struct atom_pool const* pool)
+{
+    return pool->slabBytes +
+        pool->index.size * sizeof(void*) +
+        (size_t)pool->atomAlloc * sizeof(struct peer_atom*) +
+        (size_t)(pool->atomCount + pool->freeCount) * sizeof(struct peer_atom*);
+}
+
+static struct peer_atom* getExistingAtom(tr_swarm const* swarm, tr_address const* addr)
+{
+    return atomPoolFind(&swarm->pool, addr);
+}
+
+/**
+***  Peer directory
+**/
+
+static struct peer_endpoint* endpointRef(tr_peerMgr* mgr, tr_address const* addr)
+{
+    struct peer_endpoint* e = addrIndexFind(&mgr->endpoints, addr);
+
+    if (e == NULL)
+    {
+        e = tr_new0(struct peer_endpoint, 1);
+        e->addr = *addr;
+        e->blocklisted = -1;
+        e->client = TR_KEY_NONE;
+        addrIndexInsert(&mgr->endpoints, e);
+    }
+
+    ++e->refCount;
+    return e;
+}
+
+static void endpointUnref(tr_peerMgr* mgr, struct peer_endpoint* e)
+{
+    TR_ASSERT(e->refCount > 0);
+
+    if (--e->refCount == 0)
+    {
+        addrIndexRemove(&mgr->endpoints, e);
+        tr_free(e);
+    }
+}
+
+/* the added_f flags we've been told about, plus the ones we've seen for ourselves */
+static inline uint8_t atomGetFlags(struct peer_atom const* atom)
+{
+    return atom->flags | atom->endpoint->flags;
+}
+
+/* when to start counting the reconnect interval from */
+static inline time_t atomGetRetryBaseTime(struct peer_atom const* atom)
+{
+    struct peer_endpoint const* e = atom->endpoint;
+
+    return e->unreachable ? MAX(atom->time, e->lastFailureAt) : atom->time;
+}
+
+static void swarmRemoveAtom(tr_swarm* s, struct peer_atom* atom)
+{
+    atomQueueRemove(atom);
+    endpointUnref(s->manager, atom->endpoint);
+    atomPoolRemove(&s->pool, atom);
 }
 
 static bool peerIsInUse(tr_swarm const* cs, struct peer_atom const* atom)
@@ -436,21 +786,14 @@ static void replicationNew(tr_swarm* s)
     s->pieceReplicationSize = piece_count;
     s->pieceReplication = tr_new0(uint16_t, piece_count);
 
-    for (tr_piece_index_t piece_i = 0; piece_i < piece_count; ++piece_i)
+    for (int peer_i = 0; peer_i < n; ++peer_i)
     {
-        uint16_t r = 0;
+        tr_bitfield const* have = &((tr_peer const*)tr_ptrArrayNth(&s->peers, peer_i))->have;
 
-        for (int peer_i = 0; peer_i < n; ++peer_i)
+        for (size_t i = tr_bitfieldNextSet(have, 0); i < piece_count; i = tr_bitfieldNextSet(have, i + 1))
         {
-            tr_peer* peer = tr_ptrArrayNth(&s->peers, peer_i);
-
-            if (tr_bitfieldHas(&peer->have, piece_i))
-            {
-                ++r;
-            }
+            ++s->pieceReplication[i];
         }
-
-        s->pieceReplication[piece_i] = r;
     }
 }
 
@@ -465,13 +808,20 @@ static void swarmFree(void* vs)
     TR_ASSERT(tr_ptrArrayEmpty(&s->peers));
 
     tr_ptrArrayDestruct(&s->webseeds, (PtrArrayForeachFunc)tr_peerFree);
-    tr_ptrArrayDestruct(&s->pool, (PtrArrayForeachFunc)tr_free);
+    for (int i = 0; i < s->pool.atomCount; ++i)
+    {
+        endpointUnref(s->manager, s->pool.atoms[i]->endpoint);
+    }
+
+    atomPoolDestruct(&s->pool);
     tr_ptrArrayDestruct(&s->outgoingHandshakes, NULL);
     tr_ptrArrayDestruct(&s->peers, NULL);
     s->stats = TR_SWARM_STATS_INIT;
 
     replicationFree(s);
+    swarmQueueFree(s);
 
+    tr_free(s->superSeedOffers);
     tr_free(s->requests);
     tr_free(s->pieces);
     tr_free(s);
@@ -503,7 +853,6 @@ static tr_swarm* swarmNew(tr_peerMgr* manager, tr_torrent* tor)
     s = tr_new0(tr_swarm, 1);
     s->manager = manager;
     s->tor = tor;
-    s->pool = TR_PTR_ARRAY_INIT;
     s->peers = TR_PTR_ARRAY_INIT;
     s->webseeds = TR_PTR_ARRAY_INIT;
     s->outgoingHandshakes = TR_PTR_ARRAY_INIT;
@@ -520,6 +869,7 @@ tr_peerMgr* tr_peerMgrNew(tr_session* session)
     tr_peerMgr* m = tr_new0(tr_peerMgr, 1);
     m->session = session;
     m->incomingHandshakes = TR_PTR_ARRAY_INIT;
+    m->uploadSlotStats.utilization = TR_RATIO_NA;
     ensureMgrTimersExist(m);
     return m;
 }
@@ -556,6 +906,12 @@ void tr_peerMgrFree(tr_peerMgr* manager)
 
     tr_ptrArrayDestruct(&manager->incomingHandshakes, NULL);
 
+    TR_ASSERT(manager->endpoints.count == 0);
+    addrIndexDestruct(&manager->endpoints);
+
+    tr_free(manager->contenders);
+    tr_free(manager->choke);
+
     managerUnlock(manager);
     tr_free(manager);
 }
@@ -575,22 +931,25 @@ void tr_peerMgrOnBlocklistChanged(tr_peerMgr* mgr)
     {
         tr_swarm* s = tor->swarm;
 
-        for (int i = 0, n = tr_ptrArraySize(&s->pool); i < n; ++i)
+        for (int i = 0; i < s->pool.atomCount; ++i)
         {
-            struct peer_atom* atom = tr_ptrArrayNth(&s->pool, i);
-            atom->blocklisted = -1;
+            s->pool.atoms[i]->endpoint->blocklisted = -1;
         }
+
+        swarmQueueRebuild(s);
     }
 }
 
 static bool isAtomBlocklisted(tr_session* session, struct peer_atom* atom)
 {
-    if (atom->blocklisted < 0)
+    struct peer_endpoint* e = atom->endpoint;
+
+    if (e->blocklisted < 0)
     {
-        atom->blocklisted = (int8_t)tr_sessionIsAddressBlocked(session, &atom->addr);
+        e->blocklisted = (int8_t)tr_sessionIsAddressBlocked(session, &atom->addr);
     }
 
-    return atom->blocklisted != 0;
+    return e->blocklisted != 0;
 }
 
 /***
@@ -620,13 +979,14 @@ static inline bool atomIsSeed(struct peer_atom const* atom)
     return atom->seedProbability == 100;
 }
 
-static void atomSetSeed(tr_swarm const* s, struct peer_atom* atom)
+static void atomSetSeed(tr_swarm* s, struct peer_atom* atom)
 {
     if (!atomIsSeed(atom))
     {
         tordbg(s, "marking peer %s as a seed", tr_atomAddrStr(atom));
 
         atomSetSeedProbability(atom, 100);
+        atomQueueUpdate(s, atom);
     }
 }
 
@@ -646,21 +1006,21 @@ bool tr_peerMgrPeerIsSeed(tr_torrent const* tor, tr_address const* addr)
 
 void tr_peerMgrSetUtpSupported(tr_torrent* tor, tr_address const* addr)
 {
-    struct peer_atom* atom = getExistingAtom(tor->swarm, addr);
+    struct peer_endpoint* e = addrIndexFind(&tor->swarm->manager->endpoints, addr);
 
-    if (atom != NULL)
+    if (e != NULL)
     {
-        atom->flags |= ADDED_F_UTP_FLAGS;
+        e->flags |= ADDED_F_UTP_FLAGS;
     }
 }
 
 void tr_peerMgrSetUtpFailed(tr_torrent* tor, tr_address const* addr, bool failed)
 {
-    struct peer_atom* atom = getExistingAtom(tor->swarm, addr);
+    struct peer_endpoint* e = addrIndexFind(&tor->swarm->manager->endpoints, addr);
 
-    if (atom != NULL)
+    if (e != NULL)
     {
-        atom->utp_failed = failed;
+        e->utp_failed = failed;
     }
 }
 
@@ -1155,65 +1515,176 @@ static void pieceListRebuild(tr_swarm* s)
     }
 }
 
-static void pieceListRemovePiece(tr_swarm* s, tr_piece_index_t piece)
+static inline bool pieceListWants(tr_torrent const* tor, tr_piece_index_t piece)
 {
-    struct weighted_piece* p;
-
-    if ((p = pieceListLookup(s, piece)) != NULL)
-    {
-        int const pos = p - s->pieces;
-
-        tr_removeElementFromArray(s->pieces, pos, sizeof(struct weighted_piece), s->pieceCount);
-        --s->pieceCount;
-
-        if (s->pieceCount == 0)
-        {
-            tr_free(s->pieces);
-            s->pieces = NULL;
-        }
-    }
+    return !tor->info.pieces[piece].dnd && !tr_torrentPieceIsComplete(tor, piece);
 }
 
-static void pieceListResortPiece(tr_swarm* s, struct weighted_piece* p)
+/* Update the list for pieces whose priority or dnd flag changed. The changed pieces are
+ * pulled out of the list, the ones that are still wanted (plus the newly-wanted ones)
+ * are sorted among themselves, and then merged back in. Since the unchanged pieces stay
+ * in order, this avoids resorting the whole list. */
+static void pieceListUpdate(tr_swarm* s, tr_bitfield const* changed)
 {
-    int pos;
-    bool isSorted = true;
+    tr_torrent const* tor = s->tor;
+    tr_piece_index_t const pieceCount = tor->info.pieceCount;
+    struct weighted_piece* batch;
+    int batchCount = 0;
+    int listedCount;
+    int keepCount = 0;
 
-    if (p == NULL)
+    /* if there's no list yet, it'll be built when it's needed */
+    if (s->pieces == NULL || tr_bitfieldHasNone(changed))
     {
         return;
     }
 
-    /* is the torrent already sorted? */
-    pos = p - s->pieces;
-    setComparePieceByWeightTorrent(s);
+    batch = tr_new(struct weighted_piece, tr_bitfieldCountTrueBits(changed));
 
-    if (isSorted && pos > 0 && comparePieceByWeight(p - 1, p) > 0)
+    /* pull out the changed pieces, keeping the wanted ones' requestCounts */
+    for (int i = 0; i < s->pieceCount; ++i)
     {
-        isSorted = false;
-    }
+        struct weighted_piece const* p = &s->pieces[i];
 
-    if (isSorted && pos < s->pieceCount - 1 && comparePieceByWeight(p, p + 1) > 0)
-    {
-        isSorted = false;
+        if (!tr_bitfieldHas(changed, p->index))
+        {
+            s->pieces[keepCount++] = *p;
+        }
+        else if (pieceListWants(tor, p->index))
+        {
+            batch[batchCount++] = *p;
+        }
     }
 
-    if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    {
-        pieceListSort(s, PIECES_SORTED_BY_WEIGHT);
-        isSorted = true;
-    }
+    /* add the changed pieces that weren't listed before */
+    listedCount = batchCount;
+    qsort(batch, listedCount, sizeof(struct weighted_piece), comparePieceByIndex);
 
-    /* if it's not sorted, move it around */
-    if (!isSorted)
+    for (size_t i = tr_bitfieldNextSet(changed, 0), j = 0; i < pieceCount; i = tr_bitfieldNextSet(changed, i + 1))
     {
-        bool exact;
-        struct weighted_piece const tmp = *p;
+        if (pieceListWants(tor, i))
+        {
+            while (j < (size_t)listedCount && batch[j].index < i)
+            {
+                ++j;
+            }
 
-        tr_removeElementFromArray(s->pieces, pos, sizeof(struct weighted_piece), s->pieceCount);
-        --s->pieceCount;
+            if (j == (size_t)listedCount || batch[j].index != i)
+            {
+                struct weighted_piece* piece = &batch[batchCount++];
+                piece->index = i;
+                piece->requestCount = 0;
+                piece->salt = tr_rand_int_weak(4096);
+            }
+        }
+    }
 
-        pos = tr_lowerBound(&tmp, s->pieces, s->pieceCount, sizeof(struct weighted_piece), comparePieceByWeight, &exact);
+    s->pieceCount = keepCount;
+
+    if (batchCount != 0)
+    {
+        s->pieces = tr_renew(struct weighted_piece, s->pieces, keepCount + batchCount);
+
+        if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
+        {
+            int i = keepCount - 1;
+            int j = batchCount - 1;
+
+            setComparePieceByWeightTorrent(s);
+            qsort(batch, batchCount, sizeof(struct weighted_piece), comparePieceByWeight);
+
+            /* merge from the back so it can be done in place */
+            for (int k = keepCount + batchCount - 1; j >= 0; --k)
+            {
+                if (i >= 0 && comparePieceByWeight(&s->pieces[i], &batch[j]) > 0)
+                {
+                    s->pieces[k] = s->pieces[i--];
+                }
+                else
+                {
+                    s->pieces[k] = batch[j--];
+                }
+            }
+        }
+        else
+        {
+            memcpy(s->pieces + keepCount, batch, sizeof(struct weighted_piece) * batchCount);
+            invalidatePieceSorting(s);
+        }
+
+        s->pieceCount += batchCount;
+    }
+
+    if (s->pieceCount == 0)
+    {
+        tr_free(s->pieces);
+        s->pieces = NULL;
+    }
+
+    assertWeightedPiecesAreSorted(s);
+
+    tr_free(batch);
+}
+
+static void pieceListRemovePiece(tr_swarm* s, tr_piece_index_t piece)
+{
+    struct weighted_piece* p;
+
+    if ((p = pieceListLookup(s, piece)) != NULL)
+    {
+        int const pos = p - s->pieces;
+
+        tr_removeElementFromArray(s->pieces, pos, sizeof(struct weighted_piece), s->pieceCount);
+        --s->pieceCount;
+
+        if (s->pieceCount == 0)
+        {
+            tr_free(s->pieces);
+            s->pieces = NULL;
+        }
+    }
+}
+
+static void pieceListResortPiece(tr_swarm* s, struct weighted_piece* p)
+{
+    int pos;
+    bool isSorted = true;
+
+    if (p == NULL)
+    {
+        return;
+    }
+
+    /* is the torrent already sorted? */
+    pos = p - s->pieces;
+    setComparePieceByWeightTorrent(s);
+
+    if (isSorted && pos > 0 && comparePieceByWeight(p - 1, p) > 0)
+    {
+        isSorted = false;
+    }
+
+    if (isSorted && pos < s->pieceCount - 1 && comparePieceByWeight(p, p + 1) > 0)
+    {
+        isSorted = false;
+    }
+
+    if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+    {
+        pieceListSort(s, PIECES_SORTED_BY_WEIGHT);
+        isSorted = true;
+    }
+
+    /* if it's not sorted, move it around */
+    if (!isSorted)
+    {
+        bool exact;
+        struct weighted_piece const tmp = *p;
+
+        tr_removeElementFromArray(s->pieces, pos, sizeof(struct weighted_piece), s->pieceCount);
+        --s->pieceCount;
+
+        pos = tr_lowerBound(&tmp, s->pieces, s->pieceCount, sizeof(struct weighted_piece), comparePieceByWeight, &exact);
 
         memmove(&s->pieces[pos + 1], &s->pieces[pos], sizeof(struct weighted_piece) * (s->pieceCount - pos));
         ++s->pieceCount;
@@ -1269,13 +1740,11 @@ static void tr_incrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
     TR_ASSERT(replicationExists(s));
 
     uint16_t* rep = s->pieceReplication;
+    size_t const n = s->tor->info.pieceCount;
 
-    for (size_t i = 0, n = s->tor->info.pieceCount; i < n; ++i)
+    for (size_t i = tr_bitfieldNextSet(b, 0); i < n; i = tr_bitfieldNextSet(b, i + 1))
     {
-        if (tr_bitfieldHas(b, i))
-        {
-            ++rep[i];
-        }
+        ++rep[i];
     }
 
     if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
@@ -1315,12 +1784,9 @@ static void tr_decrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
     }
     else if (!tr_bitfieldHasNone(b))
     {
-        for (size_t i = 0; i < s->pieceReplicationSize; ++i)
+        for (size_t i = tr_bitfieldNextSet(b, 0); i < s->pieceReplicationSize; i = tr_bitfieldNextSet(b, i + 1))
         {
-            if (tr_bitfieldHas(b, i))
-            {
-                --s->pieceReplication[i];
-            }
+            --s->pieceReplication[i];
         }
 
         if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
@@ -1334,11 +1800,11 @@ static void tr_decrReplicationFromBitfield(tr_swarm* s, tr_bitfield const* b)
 ***
 **/
 
-void tr_peerMgrRebuildRequests(tr_torrent* tor)
+void tr_peerMgrPiecesChanged(tr_torrent* tor, tr_bitfield const* pieces)
 {
     TR_ASSERT(tr_isTorrent(tor));
 
-    pieceListRebuild(tor->swarm);
+    pieceListUpdate(tor->swarm, pieces);
 }
 
 void tr_peerMgrGetNextRequests(tr_torrent* tor, tr_peer* peer, int numwant, tr_block_index_t* setme, int* numgot,
@@ -1351,6 +1817,13 @@ void tr_peerMgrGetNextRequests(tr_torrent* tor, tr_peer* peer, int numwant, tr_b
     tr_swarm* s;
     tr_bitfield const* const have = &peer->have;
 
+    /* if the disk can't keep up, wait for it instead of piling up more blocks in memory */
+    if (tr_diskIoIsBacklogged(tor->session->diskIo))
+    {
+        *numgot = 0;
+        return;
+    }
+
     /* walk through the pieces and find blocks that should be requested */
     s = tor->swarm;
 
@@ -1749,6 +2222,179 @@ void tr_peerMgrPieceCompleted(tr_torrent* tor, tr_piece_index_t p)
     s->needsCompletenessCheck = true;
 }
 
+/**
+***  Super-Seeding
+**/
+
+bool tr_peerMgrGetNextSuperSeedPiece(size_t pieceCount, uint16_t const* replication, uint16_t const* offers,
+    tr_bitfield const* peerHave, tr_bitfield const* revealed, tr_piece_index_t* setme)
+{
+    bool found = false;
+    unsigned int bestScore = 0;
+
+    for (size_t i = 0; i < pieceCount; ++i)
+    {
+        if (tr_bitfieldHas(peerHave, i) || tr_bitfieldHas(revealed, i))
+        {
+            continue;
+        }
+
+        unsigned int const score = (replication != NULL ? replication[i] : 0) + (offers != NULL ? offers[i] : 0);
+
+        if (!found || score < bestScore)
+        {
+            found = true;
+            bestScore = score;
+            *setme = i;
+
+            if (score == 0)
+            {
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+static void superSeedOffer(tr_swarm* s, tr_peer* peer)
+{
+    tr_torrent const* tor = s->tor;
+    tr_peerMsgs* msgs = PEER_MSGS(peer);
+    tr_piece_index_t piece;
+
+    /* we may have lost pieces since the peer connected, e.g. in a recheck */
+    if (!tr_torrentIsSuperSeeding(tor))
+    {
+        return;
+    }
+
+    if (!replicationExists(s))
+    {
+        replicationNew(s);
+    }
+
+    if (s->superSeedOffers == NULL)
+    {
+        s->superSeedOffers = tr_new0(uint16_t, tor->info.pieceCount);
+    }
+
+    if (tr_peerMgrGetNextSuperSeedPiece(tor->info.pieceCount, s->pieceReplication, s->superSeedOffers, &peer->have,
+        tr_peerMsgsGetSuperSeedRevealed(msgs), &piece))
+    {
+        if (s->superSeedOffers[piece] < UINT16_MAX)
+        {
+            ++s->superSeedOffers[piece];
+        }
+
+        tordbg(s, "super-seeding: offering piece %" PRIu32 " to %s", piece, tr_atomAddrStr(peer->atom));
+        tr_peerMsgsSuperSeedReveal(msgs, piece);
+    }
+}
+
+/* offer a piece to a super-seeded peer if it isn't waiting on one already */
+static void superSeedOfferIfIdle(tr_swarm* s, tr_peer* peer)
+{
+    tr_peerMsgs* msgs = PEER_MSGS(peer);
+    tr_piece_index_t piece;
+
+    if (msgs != NULL && tr_peerMsgsIsSuperSeeding(msgs) && !tr_peerIsSeed(peer) &&
+        !tr_peerMsgsGetSuperSeedPiece(msgs, &piece))
+    {
+        superSeedOffer(s, peer);
+    }
+}
+
+static bool superSeedPieceIsWantedElsewhere(tr_swarm const* s, tr_peer const* peer, tr_piece_index_t piece)
+{
+    for (int i = 0, n = tr_ptrArraySize(&s->peers); i < n; ++i)
+    {
+        tr_peer const* p = tr_ptrArrayNth((tr_ptrArray*)&s->peers, i);
+
+        if (p != peer && !tr_bitfieldHas(&p->have, piece))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* A peer just told us it has `piece`. Any peer we revealed that piece to
+ * has now passed it on to the swarm, so it has earned a new piece. The peer
+ * that downloaded it from us only gets a new one right away if there's
+ * nobody left for it to pass the piece on to. */
+static void superSeedPeerGotPiece(tr_swarm* s, tr_peer* from, tr_piece_index_t piece)
+{
+    for (int i = 0, n = tr_ptrArraySize(&s->peers); i < n; ++i)
+    {
+        tr_peer* peer = tr_ptrArrayNth(&s->peers, i);
+        tr_peerMsgs* msgs = PEER_MSGS(peer);
+        tr_piece_index_t offered;
+
+        if (msgs == NULL || !tr_peerMsgsGetSuperSeedPiece(msgs, &offered) || offered != piece)
+        {
+            continue;
+        }
+
+        if (peer != from || !superSeedPieceIsWantedElsewhere(s, peer, piece))
+        {
+            superSeedOffer(s, peer);
+        }
+    }
+}
+
+/* make sure every super-seeded peer has a piece to work on */
+static void superSeedPulse(tr_swarm* s)
+{
+    for (int i = 0, n = tr_ptrArraySize(&s->peers); i < n; ++i)
+    {
+        superSeedOfferIfIdle(s, tr_ptrArrayNth(&s->peers, i));
+    }
+}
+
+void tr_peerMgrOnSuperSeedingChanged(tr_torrent* tor)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    tr_swarm* s = tor->swarm;
+
+    swarmLock(s);
+
+    if (tr_torrentIsSuperSeeding(tor))
+    {
+        /* our current peers have already been told about every piece,
+         * so drop them and let them reconnect to get the HAVE_NONE */
+        for (int i = 0, n = tr_ptrArraySize(&s->peers); i < n; ++i)
+        {
+            tr_peer* peer = tr_ptrArrayNth(&s->peers, i);
+
+            if (!tr_peerIsSeed(peer))
+            {
+                tordbg(s, "purging peer %s so it can reconnect as a super-seeded peer", tr_atomAddrStr(peer->atom));
+                peer->doPurge = true;
+            }
+        }
+    }
+    else
+    {
+        for (int i = 0, n = tr_ptrArraySize(&s->peers); i < n; ++i)
+        {
+            tr_peerMsgs* msgs = PEER_MSGS(tr_ptrArrayNth(&s->peers, i));
+
+            if (msgs != NULL)
+            {
+                tr_peerMsgsStopSuperSeeding(msgs);
+            }
+        }
+
+        tr_free(s->superSeedOffers);
+        s->superSeedOffers = NULL;
+    }
+
+    swarmUnlock(s);
+}
+
 static void peerCallbackFunc(tr_peer* peer, tr_peer_event const* e, void* vs)
 {
     TR_ASSERT(peer != NULL);
@@ -1804,6 +2450,11 @@ static void peerCallbackFunc(tr_peer* peer, tr_peer_event const* e, void* vs)
             assertReplicationCountIsExact(s);
         }
 
+        if (s->superSeedOffers != NULL)
+        {
+            superSeedPeerGotPiece(s, peer, e->pieceIndex);
+        }
+
         break;
 
     case TR_PEER_CLIENT_GOT_HAVE_ALL:
@@ -1816,7 +2467,7 @@ static void peerCallbackFunc(tr_peer* peer, tr_peer_event const* e, void* vs)
         break;
 
     case TR_PEER_CLIENT_GOT_HAVE_NONE:
-        /* noop */
+        superSeedOfferIfIdle(s, peer);
         break;
 
     case TR_PEER_CLIENT_GOT_BITFIELD:
@@ -1828,6 +2479,7 @@ static void peerCallbackFunc(tr_peer* peer, tr_peer_event const* e, void* vs)
             assertReplicationCountIsExact(s);
         }
 
+        superSeedOfferIfIdle(s, peer);
         break;
 
     case TR_PEER_CLIENT_GOT_REJ:
@@ -1943,16 +2595,14 @@ static void ensureAtomExists(tr_swarm* s, tr_address const* addr, tr_port const
     if (a == NULL)
     {
         int const jitter = tr_rand_int_weak(60 * 10);
-        a = tr_new0(struct peer_atom, 1);
-        a->addr = *addr;
+        a = atomPoolNew(&s->pool, addr);
+        a->endpoint = endpointRef(s->manager, addr);
         a->port = port;
         a->flags = flags;
         a->fromFirst = from;
         a->fromBest = from;
         a->shelf_date = tr_time() + getDefaultShelfLife(from) + jitter;
-        a->blocklisted = -1;
         atomSetSeedProbability(a, seedProbability);
-        tr_ptrArrayInsertSorted(&s->pool, a, compareAtomsByAddress);
 
         tordbg(s, "got a new atom: %s", tr_atomAddrStr(a));
     }
@@ -1970,6 +2620,8 @@ static void ensureAtomExists(tr_swarm* s, tr_address const* addr, tr_port const
 
         a->flags |= flags;
     }
+
+    atomQueueUpdate(s, a);
 }
 
 static int getMaxPeerCount(tr_torrent const* tor)
@@ -1994,6 +2646,7 @@ static void createBitTorrentPeer(tr_torrent* tor, struct tr_peerIo* io, struct p
     peer->atom = atom;
     peer->client = client;
     atom->peer = peer;
+    atom->endpoint->client = client;
 
     tr_ptrArrayInsertSorted(&swarm->peers, peer, peerCompare);
     ++swarm->stats.peerCount;
@@ -2049,8 +2702,11 @@ static bool myHandshakeDoneCB(tr_handshake* handshake, tr_peerIo* io, bool readA
                 if (!readAnythingFromPeer)
                 {
                     tordbg(s, "marking peer %s as unreachable... numFails is %d", tr_atomAddrStr(atom), (int)atom->numFails);
-                    atom->flags2 |= MYFLAG_UNREACHABLE;
+                    atom->endpoint->unreachable = true;
+                    atom->endpoint->lastFailureAt = tr_time();
                 }
+
+                atomQueueUpdate(s, atom);
             }
         }
     }
@@ -2069,15 +2725,20 @@ static bool myHandshakeDoneCB(tr_handshake* handshake, tr_peerIo* io, bool readA
 
         if (!tr_peerIoIsIncoming(io))
         {
-            atom->flags |= ADDED_F_CONNECTABLE;
-            atom->flags2 &= ~MYFLAG_UNREACHABLE;
+            atom->endpoint->flags |= ADDED_F_CONNECTABLE;
+            atom->endpoint->unreachable = false;
         }
 
         /* In principle, this flag specifies whether the peer groks uTP,
            not whether it's currently connected over uTP. */
         if (io->socket.type == TR_PEER_SOCKET_TYPE_UTP)
         {
-            atom->flags |= ADDED_F_UTP_FLAGS;
+            atom->endpoint->flags |= ADDED_F_UTP_FLAGS;
+        }
+
+        if (tr_peerIoIsEncrypted(io))
+        {
+            atom->endpoint->flags |= ADDED_F_ENCRYPTION_FLAG;
         }
 
         if ((atom->flags2 & MYFLAG_BANNED) != 0)
@@ -2117,6 +2778,8 @@ static bool myHandshakeDoneCB(tr_handshake* handshake, tr_peerIo* io, bool readA
                 success = true;
             }
         }
+
+        atomQueueUpdate(s, atom);
     }
 
     if (s != NULL)
@@ -2207,13 +2870,10 @@ void tr_peerMgrAddPex(tr_torrent* tor, uint8_t from, tr_pex const* pex, int8_t s
 void tr_peerMgrMarkAllAsSeeds(tr_torrent* tor)
 {
     tr_swarm* s = tor->swarm;
-    int const n = tr_ptrArraySize(&s->pool);
-    struct peer_atom** it = (struct peer_atom**)tr_ptrArrayBase(&s->pool);
-    struct peer_atom** end = it + n;
 
-    while (it != end)
+    for (int i = 0; i < s->pool.atomCount; ++i)
     {
-        atomSetSeed(s, *it++);
+        atomSetSeed(s, s->pool.atoms[i]);
     }
 }
 
@@ -2346,6 +3006,11 @@ static int compareAtomsByUsefulness(void const* va, void const* vb)
         return a->piece_data_time > b->piece_data_time ? -1 : 1;
     }
 
+    if (a->endpoint->speed_Bps != b->endpoint->speed_Bps)
+    {
+        return a->endpoint->speed_Bps > b->endpoint->speed_Bps ? -1 : 1;
+    }
+
     if (a->fromBest != b->fromBest)
     {
         return a->fromBest < b->fromBest ? -1 : 1;
@@ -2418,8 +3083,8 @@ int tr_peerMgrGetPeers(tr_torrent* tor, tr_pex** setme_pex, uint8_t af, uint8_t
     }
     else /* TR_PEERS_INTERESTING */
     {
-        struct peer_atom** atomBase = (struct peer_atom**)tr_ptrArrayBase(&s->pool);
-        n = tr_ptrArraySize(&s->pool);
+        struct peer_atom** atomBase = s->pool.atoms;
+        n = s->pool.atomCount;
         atoms = tr_new(struct peer_atom*, n);
 
         for (int i = 0; i < n; ++i)
@@ -2450,7 +3115,7 @@ int tr_peerMgrGetPeers(tr_torrent* tor, tr_pex** setme_pex, uint8_t af, uint8_t
 
             walk->addr = atom->addr;
             walk->port = atom->port;
-            walk->flags = atom->flags;
+            walk->flags = atomGetFlags(atom);
             ++count;
             ++walk;
         }
@@ -2515,6 +3180,8 @@ void tr_peerMgrStartTorrent(tr_torrent* tor)
     s->maxPeers = tor->maxConnectedPeers;
     s->pieceSortState = PIECES_UNSORTED;
 
+    swarmQueueRebuild(s);
+
     rechokePulse(0, 0, s->manager);
 }
 
@@ -2524,9 +3191,13 @@ static void stopSwarm(tr_swarm* swarm)
 {
     swarm->isRunning = false;
 
+    swarmQueueRebuild(swarm);
     replicationFree(swarm);
     invalidatePieceSorting(swarm);
 
+    tr_free(swarm->superSeedOffers);
+    swarm->superSeedOffers = NULL;
+
     removeAllPeers(swarm);
 
     /* disconnect the handshakes. handshakeAbort calls handshakeDoneCB(),
@@ -2675,6 +3346,8 @@ void tr_swarmGetStats(tr_swarm const* swarm, tr_swarm_stats* setme)
     TR_ASSERT(setme != NULL);
 
     *setme = swarm->stats;
+    setme->atomCount = swarm->pool.atomCount;
+    setme->atomBytes = atomPoolGetMemory(&swarm->pool);
 }
 
 void tr_swarmIncrementActivePeers(tr_swarm* swarm, tr_direction direction, bool is_active)
@@ -2934,26 +3607,14 @@ void tr_peerMgrClearInterest(tr_torrent* tor)
 }
 
 /* does this peer have any pieces that we want? */
-static bool isPeerInteresting(tr_torrent* const tor, bool const* const piece_is_interesting, tr_peer const* const peer)
+static bool isPeerInteresting(tr_bitfield const* const uninteresting, tr_peer const* const peer)
 {
-    /* these cases should have already been handled by the calling code... */
-    TR_ASSERT(!tr_torrentIsSeed(tor));
-    TR_ASSERT(tr_torrentIsPieceTransferAllowed(tor, TR_PEER_TO_CLIENT));
-
     if (tr_peerIsSeed(peer))
     {
         return true;
     }
 
-    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
-    {
-        if (piece_is_interesting[i] && tr_bitfieldHas(&peer->have, i))
-        {
-            return true;
-        }
-    }
-
-    return false;
+    return tr_bitfieldCountAndNot(&peer->have, uninteresting) != 0;
 }
 
 typedef enum
@@ -3081,16 +3742,26 @@ static void rechokeDownloads(tr_swarm* s)
 
     if (peerCount > 0)
     {
-        bool* piece_is_interesting;
+        tr_bitfield uninteresting;
         tr_torrent const* const tor = s->tor;
-        int const n = tor->info.pieceCount;
+        tr_piece_index_t const n = tor->info.pieceCount;
 
-        /* build a bitfield of interesting pieces... */
-        piece_is_interesting = tr_new(bool, n);
+        /* build a bitfield of the pieces we don't want... */
+        tr_bitfieldConstruct(&uninteresting, n);
 
-        for (int i = 0; i < n; ++i)
+        if (tr_torrentHasAll(tor))
+        {
+            tr_bitfieldSetHasAll(&uninteresting);
+        }
+        else
         {
-            piece_is_interesting[i] = !tor->info.pieces[i].dnd && !tr_torrentPieceIsComplete(tor, i);
+            for (tr_piece_index_t i = 0; i < n; ++i)
+            {
+                if (tor->info.pieces[i].dnd || tr_torrentPieceIsComplete(tor, i))
+                {
+                    tr_bitfieldAdd(&uninteresting, i);
+                }
+            }
         }
 
         /* decide WHICH peers to be interested in (based on their cancel-to-block ratio) */
@@ -3098,7 +3769,7 @@ static void rechokeDownloads(tr_swarm* s)
         {
             tr_peer* peer = tr_ptrArrayNth(&s->peers, i);
 
-            if (!isPeerInteresting(s->tor, piece_is_interesting, peer))
+            if (!isPeerInteresting(&uninteresting, peer))
             {
                 tr_peerMsgsSetInterested(PEER_MSGS(peer), false);
             }
@@ -3141,7 +3812,7 @@ static void rechokeDownloads(tr_swarm* s)
             }
         }
 
-        tr_free(piece_is_interesting);
+        tr_bitfieldDestruct(&uninteresting);
     }
 
     /* now that we know which & how many peers to be interested in... update the peer interest */
@@ -3166,8 +3837,9 @@ struct ChokeData
     bool isInterested;
     bool wasChoked;
     bool isChoked;
-    int rate;
+    double utility;
     int salt;
+    tr_swarm* swarm;
     tr_peerMsgs* msgs;
 };
 
@@ -3176,9 +3848,14 @@ static int compareChoke(void const* va, void const* vb)
     struct ChokeData const* a = va;
     struct ChokeData const* b = vb;
 
-    if (a->rate != b->rate) /* prefer higher overall speeds */
+    if (a->utility > b->utility) /* prefer whoever gains the most from a slot */
+    {
+        return -1;
+    }
+
+    if (a->utility < b->utility)
     {
-        return a->rate > b->rate ? -1 : 1;
+        return 1;
     }
 
     if (a->wasChoked != b->wasChoked) /* prefer unchoked */
@@ -3194,6 +3871,11 @@ static int compareChoke(void const* va, void const* vb)
     return 0;
 }
 
+static int compareChokePtrs(void const* va, void const* vb)
+{
+    return compareChoke(*(struct ChokeData const* const*)va, *(struct ChokeData const* const*)vb);
+}
+
 /* is this a new connection? */
 static bool isNew(tr_peerMsgs const* msgs)
 {
@@ -3240,129 +3922,301 @@ static inline bool isBandwidthMaxedOut(tr_bandwidth const* b, uint64_t const now
     }
 }
 
-static void rechokeUploads(tr_swarm* s, uint64_t const now)
+/* how much a torrent's peers are worth relative to other torrents' */
+static double getUploadWeight(tr_torrent const* tor)
 {
-    TR_ASSERT(swarmIsLocked(s));
-
-    int const peerCount = tr_ptrArraySize(&s->peers);
-    tr_peer** peers = (tr_peer**)tr_ptrArrayBase(&s->peers);
-    struct ChokeData* choke = tr_new0(struct ChokeData, peerCount);
-    tr_session const* session = s->manager->session;
-    bool const chokeAll = !tr_torrentIsPieceTransferAllowed(s->tor, TR_CLIENT_TO_PEER);
-    bool const isMaxedOut = isBandwidthMaxedOut(&s->tor->bandwidth, now, TR_UP);
+    double weight;
+    double goal;
 
-    /* an optimistic unchoke peer's "optimistic"
-     * state lasts for N calls to rechokeUploads(). */
-    if (s->optimisticUnchokeTimeScaler > 0)
+    switch (tr_torrentGetPriority(tor))
     {
-        s->optimisticUnchokeTimeScaler--;
-    }
-    else
+    case TR_PRI_HIGH:
+        weight = 2.0;
+        break;
+
+    case TR_PRI_LOW:
+        weight = 0.5;
+        break;
+
+    default:
+        weight = 1.0;
+        break;
+    }
+
+    /* seeds that are far from their ratio goal need the slots more than ones that are nearly there */
+    if (tr_torrentIsSeed(tor) && tr_torrentGetSeedRatio(tor, &goal) && goal > 0)
+    {
+        uint64_t const up = tor->uploadedCur + tor->uploadedPrev;
+        uint64_t const down = tor->downloadedCur + tor->downloadedPrev;
+        double const ratio = tr_getRatio(up, down != 0 ? down : tr_cpSizeWhenDone(&tor->completion));
+
+        if (ratio >= 0)
+        {
+            weight *= 1.5 - MIN(ratio / goal, 1.0);
+        }
+    }
+
+    return weight;
+}
+
+/* how much we'd gain by giving this peer an upload slot */
+static double getChokeUtility(tr_torrent const* tor, tr_peer const* peer, uint64_t now, double weight)
+{
+    double utility = getRate(tor, peer->atom, now) + UNCHOKE_RATE_FLOOR_Bps;
+
+    /* when seeding, a peer that's missing more of the torrent gets more out of a slot */
+    if (tr_torrentIsSeed(tor))
     {
-        s->optimistic = NULL;
+        utility *= 1.5 - peer->progress;
     }
 
+    return utility * weight;
+}
+
+/* Hand out the session's upload slots.
+ *
+ * Every running torrent's best uploadSlotsPerTorrent interested peers
+ * compete for the session's slots on marginal utility, which folds in
+ * the peer's rate and need and the torrent's bandwidth priority and
+ * ratio goal. When the upload speed is limited, the number of slots is
+ * capped so that each can get a useful share of it; otherwise every
+ * contender gets one, as when torrents were rechoked on their own.
+ *
+ * Peers which aren't interested but rank above the cutoff are unchoked
+ * too, so that they can start right away if they become interested.
+ * Each torrent also keeps its own optimistic unchoke. */
+static void rechokeUploads(tr_peerMgr* mgr, uint64_t const now)
+{
+    TR_ASSERT(tr_sessionIsLocked(mgr->session));
+
+    tr_session* session = mgr->session;
+    tr_torrent* tor = NULL;
     int size = 0;
+    int maxSize = 0;
+    int contenderCount = 0;
+    int slotCount;
+    int unchokedCount = 0;
+    unsigned int limit_Bps = 0;
+    bool const isLimited = tr_sessionGetActiveSpeedLimit_Bps(session, TR_UP, &limit_Bps);
+    bool const isSessionMaxedOut = isBandwidthMaxedOut(&session->bandwidth, now, TR_UP);
+
+    /* make room for every running torrent's peers up front,
+     * since contenders[] points into choke[] */
+    while ((tor = tr_torrentNext(session, tor)) != NULL)
+    {
+        if (tor->isRunning)
+        {
+            maxSize += tr_ptrArraySize(&tor->swarm->peers);
+        }
+    }
 
-    /* sort the peers by preference and rate */
-    for (int i = 0; i < peerCount; ++i)
+    if (maxSize > mgr->chokeAlloc)
     {
-        tr_peer* peer = peers[i];
-        tr_peerMsgs* msgs = PEER_MSGS(peer);
+        mgr->chokeAlloc = MAX(mgr->chokeAlloc * 2, maxSize);
+        mgr->choke = tr_renew(struct ChokeData, mgr->choke, mgr->chokeAlloc);
+        mgr->contenders = tr_renew(struct ChokeData*, mgr->contenders, mgr->chokeAlloc);
+    }
 
-        struct peer_atom* atom = peer->atom;
+    /* gather every running torrent's candidates */
+    while ((tor = tr_torrentNext(session, tor)) != NULL)
+    {
+        tr_swarm* s = tor->swarm;
 
-        if (tr_peerIsSeed(peer))
+        if (!tor->isRunning || s->stats.peerCount == 0)
         {
-            /* choke seeds and partial seeds */
-            tr_peerMsgsSetChoke(PEER_MSGS(peer), true);
+            continue;
         }
-        else if (chokeAll)
+
+        int const peerCount = tr_ptrArraySize(&s->peers);
+        tr_peer** peers = (tr_peer**)tr_ptrArrayBase(&s->peers);
+        bool const chokeAll = !tr_torrentIsPieceTransferAllowed(tor, TR_CLIENT_TO_PEER);
+        double const weight = getUploadWeight(tor);
+        int const begin = size;
+        int interestedCount = 0;
+
+        /* an optimistic unchoke peer's "optimistic"
+         * state lasts for N calls to rechokeUploads(). */
+        if (s->optimisticUnchokeTimeScaler > 0)
         {
-            /* choke everyone if we're not uploading */
-            tr_peerMsgsSetChoke(PEER_MSGS(peer), true);
+            s->optimisticUnchokeTimeScaler--;
         }
-        else if (msgs != s->optimistic)
+        else
         {
-            struct ChokeData* n = &choke[size++];
-            n->msgs = msgs;
-            n->isInterested = tr_peerMsgsIsPeerInterested(msgs);
-            n->wasChoked = tr_peerMsgsIsPeerChoked(msgs);
-            n->rate = getRate(s->tor, atom, now);
-            n->salt = tr_rand_int_weak(INT_MAX);
-            n->isChoked = true;
+            s->optimistic = NULL;
         }
-    }
 
-    qsort(choke, size, sizeof(struct ChokeData), compareChoke);
+        TR_ASSERT(size + peerCount <= mgr->chokeAlloc);
 
-    /**
-     * Reciprocation and number of uploads capping is managed by unchoking
-     * the N peers which have the best upload rate and are interested.
-     * This maximizes the client's download rate. These N peers are
-     * referred to as downloaders, because they are interested in downloading
-     * from the client.
-     *
-     * Peers which have a better upload rate (as compared to the downloaders)
-     * but aren't interested get unchoked. If they become interested, the
-     * downloader with the worst upload rate gets choked. If a client has
-     * a complete file, it uses its upload rate rather than its download
-     * rate to decide which peers to unchoke.
-     *
-     * If our bandwidth is maxed out, don't unchoke any more peers.
-     */
-    int unchokedInterested = 0;
-    int checkedChokeCount = 0;
+        for (int i = 0; i < peerCount; ++i)
+        {
+            tr_peer* peer = peers[i];
+            tr_peerMsgs* msgs = PEER_MSGS(peer);
 
-    for (int i = 0; i < size && unchokedInterested < session->uploadSlotsPerTorrent; ++i, ++checkedChokeCount)
-    {
-        choke[i].isChoked = isMaxedOut ? choke[i].wasChoked : false;
+            if (tr_peerIsSeed(peer))
+            {
+                /* choke seeds and partial seeds */
+                tr_peerMsgsSetChoke(msgs, true);
+            }
+            else if (chokeAll)
+            {
+                /* choke everyone if we're not uploading */
+                tr_peerMsgsSetChoke(msgs, true);
+            }
+            else if (msgs != s->optimistic)
+            {
+                struct ChokeData* n = &mgr->choke[size++];
+                n->swarm = s;
+                n->msgs = msgs;
+                n->isInterested = tr_peerMsgsIsPeerInterested(msgs);
+                n->wasChoked = tr_peerMsgsIsPeerChoked(msgs);
+                n->isChoked = true;
+                n->utility = getChokeUtility(tor, peer, now, weight);
+                n->salt = tr_rand_int_weak(INT_MAX);
+
+                /* don't churn the slots over small differences */
+                if (!n->wasChoked)
+                {
+                    n->utility *= 1.1;
+                }
 
-        if (choke[i].isInterested)
+                if (n->isInterested)
+                {
+                    ++interestedCount;
+                }
+            }
+            else if (tr_peerMsgsIsPeerInterested(msgs))
+            {
+                ++unchokedCount;
+            }
+        }
+
+        /* this torrent's best interested peers become contenders */
+        int const first = contenderCount;
+
+        for (int i = begin; i < size; ++i)
         {
-            ++unchokedInterested;
+            if (mgr->choke[i].isInterested)
+            {
+                mgr->contenders[contenderCount++] = &mgr->choke[i];
+            }
         }
+
+        if (interestedCount > session->uploadSlotsPerTorrent)
+        {
+            tr_quickfindFirstK(mgr->contenders + first, interestedCount, sizeof(struct ChokeData*), compareChokePtrs,
+                session->uploadSlotsPerTorrent);
+            contenderCount = first + session->uploadSlotsPerTorrent;
+        }
+    }
+
+    /* decide how many slots the session can afford */
+    slotCount = contenderCount;
+
+    if (isLimited)
+    {
+        slotCount = MIN(slotCount, MAX(session->uploadSlotsPerTorrent, (int)(limit_Bps / UPLOAD_SLOT_MIN_SPEED_Bps)));
+    }
+
+    if (slotCount < contenderCount)
+    {
+        tr_quickfindFirstK(mgr->contenders, contenderCount, sizeof(struct ChokeData*), compareChokePtrs, slotCount);
     }
 
-    /* optimistic unchoke */
-    if (s->optimistic == NULL && !isMaxedOut && checkedChokeCount < size)
+    /* hand out the slots. if our bandwidth is maxed out, don't unchoke any more peers. */
+    double cutoff = 0;
+
+    for (int i = 0; i < slotCount; ++i)
+    {
+        struct ChokeData* c = mgr->contenders[i];
+        bool const isMaxedOut = isSessionMaxedOut || isBandwidthMaxedOut(&c->swarm->tor->bandwidth, now, TR_UP);
+
+        c->isChoked = isMaxedOut ? c->wasChoked : false;
+        cutoff = i == 0 ? c->utility : MIN(cutoff, c->utility);
+    }
+
+    if (slotCount == contenderCount)
     {
-        int n;
-        struct ChokeData* c;
-        tr_ptrArray randPool = TR_PTR_ARRAY_INIT;
+        cutoff = 0;
+    }
+
+    for (int begin = 0, end; begin < size; begin = end)
+    {
+        tr_swarm* s = mgr->choke[begin].swarm;
+        bool const isMaxedOut = isSessionMaxedOut || isBandwidthMaxedOut(&s->tor->bandwidth, now, TR_UP);
+
+        for (end = begin; end < size && mgr->choke[end].swarm == s; ++end)
+        {
+            struct ChokeData* c = &mgr->choke[end];
 
-        for (int i = checkedChokeCount; i < size; ++i)
+            /* let uninterested peers who'd have made the cut start right away */
+            if (!c->isInterested && c->utility >= cutoff)
+            {
+                c->isChoked = isMaxedOut ? c->wasChoked : false;
+            }
+        }
+
+        /* optimistic unchoke */
+        if (s->optimistic == NULL && !isMaxedOut)
         {
-            if (choke[i].isInterested)
+            int n;
+            tr_ptrArray randPool = TR_PTR_ARRAY_INIT;
+
+            for (int i = begin; i < end; ++i)
             {
-                tr_peerMsgs const* msgs = choke[i].msgs;
-                int const x = isNew(msgs) ? 3 : 1;
+                struct ChokeData* c = &mgr->choke[i];
 
-                for (int y = 0; y < x; ++y)
+                if (c->isInterested && c->isChoked)
                 {
-                    tr_ptrArrayAppend(&randPool, &choke[i]);
+                    int const x = isNew(c->msgs) ? 3 : 1;
+
+                    for (int y = 0; y < x; ++y)
+                    {
+                        tr_ptrArrayAppend(&randPool, c);
+                    }
                 }
             }
-        }
 
-        if ((n = tr_ptrArraySize(&randPool)) != 0)
-        {
-            c = tr_ptrArrayNth(&randPool, tr_rand_int_weak(n));
-            c->isChoked = false;
-            s->optimistic = c->msgs;
-            s->optimisticUnchokeTimeScaler = OPTIMISTIC_UNCHOKE_MULTIPLIER;
-        }
+            if ((n = tr_ptrArraySize(&randPool)) != 0)
+            {
+                struct ChokeData* c = tr_ptrArrayNth(&randPool, tr_rand_int_weak(n));
+                c->isChoked = false;
+                s->optimistic = c->msgs;
+                s->optimisticUnchokeTimeScaler = OPTIMISTIC_UNCHOKE_MULTIPLIER;
+            }
 
-        tr_ptrArrayDestruct(&randPool, NULL);
+            tr_ptrArrayDestruct(&randPool, NULL);
+        }
     }
 
     for (int i = 0; i < size; ++i)
     {
-        tr_peerMsgsSetChoke(choke[i].msgs, choke[i].isChoked);
+        struct ChokeData const* c = &mgr->choke[i];
+
+        tr_peerMsgsSetChoke(c->msgs, c->isChoked);
+
+        if (c->isInterested && !c->isChoked)
+        {
+            ++unchokedCount;
+        }
     }
 
-    /* cleanup */
-    tr_free(choke);
+    mgr->uploadSlotStats.slotCount = slotCount;
+    mgr->uploadSlotStats.unchokedCount = unchokedCount;
+    mgr->uploadSlotStats.speed_Bps = tr_bandwidthGetPieceSpeed_Bps(&session->bandwidth, now, TR_UP);
+    mgr->uploadSlotStats.limit_Bps = isLimited ? limit_Bps : 0;
+    mgr->uploadSlotStats.utilization = tr_getRatio(mgr->uploadSlotStats.speed_Bps, mgr->uploadSlotStats.limit_Bps);
+
+    dbgmsg("upload slots: %d of %d in use, %u of %u B/s", unchokedCount, slotCount, mgr->uploadSlotStats.speed_Bps,
+        mgr->uploadSlotStats.limit_Bps);
+}
+
+void tr_peerMgrGetUploadSlotStats(tr_peerMgr* mgr, tr_upload_slot_stats* setme)
+{
+    managerLock(mgr);
+
+    *setme = mgr->uploadSlotStats;
+
+    managerUnlock(mgr);
 }
 
 static void rechokePulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmgr)
@@ -3373,6 +4227,8 @@ static void rechokePulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmg
 
     managerLock(mgr);
 
+    rechokeUploads(mgr, now);
+
     while ((tor = tr_torrentNext(mgr->session, tor)) != NULL)
     {
         if (tor->isRunning)
@@ -3381,8 +4237,12 @@ static void rechokePulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmg
 
             if (s->stats.peerCount > 0)
             {
-                rechokeUploads(s, now);
                 rechokeDownloads(s);
+
+                if (tr_torrentIsSuperSeeding(tor))
+                {
+                    superSeedPulse(s);
+                }
             }
         }
     }
@@ -3473,7 +4333,7 @@ static tr_peer** getPeersToClose(tr_swarm* s, time_t const now_sec, int* setmeSi
 static int getReconnectIntervalSecs(struct peer_atom const* atom, time_t const now)
 {
     int sec;
-    bool const unreachable = (atom->flags2 & MYFLAG_UNREACHABLE) != 0;
+    bool const unreachable = atom->endpoint->unreachable;
 
     /* if we were recently connected to this peer and transferring piece
      * data, try to reconnect to them sooner rather that later -- we don't
@@ -3539,6 +4399,13 @@ static void removePeer(tr_swarm* s, tr_peer* peer)
 
     atom->time = tr_time();
 
+    /* remember how fast they were, for whichever swarm tries them next */
+    {
+        uint64_t const now_msec = tr_time_msec();
+        atom->endpoint->speed_Bps = tr_peerGetPieceSpeed_Bps(peer, now_msec, TR_CLIENT_TO_PEER) +
+            tr_peerGetPieceSpeed_Bps(peer, now_msec, TR_PEER_TO_CLIENT);
+    }
+
     tr_ptrArrayRemoveSortedPointer(&s->peers, peer, peerCompare);
     --s->stats.peerCount;
     --s->stats.peerFromCount[atom->fromFirst];
@@ -3552,6 +4419,8 @@ static void removePeer(tr_swarm* s, tr_peer* peer)
     TR_ASSERT(s->stats.peerFromCount[atom->fromFirst] >= 0);
 
     tr_peerFree(peer);
+
+    atomQueueUpdate(s, atom);
 }
 
 static void closePeer(tr_swarm* s, tr_peer* peer)
@@ -3917,17 +4786,6 @@ static void bandwidthPulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* v
 ****
 ***/
 
-static int compareAtomPtrsByAddress(void const* va, void const* vb)
-{
-    struct peer_atom const* a = *(struct peer_atom const* const*)va;
-    struct peer_atom const* b = *(struct peer_atom const* const*)vb;
-
-    TR_ASSERT(tr_isAtom(a));
-    TR_ASSERT(tr_isAtom(b));
-
-    return tr_address_compare(&a->addr, &b->addr);
-}
-
 /* best come first, worst go last */
 static int compareAtomPtrsByShelfDate(void const* va, void const* vb)
 {
@@ -3982,26 +4840,24 @@ static void atomPulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmgr)
 
     while ((tor = tr_torrentNext(mgr->session, tor)) != NULL)
     {
-        int atomCount;
         tr_swarm* s = tor->swarm;
+        int const atomCount = s->pool.atomCount;
         int const maxAtomCount = getMaxAtomCount(tor);
-        struct peer_atom** atoms = (struct peer_atom**)tr_ptrArrayPeek(&s->pool, &atomCount);
 
         if (atomCount > maxAtomCount) /* we've got too many atoms... time to prune */
         {
             int keepCount = 0;
             int testCount = 0;
-            struct peer_atom** keep = tr_new(struct peer_atom*, atomCount);
             struct peer_atom** test = tr_new(struct peer_atom*, atomCount);
 
             /* keep the ones that are in use */
             for (int i = 0; i < atomCount; ++i)
             {
-                struct peer_atom* atom = atoms[i];
+                struct peer_atom* atom = s->pool.atoms[i];
 
                 if (peerIsInUse(s, atom))
                 {
-                    keep[keepCount++] = atom;
+                    ++keepCount;
                 }
                 else
                 {
@@ -4009,40 +4865,26 @@ static void atomPulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmgr)
                 }
             }
 
-            /* if there's room, keep the best of what's left */
-            int i = 0;
+            /* if there's room, keep the best of what's left.
+             * we only need to know which ones make the cut, not their order */
+            int const room = MAX(0, maxAtomCount - keepCount);
 
-            if (keepCount < maxAtomCount)
+            if (room > 0 && room < testCount)
             {
-                qsort(test, testCount, sizeof(struct peer_atom*), compareAtomPtrsByShelfDate);
-
-                while (i < testCount && keepCount < maxAtomCount)
-                {
-                    keep[keepCount++] = test[i++];
-                }
+                tr_quickfindFirstK(test, testCount, sizeof(struct peer_atom*), compareAtomPtrsByShelfDate, room);
             }
 
             /* free the culled atoms */
-            while (i < testCount)
+            for (int i = room; i < testCount; ++i)
             {
-                tr_free(test[i++]);
+                swarmRemoveAtom(s, test[i]);
             }
 
-            /* rebuild Torrent.pool with what's left */
-            tr_ptrArrayDestruct(&s->pool, NULL);
-            s->pool = TR_PTR_ARRAY_INIT;
-            qsort(keep, keepCount, sizeof(struct peer_atom*), compareAtomPtrsByAddress);
-
-            for (int i = 0; i < keepCount; ++i)
-            {
-                tr_ptrArrayAppend(&s->pool, keep[i]);
-            }
-
-            tordbg(s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
+            tordbg(s, "max atom count is %d... pruned from %d to %d; atom pool is using %zu bytes", maxAtomCount, atomCount,
+                s->pool.atomCount, atomPoolGetMemory(&s->pool));
 
             /* cleanup */
             tr_free(test);
-            tr_free(keep);
         }
     }
 
@@ -4056,8 +4898,8 @@ static void atomPulse(evutil_socket_t foo UNUSED, short bar UNUSED, void* vmgr)
 ****
 ***/
 
-/* is this atom someone that we'd want to initiate a connection to? */
-static bool isPeerCandidate(tr_torrent const* tor, struct peer_atom* atom, time_t const now)
+/* would we want to initiate a connection to this atom, once its reconnect interval has passed? */
+static bool isAtomConnectable(tr_torrent const* tor, struct peer_atom* atom)
 {
     /* not if we're both seeds */
     if (tr_torrentIsSeed(tor) && atomIsSeed(atom))
@@ -4071,12 +4913,6 @@ static bool isPeerCandidate(tr_torrent const* tor, struct peer_atom* atom, time_
         return false;
     }
 
-    /* not if we just tried them already */
-    if (now - atom->time < getReconnectIntervalSecs(atom, now))
-    {
-        return false;
-    }
-
     /* not if they're blocklisted */
     if (isAtomBlocklisted(tor->session, atom))
     {
@@ -4092,12 +4928,22 @@ static bool isPeerCandidate(tr_torrent const* tor, struct peer_atom* atom, time_
     return true;
 }
 
-struct peer_candidate
+/* is this atom someone that we'd want to initiate a connection to? */
+static bool isPeerCandidate(tr_torrent const* tor, struct peer_atom* atom, time_t const now)
 {
-    uint64_t score;
-    tr_torrent* tor;
-    struct peer_atom* atom;
-};
+    if (!isAtomConnectable(tor, atom))
+    {
+        return false;
+    }
+
+    /* not if we just tried them already */
+    if (now - atomGetRetryBaseTime(atom) < getReconnectIntervalSecs(atom, now))
+    {
+        return false;
+    }
+
+    return true;
+}
 
 static bool torrentWasRecentlyStarted(tr_torrent const* tor)
 {
@@ -4153,7 +4999,7 @@ static uint64_t getPeerCandidateScore(tr_torrent const* tor, struct peer_atom co
     score = addValToKey(score, 1, i);
 
     /* prefer peers that are known to be connectible */
-    i = (atom->flags & ADDED_F_CONNECTABLE) != 0 ? 0 : 1;
+    i = (atomGetFlags(atom) & ADDED_F_CONNECTABLE) != 0 ? 0 : 1;
     score = addValToKey(score, 1, i);
 
     /* prefer peers that we might have a chance of uploading to...
@@ -4183,164 +5029,220 @@ static uint64_t getPeerCandidateScore(tr_torrent const* tor, struct peer_atom co
     return score;
 }
 
-static int comparePeerCandidates(void const* va, void const* vb)
-{
-    int ret;
-    struct peer_candidate const* a = va;
-    struct peer_candidate const* b = vb;
-
-    if (a->score < b->score)
-    {
-        ret = -1;
-    }
-    else if (a->score > b->score)
-    {
-        ret = 1;
-    }
-    else
-    {
-        ret = 0;
-    }
+/***
+****  Connection candidates
+****
+****  Rather than scoring every atom of every torrent on each reconnect
+****  pulse, each swarm keeps the atoms we might connect to in two heaps:
+****  `waitingAtoms' for the ones still inside their reconnect interval,
+****  keyed by when it ends, and `candidateAtoms' for the rest, keyed by
+****  getPeerCandidateScore(). An atom is moved between them whenever its
+****  state changes, so a pulse only has to look at the top of each heap.
+***/
 
-    return ret;
+static inline bool atomHeapIsBefore(struct atom_heap const* h, int a, int b)
+{
+    return h->items[a]->queueKey < h->items[b]->queueKey;
 }
 
-/* Partial sorting -- selecting the k best candidates
-   Adapted from http://en.wikipedia.org/wiki/Selection_algorithm */
-static void selectPeerCandidates(struct peer_candidate* candidates, int candidate_count, int select_count)
+static void atomHeapSwap(struct atom_heap* h, int a, int b)
 {
-    tr_quickfindFirstK(candidates, candidate_count, sizeof(struct peer_candidate), comparePeerCandidates, select_count);
+    struct peer_atom* tmp = h->items[a];
+    h->items[a] = h->items[b];
+    h->items[b] = tmp;
+    h->items[a]->queuePos = a;
+    h->items[b]->queuePos = b;
 }
 
-#ifdef TR_ENABLE_ASSERTS
-
-static bool checkBestScoresComeFirst(struct peer_candidate const* candidates, int n, int k)
+static void atomHeapSiftUp(struct atom_heap* h, int pos)
 {
-    uint64_t worstFirstScore = 0;
-    int const x = MIN(n, k) - 1;
-
-    for (int i = 0; i < x; i++)
+    while (pos > 0)
     {
-        if (worstFirstScore < candidates[i].score)
+        int const parent = (pos - 1) / 2;
+
+        if (!atomHeapIsBefore(h, pos, parent))
         {
-            worstFirstScore = candidates[i].score;
+            break;
         }
+
+        atomHeapSwap(h, pos, parent);
+        pos = parent;
     }
+}
 
-    for (int i = 0; i < x; i++)
+static void atomHeapSiftDown(struct atom_heap* h, int pos)
+{
+    for (;;)
     {
-        TR_ASSERT(candidates[i].score <= worstFirstScore);
+        int const left = pos * 2 + 1;
+        int const right = left + 1;
+        int best = pos;
+
+        if (left < h->n && atomHeapIsBefore(h, left, best))
+        {
+            best = left;
+        }
+
+        if (right < h->n && atomHeapIsBefore(h, right, best))
+        {
+            best = right;
+        }
+
+        if (best == pos)
+        {
+            break;
+        }
+
+        atomHeapSwap(h, pos, best);
+        pos = best;
     }
+}
 
-    for (int i = x + 1; i < n; i++)
+static void atomHeapPush(struct atom_heap* h, struct peer_atom* atom, uint64_t key)
+{
+    TR_ASSERT(atom->queue == NULL);
+
+    if (h->n == h->alloc)
     {
-        TR_ASSERT(candidates[i].score >= worstFirstScore);
+        h->alloc = h->alloc != 0 ? h->alloc * 2 : 16;
+        h->items = tr_renew(struct peer_atom*, h->items, h->alloc);
     }
 
-    return true;
+    atom->queue = h;
+    atom->queuePos = h->n;
+    atom->queueKey = key;
+    h->items[h->n++] = atom;
+    atomHeapSiftUp(h, atom->queuePos);
 }
 
-#endif /* TR_ENABLE_ASSERTS */
-
-/** @return an array of all the atoms we might want to connect to */
-static struct peer_candidate* getPeerCandidates(tr_session* session, int* candidateCount, int max)
+static inline struct peer_atom* atomHeapPeek(struct atom_heap const* h)
 {
-    int atomCount;
-    int peerCount;
-    tr_torrent* tor;
-    struct peer_candidate* candidates;
-    struct peer_candidate* walk;
-    time_t const now = tr_time();
-    uint64_t const now_msec = tr_time_msec();
-    /* leave 5% of connection slots for incoming connections -- ticket #2609 */
-    int const maxCandidates = tr_sessionGetPeerLimit(session) * 0.95;
+    return h->n > 0 ? h->items[0] : NULL;
+}
 
-    /* count how many peers and atoms we've got */
-    tor = NULL;
-    atomCount = 0;
-    peerCount = 0;
+static void atomQueueRemove(struct peer_atom* atom)
+{
+    struct atom_heap* h = atom->queue;
 
-    while ((tor = tr_torrentNext(session, tor)) != NULL)
+    if (h == NULL)
     {
-        atomCount += tr_ptrArraySize(&tor->swarm->pool);
-        peerCount += tr_ptrArraySize(&tor->swarm->peers);
+        return;
     }
 
-    /* don't start any new handshakes if we're full up */
-    if (maxCandidates <= peerCount)
+    int const pos = atom->queuePos;
+
+    TR_ASSERT(h->items[pos] == atom);
+
+    if (pos != --h->n)
     {
-        *candidateCount = 0;
-        return NULL;
+        h->items[pos] = h->items[h->n];
+        h->items[pos]->queuePos = pos;
+
+        if (pos > 0 && atomHeapIsBefore(h, pos, (pos - 1) / 2))
+        {
+            atomHeapSiftUp(h, pos);
+        }
+        else
+        {
+            atomHeapSiftDown(h, pos);
+        }
     }
 
-    /* allocate an array of candidates */
-    walk = candidates = tr_new(struct peer_candidate, atomCount);
+    atom->queue = NULL;
+}
 
-    /* populate the candidate array */
-    tor = NULL;
+/* move the atom into whichever heap matches its current state, if any */
+static void atomQueueUpdate(tr_swarm* s, struct peer_atom* atom)
+{
+    TR_ASSERT(tr_isAtom(atom));
 
-    while ((tor = tr_torrentNext(session, tor)) != NULL)
+    tr_torrent const* tor = s->tor;
+
+    atomQueueRemove(atom);
+
+    if (s->isRunning && isAtomConnectable(tor, atom))
     {
-        int nAtoms;
-        struct peer_atom** atoms;
+        time_t const now = tr_time();
+        time_t const base = atomGetRetryBaseTime(atom);
+        int const interval = getReconnectIntervalSecs(atom, now);
 
-        if (!tor->swarm->isRunning)
+        if (now - base < interval)
         {
-            continue;
+            atomHeapPush(&s->waitingAtoms, atom, base + interval);
         }
-
-        /* if we've already got enough peers in this torrent... */
-        if (tr_torrentGetPeerLimit(tor) <= tr_ptrArraySize(&tor->swarm->peers))
+        else
         {
-            continue;
+            uint8_t const salt = tr_rand_int_weak(1024);
+            atomHeapPush(&s->candidateAtoms, atom, getPeerCandidateScore(tor, atom, salt));
         }
+    }
+}
 
-        /* if we've already got enough speed in this torrent... */
-        if (tr_torrentIsSeed(tor) && isBandwidthMaxedOut(&tor->bandwidth, now_msec, TR_UP))
-        {
-            continue;
-        }
+/* the torrent-wide inputs to isAtomConnectable() and getPeerCandidateScore() */
+static int getSwarmCandidateState(tr_torrent const* tor)
+{
+    int state = tr_torrentGetPriority(tor) - TR_PRI_LOW;
+    state = (state << 1) | (torrentWasRecentlyStarted(tor) ? 1 : 0);
+    state = (state << 1) | (tr_torrentIsSeed(tor) ? 1 : 0);
+    return state;
+}
+
+static void swarmQueueRebuild(tr_swarm* s)
+{
+    int const atomCount = s->pool.atomCount;
+    struct peer_atom** atoms = s->pool.atoms;
 
-        atoms = (struct peer_atom**)tr_ptrArrayPeek(&tor->swarm->pool, &nAtoms);
+    for (int i = 0; i < atomCount; ++i)
+    {
+        atoms[i]->queue = NULL;
+    }
 
-        for (int i = 0; i < nAtoms; ++i)
-        {
-            struct peer_atom* atom = atoms[i];
+    s->waitingAtoms.n = 0;
+    s->candidateAtoms.n = 0;
+    s->candidateState = getSwarmCandidateState(s->tor);
 
-            if (isPeerCandidate(tor, atom, now))
-            {
-                uint8_t const salt = tr_rand_int_weak(1024);
-                walk->tor = tor;
-                walk->atom = atom;
-                walk->score = getPeerCandidateScore(tor, atom, salt);
-                ++walk;
-            }
-        }
+    for (int i = 0; i < atomCount; ++i)
+    {
+        atomQueueUpdate(s, atoms[i]);
     }
+}
+
+static void swarmQueueFree(tr_swarm* s)
+{
+    tr_free(s->waitingAtoms.items);
+    tr_free(s->candidateAtoms.items);
+}
 
-    *candidateCount = walk - candidates;
+/* promote the atoms whose reconnect interval has passed, and rescore
+ * the swarm if something that affects all of its atoms has changed */
+static void swarmQueueRefresh(tr_swarm* s, time_t const now)
+{
+    struct peer_atom* atom;
 
-    if (walk != candidates)
+    if (s->candidateState != getSwarmCandidateState(s->tor))
     {
-        selectPeerCandidates(candidates, walk - candidates, max);
+        swarmQueueRebuild(s);
+        return;
     }
 
-    TR_ASSERT(checkBestScoresComeFirst(candidates, *candidateCount, max));
-    return candidates;
+    while ((atom = atomHeapPeek(&s->waitingAtoms)) != NULL && atom->queueKey <= (uint64_t)now)
+    {
+        atomQueueUpdate(s, atom);
+    }
 }
 
 static void initiateConnection(tr_peerMgr* mgr, tr_swarm* s, struct peer_atom* atom)
 {
     tr_peerIo* io;
     time_t const now = tr_time();
-    bool utp = tr_sessionIsUTPEnabled(mgr->session) && !atom->utp_failed;
+    bool utp = tr_sessionIsUTPEnabled(mgr->session) && !atom->endpoint->utp_failed;
 
     if (atom->fromFirst == TR_PEER_FROM_PEX)
     {
         /* PEX has explicit signalling for uTP support.  If an atom
            originally came from PEX and doesn't have the uTP flag, skip the
            uTP connection attempt.  Are we being optimistic here? */
-        utp = utp && (atom->flags & ADDED_F_UTP_FLAGS) != 0;
+        utp = utp && (atomGetFlags(atom) & ADDED_F_UTP_FLAGS) != 0;
     }
 
     tordbg(s, "Starting an OUTGOING%s connection with %s", utp ? " µTP" : "", tr_atomAddrStr(atom));
@@ -4351,7 +5253,8 @@ static void initiateConnection(tr_peerMgr* mgr, tr_swarm* s, struct peer_atom* a
     if (io == NULL)
     {
         tordbg(s, "peerIo not created; marking peer %s as unreachable", tr_atomAddrStr(atom));
-        atom->flags2 |= MYFLAG_UNREACHABLE;
+        atom->endpoint->unreachable = true;
+        atom->endpoint->lastFailureAt = now;
         atom->numFails++;
     }
     else
@@ -4367,32 +5270,104 @@ static void initiateConnection(tr_peerMgr* mgr, tr_swarm* s, struct peer_atom* a
 
     atom->lastConnectionAttemptAt = now;
     atom->time = now;
+
+    atomQueueUpdate(s, atom);
 }
 
-static void initiateCandidateConnection(tr_peerMgr* mgr, struct peer_candidate* c)
+static void initiateCandidateConnection(tr_peerMgr* mgr, tr_swarm* s, struct peer_atom* atom)
 {
 #if 0
 
-    fprintf(stderr, "Starting an OUTGOING connection with %s - [%s] seedProbability==%d; %s, %s\n", tr_atomAddrStr(c->atom),
-        tr_torrentName(c->tor), (int)c->atom->seedProbability, tr_torrentIsPrivate(c->tor) ? "private" : "public",
-        tr_torrentIsSeed(c->tor) ? "seed" : "downloader");
+    fprintf(stderr, "Starting an OUTGOING connection with %s - [%s] seedProbability==%d; %s, %s\n", tr_atomAddrStr(atom),
+        tr_torrentName(s->tor), (int)atom->seedProbability, tr_torrentIsPrivate(s->tor) ? "private" : "public",
+        tr_torrentIsSeed(s->tor) ? "seed" : "downloader");
 
 #endif
 
-    initiateConnection(mgr, c->tor->swarm, c->atom);
+    initiateConnection(mgr, s, atom);
 }
 
 static void makeNewPeerConnections(struct tr_peerMgr* mgr, int const max)
 {
-    int n;
-    struct peer_candidate* candidates;
+    tr_session* session = mgr->session;
+    time_t const now = tr_time();
+    uint64_t const now_msec = tr_time_msec();
+    /* leave 5% of connection slots for incoming connections -- ticket #2609 */
+    int const maxCandidates = tr_sessionGetPeerLimit(session) * 0.95;
+    tr_swarm** swarms = tr_new(tr_swarm*, tr_sessionCountTorrents(session));
+    int swarmCount = 0;
+    int peerCount = 0;
+    int connectCount = 0;
+    tr_torrent* tor = NULL;
 
-    candidates = getPeerCandidates(mgr->session, &n, max);
+    /* find the swarms that may make new connections */
+    while ((tor = tr_torrentNext(session, tor)) != NULL)
+    {
+        tr_swarm* s = tor->swarm;
 
-    for (int i = 0; i < n && i < max; ++i)
+        peerCount += tr_ptrArraySize(&s->peers);
+
+        if (!s->isRunning)
+        {
+            continue;
+        }
+
+        swarmQueueRefresh(s, now);
+
+        /* if we've already got enough peers in this torrent... */
+        if (tr_torrentGetPeerLimit(tor) <= tr_ptrArraySize(&s->peers))
+        {
+            continue;
+        }
+
+        /* if we've already got enough speed in this torrent... */
+        if (tr_torrentIsSeed(tor) && isBandwidthMaxedOut(&tor->bandwidth, now_msec, TR_UP))
+        {
+            continue;
+        }
+
+        if (s->candidateAtoms.n > 0)
+        {
+            swarms[swarmCount++] = s;
+        }
+    }
+
+    /* don't start any new handshakes if we're full up */
+    while (maxCandidates > peerCount && connectCount < max)
     {
-        initiateCandidateConnection(mgr, &candidates[i]);
+        tr_swarm* best = NULL;
+        struct peer_atom* atom;
+
+        /* find the best-scoring candidate out of all the swarms */
+        for (int i = 0; i < swarmCount; ++i)
+        {
+            struct peer_atom const* top = atomHeapPeek(&swarms[i]->candidateAtoms);
+
+            if (top != NULL && (best == NULL || top->queueKey < atomHeapPeek(&best->candidateAtoms)->queueKey))
+            {
+                best = swarms[i];
+            }
+        }
+
+        if (best == NULL)
+        {
+            break;
+        }
+
+        atom = atomHeapPeek(&best->candidateAtoms);
+
+        if (isPeerCandidate(best->tor, atom, now))
+        {
+            initiateCandidateConnection(mgr, best, atom);
+            ++connectCount;
+        }
+        else
+        {
+            atomQueueUpdate(best, atom);
+        }
+
+        TR_ASSERT(atom->queue != &best->candidateAtoms);
     }
 
-    tr_free(candidates);
+    tr_free(swarms);
 }
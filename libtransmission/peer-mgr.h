@@ -85,7 +85,8 @@ void tr_peerMgrGetNextRequests(tr_torrent* torrent, tr_peer* peer, int numwant,
 
 bool tr_peerMgrDidPeerRequest(tr_torrent const* torrent, tr_peer const* peer, tr_block_index_t block);
 
-void tr_peerMgrRebuildRequests(tr_torrent* torrent);
+/* patch the list of pieces to request after these pieces' priorities or wanted state changed */
+void tr_peerMgrPiecesChanged(tr_torrent* torrent, struct tr_bitfield const* pieces);
 
 void tr_peerMgrAddIncoming(tr_peerMgr* manager, tr_address* addr, tr_port port, struct tr_peer_socket socket);
 
@@ -128,6 +129,36 @@ void tr_peerMgrOnTorrentGotMetainfo(tr_torrent* tor);
 
 void tr_peerMgrOnBlocklistChanged(tr_peerMgr* manager);
 
+void tr_peerMgrOnSuperSeedingChanged(tr_torrent* tor);
+
+/**
+ * @brief pick the next piece to reveal to a peer while super-seeding
+ *
+ * Of the pieces that the peer doesn't have and hasn't been shown yet,
+ * this picks the one that is least common in the swarm, counting both
+ * the peers that have it and the peers it has already been offered to.
+ * Ties go to the lowest piece index.
+ *
+ * @param replication how many peers have each piece, or NULL if unknown
+ * @param offers how many peers each piece has been revealed to, or NULL
+ * @return true if a piece was found
+ */
+bool tr_peerMgrGetNextSuperSeedPiece(size_t pieceCount, uint16_t const* replication, uint16_t const* offers,
+    struct tr_bitfield const* peerHave, struct tr_bitfield const* revealed, tr_piece_index_t* setme);
+
+/** @brief how the session's upload slots were handed out at the last rechoke */
+typedef struct tr_upload_slot_stats
+{
+    int slotCount; /* how many interested peers we were willing to unchoke */
+    int unchokedCount; /* how many interested peers we did unchoke */
+    unsigned int speed_Bps; /* our upload speed */
+    unsigned int limit_Bps; /* our upload speed limit, or 0 if unlimited */
+    double utilization; /* speed_Bps / limit_Bps, or TR_RATIO_NA if unlimited */
+}
+tr_upload_slot_stats;
+
+void tr_peerMgrGetUploadSlotStats(tr_peerMgr* mgr, tr_upload_slot_stats* setme);
+
 struct tr_peer_stat* tr_peerMgrPeerStats(tr_torrent const* tor, int* setmeCount);
 
 double* tr_peerMgrWebSpeeds_KBps(tr_torrent const* tor);
@@ -18,7 +18,9 @@
 #include "transmission.h"
 #include "cache.h"
 #include "completion.h"
+#include "disk-io.h"
 #include "file.h"
+#include "inout.h" /* tr_ioAddFileSegment() */
 #include "log.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
@@ -87,6 +89,8 @@ enum
     MAX_FAST_SET_SIZE = 3,
     /* how many blocks to keep prefetched per peer */
     PREFETCH_SIZE = 18,
+    /* how many blocks per peer can be waiting to be read from disk */
+    MAX_UPLOAD_READS = 4,
     /* when we're making requests from another peer,
        batch them together to send enough requests to
        meet our bandwidth goals for the next N seconds */
@@ -241,6 +245,17 @@ struct tr_peerMsgs
 
     struct event* pexTimer;
 
+    /* super-seeding: we told the peer we have nothing and
+       reveal pieces to it one at a time. */
+    bool superSeeding;
+    bool hasSuperSeedPiece;
+    tr_piece_index_t superSeedPiece;
+    tr_bitfield superSeedRevealed;
+
+    /* blocks being read from disk to upload to the peer */
+    tr_ptrArray uploadReads;
+    size_t uploadReadBytes;
+
     struct tr_peerIo* io;
 };
 
@@ -833,6 +848,70 @@ void tr_peerMsgsHave(tr_peerMsgs* msgs, uint32_t index)
     updateInterest(msgs);
 }
 
+/**
+***  Super-Seeding
+**/
+
+bool tr_peerMsgsIsSuperSeeding(tr_peerMsgs const* msgs)
+{
+    return msgs->superSeeding;
+}
+
+bool tr_peerMsgsGetSuperSeedPiece(tr_peerMsgs const* msgs, tr_piece_index_t* setme)
+{
+    if (!msgs->superSeeding || !msgs->hasSuperSeedPiece)
+    {
+        return false;
+    }
+
+    *setme = msgs->superSeedPiece;
+    return true;
+}
+
+struct tr_bitfield const* tr_peerMsgsGetSuperSeedRevealed(tr_peerMsgs const* msgs)
+{
+    return &msgs->superSeedRevealed;
+}
+
+void tr_peerMsgsSuperSeedReveal(tr_peerMsgs* msgs, tr_piece_index_t piece)
+{
+    TR_ASSERT(msgs->superSeeding);
+    TR_ASSERT(tr_torrentPieceIsComplete(msgs->torrent, piece));
+
+    dbgmsg(msgs, "super-seeding: revealing piece %" PRIu32, piece);
+
+    tr_bitfieldAdd(&msgs->superSeedRevealed, piece);
+    msgs->superSeedPiece = piece;
+    msgs->hasSuperSeedPiece = true;
+    protocolSendHave(msgs, piece);
+
+    /* the peer has nothing else to do until it sees this */
+    pokeBatchPeriod(msgs, HIGH_PRIORITY_INTERVAL_SECS);
+}
+
+void tr_peerMsgsStopSuperSeeding(tr_peerMsgs* msgs)
+{
+    if (!msgs->superSeeding)
+    {
+        return;
+    }
+
+    dbgmsg(msgs, "super-seeding stopped; revealing the rest of our pieces");
+
+    for (tr_piece_index_t i = 0, n = msgs->torrent->info.pieceCount; i < n; ++i)
+    {
+        if (!tr_bitfieldHas(&msgs->superSeedRevealed, i) && tr_torrentPieceIsComplete(msgs->torrent, i))
+        {
+            protocolSendHave(msgs, i);
+        }
+    }
+
+    msgs->superSeeding = false;
+    msgs->hasSuperSeedPiece = false;
+    tr_bitfieldSetHasNone(&msgs->superSeedRevealed);
+    pokeBatchPeriod(msgs, HIGH_PRIORITY_INTERVAL_SECS);
+}
+
 /**
 ***
 **/
@@ -922,7 +1001,8 @@ static void sendLtepHandshake(tr_peerMsgs* msgs)
 
     tr_variantDictAddInt(&val, TR_KEY_p, tr_sessionGetPublicPeerPort(getSession(msgs)));
     tr_variantDictAddInt(&val, TR_KEY_reqq, REQQ);
-    tr_variantDictAddBool(&val, TR_KEY_upload_only, tr_torrentIsSeed(msgs->torrent));
+    tr_variantDictAddBool(&val, TR_KEY_upload_only, tr_torrentIsSeed(msgs->torrent) &&
+        !tr_torrentIsSuperSeeding(msgs->torrent));
     tr_variantDictAddQuark(&val, TR_KEY_v, version_quark);
 
     if (allow_metadata_xfer || allow_pex)
@@ -1362,7 +1442,8 @@ static void peerMadeRequest(tr_peerMsgs* msgs, struct peer_request const* req)
 {
     bool const fext = tr_peerIoSupportsFEXT(msgs->io);
     bool const reqIsValid = requestIsValid(msgs, req);
-    bool const clientHasPiece = reqIsValid && tr_torrentPieceIsComplete(msgs->torrent, req->index);
+    bool const clientHasPiece = reqIsValid && tr_torrentPieceIsComplete(msgs->torrent, req->index) &&
+        !tr_torrentPieceIsChecking(msgs->torrent, req->index);
     bool const peerIsChoked = msgs->peer_is_choked;
 
     bool allow = false;
@@ -1375,6 +1456,10 @@ static void peerMadeRequest(tr_peerMsgs* msgs, struct peer_request const* req)
     {
         dbgmsg(msgs, "rejecting request for a piece we don't have.");
     }
+    else if (msgs->superSeeding && !tr_bitfieldHas(&msgs->superSeedRevealed, req->index))
+    {
+        dbgmsg(msgs, "rejecting request for a piece we haven't revealed yet.");
+    }
     else if (peerIsChoked)
     {
         dbgmsg(msgs, "rejecting request from choked peer");
@@ -2000,6 +2085,139 @@ static void updateBlockRequests(tr_peerMsgs* msgs)
     }
 }
 
+/* adds the header of a BT_PIECE message for `req' to `out' */
+static void addPieceHeader(struct evbuffer* out, struct peer_request const* req)
+{
+    evbuffer_add_uint32(out, sizeof(uint8_t) + 2 * sizeof(uint32_t) + req->length);
+    evbuffer_add_uint8(out, BT_PIECE);
+    evbuffer_add_uint32(out, req->index);
+    evbuffer_add_uint32(out, req->offset);
+}
+
+/* @return a new BT_PIECE message for `req', with space reserved in `iovec' for the block */
+static struct evbuffer* newPieceMessage(struct peer_request const* req, struct evbuffer_iovec* iovec)
+{
+    uint32_t const msglen = 4 + 1 + 4 + 4 + req->length;
+    struct evbuffer* out = evbuffer_new();
+
+    evbuffer_expand(out, msglen);
+    addPieceHeader(out, req);
+
+    evbuffer_reserve_space(out, req->length, iovec, 1);
+    iovec[0].iov_len = req->length;
+
+    return out;
+}
+
+/* a BT_PIECE message whose block is a reference to the file that holds it,
+ * so the kernel can send it straight from the page cache with sendfile().
+ * returns NULL if that can't be done */
+static struct evbuffer* newPieceFileMessage(tr_torrent* tor, struct peer_request const* req)
+{
+    struct evbuffer* out = evbuffer_new();
+
+    addPieceHeader(out, req);
+
+    if (!tr_ioAddFileSegment(tor, req->index, req->offset, req->length, out))
+    {
+        evbuffer_free(out);
+        out = NULL;
+    }
+
+    return out;
+}
+
+/* send a BT_PIECE message whose block has been read into `out', or a reject if it couldn't be.
+ * @return the number of bytes written, or 0 on error */
+static size_t sendPieceMessage(tr_peerMsgs* msgs, struct peer_request const* req, struct evbuffer* out, bool err, time_t now)
+{
+    size_t bytesWritten = 0;
+    bool const fext = tr_peerIoSupportsFEXT(msgs->io);
+
+    /* check the piece if it needs checking... */
+    if (!err && tr_torrentPieceNeedsCheck(msgs->torrent, req->index))
+    {
+        err = !tr_torrentCheckPiece(msgs->torrent, req->index);
+
+        if (err)
+        {
+            tr_torrentSetLocalError(msgs->torrent, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)req->index);
+        }
+    }
+
+    if (err)
+    {
+        if (fext)
+        {
+            protocolSendReject(msgs, req);
+        }
+    }
+    else
+    {
+        size_t const n = evbuffer_get_length(out);
+        dbgmsg(msgs, "sending block %u:%u->%u", req->index, req->offset, req->length);
+        TR_ASSERT(n == 4 + 1 + 4 + 4 + req->length);
+        tr_peerIoWriteBuf(msgs->io, out, true);
+        bytesWritten += n;
+        msgs->clientSentAnythingAt = now;
+        tr_historyAdd(&msgs->peer.blocksSentToPeer, tr_time(), 1);
+    }
+
+    return bytesWritten;
+}
+
+/* a block that's being read from disk to upload to a peer */
+struct upload_read
+{
+    tr_peerMsgs* msgs; /* NULL if the peer went away while it was being read */
+    struct peer_request req;
+    struct evbuffer* out;
+    struct evbuffer_iovec iovec[1];
+};
+
+static int compareUploadReads(void const* va, void const* vb)
+{
+    return va == vb ? 0 : (va < vb ? -1 : 1);
+}
+
+static void onUploadReadDone(tr_session* session UNUSED, int torrent_id UNUSED, int err, void* vread)
+{
+    struct upload_read* r = vread;
+    tr_peerMsgs* msgs = r->msgs;
+
+    evbuffer_commit_space(r->out, r->iovec, 1);
+
+    if (msgs != NULL)
+    {
+        tr_ptrArrayRemoveSortedPointer(&msgs->uploadReads, r, compareUploadReads);
+        msgs->uploadReadBytes -= r->req.length;
+
+        /* the peer may have choked or cancelled while we were reading */
+        if (sendPieceMessage(msgs, &r->req, r->out, err != 0, tr_time()) != 0)
+        {
+            peerPulse(msgs);
+        }
+    }
+
+    evbuffer_free(r->out);
+    tr_free(r);
+}
+
+static void startUploadRead(tr_peerMsgs* msgs, struct peer_request const* req)
+{
+    struct upload_read* r = tr_new0(struct upload_read, 1);
+
+    r->msgs = msgs;
+    r->req = *req;
+    r->out = newPieceMessage(req, r->iovec);
+
+    tr_ptrArrayInsertSorted(&msgs->uploadReads, r, compareUploadReads);
+    msgs->uploadReadBytes += req->length;
+
+    tr_cacheReadBlockAsync(getSession(msgs)->cache, msgs->torrent, req->index, req->offset, req->length, r->iovec[0].iov_base,
+        onUploadReadDone, r);
+}
+
 static size_t fillOutputBuffer(tr_peerMsgs* msgs, time_t now)
 {
     int piece;
@@ -2099,67 +2317,45 @@ static size_t fillOutputBuffer(tr_peerMsgs* msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if (tr_peerIoGetWriteBufferSpace(msgs->io, now) >= msgs->torrent->blockSize && popNextRequest(msgs, &req))
+    if (tr_peerIoGetWriteBufferSpace(msgs->io, now) >= msgs->torrent->blockSize + msgs->uploadReadBytes &&
+        tr_ptrArraySize(&msgs->uploadReads) < MAX_UPLOAD_READS && popNextRequest(msgs, &req))
     {
         --msgs->prefetchCount;
 
         if (requestIsValid(msgs, &req) && tr_torrentPieceIsComplete(msgs->torrent, req.index))
         {
-            bool err;
-            uint32_t const msglen = 4 + 1 + 4 + 4 + req.length;
-            struct evbuffer* out;
-            struct evbuffer_iovec iovec[1];
-
-            out = evbuffer_new();
-            evbuffer_expand(out, msglen);
-
-            evbuffer_add_uint32(out, sizeof(uint8_t) + 2 * sizeof(uint32_t) + req.length);
-            evbuffer_add_uint8(out, BT_PIECE);
-            evbuffer_add_uint32(out, req.index);
-            evbuffer_add_uint32(out, req.offset);
+            bool err = false;
+            struct evbuffer* out = NULL;
 
-            evbuffer_reserve_space(out, req.length, iovec, 1);
-            err = tr_cacheReadBlock(getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length,
-                iovec[0].iov_base) != 0;
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space(out, iovec, 1);
-
-            /* check the piece if it needs checking... */
-            if (!err && tr_torrentPieceNeedsCheck(msgs->torrent, req.index))
+            if (tr_cacheHasBlock(getSession(msgs)->cache, msgs->torrent, req.index, req.offset))
             {
-                err = !tr_torrentCheckPiece(msgs->torrent, req.index);
+                struct evbuffer_iovec iovec[1];
 
-                if (err)
-                {
-                    tr_torrentSetLocalError(msgs->torrent, _("Please Verify Local Data! Piece #%zu is corrupt."),
-                        (size_t)req.index);
-                }
+                out = newPieceMessage(&req, iovec);
+                err = tr_cacheReadBlock(getSession(msgs)->cache, msgs->torrent, req.index, req.offset, req.length,
+                    iovec[0].iov_base) != 0;
+                evbuffer_commit_space(out, iovec, 1);
+            }
+            else if (tr_peerIoSupportsSendfile(msgs->io))
+            {
+                out = newPieceFileMessage(msgs->torrent, &req);
             }
 
-            if (err)
+            if (out != NULL)
             {
-                if (fext)
+                bytesWritten += sendPieceMessage(msgs, &req, out, err, now);
+                evbuffer_free(out);
+
+                if (bytesWritten == 0)
                 {
-                    protocolSendReject(msgs, &req);
+                    msgs = NULL;
                 }
             }
             else
             {
-                size_t const n = evbuffer_get_length(out);
-                dbgmsg(msgs, "sending block %u:%u->%u", req.index, req.offset, req.length);
-                TR_ASSERT(n == msglen);
-                tr_peerIoWriteBuf(msgs->io, out, true);
-                bytesWritten += n;
-                msgs->clientSentAnythingAt = now;
-                tr_historyAdd(&msgs->peer.blocksSentToPeer, tr_time(), 1);
-            }
-
-            evbuffer_free(out);
-
-            if (err)
-            {
-                bytesWritten = 0;
-                msgs = NULL;
+                /* read it in the background so that a slow disk doesn't hold up the other peers */
+                startUploadRead(msgs, &req);
+                bytesWritten += req.length;
             }
         }
         else if (fext) /* peer needs a reject message */
@@ -2253,7 +2449,17 @@ static void tellPeerWhatWeHave(tr_peerMsgs* msgs)
 {
     bool const fext = tr_peerIoSupportsFEXT(msgs->io);
 
-    if (fext && tr_torrentHasAll(msgs->torrent))
+    if (tr_torrentIsSuperSeeding(msgs->torrent))
+    {
+        /* pretend to have nothing; the peer-mgr reveals pieces one by one */
+        msgs->superSeeding = true;
+
+        if (fext)
+        {
+            protocolSendHaveNone(msgs);
+        }
+    }
+    else if (fext && tr_torrentHasAll(msgs->torrent))
     {
         protocolSendHaveAll(msgs);
     }
@@ -2609,6 +2815,15 @@ static void peermsgs_destruct(tr_peer* peer)
         evbuffer_free(msgs->incoming.block);
     }
 
+    /* the reads will be freed when they're done */
+    for (int i = 0, n = tr_ptrArraySize(&msgs->uploadReads); i < n; ++i)
+    {
+        struct upload_read* r = tr_ptrArrayNth(&msgs->uploadReads, i);
+        r->msgs = NULL;
+    }
+
+    tr_ptrArrayDestruct(&msgs->uploadReads, NULL);
+
     if (msgs->io != NULL)
     {
         tr_peerIoClear(msgs->io);
@@ -2618,6 +2833,7 @@ static void peermsgs_destruct(tr_peer* peer)
     evbuffer_free(msgs->outMessages);
     tr_free(msgs->pex6);
     tr_free(msgs->pex);
+    tr_bitfieldDestruct(&msgs->superSeedRevealed);
 
     tr_peerDestruct(&msgs->peer);
 
@@ -2729,6 +2945,8 @@ tr_peerMsgs* tr_peerMsgsNew(struct tr_torrent* torrent, struct tr_peerIo* io, tr
     m->outMessages = evbuffer_new();
     m->outMessagesBatchedAt = 0;
     m->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
+    tr_bitfieldConstruct(&m->superSeedRevealed, torrent->info.pieceCount);
+    m->uploadReads = TR_PTR_ARRAY_INIT;
 
     if (tr_torrentAllowsPex(torrent))
     {
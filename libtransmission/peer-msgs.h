@@ -68,6 +68,20 @@ void tr_peerMsgsPulse(tr_peerMsgs* msgs);
 
 void tr_peerMsgsCancel(tr_peerMsgs* msgs, tr_block_index_t block);
 
+bool tr_peerMsgsIsSuperSeeding(tr_peerMsgs const* msgs);
+
+/** @brief get the piece most recently revealed to this peer while super-seeding */
+bool tr_peerMsgsGetSuperSeedPiece(tr_peerMsgs const* msgs, tr_piece_index_t* setme);
+
+/** @brief the pieces already revealed to this peer while super-seeding */
+struct tr_bitfield const* tr_peerMsgsGetSuperSeedRevealed(tr_peerMsgs const* msgs);
+
+/** @brief tell a super-seeded peer that we have this piece */
+void tr_peerMsgsSuperSeedReveal(tr_peerMsgs* msgs, tr_piece_index_t piece);
+
+/** @brief leave super-seeding mode, telling the peer about every piece we have */
+void tr_peerMsgsStopSuperSeeding(tr_peerMsgs* msgs);
+
 size_t tr_generateAllowedSet(tr_piece_index_t* setmePieces, size_t desiredSetSize, size_t pieceCount, uint8_t const* infohash,
     struct tr_address const* addr);
 
@@ -56,6 +56,9 @@ tr_thread* tr_threadNew(void (* func)(void*), void* arg);
     @param thread the thread being tested */
 bool tr_amInThread(tr_thread const* thread);
 
+/** @brief Return how many processors threads can run on, or 1 if that can't be told */
+unsigned int tr_getProcessorCount(void);
+
 /***
 ****
 ***/
@@ -77,4 +80,22 @@ void tr_lockUnlock(tr_lock*);
 /** @brief return nonzero if the specified lock is locked */
 bool tr_lockHave(tr_lock const*);
 
+typedef struct tr_cond tr_cond;
+
+/** @brief Create a new condition variable */
+tr_cond* tr_condNew(void);
+
+/** @brief Destroy a condition variable */
+void tr_condFree(tr_cond*);
+
+/**
+ * @brief Unlock `lock', sleep until the condition is signaled, then lock `lock' again.
+ * The caller must hold `lock' exactly once. Wakeups can be spurious, so check
+ * what you're waiting for in a loop.
+ */
+void tr_condWait(tr_cond*, tr_lock*);
+
+/** @brief Wake up every thread waiting on the condition variable */
+void tr_condBroadcast(tr_cond*);
+
 /* @} */
@@ -124,6 +124,7 @@ static struct tr_key_struct const my_static[] =
     Q("filter-mode"),
     Q("filter-text"),
     Q("filter-trackers"),
+    Q("fingerprints"),
     Q("flagStr"),
     Q("flags"),
     Q("format"),
@@ -155,6 +156,7 @@ static struct tr_key_struct const my_static[] =
     Q("info_hash"),
     Q("inhibit-desktop-hibernation"),
     Q("interval"),
+    Q("io-uring-enabled"),
     Q("ip"),
     Q("ipv4"),
     Q("ipv6"),
@@ -165,6 +167,7 @@ static struct tr_key_struct const my_static[] =
     Q("isIncoming"),
     Q("isPrivate"),
     Q("isStalled"),
+    Q("isSuperSeeding"),
     Q("isUTP"),
     Q("isUploadingTo"),
     Q("labels"),
@@ -215,6 +218,7 @@ static struct tr_key_struct const my_static[] =
     Q("nodes"),
     Q("nodes6"),
     Q("open-dialog-dir"),
+    Q("open-file-limit"),
     Q("p"),
     Q("path"),
     Q("path.utf-8"),
@@ -268,6 +272,7 @@ static struct tr_key_struct const my_static[] =
     Q("queue-stalled-enabled"),
     Q("queue-stalled-minutes"),
     Q("queuePosition"),
+    Q("quick"),
     Q("rateDownload"),
     Q("rateToClient"),
     Q("rateToPeer"),
@@ -275,6 +280,9 @@ static struct tr_key_struct const my_static[] =
     Q("ratio-limit"),
     Q("ratio-limit-enabled"),
     Q("ratio-mode"),
+    Q("read-cache-size-mb"),
+    Q("readCacheHits"),
+    Q("readCacheMisses"),
     Q("recent-download-dir-1"),
     Q("recent-download-dir-2"),
     Q("recent-download-dir-3"),
@@ -350,6 +358,8 @@ static struct tr_key_struct const my_static[] =
     Q("startDate"),
     Q("status"),
     Q("statusbar-stats"),
+    Q("super-seeding"),
+    Q("superSeeding"),
     Q("tag"),
     Q("tier"),
     Q("time-checked"),
@@ -383,7 +393,10 @@ static struct tr_key_struct const my_static[] =
     Q("uploadLimit"),
     Q("uploadLimited"),
     Q("uploadRatio"),
+    Q("uploadSlots"),
+    Q("uploadSlotsUsed"),
     Q("uploadSpeed"),
+    Q("uploadUtilization"),
     Q("upload_only"),
     Q("uploaded"),
     Q("uploaded-bytes"),
@@ -400,6 +413,8 @@ static struct tr_key_struct const my_static[] =
     Q("ut_recommend"),
     Q("utp-enabled"),
     Q("v"),
+    Q("verify-speed-limit"),
+    Q("verify-threads"),
     Q("version"),
     Q("wanted"),
     Q("warning message"),
@@ -124,6 +124,7 @@ enum
     TR_KEY_filter_mode,
     TR_KEY_filter_text,
     TR_KEY_filter_trackers,
+    TR_KEY_fingerprints,
     TR_KEY_flagStr,
     TR_KEY_flags,
     TR_KEY_format,
@@ -155,6 +156,7 @@ enum
     TR_KEY_info_hash,
     TR_KEY_inhibit_desktop_hibernation,
     TR_KEY_interval,
+    TR_KEY_io_uring_enabled,
     TR_KEY_ip,
     TR_KEY_ipv4,
     TR_KEY_ipv6,
@@ -165,6 +167,7 @@ enum
     TR_KEY_isIncoming,
     TR_KEY_isPrivate,
     TR_KEY_isStalled,
+    TR_KEY_isSuperSeeding,
     TR_KEY_isUTP,
     TR_KEY_isUploadingTo,
     TR_KEY_labels,
@@ -215,6 +218,7 @@ enum
     TR_KEY_nodes,
     TR_KEY_nodes6,
     TR_KEY_open_dialog_dir,
+    TR_KEY_open_file_limit,
     TR_KEY_p,
     TR_KEY_path,
     TR_KEY_path_utf_8,
@@ -268,6 +272,7 @@ enum
     TR_KEY_queue_stalled_enabled,
     TR_KEY_queue_stalled_minutes,
     TR_KEY_queuePosition,
+    TR_KEY_quick,
     TR_KEY_rateDownload,
     TR_KEY_rateToClient,
     TR_KEY_rateToPeer,
@@ -275,6 +280,9 @@ enum
     TR_KEY_ratio_limit,
     TR_KEY_ratio_limit_enabled,
     TR_KEY_ratio_mode,
+    TR_KEY_read_cache_size_mb,
+    TR_KEY_readCacheHits,
+    TR_KEY_readCacheMisses,
     TR_KEY_recent_download_dir_1,
     TR_KEY_recent_download_dir_2,
     TR_KEY_recent_download_dir_3,
@@ -350,6 +358,8 @@ enum
     TR_KEY_startDate,
     TR_KEY_status,
     TR_KEY_statusbar_stats,
+    TR_KEY_super_seeding,
+    TR_KEY_superSeeding,
     TR_KEY_tag,
     TR_KEY_tier,
     TR_KEY_time_checked,
@@ -383,7 +393,10 @@ enum
     TR_KEY_uploadLimit,
     TR_KEY_uploadLimited,
     TR_KEY_uploadRatio,
+    TR_KEY_uploadSlots,
+    TR_KEY_uploadSlotsUsed,
     TR_KEY_uploadSpeed,
+    TR_KEY_uploadUtilization,
     TR_KEY_upload_only,
     TR_KEY_uploaded,
     TR_KEY_uploaded_bytes,
@@ -400,6 +413,8 @@ enum
     TR_KEY_ut_recommend,
     TR_KEY_utp_enabled,
     TR_KEY_v,
+    TR_KEY_verify_speed_limit,
+    TR_KEY_verify_threads,
     TR_KEY_version,
     TR_KEY_wanted,
     TR_KEY_warning_message,
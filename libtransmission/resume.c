@@ -500,7 +500,7 @@ static void saveProgress(tr_variant* dict, tr_torrent* tor)
     tr_info const* inf = tr_torrentInfo(tor);
     time_t const now = tr_time();
 
-    prog = tr_variantDictAddDict(dict, TR_KEY_progress, 3);
+    prog = tr_variantDictAddDict(dict, TR_KEY_progress, 4);
 
     /* add the file/piece check timestamps... */
     l = tr_variantDictAddList(prog, TR_KEY_time_checked, inf->fileCount);
@@ -565,6 +565,26 @@ static void saveProgress(tr_variant* dict, tr_torrent* tor)
         }
     }
 
+    /* add the files' fingerprints, for quick verifies */
+    if (tor->fingerprints != NULL)
+    {
+        l = tr_variantDictAddList(prog, TR_KEY_fingerprints, inf->fileCount);
+
+        for (tr_file_index_t fi = 0; fi < inf->fileCount; ++fi)
+        {
+            tr_file_fingerprint const* fp = &tor->fingerprints[fi];
+            tr_variant* ll = tr_variantListAddList(l, fp->mtime != 0 ? 4 : 0);
+
+            if (fp->mtime != 0)
+            {
+                tr_variantListAddInt(ll, (int64_t)fp->size);
+                tr_variantListAddInt(ll, fp->mtime);
+                tr_variantListAddInt(ll, (int64_t)fp->device);
+                tr_variantListAddInt(ll, (int64_t)fp->inode);
+            }
+        }
+    }
+
     /* add the progress */
     if (tor->completeness == TR_SEED)
     {
@@ -664,6 +684,32 @@ static uint64_t loadProgress(tr_variant* dict, tr_torrent* tor)
             }
         }
 
+        if (tr_variantDictFindList(prog, TR_KEY_fingerprints, &l) && tr_variantListSize(l) == inf->fileCount)
+        {
+            tr_free(tor->fingerprints);
+            tor->fingerprints = tr_new0(tr_file_fingerprint, inf->fileCount);
+
+            for (tr_file_index_t fi = 0; fi < inf->fileCount; ++fi)
+            {
+                int64_t size;
+                int64_t mtime;
+                int64_t device;
+                int64_t inode;
+                tr_variant* ll = tr_variantListChild(l, fi);
+
+                if (tr_variantListSize(ll) == 4 && tr_variantGetInt(tr_variantListChild(ll, 0), &size) &&
+                    tr_variantGetInt(tr_variantListChild(ll, 1), &mtime) &&
+                    tr_variantGetInt(tr_variantListChild(ll, 2), &device) &&
+                    tr_variantGetInt(tr_variantListChild(ll, 3), &inode))
+                {
+                    tor->fingerprints[fi].size = (uint64_t)size;
+                    tor->fingerprints[fi].mtime = (time_t)mtime;
+                    tor->fingerprints[fi].device = (uint64_t)device;
+                    tor->fingerprints[fi].inode = (uint64_t)inode;
+                }
+            }
+        }
+
         err = NULL;
         tr_bitfieldConstruct(&blocks, tor->blockCount);
 
@@ -758,6 +804,7 @@ void tr_torrentSaveResume(tr_torrent* tor)
     tr_variantDictAddInt(&top, TR_KEY_uploaded, tor->uploadedPrev + tor->uploadedCur);
     tr_variantDictAddInt(&top, TR_KEY_max_peers, tor->maxConnectedPeers);
     tr_variantDictAddInt(&top, TR_KEY_bandwidth_priority, tr_torrentGetPriority(tor));
+    tr_variantDictAddBool(&top, TR_KEY_super_seeding, tor->superSeeding);
     tr_variantDictAddBool(&top, TR_KEY_paused, !tor->isRunning && !tor->isQueued);
     savePeers(&top, tor);
 
@@ -937,6 +984,12 @@ static uint64_t loadFromFile(tr_torrent* tor, uint64_t fieldsToLoad, bool* didRe
         fieldsLoaded |= TR_FR_BANDWIDTH_PRIORITY;
     }
 
+    if ((fieldsToLoad & TR_FR_SUPER_SEEDING) != 0 && tr_variantDictFindBool(&top, TR_KEY_super_seeding, &boolVal))
+    {
+        tor->superSeeding = boolVal;
+        fieldsLoaded |= TR_FR_SUPER_SEEDING;
+    }
+
     if ((fieldsToLoad & TR_FR_PEERS) != 0)
     {
         fieldsLoaded |= loadPeers(&top, tor);
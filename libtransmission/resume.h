@@ -36,7 +36,8 @@ enum
     TR_FR_TIME_DOWNLOADING = (1 << 19),
     TR_FR_FILENAMES = (1 << 20),
     TR_FR_NAME = (1 << 21),
-    TR_FR_LABELS = (1 << 22)
+    TR_FR_LABELS = (1 << 22),
+    TR_FR_SUPER_SEEDING = (1 << 23)
 };
 
 /**
@@ -16,12 +16,14 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "cache.h" /* tr_cacheGetReadStats() */
 #include "completion.h"
 #include "crypto-utils.h"
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "log.h"
+#include "peer-mgr.h" /* tr_peerMgrGetUploadSlotStats() */
 #include "platform-quota.h" /* tr_device_info_get_free_space() */
 #include "rpcimpl.h"
 #include "session.h"
@@ -388,12 +390,24 @@ static char const* torrentVerify(tr_session* session, tr_variant* args_in, tr_va
     TR_ASSERT(idle_data == NULL);
 
     int torrentCount;
+    bool quick = false;
     tr_torrent** torrents = getTorrents(session, args_in, &torrentCount);
 
+    tr_variantDictFindBool(args_in, TR_KEY_quick, &quick);
+
     for (int i = 0; i < torrentCount; ++i)
     {
         tr_torrent* tor = torrents[i];
-        tr_torrentVerify(tor, NULL, NULL);
+
+        if (quick)
+        {
+            tr_torrentVerifyQuick(tor, NULL, NULL);
+        }
+        else
+        {
+            tr_torrentVerify(tor, NULL, NULL);
+        }
+
         notify(session, TR_RPC_TORRENT_CHANGED, tor);
     }
 
@@ -657,6 +671,10 @@ static void initField(tr_torrent* const tor, tr_info const* const inf, tr_stat c
         tr_variantInitBool(initme, st->isStalled);
         break;
 
+    case TR_KEY_isSuperSeeding:
+        tr_variantInitBool(initme, st->isSuperSeeding);
+        break;
+
     case TR_KEY_labels:
         addLabels(tor, initme);
         break;
@@ -815,6 +833,10 @@ static void initField(tr_torrent* const tor, tr_info const* const inf, tr_stat c
         tr_variantInitInt(initme, st->secondsSeeding);
         break;
 
+    case TR_KEY_superSeeding:
+        tr_variantInitBool(initme, tr_torrentUsesSuperSeeding(tor));
+        break;
+
     case TR_KEY_trackers:
         tr_variantInitList(initme, inf->trackerCount);
         addTrackers(inf, initme);
@@ -1451,6 +1473,11 @@ static char const* torrentSet(tr_session* session, tr_variant* args_in, tr_varia
             tr_torrentSetRatioMode(tor, tmp);
         }
 
+        if (tr_variantDictFindBool(args_in, TR_KEY_superSeeding, &boolVal))
+        {
+            tr_torrentUseSuperSeeding(tor, boolVal);
+        }
+
         if (tr_variantDictFindInt(args_in, TR_KEY_queuePosition, &tmp))
         {
             tr_torrentSetQueuePosition(tor, tmp);
@@ -2005,6 +2032,11 @@ static char const* sessionSet(tr_session* session, tr_variant* args_in, tr_varia
         tr_sessionSetCacheLimit_MB(session, i);
     }
 
+    if (tr_variantDictFindInt(args_in, TR_KEY_read_cache_size_mb, &i))
+    {
+        tr_sessionSetReadCacheLimit_MB(session, i);
+    }
+
     if (tr_variantDictFindInt(args_in, TR_KEY_alt_speed_up, &i))
     {
         tr_sessionSetAltSpeed_KBps(session, TR_UP, i);
@@ -2236,6 +2268,9 @@ static char const* sessionStats(tr_session* session, tr_variant* args_in UNUSED,
     tr_variant* d;
     tr_session_stats currentStats = TR_SESSION_STATS_INIT;
     tr_session_stats cumulativeStats = TR_SESSION_STATS_INIT;
+    tr_upload_slot_stats slotStats;
+    uint64_t readCacheHits;
+    uint64_t readCacheMisses;
     tr_torrent* tor = NULL;
 
     while ((tor = tr_torrentNext(session, tor)) != NULL)
@@ -2250,12 +2285,19 @@ static char const* sessionStats(tr_session* session, tr_variant* args_in UNUSED,
 
     tr_sessionGetStats(session, &currentStats);
     tr_sessionGetCumulativeStats(session, &cumulativeStats);
+    tr_peerMgrGetUploadSlotStats(session->peerMgr, &slotStats);
+    tr_cacheGetReadStats(session->cache, &readCacheHits, &readCacheMisses);
 
     tr_variantDictAddInt(args_out, TR_KEY_activeTorrentCount, running);
     tr_variantDictAddReal(args_out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps(session, TR_DOWN));
     tr_variantDictAddInt(args_out, TR_KEY_pausedTorrentCount, total - running);
+    tr_variantDictAddInt(args_out, TR_KEY_readCacheHits, readCacheHits);
+    tr_variantDictAddInt(args_out, TR_KEY_readCacheMisses, readCacheMisses);
     tr_variantDictAddInt(args_out, TR_KEY_torrentCount, total);
+    tr_variantDictAddInt(args_out, TR_KEY_uploadSlots, slotStats.slotCount);
+    tr_variantDictAddInt(args_out, TR_KEY_uploadSlotsUsed, slotStats.unchokedCount);
     tr_variantDictAddReal(args_out, TR_KEY_uploadSpeed, tr_sessionGetPieceSpeed_Bps(session, TR_UP));
+    tr_variantDictAddReal(args_out, TR_KEY_uploadUtilization, slotStats.utilization);
 
     d = tr_variantDictAddDict(args_out, TR_KEY_cumulative_stats, 5);
     tr_variantDictAddInt(d, TR_KEY_downloadedBytes, cumulativeStats.downloadedBytes);
@@ -2318,6 +2360,10 @@ static void addSessionField(tr_session* s, tr_variant* d, tr_quark key)
         tr_variantDictAddInt(d, key, tr_sessionGetCacheLimit_MB(s));
         break;
 
+    case TR_KEY_read_cache_size_mb:
+        tr_variantDictAddInt(d, key, tr_sessionGetReadCacheLimit_MB(s));
+        break;
+
     case TR_KEY_blocklist_size:
         tr_variantDictAddInt(d, key, tr_blocklistGetRuleCount(s));
         break;
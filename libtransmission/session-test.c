@@ -10,12 +10,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include "transmission.h"
+#include "platform.h" /* tr_threadNew() */
 #include "session.h"
 #include "session-id.h"
+#include "trevent.h"
 #include "utils.h"
 #include "version.h"
 
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#else
 #undef VERBOSE
+#endif
+
 #include "libtransmission-test.h"
 
 static int testPeerId(void)
@@ -127,12 +136,265 @@ static int test_session_id(void)
     return 0;
 }
 
+/***
+****
+***/
+
+#define N_PRODUCERS 4
+#define N_CALLS 2000
+
+struct run_producer
+{
+    tr_session* session;
+    int index;
+    int seq[N_CALLS];
+    bool done;
+};
+
+struct run_state
+{
+    int ran;
+    int last[N_PRODUCERS];
+    bool inOrder;
+    bool inEventThread;
+};
+
+static struct run_state runState;
+
+static void onRun(void* vseq)
+{
+    int const* seq = vseq;
+    int const producer = *seq / N_CALLS;
+
+    if (*seq % N_CALLS != runState.last[producer] + 1)
+    {
+        runState.inOrder = false;
+    }
+
+    runState.last[producer] = *seq % N_CALLS;
+    ++runState.ran;
+}
+
+static void checkEventThread(void* vsession)
+{
+    runState.inEventThread = tr_amInEventThread(vsession);
+}
+
+static void producerFunc(void* vproducer)
+{
+    struct run_producer* producer = vproducer;
+
+    for (int i = 0; i < N_CALLS; ++i)
+    {
+        producer->seq[i] = producer->index * N_CALLS + i;
+        tr_runInEventThread(producer->session, onRun, &producer->seq[i]);
+    }
+
+    producer->done = true;
+}
+
+static int test_run_in_event_thread(void)
+{
+    tr_session* session;
+    struct run_producer producers[N_PRODUCERS];
+    bool done;
+
+    session = libttest_session_init(NULL);
+
+    runState.ran = 0;
+    runState.inOrder = true;
+    runState.inEventThread = false;
+
+    for (int i = 0; i < N_PRODUCERS; ++i)
+    {
+        runState.last[i] = -1;
+        producers[i].session = session;
+        producers[i].index = i;
+        producers[i].done = false;
+    }
+
+    tr_runInEventThread(session, checkEventThread, session);
+
+    for (int i = 0; i < N_PRODUCERS; ++i)
+    {
+        tr_threadNew(producerFunc, &producers[i]);
+    }
+
+    /* wait for the producers, then for the last of their calls to be run */
+    do
+    {
+        tr_wait_msec(10);
+        done = true;
+
+        for (int i = 0; i < N_PRODUCERS; ++i)
+        {
+            done = done && producers[i].done;
+        }
+    }
+    while (!done);
+
+    while (runState.ran < N_PRODUCERS * N_CALLS)
+    {
+        tr_wait_msec(10);
+    }
+
+    /* every call ran once, in the libevent thread, in the order each thread made them */
+    check(runState.inEventThread);
+    check(runState.inOrder);
+    check_int(runState.ran, ==, N_PRODUCERS * N_CALLS);
+
+    for (int i = 0; i < N_PRODUCERS; ++i)
+    {
+        check_int(runState.last[i], ==, N_CALLS - 1);
+    }
+
+    libttest_session_close(session);
+    return 0;
+}
+
+#if SPEED_TEST
+
+#define SPEED_CALLS 2000000
+#define LATENCY_SAMPLES 20000
+
+static uint64_t now_usec(void)
+{
+    struct timeval tv;
+
+    tr_gettimeofday(&tv);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+struct speed_producer
+{
+    tr_session* session;
+    int calls;
+};
+
+static int speedRan;
+
+static void onSpeedRun(void* unused UNUSED)
+{
+    ++speedRan;
+}
+
+static void speedProducerFunc(void* vproducer)
+{
+    struct speed_producer const* producer = vproducer;
+
+    for (int i = 0; i < producer->calls; ++i)
+    {
+        tr_runInEventThread(producer->session, onSpeedRun, NULL);
+    }
+}
+
+struct latency_state
+{
+    tr_lock* lock;
+    tr_cond* cond;
+    uint64_t sent;
+    bool ran;
+    int count;
+    uint64_t samples[LATENCY_SAMPLES];
+};
+
+static void onLatencyRun(void* vstate)
+{
+    struct latency_state* state = vstate;
+    uint64_t const now = now_usec();
+
+    tr_lockLock(state->lock);
+    state->samples[state->count++] = now - state->sent;
+    state->ran = true;
+    tr_condBroadcast(state->cond);
+    tr_lockUnlock(state->lock);
+}
+
+static int compareSamples(void const* va, void const* vb)
+{
+    uint64_t const a = *(uint64_t const*)va;
+    uint64_t const b = *(uint64_t const*)vb;
+
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/* how many calls the event thread runs per second when other threads flood it,
+ * and how long one call waits to be run when it's otherwise idle */
+static int test_run_in_event_thread_speed(void)
+{
+    int const producer_counts[] = { 1, 4 };
+    tr_session* session = libttest_session_init(NULL);
+    struct latency_state* state = tr_new0(struct latency_state, 1);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(producer_counts); ++i)
+    {
+        int const n = producer_counts[i];
+        struct speed_producer producers[4];
+        uint64_t start;
+        uint64_t usec;
+
+        speedRan = 0;
+        start = now_usec();
+
+        for (int j = 0; j < n; ++j)
+        {
+            producers[j].session = session;
+            producers[j].calls = SPEED_CALLS / n;
+            tr_threadNew(speedProducerFunc, &producers[j]);
+        }
+
+        while (speedRan < SPEED_CALLS / n * n)
+        {
+            tr_wait_msec(1);
+        }
+
+        usec = MAX(now_usec() - start, 1);
+        fprintf(stderr, "%d producer threads: %d calls in %.2f s (%.0f calls/s)\n", n, SPEED_CALLS / n * n, usec / 1e6,
+            (SPEED_CALLS / n * n) * 1e6 / usec);
+    }
+
+    state->lock = tr_lockNew();
+    state->cond = tr_condNew();
+
+    for (int i = 0; i < LATENCY_SAMPLES; ++i)
+    {
+        tr_lockLock(state->lock);
+        state->ran = false;
+        state->sent = now_usec();
+        tr_runInEventThread(session, onLatencyRun, state);
+
+        while (!state->ran)
+        {
+            tr_condWait(state->cond, state->lock);
+        }
+
+        tr_lockUnlock(state->lock);
+    }
+
+    qsort(state->samples, state->count, sizeof(state->samples[0]), compareSamples);
+    fprintf(stderr, "latency over %d calls: median %" PRIu64 " us, 99th percentile %" PRIu64 " us, max %" PRIu64 " us\n",
+        state->count, state->samples[state->count / 2], state->samples[state->count * 99 / 100],
+        state->samples[state->count - 1]);
+
+    tr_condFree(state->cond);
+    tr_lockFree(state->lock);
+    tr_free(state);
+    libttest_session_close(session);
+    return 0;
+}
+
+#endif
+
 int main(void)
 {
     testFunc const tests[] =
     {
         testPeerId,
-        test_session_id
+        test_session_id,
+        test_run_in_event_thread,
+#if SPEED_TEST
+        test_run_in_event_thread_speed
+#endif
     };
 
     return runTests(tests, NUM_TESTS(tests));
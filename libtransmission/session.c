@@ -30,6 +30,7 @@
 #include "blocklist.h"
 #include "cache.h"
 #include "crypto-utils.h"
+#include "disk-io.h"
 #include "error.h"
 #include "error-types.h"
 #include "fdlimit.h"
@@ -63,9 +64,11 @@ enum
 {
 #ifdef TR_LIGHTWEIGHT
     DEFAULT_CACHE_SIZE_MB = 2,
+    DEFAULT_READ_CACHE_SIZE_MB = 0,
     DEFAULT_PREFETCH_ENABLED = false,
 #else
     DEFAULT_CACHE_SIZE_MB = 4,
+    DEFAULT_READ_CACHE_SIZE_MB = 16,
     DEFAULT_PREFETCH_ENABLED = true,
 #endif
     SAVE_INTERVAL_SECS = 360
@@ -333,6 +336,7 @@ void tr_sessionGetDefaultSettings(tr_variant* d)
     tr_variantDictAddBool(d, TR_KEY_blocklist_enabled, false);
     tr_variantDictAddStr(d, TR_KEY_blocklist_url, "http://www.example.com/blocklist");
     tr_variantDictAddInt(d, TR_KEY_cache_size_mb, DEFAULT_CACHE_SIZE_MB);
+    tr_variantDictAddInt(d, TR_KEY_read_cache_size_mb, DEFAULT_READ_CACHE_SIZE_MB);
     tr_variantDictAddBool(d, TR_KEY_dht_enabled, true);
     tr_variantDictAddBool(d, TR_KEY_utp_enabled, true);
     tr_variantDictAddBool(d, TR_KEY_lpd_enabled, false);
@@ -358,6 +362,10 @@ void tr_sessionGetDefaultSettings(tr_variant* d)
     tr_variantDictAddBool(d, TR_KEY_port_forwarding_enabled, true);
     tr_variantDictAddInt(d, TR_KEY_preallocation, TR_PREALLOCATE_SPARSE);
     tr_variantDictAddBool(d, TR_KEY_prefetch_enabled, DEFAULT_PREFETCH_ENABLED);
+    tr_variantDictAddBool(d, TR_KEY_io_uring_enabled, false);
+    tr_variantDictAddInt(d, TR_KEY_open_file_limit, 0);
+    tr_variantDictAddInt(d, TR_KEY_verify_speed_limit, 0);
+    tr_variantDictAddInt(d, TR_KEY_verify_threads, 0);
     tr_variantDictAddInt(d, TR_KEY_peer_id_ttl_hours, 6);
     tr_variantDictAddBool(d, TR_KEY_queue_stalled_enabled, true);
     tr_variantDictAddInt(d, TR_KEY_queue_stalled_minutes, 30);
@@ -405,6 +413,7 @@ void tr_sessionGetSettings(tr_session* s, tr_variant* d)
     tr_variantDictAddBool(d, TR_KEY_blocklist_enabled, tr_blocklistIsEnabled(s));
     tr_variantDictAddStr(d, TR_KEY_blocklist_url, tr_blocklistGetURL(s));
     tr_variantDictAddInt(d, TR_KEY_cache_size_mb, tr_sessionGetCacheLimit_MB(s));
+    tr_variantDictAddInt(d, TR_KEY_read_cache_size_mb, tr_sessionGetReadCacheLimit_MB(s));
     tr_variantDictAddBool(d, TR_KEY_dht_enabled, s->isDHTEnabled);
     tr_variantDictAddBool(d, TR_KEY_utp_enabled, s->isUTPEnabled);
     tr_variantDictAddBool(d, TR_KEY_lpd_enabled, s->isLPDEnabled);
@@ -431,6 +440,10 @@ void tr_sessionGetSettings(tr_session* s, tr_variant* d)
     tr_variantDictAddBool(d, TR_KEY_port_forwarding_enabled, tr_sessionIsPortForwardingEnabled(s));
     tr_variantDictAddInt(d, TR_KEY_preallocation, s->preallocationMode);
     tr_variantDictAddBool(d, TR_KEY_prefetch_enabled, s->isPrefetchEnabled);
+    tr_variantDictAddBool(d, TR_KEY_io_uring_enabled, s->isIoUringEnabled);
+    tr_variantDictAddInt(d, TR_KEY_open_file_limit, s->openFileLimit);
+    tr_variantDictAddInt(d, TR_KEY_verify_speed_limit, toSpeedKBps(s->verifySpeedLimit_Bps));
+    tr_variantDictAddInt(d, TR_KEY_verify_threads, s->verifyThreads);
     tr_variantDictAddInt(d, TR_KEY_peer_id_ttl_hours, s->peer_id_ttl_hours);
     tr_variantDictAddBool(d, TR_KEY_queue_stalled_enabled, tr_sessionGetQueueStalledEnabled(s));
     tr_variantDictAddInt(d, TR_KEY_queue_stalled_minutes, tr_sessionGetQueueStalledMinutes(s));
@@ -612,6 +625,7 @@ tr_session* tr_sessionInit(char const* configDir, bool messageQueuingEnabled, tr
     session->udp6_socket = TR_BAD_SOCKET;
     session->lock = tr_lockNew();
     session->cache = tr_cacheNew(1024 * 1024 * 2);
+    session->diskIo = tr_diskIoNew(session);
     session->magicNumber = SESSION_MAGIC_NUMBER;
     session->session_id = tr_session_id_new();
     tr_bandwidthConstruct(&session->bandwidth, session, NULL);
@@ -825,6 +839,11 @@ static void sessionSetImpl(void* vdata)
         tr_sessionSetCacheLimit_MB(session, i);
     }
 
+    if (tr_variantDictFindInt(settings, TR_KEY_read_cache_size_mb, &i))
+    {
+        tr_sessionSetReadCacheLimit_MB(session, i);
+    }
+
     if (tr_variantDictFindInt(settings, TR_KEY_peer_limit_per_torrent, &i))
     {
         tr_sessionSetPeerLimitPerTorrent(session, i);
@@ -931,6 +950,26 @@ static void sessionSetImpl(void* vdata)
         session->isPrefetchEnabled = boolVal;
     }
 
+    if (tr_variantDictFindBool(settings, TR_KEY_io_uring_enabled, &boolVal))
+    {
+        session->isIoUringEnabled = boolVal;
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_open_file_limit, &i))
+    {
+        session->openFileLimit = i;
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_verify_speed_limit, &i))
+    {
+        session->verifySpeedLimit_Bps = toSpeedBytes(i);
+    }
+
+    if (tr_variantDictFindInt(settings, TR_KEY_verify_threads, &i))
+    {
+        session->verifyThreads = i;
+    }
+
     if (tr_variantDictFindInt(settings, TR_KEY_preallocation, &i))
     {
         session->preallocationMode = i;
@@ -1962,6 +2001,8 @@ static void sessionCloseImplStart(tr_session* session)
        it won't be idle until the announce events are sent... */
     tr_webClose(session, TR_WEB_CLOSE_WHEN_IDLE);
 
+    tr_diskIoFree(session->diskIo);
+
     tr_cacheFree(session->cache);
     session->cache = NULL;
 
@@ -2356,6 +2397,20 @@ int tr_sessionGetCacheLimit_MB(tr_session const* session)
     return toMemMB(tr_cacheGetLimit(session->cache));
 }
 
+void tr_sessionSetReadCacheLimit_MB(tr_session* session, int max_bytes)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    tr_cacheSetReadLimit(session->cache, toMemBytes(max_bytes));
+}
+
+int tr_sessionGetReadCacheLimit_MB(tr_session const* session)
+{
+    TR_ASSERT(tr_isSession(session));
+
+    return toMemMB(tr_cacheGetReadLimit(session->cache));
+}
+
 /***
 ****
 ***/
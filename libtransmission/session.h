@@ -103,6 +103,7 @@ struct tr_session
     bool isLPDEnabled;
     bool isBlocklistEnabled;
     bool isPrefetchEnabled;
+    bool isIoUringEnabled;
     bool isTorrentDoneScriptEnabled;
     bool isClosing;
     bool isClosed;
@@ -145,6 +146,15 @@ struct tr_session
     uint16_t peerLimit;
     uint16_t peerLimitPerTorrent;
 
+    /* how many local files to keep open, or 0 to size it from the process's fd limit */
+    int openFileLimit;
+
+    /* how many threads hash pieces during verification, or 0 for one per processor */
+    int verifyThreads;
+
+    /* how fast torrents are read during verification, or 0 for no limit */
+    unsigned int verifySpeedLimit_Bps;
+
     int uploadSlotsPerTorrent;
 
     /* The UDP sockets used for the DHT and uTP. */
@@ -194,6 +204,8 @@ struct tr_session
 
     struct tr_cache* cache;
 
+    struct tr_disk_io* diskIo;
+
     struct tr_lock* lock;
 
     struct tr_web* web;
@@ -30,6 +30,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto-utils.h" /* for tr_sha1 */
+#include "disk-io.h" /* tr_diskIoWaitForTorrent() */
 #include "error.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
 #include "file.h"
@@ -39,7 +40,7 @@
 #include "metainfo.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-mgr.h"
-#include "platform.h" /* TR_PATH_DELIMITER_STR */
+#include "platform.h" /* TR_PATH_DELIMITER_STR, tr_lock */
 #include "ptrarray.h"
 #include "resume.h"
 #include "session.h"
@@ -316,6 +317,29 @@ bool tr_torrentUsesSessionLimits(tr_torrent const* tor)
 ****
 ***/
 
+void tr_torrentUseSuperSeeding(tr_torrent* tor, bool doUse)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    if (tor->superSeeding != doUse)
+    {
+        tor->superSeeding = doUse;
+        tr_peerMgrOnSuperSeedingChanged(tor);
+        tr_torrentSetDirty(tor);
+    }
+}
+
+bool tr_torrentUsesSuperSeeding(tr_torrent const* tor)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+
+    return tor->superSeeding;
+}
+
+/***
+****
+***/
+
 void tr_torrentSetRatioMode(tr_torrent* tor, tr_ratiolimit mode)
 {
     TR_ASSERT(tr_isTorrent(tor));
@@ -671,65 +695,90 @@ static void initFilePieces(tr_info* info, tr_file_index_t fileIndex)
     file->lastPiece = getBytePiece(info, lastByte);
 }
 
+#ifdef TR_ENABLE_ASSERTS
+
 static bool pieceHasFile(tr_piece_index_t piece, tr_file const* file)
 {
     return file->firstPiece <= piece && piece <= file->lastPiece;
 }
 
-static tr_priority_t calculatePiecePriority(tr_torrent const* tor, tr_piece_index_t piece, int fileHint)
+#endif
+
+/* the priority that a file lends to one of its pieces */
+static tr_priority_t getFilePiecePriority(tr_file const* file, tr_piece_index_t piece)
+{
+    /* when dealing with multimedia files, getting the first and
+       last pieces can sometimes allow you to preview it a bit
+       before it's fully downloaded... */
+    if (file->priority >= TR_PRI_NORMAL && (file->firstPiece == piece || file->lastPiece == piece))
+    {
+        return TR_PRI_HIGH;
+    }
+
+    return file->priority;
+}
+
+/* add or remove a file's references to each of its pieces */
+static void refFilePieces(tr_torrent* tor, tr_file_index_t fileIndex, bool add)
 {
-    tr_file_index_t firstFileIndex;
-    tr_priority_t priority = TR_PRI_LOW;
+    tr_file const* file = &tor->info.files[fileIndex];
 
-    /* find the first file that has data in this piece */
-    if (fileHint >= 0)
+    for (tr_piece_index_t p = file->firstPiece; p <= file->lastPiece; ++p)
     {
-        firstFileIndex = fileHint;
+        tr_piece_refs* refs = &tor->pieceRefs[p];
+        tr_file_index_t* priorityRefs = &refs->priorities[getFilePiecePriority(file, p) - TR_PRI_LOW];
 
-        while (firstFileIndex > 0 && pieceHasFile(piece, &tor->info.files[firstFileIndex - 1]))
+        if (add)
         {
-            --firstFileIndex;
+            refs->wanted += file->dnd ? 0 : 1;
+            ++*priorityRefs;
         }
-    }
-    else
-    {
-        firstFileIndex = 0;
-
-        for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i, ++firstFileIndex)
+        else
         {
-            if (pieceHasFile(piece, &tor->info.files[i]))
-            {
-                break;
-            }
+            TR_ASSERT(file->dnd || refs->wanted > 0);
+            TR_ASSERT(*priorityRefs > 0);
+
+            refs->wanted -= file->dnd ? 0 : 1;
+            --*priorityRefs;
         }
     }
+}
 
-    /* the piece's priority is the max of the priorities
-     * of all the files in that piece */
-    for (tr_file_index_t i = firstFileIndex; i < tor->info.fileCount; ++i)
+/* Refresh the pieces' dnd flags and priorities from their references.
+ * A piece can't be DND unless every file using that piece is DND,
+ * and its priority is the max of the priorities of all its files.
+ * If `changed' isn't NULL, the pieces that change are added to it. */
+static void updatePieces(tr_torrent* tor, tr_piece_index_t first, tr_piece_index_t last, tr_bitfield* changed)
+{
+    for (tr_piece_index_t p = first; p <= last; ++p)
     {
-        tr_file const* file = &tor->info.files[i];
+        tr_piece* piece = &tor->info.pieces[p];
+        tr_piece_refs const* refs = &tor->pieceRefs[p];
+        bool const dnd = refs->wanted == 0;
+        tr_priority_t priority = TR_PRI_HIGH;
 
-        if (!pieceHasFile(piece, file))
+        while (priority > TR_PRI_LOW && refs->priorities[priority - TR_PRI_LOW] == 0)
         {
-            break;
+            --priority;
         }
 
-        priority = MAX(priority, file->priority);
-
-        /* when dealing with multimedia files, getting the first and
-           last pieces can sometimes allow you to preview it a bit
-           before it's fully downloaded... */
-        if (file->priority >= TR_PRI_NORMAL)
+        if (piece->dnd != dnd || piece->priority != priority)
         {
-            if (file->firstPiece == piece || file->lastPiece == piece)
+            /* whatever's been hashed of an unwanted piece would never be used */
+            if (dnd && !piece->dnd)
             {
-                priority = TR_PRI_HIGH;
+                tr_cacheDropPieceHash(tor->session->cache, tor, p);
+            }
+
+            piece->dnd = dnd;
+            piece->priority = priority;
+
+            if (changed != NULL)
+            {
+                tr_bitfieldAdd(changed, p);
             }
         }
     }
-
-    return priority;
 }
 
 static void tr_torrentInitFilePieces(tr_torrent* tor)
@@ -745,56 +794,48 @@ static void tr_torrentInitFilePieces(tr_torrent* tor)
         initFilePieces(inf, f);
     }
 
-    /* build the array of first-file hints to give calculatePiecePriority */
-    int* firstFiles = tr_new(int, inf->pieceCount);
+    /* Build the table of each piece's files. The files are in the same order as the
+     * pieces, so each piece's first file is the first one that doesn't end before it,
+     * and its last is the last one that doesn't start after it. */
+    tr_free(tor->pieceSpans);
+    tor->pieceSpans = tr_new(tr_piece_span, inf->pieceCount);
     tr_file_index_t f = 0;
 
     for (tr_piece_index_t p = 0; p < inf->pieceCount; ++p)
     {
+        tr_file_index_t n = 0;
+
         while (inf->files[f].lastPiece < p)
         {
             ++f;
         }
 
-        firstFiles[p] = f;
-    }
-
-#if 0
-
-    /* test to confirm the first-file hints are correct */
-    for (tr_piece_index_t p = 0; p < inf->pieceCount; ++p)
-    {
-        tr_file_index_t f = firstFiles[p];
-
-        TR_ASSERT(inf->files[f].firstPiece <= p);
-        TR_ASSERT(inf->files[f].lastPiece >= p);
-
-        if (f > 0)
+        while (f + n < inf->fileCount && inf->files[f + n].firstPiece <= p)
         {
-            TR_ASSERT(inf->files[f - 1].lastPiece < p);
+            ++n;
         }
 
-        f = 0;
-
-        for (tr_file_index_t i = 0; i < inf->fileCount; ++i, ++f)
-        {
-            if (pieceHasFile(p, &inf->files[i]))
-            {
-                break;
-            }
-        }
+        TR_ASSERT(n > 0);
+        TR_ASSERT(pieceHasFile(p, &inf->files[f]));
+        TR_ASSERT(pieceHasFile(p, &inf->files[f + n - 1]));
 
-        TR_ASSERT((int)f == firstFiles[p]);
+        tor->pieceSpans[p].firstFile = f;
+        tor->pieceSpans[p].fileCount = n;
     }
 
-#endif
+    /* count the files' references to their pieces */
+    tr_free(tor->pieceRefs);
+    tor->pieceRefs = tr_new0(tr_piece_refs, inf->pieceCount);
 
-    for (tr_piece_index_t p = 0; p < inf->pieceCount; ++p)
+    for (tr_file_index_t i = 0; i < inf->fileCount; ++i)
     {
-        inf->pieces[p].priority = calculatePiecePriority(tor, p, firstFiles[p]);
+        refFilePieces(tor, i, true);
     }
 
-    tr_free(firstFiles);
+    if (inf->pieceCount != 0)
+    {
+        updatePieces(tor, 0, inf->pieceCount - 1, NULL);
+    }
 }
 
 static void torrentStart(tr_torrent* tor, bool bypass_queue);
@@ -828,6 +869,10 @@ static void torrentInitFromInfo(tr_torrent* tor)
     uint64_t t;
     tr_info* info = &tor->info;
 
+    tr_torrentForgetFilePaths(tor);
+    tr_free(tor->fingerprints);
+    tor->fingerprints = NULL;
+
     tor->blockSize = tr_getBlockSize(info->pieceSize);
 
     if (info->pieceSize != 0)
@@ -876,6 +921,7 @@ static void torrentInitFromInfo(tr_torrent* tor)
     TR_ASSERT(t == (uint64_t)tor->blockCount);
 
     tr_cpConstruct(&tor->completion, tor);
+    tr_bitfieldConstruct(&tor->checkingPieces, info->pieceCount);
 
     tr_torrentInitFilePieces(tor);
 
@@ -1191,6 +1237,7 @@ void tr_torrentSetDownloadDir(tr_torrent* tor, char const* path)
     {
         tr_free(tor->downloadDir);
         tor->downloadDir = tr_strdup(path);
+        tr_torrentForgetFilePaths(tor);
 
         tr_torrentMarkEdited(tor);
         tr_torrentSetDirty(tor);
@@ -1378,6 +1425,7 @@ tr_stat const* tr_torrentStat(tr_torrent* tor)
     s->error = tor->error;
     s->queuePosition = tor->queuePosition;
     s->isStalled = tr_torrentIsStalled(tor);
+    s->isSuperSeeding = tr_torrentIsSuperSeeding(tor);
     tr_strlcpy(s->errorString, tor->errorString, sizeof(s->errorString));
 
     s->manualAnnounceTime = tr_announcerNextManualAnnounce(tor);
@@ -1527,51 +1575,6 @@ tr_stat const* tr_torrentStat(tr_torrent* tor)
 ****
 ***/
 
-static uint64_t countFileBytesCompleted(tr_torrent const* tor, tr_file_index_t index)
-{
-    uint64_t total = 0;
-    tr_file const* f = &tor->info.files[index];
-
-    if (f->length != 0)
-    {
-        tr_block_index_t first;
-        tr_block_index_t last;
-        tr_torGetFileBlockRange(tor, index, &first, &last);
-
-        if (first == last)
-        {
-            if (tr_torrentBlockIsComplete(tor, first))
-            {
-                total = f->length;
-            }
-        }
-        else
-        {
-            /* the first block */
-            if (tr_torrentBlockIsComplete(tor, first))
-            {
-                total += tor->blockSize - f->offset % tor->blockSize;
-            }
-
-            /* the middle blocks */
-            if (first + 1 < last)
-            {
-                uint64_t u = tr_bitfieldCountRange(&tor->completion.blockBitfield, first + 1, last);
-                u *= tor->blockSize;
-                total += u;
-            }
-
-            /* the last block */
-            if (tr_torrentBlockIsComplete(tor, last))
-            {
-                total += f->offset + f->length - (uint64_t)tor->blockSize * last;
-            }
-        }
-    }
-
-    return total;
-}
-
 tr_file_stat* tr_torrentFiles(tr_torrent const* tor, tr_file_index_t* fileCount)
 {
     TR_ASSERT(tr_isTorrent(tor));
@@ -1579,11 +1582,10 @@ tr_file_stat* tr_torrentFiles(tr_torrent const* tor, tr_file_index_t* fileCount)
     tr_file_index_t const n = tor->info.fileCount;
     tr_file_stat* files = tr_new0(tr_file_stat, n);
     tr_file_stat* walk = files;
-    bool const isSeed = tor->completeness == TR_SEED;
 
     for (tr_file_index_t i = 0; i < n; ++i, ++walk)
     {
-        uint64_t const b = isSeed ? tor->info.files[i].length : countFileBytesCompleted(tor, i);
+        uint64_t const b = tr_cpFileBytesCompleted(&tor->completion, i);
         walk->bytesCompleted = b;
         walk->progress = tor->info.files[i].length > 0 ? (float)b / tor->info.files[i].length : 1.0F;
     }
@@ -1700,12 +1702,20 @@ static void freeTorrent(tr_torrent* tor)
 
     tr_sessionLock(session);
 
+    tr_verifyRemove(tor);
+    tr_diskIoWaitForTorrent(tor);
+
     tr_peerMgrRemoveTorrent(tor);
 
     tr_announcerRemoveTorrent(session->announcer, tor);
 
     tr_cpDestruct(&tor->completion);
+    tr_bitfieldDestruct(&tor->checkingPieces);
 
+    tr_torrentForgetFilePaths(tor);
+    tr_free(tor->fingerprints);
+    tr_free(tor->pieceSpans);
+    tr_free(tor->pieceRefs);
     tr_free(tor->downloadDir);
     tr_free(tor->incompleteDir);
 
@@ -1759,6 +1769,8 @@ static void freeTorrent(tr_torrent* tor)
 
 static void torrentSetQueued(tr_torrent* tor, bool queued);
 
+static void checkFingerprints(tr_torrent* tor, bool stopping);
+
 static void torrentStartImpl(void* vtor)
 {
     tr_torrent* tor = vtor;
@@ -1767,6 +1779,10 @@ static void torrentStartImpl(void* vtor)
 
     tr_sessionLock(tor->session);
 
+    /* files that were changed while the torrent was stopped can't be trusted
+     * any more, even once we've written to them ourselves */
+    checkFingerprints(tor, false);
+
     tr_torrentRecheckCompleteness(tor);
     torrentSetQueued(tor, false);
 
@@ -1901,6 +1917,7 @@ void tr_torrentStartNow(tr_torrent* tor)
 struct verify_data
 {
     bool aborted;
+    bool quick;
     tr_torrent* tor;
     tr_verify_done_func callback_func;
     void* callback_data;
@@ -1918,6 +1935,8 @@ static void onVerifyDoneThreadFunc(void* vdata)
 
     if (!data->aborted)
     {
+        tr_torrentUpdateFingerprints(tor);
+        tr_torrentSetDirty(tor);
         tr_torrentRecheckCompleteness(tor);
     }
 
@@ -1983,25 +2002,36 @@ static void verifyTorrent(void* vdata)
     }
     else
     {
-        tr_verifyAdd(tor, onVerifyDone, data);
+        tr_verifyAdd(tor, data->quick, onVerifyDone, data);
     }
 
 unlock:
     tr_sessionUnlock(tor->session);
 }
 
-void tr_torrentVerify(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+static void queueVerify(tr_torrent* tor, bool quick, tr_verify_done_func callback_func, void* callback_data)
 {
     struct verify_data* data;
 
     data = tr_new(struct verify_data, 1);
     data->tor = tor;
     data->aborted = false;
+    data->quick = quick;
     data->callback_func = callback_func;
     data->callback_data = callback_data;
     tr_runInEventThread(tor->session, verifyTorrent, data);
 }
 
+void tr_torrentVerify(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+{
+    queueVerify(tor, false, callback_func, callback_data);
+}
+
+void tr_torrentVerifyQuick(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+{
+    queueVerify(tor, true, callback_func, callback_data);
+}
+
 void tr_torrentSave(tr_torrent* tor)
 {
     TR_ASSERT(tr_isTorrent(tor));
@@ -2013,6 +2043,8 @@ void tr_torrentSave(tr_torrent* tor)
     }
 }
 
+static void finishPieceChecks(tr_torrent* tor);
+
 static void stopTorrent(void* vtor)
 {
     tr_torrent* tor = vtor;
@@ -2027,11 +2059,16 @@ static void stopTorrent(void* vtor)
     tr_peerMgrStopTorrent(tor);
     tr_announcerTorrentStopped(tor);
     tr_cacheFlushTorrent(tor->session->cache, tor);
+    finishPieceChecks(tor);
 
     tr_fdTorrentClose(tor->session, tor->uniqueId);
 
     if (!tor->isDeleting)
     {
+        /* everything we've written is on disk now, so the trusted files
+         * that only we have changed still are */
+        checkFingerprints(tor, true);
+
         tr_torrentSave(tor);
     }
 
@@ -2287,6 +2324,13 @@ void tr_torrentRecheckCompleteness(tr_torrent* tor)
 
     completeness = tr_cpGetStatus(&tor->completion);
 
+    /* a piece that's being checked already counts as complete, but it
+     * might still fail. Wait for its check before finishing the torrent */
+    if (completeness != TR_LEECH && !tr_bitfieldHasNone(&tor->checkingPieces))
+    {
+        completeness = tor->completeness;
+    }
+
     if (completeness != tor->completeness)
     {
         bool const recentChange = tor->downloadedCur != 0;
@@ -2300,6 +2344,7 @@ void tr_torrentRecheckCompleteness(tr_torrent* tor)
         }
 
         tor->completeness = completeness;
+        tr_diskIoWaitForTorrent(tor);
         tr_fdTorrentClose(tor->session, tor->uniqueId);
 
         if (tr_torrentIsSeed(tor))
@@ -2370,20 +2415,26 @@ void tr_torrentSetMetadataCallback(tr_torrent* tor, tr_torrent_metadata_func fun
 ***  File priorities
 **/
 
+static void setFilePriority(tr_torrent* tor, tr_file_index_t fileIndex, tr_priority_t priority, tr_bitfield* changed)
+{
+    tr_file* file = &tor->info.files[fileIndex];
+
+    if (file->priority != priority)
+    {
+        refFilePieces(tor, fileIndex, false);
+        file->priority = priority;
+        refFilePieces(tor, fileIndex, true);
+        updatePieces(tor, file->firstPiece, file->lastPiece, changed);
+    }
+}
+
 void tr_torrentInitFilePriority(tr_torrent* tor, tr_file_index_t fileIndex, tr_priority_t priority)
 {
     TR_ASSERT(tr_isTorrent(tor));
     TR_ASSERT(fileIndex < tor->info.fileCount);
     TR_ASSERT(tr_isPriority(priority));
 
-    tr_file* file = &tor->info.files[fileIndex];
-
-    file->priority = priority;
-
-    for (tr_piece_index_t i = file->firstPiece; i <= file->lastPiece; ++i)
-    {
-        tor->info.pieces[i].priority = calculatePiecePriority(tor, i, fileIndex);
-    }
+    setFilePriority(tor, fileIndex, priority, NULL);
 }
 
 void tr_torrentSetFilePriorities(tr_torrent* tor, tr_file_index_t const* files, tr_file_index_t fileCount,
@@ -2391,18 +2442,23 @@ void tr_torrentSetFilePriorities(tr_torrent* tor, tr_file_index_t const* files,
 {
     TR_ASSERT(tr_isTorrent(tor));
 
+    tr_bitfield changed;
+
     tr_torrentLock(tor);
 
+    tr_bitfieldConstruct(&changed, tor->info.pieceCount);
+
     for (tr_file_index_t i = 0; i < fileCount; ++i)
     {
         if (files[i] < tor->info.fileCount)
         {
-            tr_torrentInitFilePriority(tor, files[i], priority);
+            setFilePriority(tor, files[i], priority, &changed);
         }
     }
 
     tr_torrentSetDirty(tor);
-    tr_peerMgrRebuildRequests(tor);
+    tr_peerMgrPiecesChanged(tor, &changed);
+    tr_bitfieldDestruct(&changed);
 
     tr_torrentUnlock(tor);
 }
@@ -2425,69 +2481,32 @@ tr_priority_t* tr_torrentGetFilePriorities(tr_torrent const* tor)
 ***  File DND
 **/
 
-static void setFileDND(tr_torrent* tor, tr_file_index_t fileIndex, bool doDownload)
+static void setFileDND(tr_torrent* tor, tr_file_index_t fileIndex, bool doDownload, tr_bitfield* changed)
 {
     bool const dnd = !doDownload;
-    tr_piece_index_t firstPiece;
-    bool firstPieceDND;
-    tr_piece_index_t lastPiece;
-    bool lastPieceDND;
     tr_file* file = &tor->info.files[fileIndex];
 
-    file->dnd = dnd;
-    firstPiece = file->firstPiece;
-    lastPiece = file->lastPiece;
-
-    /* can't set the first piece to DND unless
-       every file using that piece is DND */
-    firstPieceDND = dnd;
-
-    if (fileIndex > 0)
+    if (file->dnd != dnd)
     {
-        for (tr_file_index_t i = fileIndex - 1; firstPieceDND; --i)
-        {
-            if (tor->info.files[i].lastPiece != firstPiece)
-            {
-                break;
-            }
-
-            firstPieceDND = tor->info.files[i].dnd;
-
-            if (i == 0)
-            {
-                break;
-            }
-        }
+        refFilePieces(tor, fileIndex, false);
+        file->dnd = dnd;
+        refFilePieces(tor, fileIndex, true);
+        updatePieces(tor, file->firstPiece, file->lastPiece, changed);
     }
+}
 
-    /* can't set the last piece to DND unless
-       every file using that piece is DND */
-    lastPieceDND = dnd;
-
-    for (tr_file_index_t i = fileIndex + 1; lastPieceDND && i < tor->info.fileCount; ++i)
+static void setFileDLs(tr_torrent* tor, tr_file_index_t const* files, tr_file_index_t fileCount, bool doDownload,
+    tr_bitfield* changed)
+{
+    for (tr_file_index_t i = 0; i < fileCount; ++i)
     {
-        if (tor->info.files[i].firstPiece != lastPiece)
+        if (files[i] < tor->info.fileCount)
         {
-            break;
+            setFileDND(tor, files[i], doDownload, changed);
         }
-
-        lastPieceDND = tor->info.files[i].dnd;
     }
 
-    if (firstPiece == lastPiece)
-    {
-        tor->info.pieces[firstPiece].dnd = firstPieceDND && lastPieceDND;
-    }
-    else
-    {
-        tor->info.pieces[firstPiece].dnd = firstPieceDND;
-        tor->info.pieces[lastPiece].dnd = lastPieceDND;
-
-        for (tr_piece_index_t pp = firstPiece + 1; pp < lastPiece; ++pp)
-        {
-            tor->info.pieces[pp].dnd = dnd;
-        }
-    }
+    tr_cpInvalidateDND(&tor->completion);
 }
 
 void tr_torrentInitFileDLs(tr_torrent* tor, tr_file_index_t const* files, tr_file_index_t fileCount, bool doDownload)
@@ -2496,15 +2515,7 @@ void tr_torrentInitFileDLs(tr_torrent* tor, tr_file_index_t const* files, tr_fil
 
     tr_torrentLock(tor);
 
-    for (tr_file_index_t i = 0; i < fileCount; ++i)
-    {
-        if (files[i] < tor->info.fileCount)
-        {
-            setFileDND(tor, files[i], doDownload);
-        }
-    }
-
-    tr_cpInvalidateDND(&tor->completion);
+    setFileDLs(tor, files, fileCount, doDownload, NULL);
 
     tr_torrentUnlock(tor);
 }
@@ -2513,12 +2524,16 @@ void tr_torrentSetFileDLs(tr_torrent* tor, tr_file_index_t const* files, tr_file
 {
     TR_ASSERT(tr_isTorrent(tor));
 
+    tr_bitfield changed;
+
     tr_torrentLock(tor);
 
-    tr_torrentInitFileDLs(tor, files, fileCount, doDownload);
+    tr_bitfieldConstruct(&changed, tor->info.pieceCount);
+    setFileDLs(tor, files, fileCount, doDownload, &changed);
     tr_torrentSetDirty(tor);
     tr_torrentRecheckCompleteness(tor);
-    tr_peerMgrRebuildRequests(tor);
+    tr_peerMgrPiecesChanged(tor, &changed);
+    tr_bitfieldDestruct(&changed);
 
     tr_torrentUnlock(tor);
 }
@@ -2719,15 +2734,21 @@ void tr_torrentSetChecked(tr_torrent* tor, time_t when)
     }
 }
 
-bool tr_torrentCheckPiece(tr_torrent* tor, tr_piece_index_t pieceIndex)
+static void setPieceCheckResult(tr_torrent* tor, tr_piece_index_t pieceIndex, bool pass)
 {
-    bool const pass = tr_ioTestPiece(tor, pieceIndex);
-
-    tr_deeplog_tor(tor, "[LAZY] tr_torrentCheckPiece tested piece %zu, pass==%d", (size_t)pieceIndex, (int)pass);
+    tr_deeplog_tor(tor, "[LAZY] tested piece %zu, pass==%d", (size_t)pieceIndex, (int)pass);
     tr_torrentSetHasPiece(tor, pieceIndex, pass);
     tr_torrentSetPieceChecked(tor, pieceIndex);
+    tr_cachePieceChecked(tor->session->cache, tor, pieceIndex);
     tor->anyDate = tr_time();
     tr_torrentSetDirty(tor);
+}
+
+bool tr_torrentCheckPiece(tr_torrent* tor, tr_piece_index_t pieceIndex)
+{
+    bool const pass = tr_ioTestPiece(tor, pieceIndex);
+
+    setPieceCheckResult(tor, pieceIndex, pass);
 
     return pass;
 }
@@ -2744,11 +2765,232 @@ time_t tr_torrentGetFileMTime(tr_torrent const* tor, tr_file_index_t i)
     return mtime;
 }
 
+static void getFingerprint(tr_torrent const* tor, tr_file_index_t i, tr_file_fingerprint* setme)
+{
+    tr_sys_path_info info;
+    char* path = tr_torrentFindFile(tor, i);
+
+    memset(setme, 0, sizeof(tr_file_fingerprint));
+
+    if (path != NULL && tr_sys_path_get_info(path, 0, &info, NULL) && info.type == TR_SYS_PATH_IS_FILE)
+    {
+        setme->size = info.size;
+        setme->mtime = info.last_modified_at;
+        setme->device = info.device;
+        setme->inode = info.inode;
+    }
+
+    tr_free(path);
+}
+
+static bool fingerprintsAreEqual(tr_file_fingerprint const* a, tr_file_fingerprint const* b)
+{
+    return a->mtime == b->mtime && a->size == b->size && a->device == b->device && a->inode == b->inode;
+}
+
+void tr_torrentUpdateFingerprint(tr_torrent* tor, tr_file_index_t i)
+{
+    TR_ASSERT(i < tor->info.fileCount);
+
+    if (tor->fingerprints == NULL)
+    {
+        tor->fingerprints = tr_new0(tr_file_fingerprint, tor->info.fileCount);
+    }
+
+    getFingerprint(tor, i, &tor->fingerprints[i]);
+}
+
+void tr_torrentUpdateFingerprints(tr_torrent* tor)
+{
+    for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+    {
+        tr_torrentUpdateFingerprint(tor, i);
+    }
+}
+
+bool tr_torrentFingerprintMatches(tr_torrent const* tor, tr_file_index_t i)
+{
+    TR_ASSERT(i < tor->info.fileCount);
+
+    tr_file_fingerprint now;
+    tr_file_fingerprint const* then;
+
+    if (tor->fingerprints == NULL || (then = &tor->fingerprints[i])->mtime == 0)
+    {
+        return false;
+    }
+
+    getFingerprint(tor, i, &now);
+
+    return fingerprintsAreEqual(&now, then);
+}
+
+/* A look at the fingerprinted files of a torrent when it starts or stops.
+ * The files are stat()ed by a verify thread, since there can be a lot of them */
+struct fingerprint_check
+{
+    tr_session* session;
+    int torrent_id;
+    bool stopping;
+    tr_file_index_t count;
+    tr_file_index_t* files;
+    tr_file_fingerprint* then; /* the files' fingerprints when the check was queued */
+    tr_file_fingerprint* now; /* and what the files look like on disk */
+};
+
+static void freeFingerprintCheck(struct fingerprint_check* check)
+{
+    tr_free(check->now);
+    tr_free(check->then);
+    tr_free(check->files);
+    tr_free(check);
+}
+
+static void applyFingerprintCheck(void* vcheck)
+{
+    struct fingerprint_check* check = vcheck;
+    tr_torrent* tor;
+
+    tr_sessionLock(check->session);
+
+    if ((tor = tr_torrentFindFromId(check->session, check->torrent_id)) != NULL && tor->fingerprints != NULL)
+    {
+        for (tr_file_index_t i = 0; i < check->count; ++i)
+        {
+            tr_file_fingerprint* fp = &tor->fingerprints[check->files[i]];
+
+            /* leave alone the ones that have been taken again since */
+            if (!fingerprintsAreEqual(fp, &check->then[i]))
+            {
+                continue;
+            }
+
+            if (fingerprintsAreEqual(&check->now[i], fp))
+            {
+                if (check->stopping)
+                {
+                    fp->written = false;
+                }
+            }
+            else if (check->stopping && fp->written && check->now[i].mtime != 0)
+            {
+                /* the changes are ours, and they're all on disk now */
+                *fp = check->now[i];
+            }
+            else
+            {
+                /* someone else changed it, or it changed while we were stopped */
+                memset(fp, 0, sizeof(tr_file_fingerprint));
+            }
+        }
+
+        tr_torrentSetDirty(tor);
+    }
+
+    tr_sessionUnlock(check->session);
+
+    freeFingerprintCheck(check);
+}
+
+static void statFingerprintedFiles(tr_torrent* tor, bool const* stopFlag, void* vcheck)
+{
+    struct fingerprint_check* check = vcheck;
+
+    for (tr_file_index_t i = 0; i < check->count && !*stopFlag; ++i)
+    {
+        getFingerprint(tor, check->files[i], &check->now[i]);
+    }
+}
+
+static void onFingerprintsStatted(tr_torrent* tor UNUSED, bool aborted, void* vcheck)
+{
+    struct fingerprint_check* check = vcheck;
+
+    if (aborted)
+    {
+        freeFingerprintCheck(check);
+    }
+    else
+    {
+        tr_runInEventThread(check->session, applyFingerprintCheck, check);
+    }
+}
+
+/* drops the fingerprints of files that have changed. When the torrent's
+ * stopping, the ones that only we've changed are taken again instead */
+static void checkFingerprints(tr_torrent* tor, bool stopping)
+{
+    struct fingerprint_check* check;
+    tr_file_index_t n = 0;
+
+    if (tor->fingerprints == NULL)
+    {
+        return;
+    }
+
+    for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+    {
+        if (tor->fingerprints[i].mtime != 0)
+        {
+            ++n;
+        }
+    }
+
+    if (n == 0)
+    {
+        return;
+    }
+
+    check = tr_new(struct fingerprint_check, 1);
+    check->session = tor->session;
+    check->torrent_id = tor->uniqueId;
+    check->stopping = stopping;
+    check->count = 0;
+    check->files = tr_new(tr_file_index_t, n);
+    check->then = tr_new(tr_file_fingerprint, n);
+    check->now = tr_new0(tr_file_fingerprint, n);
+
+    for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+    {
+        if (tor->fingerprints[i].mtime != 0)
+        {
+            check->files[check->count] = i;
+            check->then[check->count] = tor->fingerprints[i];
+            ++check->count;
+        }
+    }
+
+    tr_verifyAddTask(tor, statFingerprintedFiles, onFingerprintsStatted, check);
+}
+
+/* notes which files a new block goes into, so that changes we've made
+ * to a trusted file can be told from someone else's */
+static void markFilesWritten(tr_torrent* tor, tr_block_index_t block)
+{
+    uint64_t const begin = (uint64_t)block * tor->blockSize;
+    uint64_t const end = begin + tr_torBlockCountBytes(tor, block);
+    tr_piece_span const* span = &tor->pieceSpans[tr_torBlockPiece(tor, block)];
+
+    if (tor->fingerprints == NULL)
+    {
+        return;
+    }
+
+    for (tr_file_index_t i = span->firstFile; i < span->firstFile + span->fileCount; ++i)
+    {
+        tr_file const* file = &tor->info.files[i];
+
+        if (file->offset < end && file->offset + file->length > begin)
+        {
+            tor->fingerprints[i].written = true;
+        }
+    }
+}
+
 bool tr_torrentPieceNeedsCheck(tr_torrent const* tor, tr_piece_index_t p)
 {
-    uint64_t unused;
-    tr_file_index_t f;
     tr_info const* inf = tr_torrentInfo(tor);
+    tr_piece_span const* span = &tor->pieceSpans[p];
 
     /* if we've never checked this piece, then it needs to be checked */
     if (inf->pieces[p].timeChecked == 0)
@@ -2759,9 +3001,7 @@ bool tr_torrentPieceNeedsCheck(tr_torrent const* tor, tr_piece_index_t p)
     /* If we think we've completed one of the files in this piece,
      * but it's been modified since we last checked it,
      * then it needs to be rechecked */
-    tr_ioFindFileLocation(tor, p, 0, &f, &unused);
-
-    for (tr_file_index_t i = f; i < inf->fileCount && pieceHasFile(p, &inf->files[i]); ++i)
+    for (tr_file_index_t i = span->firstFile; i < span->firstFile + span->fileCount; ++i)
     {
         if (tr_cpFileIsComplete(&tor->completion, i))
         {
@@ -3229,6 +3469,7 @@ static void tr_torrentDeleteLocalData(tr_torrent* tor, tr_fileFunc func)
     tr_fdTorrentClose(tor->session, tor->uniqueId);
 
     deleteLocalData(tor, func);
+    tr_torrentForgetFilePaths(tor);
 }
 
 /***
@@ -3257,6 +3498,7 @@ static void setLocation(void* vdata)
     bool const do_move = data->move_from_old_location;
     char const* location = data->location;
     double bytesHandled = 0;
+    bool* trusted = NULL;
 
     tr_logAddDebug("Moving \"%s\" location from currentDir \"%s\" to \"%s\"", tr_torrentName(tor), tor->currentDir, location);
 
@@ -3267,6 +3509,21 @@ static void setLocation(void* vdata)
         /* bad idea to move files while they're being verified... */
         tr_verifyRemove(tor);
 
+        /* ...or read and written */
+        tr_diskIoWaitForTorrent(tor);
+
+        /* moving a file doesn't change what's in it, so its fingerprint
+         * can be taken again afterwards if it could be trusted before */
+        if (do_move && tor->fingerprints != NULL)
+        {
+            trusted = tr_new(bool, tor->info.fileCount);
+
+            for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+            {
+                trusted[i] = tr_torrentFingerprintMatches(tor, i);
+            }
+        }
+
         /* try to move the files.
          * FIXME: there are still all kinds of nasty cases, like what
          * if the target directory runs out of space halfway through... */
@@ -3326,7 +3583,18 @@ static void setLocation(void* vdata)
             tr_free(tor->incompleteDir);
             tor->incompleteDir = NULL;
             tor->currentDir = tor->downloadDir;
+            tr_torrentForgetFilePaths(tor);
         }
+
+        for (tr_file_index_t i = 0; trusted != NULL && i < tor->info.fileCount; ++i)
+        {
+            if (trusted[i])
+            {
+                tr_torrentUpdateFingerprint(tor, i);
+            }
+        }
+
+        tr_torrentSetDirty(tor);
     }
 
     if (data->setme_state != NULL)
@@ -3336,6 +3604,7 @@ static void setLocation(void* vdata)
 
     /* cleanup */
     tr_torrentUnlock(tor);
+    tr_free(trusted);
     tr_free(data->location);
     tr_free(data);
 }
@@ -3405,29 +3674,121 @@ static void tr_torrentFileCompleted(tr_torrent* tor, tr_file_index_t fileIndex)
                 tr_error_free(error);
             }
 
+            tr_torrentForgetFilePath(tor, fileIndex);
             tr_free(newpath);
             tr_free(oldpath);
         }
 
         tr_free(sub);
     }
+
+    tr_torrentUpdateFingerprint(tor, fileIndex);
+    tr_torrentSetDirty(tor);
 }
 
 static void tr_torrentPieceCompleted(tr_torrent* tor, tr_piece_index_t pieceIndex)
 {
+    tr_piece_span const* span = &tor->pieceSpans[pieceIndex];
+
     tr_peerMgrPieceCompleted(tor, pieceIndex);
 
     /* if this piece completes any file, invoke the fileCompleted func for it */
-    for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+
+    for (tr_file_index_t i = span->firstFile; i < span->firstFile + span->fileCount; ++i)
     {
-        tr_file const* file = &tor->info.files[i];
+        if (tr_cpFileIsComplete(&tor->completion, i))
+        {
+            tr_torrentFileCompleted(tor, i);
+        }
+    }
+}
+
+static void onDownloadedPieceChecked(tr_torrent* tor, tr_piece_index_t p, bool pass)
+{
+    setPieceCheckResult(tor, p, pass);
 
-        if (file->firstPiece <= pieceIndex && pieceIndex <= file->lastPiece)
+    if (pass)
+    {
+        tr_torrentPieceCompleted(tor, p);
+    }
+    else
+    {
+        uint32_t const n = tr_torPieceCountBytes(tor, p);
+        tr_logAddTorErr(tor, _("Piece %" PRIu32 ", which was just downloaded, failed its checksum test"), p);
+        tor->corruptCur += n;
+        tor->downloadedCur -= MIN(tor->downloadedCur, n);
+        tr_peerMgrGotBadPiece(tor, p);
+    }
+}
+
+struct piece_check
+{
+    tr_piece_index_t piece;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+};
+
+static void onPieceHashed(tr_session* session, int torrent_id, int err, void* vcheck)
+{
+    struct piece_check* check = vcheck;
+    tr_torrent* tor;
+
+    tr_sessionLock(session);
+
+    tor = tr_torrentFindFromId(session, torrent_id);
+
+    /* unless the torrent's been stopped, which finishes its checks itself */
+    if (tor != NULL && tr_bitfieldHas(&tor->checkingPieces, check->piece))
+    {
+        tr_bitfieldRem(&tor->checkingPieces, check->piece);
+        onDownloadedPieceChecked(tor, check->piece, err == 0 &&
+            memcmp(check->hash, tor->info.pieces[check->piece].hash, SHA_DIGEST_LENGTH) == 0);
+    }
+
+    tr_sessionUnlock(session);
+
+    tr_free(check);
+}
+
+static void checkDownloadedPiece(tr_torrent* tor, tr_piece_index_t p)
+{
+    uint32_t hashed = 0;
+    struct piece_check* check;
+    tr_sha1_ctx_t sha = tr_cacheTakePieceHash(tor->session->cache, tor, p, &hashed);
+
+    /* usually the whole piece was hashed as it arrived... */
+    if (sha != NULL && hashed == tr_torPieceCountBytes(tor, p))
+    {
+        uint8_t hash[SHA_DIGEST_LENGTH];
+        onDownloadedPieceChecked(tor, p, tr_sha1_final(sha, hash) &&
+            memcmp(hash, tor->info.pieces[p].hash, SHA_DIGEST_LENGTH) == 0);
+        return;
+    }
+
+    if (sha == NULL)
+    {
+        sha = tr_sha1_init();
+        hashed = 0;
+    }
+
+    /* ...but if it wasn't, the rest is read back and hashed by a disk-io worker,
+     * after the piece's blocks have been written, to keep the disk off this thread */
+    tr_cacheFlushPiece(tor->session->cache, tor, p);
+
+    check = tr_new(struct piece_check, 1);
+    check->piece = p;
+    tr_bitfieldAdd(&tor->checkingPieces, p);
+    tr_diskIoHashPiece(tor, p, hashed, sha, check->hash, onPieceHashed, check);
+}
+
+/* called when a torrent stops, since its pieces' checks might not be delivered until after it's gone */
+static void finishPieceChecks(tr_torrent* tor)
+{
+    for (tr_piece_index_t p = 0; !tr_bitfieldHasNone(&tor->checkingPieces) && p < tor->info.pieceCount; ++p)
+    {
+        if (tr_bitfieldHas(&tor->checkingPieces, p))
         {
-            if (tr_cpFileIsComplete(&tor->completion, i))
-            {
-                tr_torrentFileCompleted(tor, i);
-            }
+            tr_bitfieldRem(&tor->checkingPieces, p);
+            onDownloadedPieceChecked(tor, p, tr_ioTestPiece(tor, p));
         }
     }
 }
@@ -3444,6 +3805,7 @@ void tr_torrentGotBlock(tr_torrent* tor, tr_block_index_t block)
         tr_piece_index_t p;
 
         tr_cpBlockAdd(&tor->completion, block);
+        markFilesWritten(tor, block);
         tr_torrentSetDirty(tor);
 
         p = tr_torBlockPiece(tor, block);
@@ -3451,19 +3813,7 @@ void tr_torrentGotBlock(tr_torrent* tor, tr_block_index_t block)
         if (tr_torrentPieceIsComplete(tor, p))
         {
             tr_logAddTorDbg(tor, "[LAZY] checking just-completed piece %zu", (size_t)p);
-
-            if (tr_torrentCheckPiece(tor, p))
-            {
-                tr_torrentPieceCompleted(tor, p);
-            }
-            else
-            {
-                uint32_t const n = tr_torPieceCountBytes(tor, p);
-                tr_logAddTorErr(tor, _("Piece %" PRIu32 ", which was just downloaded, failed its checksum test"), p);
-                tor->corruptCur += n;
-                tor->downloadedCur -= MIN(tor->downloadedCur, n);
-                tr_peerMgrGotBadPiece(tor, p);
-            }
+            checkDownloadedPiece(tor, p);
         }
     }
     else
@@ -3478,7 +3828,8 @@ void tr_torrentGotBlock(tr_torrent* tor, tr_block_index_t block)
 ****
 ***/
 
-bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char const** base, char** subpath, time_t* mtime)
+bool tr_torrentFindFileIn(tr_torrent const* tor, char const* downloadDir, char const* incompleteDir, tr_file_index_t fileNum,
+    char const** base, char** subpath, time_t* mtime)
 {
     TR_ASSERT(tr_isTorrent(tor));
     TR_ASSERT(fileNum < tor->info.fileCount);
@@ -3494,11 +3845,11 @@ bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char co
     /* look in the download dir... */
     if (b == NULL)
     {
-        char* filename = tr_buildPath(tor->downloadDir, file->name, NULL);
+        char* filename = tr_buildPath(downloadDir, file->name, NULL);
 
         if (tr_sys_path_get_info(filename, 0, &file_info, NULL))
         {
-            b = tor->downloadDir;
+            b = downloadDir;
             s = file->name;
         }
 
@@ -3506,13 +3857,13 @@ bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char co
     }
 
     /* look in the incomplete dir... */
-    if (b == NULL && tor->incompleteDir != NULL)
+    if (b == NULL && incompleteDir != NULL)
     {
-        char* filename = tr_buildPath(tor->incompleteDir, file->name, NULL);
+        char* filename = tr_buildPath(incompleteDir, file->name, NULL);
 
         if (tr_sys_path_get_info(filename, 0, &file_info, NULL))
         {
-            b = tor->incompleteDir;
+            b = incompleteDir;
             s = file->name;
         }
 
@@ -3525,13 +3876,13 @@ bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char co
     }
 
     /* look for a .part file in the incomplete dir... */
-    if (b == NULL && tor->incompleteDir != NULL)
+    if (b == NULL && incompleteDir != NULL)
     {
-        char* filename = tr_buildPath(tor->incompleteDir, part, NULL);
+        char* filename = tr_buildPath(incompleteDir, part, NULL);
 
         if (tr_sys_path_get_info(filename, 0, &file_info, NULL))
         {
-            b = tor->incompleteDir;
+            b = incompleteDir;
             s = part;
         }
 
@@ -3541,11 +3892,11 @@ bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char co
     /* look for a .part file in the download dir... */
     if (b == NULL)
     {
-        char* filename = tr_buildPath(tor->downloadDir, part, NULL);
+        char* filename = tr_buildPath(downloadDir, part, NULL);
 
         if (tr_sys_path_get_info(filename, 0, &file_info, NULL))
         {
-            b = tor->downloadDir;
+            b = downloadDir;
             s = part;
         }
 
@@ -3573,6 +3924,11 @@ bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char co
     return b != NULL;
 }
 
+bool tr_torrentFindFile2(tr_torrent const* tor, tr_file_index_t fileNum, char const** base, char** subpath, time_t* mtime)
+{
+    return tr_torrentFindFileIn(tor, tor->downloadDir, tor->incompleteDir, fileNum, base, subpath, mtime);
+}
+
 char* tr_torrentFindFile(tr_torrent const* tor, tr_file_index_t fileNum)
 {
     char* subpath;
@@ -3588,6 +3944,99 @@ char* tr_torrentFindFile(tr_torrent const* tor, tr_file_index_t fileNum)
     return ret;
 }
 
+/* The known file paths are shared with the disk-io threads */
+static tr_lock* getFilePathLock(void)
+{
+    static tr_lock* lock = NULL;
+
+    if (lock == NULL)
+    {
+        lock = tr_lockNew();
+    }
+
+    return lock;
+}
+
+char* tr_torrentGetKnownFilePath(tr_torrent* tor, tr_file_index_t fileNum, unsigned int* setme_generation)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(fileNum < tor->info.fileCount);
+
+    char* ret = NULL;
+
+    tr_lockLock(getFilePathLock());
+
+    if (tor->filePaths != NULL)
+    {
+        ret = tr_strdup(tor->filePaths[fileNum]);
+    }
+
+    *setme_generation = tor->filePathsGeneration;
+
+    tr_lockUnlock(getFilePathLock());
+    return ret;
+}
+
+void tr_torrentSetKnownFilePath(tr_torrent* tor, tr_file_index_t fileNum, char const* path, unsigned int generation)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(fileNum < tor->info.fileCount);
+
+    tr_lockLock(getFilePathLock());
+
+    /* if the files were moved while we were looking for this one,
+     * it might not be where we found it anymore */
+    if (generation == tor->filePathsGeneration)
+    {
+        if (tor->filePaths == NULL)
+        {
+            tor->filePaths = tr_new0(char*, tor->info.fileCount);
+        }
+
+        tr_free(tor->filePaths[fileNum]);
+        tor->filePaths[fileNum] = tr_strdup(path);
+    }
+
+    tr_lockUnlock(getFilePathLock());
+}
+
+void tr_torrentForgetFilePath(tr_torrent* tor, tr_file_index_t fileNum)
+{
+    TR_ASSERT(fileNum < tor->info.fileCount);
+
+    tr_lockLock(getFilePathLock());
+
+    if (tor->filePaths != NULL)
+    {
+        tr_free(tor->filePaths[fileNum]);
+        tor->filePaths[fileNum] = NULL;
+    }
+
+    ++tor->filePathsGeneration;
+
+    tr_lockUnlock(getFilePathLock());
+}
+
+void tr_torrentForgetFilePaths(tr_torrent* tor)
+{
+    tr_lockLock(getFilePathLock());
+
+    if (tor->filePaths != NULL)
+    {
+        for (tr_file_index_t i = 0; i < tor->info.fileCount; ++i)
+        {
+            tr_free(tor->filePaths[i]);
+        }
+
+        tr_free(tor->filePaths);
+        tor->filePaths = NULL;
+    }
+
+    ++tor->filePathsGeneration;
+
+    tr_lockUnlock(getFilePathLock());
+}
+
 /* Decide whether we should be looking for files in downloadDir or incompleteDir. */
 static void refreshCurrentDir(tr_torrent* tor)
 {
@@ -3839,6 +4288,9 @@ static int renamePath(tr_torrent* tor, char const* oldpath, char const* newname)
     char const* base;
     int err = 0;
 
+    /* don't let queued reads and writes go to the old name */
+    tr_diskIoWaitForTorrent(tor);
+
     if (!tr_torrentIsSeed(tor) && tor->incompleteDir != NULL)
     {
         base = tor->incompleteDir;
@@ -4002,6 +4454,8 @@ static void torrentRenamePath(void* vdata)
                     renameTorrentFileString(tor, oldpath, newname, file_indices[i]);
                 }
 
+                tr_torrentForgetFilePaths(tor);
+
                 /* update tr_info.name if user changed the toplevel */
                 if (n == tor->info.fileCount && strchr(oldpath, '/') == NULL)
                 {
@@ -107,6 +107,38 @@ tr_torrent_activity tr_torrentGetActivity(tr_torrent const* tor);
 
 struct tr_incomplete_metadata;
 
+/* What a file looked like the last time its pieces were known to match
+ * the torrent's completion, so a quick verify can tell if it's changed.
+ * It's all zeroes if there's no fingerprint for the file. */
+typedef struct tr_file_fingerprint
+{
+    uint64_t size;
+    time_t mtime;
+    uint64_t device;
+    uint64_t inode;
+    bool written; /* whether we've written to the file since, which isn't saved */
+}
+tr_file_fingerprint;
+
+/* The files that have bytes in a piece: info.files[firstFile] through
+ * info.files[firstFile + fileCount - 1]. Like tr_file.firstPiece and
+ * tr_file.lastPiece, this counts empty files at the piece's edges. */
+typedef struct tr_piece_span
+{
+    tr_file_index_t firstFile;
+    tr_file_index_t fileCount;
+}
+tr_piece_span;
+
+/* How many of a piece's files are wanted, and how many want each priority.
+ * A piece's dnd flag and priority are kept up to date from these. */
+typedef struct tr_piece_refs
+{
+    tr_file_index_t wanted;
+    tr_file_index_t priorities[TR_PRI_HIGH - TR_PRI_LOW + 1];
+}
+tr_piece_refs;
+
 /** @brief Torrent object */
 struct tr_torrent
 {
@@ -156,6 +188,24 @@ struct tr_torrent
      * This pointer will be equal to downloadDir or incompleteDir */
     char const* currentDir;
 
+    /* The disk queue that the torrent's reads and writes last went to,
+     * and how many of them (and of the writes) haven't been done yet.
+     * @see disk-io.h */
+    struct tr_disk_queue* diskQueue;
+    int diskIoPending;
+    int diskIoPendingWrites;
+
+    /* Where each file was last found or created, so that it can be
+     * reopened without looking for it again, or NULL if it hasn't been.
+     * The generation changes whenever files might have moved.
+     * @see tr_torrentGetKnownFilePath() */
+    char** filePaths;
+    unsigned int filePathsGeneration;
+
+    /* Each file's fingerprint, or NULL if none have been taken.
+     * @see tr_torrentUpdateFingerprint() */
+    tr_file_fingerprint* fingerprints;
+
     /* How many bytes we ask for per request */
     uint32_t blockSize;
     tr_block_index_t blockCount;
@@ -166,8 +216,16 @@ struct tr_torrent
     uint16_t blockCountInPiece;
     uint16_t blockCountInLastPiece;
 
+    /* Each piece's files, built when the metainfo's loaded */
+    tr_piece_span* pieceSpans;
+    tr_piece_refs* pieceRefs;
+
     struct tr_completion completion;
 
+    /* Downloaded pieces whose hashes are being checked by the disk-io workers.
+     * They aren't announced to peers until the check passes. */
+    tr_bitfield checkingPieces;
+
     tr_completeness completeness;
 
     struct tr_torrent_tiers* tiers;
@@ -251,6 +309,8 @@ struct tr_torrent
     tr_idlelimit idleLimitMode;
     bool finishedSeedingByIdle;
 
+    bool superSeeding;
+
     tr_ptrArray labels;
 };
 
@@ -380,6 +440,40 @@ void tr_torrentGotBlock(tr_torrent* tor, tr_block_index_t blockIndex);
  */
 bool tr_torrentFindFile2(tr_torrent const*, tr_file_index_t fileNo, char const** base, char** subpath, time_t* mtime);
 
+/**
+ * @brief Like tr_torrentFindFile2(), but looks in the given directories instead of the torrent's.
+ *
+ * The file's name is still the torrent's. Names are only changed once the torrent's
+ * queued disk-io jobs are done, so the disk-io workers can call this.
+ *
+ * @param incompleteDir may be NULL
+ */
+bool tr_torrentFindFileIn(tr_torrent const*, char const* downloadDir, char const* incompleteDir, tr_file_index_t fileNo,
+    char const** base, char** subpath, time_t* mtime);
+
+/**
+ * @brief Where a file was last found or created, to save looking for it again.
+ *
+ * These are safe to call from any thread.
+ *
+ * @param setme_generation is set to the current generation, to be passed to
+ *                         tr_torrentSetKnownFilePath() once the file's found
+ * @return a newly-allocated copy of the file's full path, or NULL if it isn't known
+ */
+char* tr_torrentGetKnownFilePath(tr_torrent* tor, tr_file_index_t fileNo, unsigned int* setme_generation);
+
+/**
+ * Remembers where a file was found or created, unless the torrent's
+ * files might have moved since `generation' was handed out.
+ */
+void tr_torrentSetKnownFilePath(tr_torrent* tor, tr_file_index_t fileNo, char const* path, unsigned int generation);
+
+/** @brief Forgets where a file is, for when it's been renamed or moved */
+void tr_torrentForgetFilePath(tr_torrent* tor, tr_file_index_t fileNo);
+
+/** @brief Forgets where all of the torrent's files are */
+void tr_torrentForgetFilePaths(tr_torrent* tor);
+
 /* Returns a newly-allocated version of the tr_file.name string
  * that's been modified to denote that it's not a complete file yet.
  * In the current implementation this is done by appending ".part"
@@ -406,6 +500,21 @@ bool tr_torrentCheckPiece(tr_torrent* tor, tr_piece_index_t pieceIndex);
 
 time_t tr_torrentGetFileMTime(tr_torrent const* tor, tr_file_index_t i);
 
+/**
+ * @brief Remembers what a file looks like on disk now.
+ *
+ * Only call this when the file's pieces in the torrent's completion are
+ * known to match what's on disk, such as after a verify or once the file's
+ * been flushed, since a quick verify trusts them for as long as it's unchanged.
+ */
+void tr_torrentUpdateFingerprint(tr_torrent* tor, tr_file_index_t i);
+
+/** @brief Like tr_torrentUpdateFingerprint(), for all of the torrent's files */
+void tr_torrentUpdateFingerprints(tr_torrent* tor);
+
+/** @return true if the file hasn't changed since its fingerprint was taken */
+bool tr_torrentFingerprintMatches(tr_torrent const* tor, tr_file_index_t i);
+
 uint64_t tr_torrentGetCurrentSizeOnDisk(tr_torrent const* tor);
 
 bool tr_torrentIsStalled(tr_torrent const* tor);
@@ -417,9 +526,10 @@ static inline uint64_t tr_torrentGetLeftUntilDone(tr_torrent const* tor)
     return tr_cpLeftUntilDone(&tor->completion);
 }
 
+/* pieces that are still being checked aren't counted, since they might yet fail */
 static inline bool tr_torrentHasAll(tr_torrent const* tor)
 {
-    return tr_cpHasAll(&tor->completion);
+    return tr_cpHasAll(&tor->completion) && tr_bitfieldHasNone(&tor->checkingPieces);
 }
 
 static inline bool tr_torrentHasNone(tr_torrent const* tor)
@@ -427,11 +537,23 @@ static inline bool tr_torrentHasNone(tr_torrent const* tor)
     return tr_cpHasNone(&tor->completion);
 }
 
+/* super-seeding only makes sense once we have every piece to hand out */
+static inline bool tr_torrentIsSuperSeeding(tr_torrent const* tor)
+{
+    return tor->superSeeding && tr_torrentHasAll(tor);
+}
+
 static inline bool tr_torrentPieceIsComplete(tr_torrent const* tor, tr_piece_index_t i)
 {
     return tr_cpPieceIsComplete(&tor->completion, i);
 }
 
+/* whether a piece's blocks are all here, but it hasn't passed its check yet */
+static inline bool tr_torrentPieceIsChecking(tr_torrent const* tor, tr_piece_index_t i)
+{
+    return tr_bitfieldHas(&tor->checkingPieces, i);
+}
+
 static inline bool tr_torrentBlockIsComplete(tr_torrent const* tor, tr_block_index_t i)
 {
     return tr_cpBlockIsComplete(&tor->completion, i);
@@ -471,6 +471,10 @@ void tr_sessionSetLPDEnabled(tr_session* session, bool enabled);
 void tr_sessionSetCacheLimit_MB(tr_session* session, int mb);
 int tr_sessionGetCacheLimit_MB(tr_session const* session);
 
+/** @brief how much memory to use for keeping pieces that are being uploaded, or 0 for none */
+void tr_sessionSetReadCacheLimit_MB(tr_session* session, int mb);
+int tr_sessionGetReadCacheLimit_MB(tr_session const* session);
+
 tr_encryption_mode tr_sessionGetEncryption(tr_session* session);
 void tr_sessionSetEncryption(tr_session* session, tr_encryption_mode mode);
 
@@ -1101,6 +1105,28 @@ bool tr_torrentUsesSpeedLimit(tr_torrent const*, tr_direction);
 void tr_torrentUseSessionLimits(tr_torrent*, bool);
 bool tr_torrentUsesSessionLimits(tr_torrent const*);
 
+/****
+*****  Super-Seeding
+****/
+
+/**
+ * @brief Enable or disable super-seeding (initial seeding) for a torrent.
+ *
+ * While super-seeding, a torrent that has every piece pretends to have
+ * none of them and reveals pieces to each peer one at a time, only
+ * offering a new piece once the previous one has been seen elsewhere
+ * in the swarm. This lets an initial seed push out a full copy of the
+ * torrent while uploading little more than a single copy itself.
+ *
+ * Peers that were already shown our pieces can't be made to forget them,
+ * so turning super-seeding on disconnects the torrent's current non-seed
+ * peers; they are super-seeded when they reconnect. Turning it off reveals
+ * the remaining pieces to every connected peer.
+ */
+void tr_torrentUseSuperSeeding(tr_torrent* tor, bool doUse);
+
+bool tr_torrentUsesSuperSeeding(tr_torrent const* tor);
+
 /****
 *****  Ratio Limits
 ****/
@@ -1564,6 +1590,14 @@ typedef void (* tr_verify_done_func)(tr_torrent* torrent, bool aborted, void* us
  */
 void tr_torrentVerify(tr_torrent* torrent, tr_verify_done_func callback_func_or_NULL, void* callback_data_or_NULL);
 
+/**
+ * Like tr_torrentVerify(), but only the files that have changed since they
+ * were last known to be good are fully hashed. The pieces in the other files
+ * are trusted, apart from a random sample that's hashed to spot-check them.
+ * If any of those fail, the rest of the torrent is verified too.
+ */
+void tr_torrentVerifyQuick(tr_torrent* torrent, tr_verify_done_func callback_func_or_NULL, void* callback_data_or_NULL);
+
 /***********************************************************************
  * tr_info
  **********************************************************************/
@@ -1855,6 +1889,11 @@ typedef struct tr_stat
     /** True if the torrent is running, but has been idle for long enough
         to be considered stalled.  @see tr_sessionGetQueueStalledMinutes() */
     bool isStalled;
+
+    /** True if super-seeding is enabled and the torrent is a complete seed,
+        so peers are currently being shown pieces one at a time.
+        @see tr_torrentUseSuperSeeding() */
+    bool isSuperSeeding;
 }
 tr_stat;
 
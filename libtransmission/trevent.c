@@ -17,6 +17,10 @@
 #include <unistd.h> /* read(), write(), pipe() */
 #endif
 
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #include <event2/dns.h>
 #include <event2/event.h>
 
@@ -26,7 +30,7 @@
 #include "session.h"
 
 #include "transmission.h"
-#include "platform.h" /* tr_lockLock() */
+#include "platform.h" /* tr_threadNew() */
 #include "tr-assert.h"
 #include "trevent.h"
 #include "utils.h"
@@ -148,76 +152,166 @@ typedef int tr_pipe_end_t;
 ****
 ***/
 
+struct tr_run_data
+{
+    struct tr_run_data* next;
+    void (* func)(void*);
+    void* user_data;
+};
+
 typedef struct tr_event_handle
 {
     bool die;
-    tr_pipe_end_t fds[2];
-    tr_lock* lock;
+
+    /* Functions waiting to be run in the libevent thread, newest first.
+     * Any thread may push onto it, and only the libevent thread takes
+     * things off of it, all at once, so it needs no lock. */
+    struct tr_run_data* volatile tasks;
+
+    /* The libevent thread is woken up by writing to wakeFds[1],
+     * and told to shut down by tr_eventClose() closing it.
+     * Where eventfd() is available, both are the same eventfd
+     * and shutting down is signalled by adding WAKE_CLOSE to it. */
+    tr_pipe_end_t wakeFds[2];
+
     tr_session* session;
     tr_thread* thread;
     struct event_base* base;
-    struct event* pipeEvent;
+    struct event* wakeEvent;
 }
 tr_event_handle;
 
-struct tr_run_data
+#define dbgmsg(...) tr_logAddDeepNamed("event", __VA_ARGS__)
+
+#ifdef HAVE_EVENTFD
+#define WAKE_CLOSE (UINT64_C(1) << 32)
+#endif
+
+#ifdef _WIN32
+
+static inline bool tasksCompareAndSwap(tr_event_handle* eh, struct tr_run_data* oldval, struct tr_run_data* newval)
 {
-    void (* func)(void*);
-    void* user_data;
-};
+    return InterlockedCompareExchangePointer((PVOID volatile*)&eh->tasks, newval, oldval) == oldval;
+}
 
-#define dbgmsg(...) tr_logAddDeepNamed("event", __VA_ARGS__)
+static inline struct tr_run_data* tasksTakeAll(tr_event_handle* eh)
+{
+    return InterlockedExchangePointer((PVOID volatile*)&eh->tasks, NULL);
+}
+
+#else
 
-static void readFromPipe(evutil_socket_t fd, short eventType, void* veh)
+static inline bool tasksCompareAndSwap(tr_event_handle* eh, struct tr_run_data* oldval, struct tr_run_data* newval)
 {
-    char ch;
-    int ret;
-    tr_event_handle* eh = veh;
+    return __atomic_compare_exchange_n(&eh->tasks, &oldval, newval, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
 
-    dbgmsg("readFromPipe: eventType is %hd", eventType);
+static inline struct tr_run_data* tasksTakeAll(tr_event_handle* eh)
+{
+    return __atomic_exchange_n(&eh->tasks, NULL, __ATOMIC_ACQUIRE);
+}
 
-    /* read the command type */
-    ch = '\0';
+#endif
+
+/* returns true if the queue was empty, in which case
+ * the libevent thread needs to be woken up */
+static bool tasksPush(tr_event_handle* eh, struct tr_run_data* data)
+{
+    struct tr_run_data* head;
 
     do
     {
-        ret = piperead(fd, &ch, 1);
+        head = eh->tasks;
+        data->next = head;
     }
-    while (!eh->die && ret == -1 && errno == EAGAIN);
+    while (!tasksCompareAndSwap(eh, head, data));
+
+    return head == NULL;
+}
+
+static bool wakeUp(tr_event_handle* eh)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t const one = 1;
+    return write(eh->wakeFds[1], &one, sizeof(one)) == sizeof(one);
+#else
+    char const ch = 'r';
+    return pipewrite(eh->wakeFds[1], &ch, 1) == 1;
+#endif
+}
 
-    dbgmsg("command is [%c], ret is %d, errno is %d", ch, ret, (int)errno);
+static void closeWakeUps(tr_event_handle* eh)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t const count = WAKE_CLOSE;
 
-    switch (ch)
+    if (write(eh->wakeFds[1], &count, sizeof(count)) == -1)
     {
-    case 'r': /* run in libevent thread */
-        {
-            struct tr_run_data data;
-            size_t const nwant = sizeof(data);
-            ev_ssize_t const ngot = piperead(fd, &data, nwant);
+        tr_logAddError("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
+    }
+#else
+    tr_netCloseSocket(eh->wakeFds[1]);
+#endif
+}
 
-            if (!eh->die && ngot == (ev_ssize_t)nwant)
-            {
-                dbgmsg("invoking function in libevent thread");
-                (*data.func)(data.user_data);
-            }
+/* returns false once tr_eventClose() has been called */
+static bool clearWakeUps(tr_event_handle* eh)
+{
+#ifdef HAVE_EVENTFD
+    uint64_t count = 0;
+    return read(eh->wakeFds[0], &count, sizeof(count)) == -1 || count < WAKE_CLOSE;
+#else
+    char buf[64];
+    return piperead(eh->wakeFds[0], buf, sizeof(buf)) != 0;
+#endif
+}
 
-            break;
-        }
+static void onWakeUp(evutil_socket_t fd UNUSED, short eventType, void* veh)
+{
+    tr_event_handle* eh = veh;
+    struct tr_run_data* list;
+    struct tr_run_data* walk;
+    bool const eof = !clearWakeUps(eh);
+    int n = 0;
 
-    case '\0': /* eof */
-        {
-            dbgmsg("pipe eof reached... removing event listener");
-            event_free(eh->pipeEvent);
-            tr_netCloseSocket(eh->fds[0]);
-            event_base_loopexit(eh->base, NULL);
-            break;
-        }
+    dbgmsg("onWakeUp: eventType is %hd", eventType);
+
+    /* Take everything that's been queued. Anything queued after this
+     * finds the queue empty and wakes us up again, so nothing gets stuck.
+     * The wakeups were cleared first so that none of those get lost. */
+    list = tasksTakeAll(eh);
+
+    /* it's newest first, so flip it to run them in the order they were queued */
+    for (walk = list, list = NULL; walk != NULL;)
+    {
+        struct tr_run_data* next = walk->next;
+        walk->next = list;
+        list = walk;
+        walk = next;
+    }
+
+    while (list != NULL)
+    {
+        struct tr_run_data* data = list;
+        list = data->next;
 
-    default:
+        if (!eh->die)
         {
-            TR_ASSERT_MSG(false, "unhandled command type %d", (int)ch);
-            break;
+            (*data->func)(data->user_data);
+            ++n;
         }
+
+        tr_free(data);
+    }
+
+    dbgmsg("ran %d functions in libevent thread", n);
+
+    if (eof)
+    {
+        dbgmsg("closing... removing event listener");
+        event_free(eh->wakeEvent);
+        tr_netCloseSocket(eh->wakeFds[0]);
+        event_base_loopexit(eh->base, NULL);
     }
 }
 
@@ -252,9 +346,9 @@ static void libeventThreadFunc(void* veh)
     eh->session->evdns_base = evdns_base_new(base, true);
     eh->session->events = eh;
 
-    /* listen to the pipe's read fd */
-    eh->pipeEvent = event_new(base, eh->fds[0], EV_READ | EV_PERSIST, readFromPipe, veh);
-    event_add(eh->pipeEvent, NULL);
+    /* listen for wakeups */
+    eh->wakeEvent = event_new(base, eh->wakeFds[0], EV_READ | EV_PERSIST, onWakeUp, veh);
+    event_add(eh->wakeEvent, NULL);
     event_set_log_callback(logFunc);
 
     /* loop until all the events are done */
@@ -264,7 +358,6 @@ static void libeventThreadFunc(void* veh)
     }
 
     /* shut down the thread */
-    tr_lockFree(eh->lock);
     event_base_free(base);
     eh->session->events = NULL;
     tr_free(eh);
@@ -278,12 +371,26 @@ void tr_eventInit(tr_session* session)
     session->events = NULL;
 
     eh = tr_new0(tr_event_handle, 1);
-    eh->lock = tr_lockNew();
 
-    if (pipe(eh->fds) == -1)
+#ifdef HAVE_EVENTFD
+
+    if ((eh->wakeFds[0] = eh->wakeFds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+    {
+        tr_logAddError("Unable to create eventfd() in libtransmission: %s", tr_strerror(errno));
+    }
+
+#else
+
+    if (pipe(eh->wakeFds) == -1)
     {
         tr_logAddError("Unable to write to pipe() in libtransmission: %s", tr_strerror(errno));
     }
+    else
+    {
+        evutil_make_socket_nonblocking(eh->wakeFds[0]);
+    }
+
+#endif
 
     eh->session = session;
     eh->thread = tr_threadNew(libeventThreadFunc, eh);
@@ -306,7 +413,7 @@ void tr_eventClose(tr_session* session)
 
     session->events->die = true;
     tr_logAddDeep(__FILE__, __LINE__, NULL, "closing trevent pipe");
-    tr_netCloseSocket(session->events->fds[1]);
+    closeWakeUps(session->events);
 }
 
 /**
@@ -336,26 +443,15 @@ void tr_runInEventThread(tr_session* session, void (* func)(void*), void* user_d
     }
     else
     {
-        tr_pipe_end_t fd;
-        char ch;
-        ev_ssize_t res_1;
-        ev_ssize_t res_2;
         tr_event_handle* e = session->events;
-        struct tr_run_data data;
-
-        tr_lockLock(e->lock);
-
-        fd = e->fds[1];
-        ch = 'r';
-        res_1 = pipewrite(fd, &ch, 1);
-
-        data.func = func;
-        data.user_data = user_data;
-        res_2 = pipewrite(fd, &data, sizeof(data));
+        struct tr_run_data* data = tr_new(struct tr_run_data, 1);
 
-        tr_lockUnlock(e->lock);
+        data->func = func;
+        data->user_data = user_data;
 
-        if (res_1 == -1 || res_2 == -1)
+        /* only the call that finds the queue empty needs to wake the
+         * libevent thread; the rest get picked up in the same batch */
+        if (tasksPush(e, data) && !wakeUp(e))
         {
             tr_logAddError("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
         }
@@ -0,0 +1,478 @@
+/*
+ * This file Copyright (C) 2017 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ */
+
+#include <stdio.h> /* fprintf() */
+
+#ifndef _WIN32
+#include <utime.h> /* utime() */
+#endif
+
+#include "transmission.h"
+#include "crypto-utils.h" /* tr_rand_buffer() */
+#include "file.h"
+#include "makemeta.h"
+#include "platform.h" /* tr_wait_msec() */
+#include "resume.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread() */
+#include "utils.h"
+#include "verify.h"
+
+#define SPEED_TEST 0
+
+#if SPEED_TEST
+#define VERBOSE
+#endif
+
+#include "libtransmission-test.h"
+
+/* 32 KiB pieces, so a few MiB is enough to need several chunks */
+#define PIECE_SIZE (32 * 1024)
+
+static void create_random_file(char const* path, uint64_t size)
+{
+    size_t const buflen = 1024 * 1024;
+    uint8_t* buf = tr_new(uint8_t, buflen);
+    char* dir = tr_sys_path_dirname(path, NULL);
+    tr_sys_file_t fd;
+
+    tr_sys_dir_create(dir, TR_SYS_DIR_CREATE_PARENTS, 0700, NULL);
+    fd = tr_sys_file_open(path, TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE | TR_SYS_FILE_TRUNCATE, 0600, NULL);
+
+    for (uint64_t pos = 0; pos < size; pos += buflen)
+    {
+        size_t const n = MIN(buflen, size - pos);
+        tr_rand_buffer(buf, n);
+        tr_sys_file_write(fd, buf, n, NULL, NULL);
+    }
+
+    tr_sys_file_close(fd, NULL);
+    tr_free(dir);
+    tr_free(buf);
+}
+
+/* makes a single-file torrent of random data in `dir' */
+static tr_torrent* random_torrent_init(tr_session* session, char const* dir, char const* name, uint64_t size)
+{
+    char* path = tr_buildPath(dir, name, NULL);
+    char* torrent_file = tr_strdup_printf("%s.torrent", path);
+    tr_metainfo_builder* builder;
+    tr_ctor* ctor;
+    tr_torrent* tor;
+    int err = 0;
+
+    create_random_file(path, size);
+
+    builder = tr_metaInfoBuilderCreate(path);
+    tr_metaInfoBuilderSetPieceSize(builder, PIECE_SIZE);
+    tr_makeMetaInfo(builder, torrent_file, NULL, 0, NULL, false);
+
+    while (!builder->isDone)
+    {
+        tr_wait_msec(10);
+    }
+
+    ctor = tr_ctorNew(session);
+    tr_ctorSetMetainfoFromFile(ctor, torrent_file);
+    tr_ctorSetDownloadDir(ctor, TR_FORCE, dir);
+    tr_ctorSetPaused(ctor, TR_FORCE, true);
+    tor = tr_torrentNew(ctor, &err, NULL);
+    TR_ASSERT(err == 0);
+
+    tr_ctorFree(ctor);
+    tr_metaInfoBuilderFree(builder);
+    tr_sys_path_remove(torrent_file, NULL);
+    tr_free(torrent_file);
+    tr_free(path);
+    return tor;
+}
+
+static void onVerifyDone(tr_torrent* tor UNUSED, bool aborted UNUSED, void* done)
+{
+    *(bool*)done = true;
+}
+
+static int test_verify_damaged_pieces(void)
+{
+    uint64_t const size = 9 * 1024 * 1024 + 1000;
+    tr_session* session;
+    tr_torrent* tor;
+    char* path;
+    tr_sys_file_t fd;
+    tr_piece_index_t const damaged = (5 * 1024 * 1024 + 3) / PIECE_SIZE;
+
+    session = libttest_session_init(NULL);
+    session->verifyThreads = 3;
+    tor = random_torrent_init(session, tr_sessionGetDownloadDir(session), "damaged", size);
+
+    libttest_blockingTorrentVerify(tor);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+
+    /* flip a byte in the middle and cut off the end */
+    path = tr_torrentFindFile(tor, 0);
+    fd = tr_sys_file_open(path, TR_SYS_FILE_WRITE, 0, NULL);
+    check(fd != TR_BAD_SYS_FILE);
+    check(tr_sys_file_write_at(fd, "\xff\x00\xff", 3, 5 * 1024 * 1024 + 2, NULL, NULL));
+    check(tr_sys_file_truncate(fd, size - 100, NULL));
+    tr_sys_file_close(fd, NULL);
+    tr_free(path);
+
+    libttest_blockingTorrentVerify(tor);
+
+    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+    {
+        check_bool(tr_torrentPieceIsComplete(tor, i), ==, i != damaged && i != tor->info.pieceCount - 1);
+    }
+
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, PIECE_SIZE + size % PIECE_SIZE);
+
+    tr_torrentRemove(tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_verify_concurrently(void)
+{
+    enum
+    {
+        N_TORRENTS = 3
+    };
+
+    /* two torrents in one directory and one in another */
+    char const* const dirs[N_TORRENTS] = { "a", "a", "b" };
+    tr_session* session;
+    tr_torrent* tors[N_TORRENTS];
+    bool done[N_TORRENTS];
+
+    session = libttest_session_init(NULL);
+
+    for (int i = 0; i < N_TORRENTS; ++i)
+    {
+        char* dir = tr_buildPath(tr_sessionGetDownloadDir(session), dirs[i], NULL);
+        char name[32];
+
+        tr_snprintf(name, sizeof(name), "torrent-%d", i);
+        tors[i] = random_torrent_init(session, dir, name, (i + 1) * 1024 * 1024 + 12345);
+        tr_free(dir);
+    }
+
+    for (int i = 0; i < N_TORRENTS; ++i)
+    {
+        done[i] = false;
+        tr_torrentVerify(tors[i], onVerifyDone, &done[i]);
+    }
+
+    for (int i = 0; i < N_TORRENTS; ++i)
+    {
+        while (!done[i])
+        {
+            tr_wait_msec(10);
+        }
+    }
+
+    for (int i = 0; i < N_TORRENTS; ++i)
+    {
+        check_uint(tr_torrentStat(tors[i])->leftUntilDone, ==, 0);
+        tr_torrentRemove(tors[i], true, NULL);
+    }
+
+    libttest_session_close(session);
+    return 0;
+}
+
+static int test_verify_speed_limit(void)
+{
+    tr_session* session;
+    tr_torrent* tor;
+    uint64_t start;
+
+    session = libttest_session_init(NULL);
+    tor = random_torrent_init(session, tr_sessionGetDownloadDir(session), "throttled", 9 * 1024 * 1024);
+
+    /* the first chunk is read right away, the others have to wait their turn */
+    session->verifySpeedLimit_Bps = 8 * 1024 * 1024;
+    start = tr_time_msec();
+    libttest_blockingTorrentVerify(tor);
+    check_uint(tr_time_msec() - start, >=, 900);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+
+    tr_torrentRemove(tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+static void blocking_quick_verify(tr_torrent* tor)
+{
+    bool done = false;
+
+    tr_torrentVerifyQuick(tor, onVerifyDone, &done);
+
+    while (!done)
+    {
+        tr_wait_msec(10);
+    }
+}
+
+/* marks every piece as checked long ago, to see which ones get checked again */
+static void reset_time_checked(tr_torrent* tor)
+{
+    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+    {
+        tor->info.pieces[i].timeChecked = 1;
+    }
+}
+
+static tr_piece_index_t count_rechecked(tr_torrent const* tor)
+{
+    tr_piece_index_t n = 0;
+
+    for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+    {
+        if (tor->info.pieces[i].timeChecked != 1)
+        {
+            ++n;
+        }
+    }
+
+    return n;
+}
+
+static int test_quick_verify(void)
+{
+    uint64_t const size = 9 * 1024 * 1024;
+    tr_session* session;
+    tr_torrent* tor;
+    tr_ctor* ctor;
+    char* path;
+    tr_sys_file_t fd;
+
+    session = libttest_session_init(NULL);
+    tor = random_torrent_init(session, tr_sessionGetDownloadDir(session), "quick", size);
+
+    /* a full verify fingerprints the files */
+    libttest_blockingTorrentVerify(tor);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+    check(tr_torrentFingerprintMatches(tor, 0));
+
+    /* and they're kept in the .resume file */
+    tr_torrentSaveResume(tor);
+    tr_free(tor->fingerprints);
+    tor->fingerprints = NULL;
+    check(!tr_torrentFingerprintMatches(tor, 0));
+    ctor = tr_ctorNew(session);
+    check_uint(tr_torrentLoadResume(tor, TR_FR_PROGRESS, ctor, NULL) & TR_FR_PROGRESS, ==, TR_FR_PROGRESS);
+    tr_ctorFree(ctor);
+    check(tr_torrentFingerprintMatches(tor, 0));
+
+    /* if nothing's changed, only a sample of the pieces is checked */
+    reset_time_checked(tor);
+    blocking_quick_verify(tor);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+    check_uint(count_rechecked(tor), >, 0);
+    check_uint(count_rechecked(tor), <, tor->info.pieceCount / 2);
+
+    /* a file that has changed is checked in full */
+    path = tr_torrentFindFile(tor, 0);
+    fd = tr_sys_file_open(path, TR_SYS_FILE_WRITE, 0, NULL);
+    check(fd != TR_BAD_SYS_FILE);
+    check(tr_sys_file_truncate(fd, size - 100, NULL));
+    tr_sys_file_close(fd, NULL);
+    check(!tr_torrentFingerprintMatches(tor, 0));
+
+    reset_time_checked(tor);
+    blocking_quick_verify(tor);
+    check_uint(tr_torrentStat(tor)->leftUntilDone, ==, PIECE_SIZE);
+    check_uint(count_rechecked(tor), ==, tor->info.pieceCount);
+    check(tr_torrentFingerprintMatches(tor, 0));
+
+#ifndef _WIN32
+
+    {
+        /* if a file changes behind the fingerprint's back, the sample catches it */
+        tr_sys_path_info info;
+        struct utimbuf times;
+
+        check(tr_sys_path_get_info(path, 0, &info, NULL));
+        create_random_file(path, size - 100);
+        times.actime = info.last_modified_at;
+        times.modtime = info.last_modified_at;
+        check_int(utime(path, &times), ==, 0);
+        check(tr_torrentFingerprintMatches(tor, 0));
+
+        blocking_quick_verify(tor);
+        check_uint(tr_torrentStat(tor)->leftUntilDone, ==, size);
+    }
+
+#endif
+
+    tr_free(path);
+    tr_torrentRemove(tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+struct task_sync
+{
+    tr_torrent* tor;
+    bool done;
+};
+
+static void sync_done(void* vsync)
+{
+    ((struct task_sync*)vsync)->done = true;
+}
+
+static void sync_task(tr_torrent* tor UNUSED, bool const* stopFlag UNUSED, void* vsync UNUSED)
+{
+}
+
+static void on_sync_task_done(tr_torrent* tor, bool aborted UNUSED, void* vsync)
+{
+    tr_runInEventThread(tor->session, sync_done, vsync);
+}
+
+static void queue_sync_task(void* vsync)
+{
+    struct task_sync* sync = vsync;
+
+    tr_verifyAddTask(sync->tor, sync_task, on_sync_task_done, sync);
+}
+
+/* waits for the look at the files that starting or stopping the torrent queued */
+static void wait_for_fingerprint_check(tr_torrent* tor)
+{
+    struct task_sync sync;
+
+    sync.tor = tor;
+    sync.done = false;
+    tr_runInEventThread(tor->session, queue_sync_task, &sync);
+
+    while (!sync.done)
+    {
+        tr_wait_msec(10);
+    }
+}
+
+static void truncate_file(char const* path, uint64_t size)
+{
+    tr_sys_file_t const fd = tr_sys_file_open(path, TR_SYS_FILE_WRITE, 0, NULL);
+
+    TR_ASSERT(fd != TR_BAD_SYS_FILE);
+    tr_sys_file_truncate(fd, size, NULL);
+    tr_sys_file_close(fd, NULL);
+}
+
+static void set_written(tr_torrent* tor, tr_file_index_t i)
+{
+    tr_sessionLock(tor->session);
+    tor->fingerprints[i].written = true;
+    tr_sessionUnlock(tor->session);
+}
+
+static int test_fingerprints_across_stops(void)
+{
+    uint64_t const size = 1024 * 1024;
+    tr_session* session;
+    tr_torrent* tor;
+    char* path;
+
+    session = libttest_session_init(NULL);
+    tor = random_torrent_init(session, tr_sessionGetDownloadDir(session), "stops", size);
+    path = tr_torrentFindFile(tor, 0);
+
+    libttest_blockingTorrentVerify(tor);
+    check(tr_torrentFingerprintMatches(tor, 0));
+
+    /* a trusted file that someone else changes while we're running isn't trusted once we stop */
+    tr_torrentStartNow(tor);
+    wait_for_fingerprint_check(tor);
+    check(tr_torrentFingerprintMatches(tor, 0));
+    truncate_file(path, size - 100);
+    tr_torrentStop(tor);
+    wait_for_fingerprint_check(tor);
+    check_uint(tor->fingerprints[0].mtime, ==, 0);
+
+    /* but if the changes were ours, it still is */
+    libttest_blockingTorrentVerify(tor);
+    check(tr_torrentFingerprintMatches(tor, 0));
+    tr_torrentStartNow(tor);
+    wait_for_fingerprint_check(tor);
+    set_written(tor, 0);
+    truncate_file(path, size - 200);
+    tr_torrentStop(tor);
+    wait_for_fingerprint_check(tor);
+    check(tr_torrentFingerprintMatches(tor, 0));
+    check(!tor->fingerprints[0].written);
+
+    /* and one that changed while we were stopped isn't trusted once we start */
+    set_written(tor, 0);
+    truncate_file(path, size - 300);
+    tr_torrentStartNow(tor);
+    wait_for_fingerprint_check(tor);
+    check_uint(tor->fingerprints[0].mtime, ==, 0);
+
+    tr_free(path);
+    tr_torrentRemove(tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+#if SPEED_TEST
+
+/* The data set is still in the page cache after it's been written,
+ * so this measures hashing more than it does the disk */
+static int test_speed(void)
+{
+    uint64_t const size = 1024 * 1024 * 1024;
+    int const threads[] = { 1, 2, 4, 0 };
+    tr_session* session;
+    tr_torrent* tor;
+
+    session = libttest_session_init(NULL);
+    tor = random_torrent_init(session, tr_sessionGetDownloadDir(session), "speed", size);
+
+    for (size_t i = 0; i < TR_N_ELEMENTS(threads); ++i)
+    {
+        uint64_t start;
+        uint64_t msec;
+
+        session->verifyThreads = threads[i];
+        start = tr_time_msec();
+        libttest_blockingTorrentVerify(tor);
+        msec = MAX(tr_time_msec() - start, 1);
+        check_uint(tr_torrentStat(tor)->leftUntilDone, ==, 0);
+
+        fprintf(stderr, "%d hashing threads: verified %" PRIu64 " MiB in %.2f s (%.0f MiB/s)\n",
+            threads[i] > 0 ? threads[i] : (int)tr_getProcessorCount(), size >> 20, msec / 1000.0,
+            (size >> 20) * 1000.0 / msec);
+    }
+
+    tr_torrentRemove(tor, true, NULL);
+    libttest_session_close(session);
+    return 0;
+}
+
+#endif
+
+int main(void)
+{
+    testFunc const tests[] =
+    {
+        test_verify_damaged_pieces,
+        test_verify_concurrently,
+        test_verify_speed_limit,
+        test_quick_verify,
+        test_fingerprints_across_stops,
+#if SPEED_TEST
+        test_speed
+#endif
+    };
+
+    return runTests(tests, NUM_TESTS(tests));
+}
@@ -6,7 +6,7 @@
  *
  */
 
-#include <string.h> /* memcmp() */
+#include <string.h> /* memcmp(), strcmp() */
 #include <stdlib.h> /* free() */
 
 #include "transmission.h"
@@ -15,171 +15,613 @@
 #include "file.h"
 #include "list.h"
 #include "log.h"
-#include "platform.h" /* tr_lock() */
+#include "inout.h" /* tr_ioFindFileLocation() */
+#include "platform.h" /* tr_lock(), tr_threadNew() */
+#include "session.h"
 #include "torrent.h"
 #include "tr-assert.h"
 #include "utils.h" /* tr_valloc(), tr_free() */
 #include "verify.h"
 
 /***
-****
+****  Hashing
 ***/
 
 enum
 {
-    MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+    /* how many torrents can be verified at once */
+    MAX_READERS = 8,
+
+    /* how much of a torrent is read in one go. It's rounded down to whole
+     * pieces, and bigger pieces get bigger chunks so every hashing thread
+     * has a batch of pieces to work on */
+    CHUNK_BYTES = (4 * 1024 * 1024),
+    MAX_CHUNK_BYTES = (64 * 1024 * 1024),
+
+    /* how long a reader sleeps at a time while it's being throttled */
+    MAX_THROTTLE_SLEEP_MSEC = 100,
+
+    /* a quick verify hashes about one in this many of the pieces
+     * that it would otherwise trust, to spot-check them */
+    QUICK_VERIFY_SAMPLE_RATE = 1024
 };
 
-static bool verifyTorrent(tr_torrent* tor, bool* stopFlag)
+/* what a quick verify does with each piece */
+enum
 {
-    time_t end;
-    tr_sha1_ctx_t sha;
-    tr_sys_file_t fd = TR_BAD_SYS_FILE;
-    uint64_t filePos = 0;
-    bool changed = false;
-    bool hadPiece = false;
-    time_t lastSleptAt = 0;
-    uint32_t piecePos = 0;
-    tr_file_index_t fileIndex = 0;
-    tr_file_index_t prevFileIndex = !fileIndex;
-    tr_piece_index_t pieceIndex = 0;
-    time_t const begin = tr_time();
-    size_t const buflen = 1024 * 128; /* 128 KiB buffer */
-    uint8_t* buffer = tr_valloc(buflen);
+    PIECE_TRUST,
+    PIECE_HASH,
+    PIECE_SAMPLE
+};
 
-    sha = tr_sha1_init();
+/* a run of whole pieces that's been read into memory */
+struct verify_chunk
+{
+    struct verify_chunk* next;
+    tr_torrent* tor;
+    uint8_t* buf;
+    uint64_t byte_offset;
+    tr_piece_index_t first_piece;
+    tr_piece_index_t piece_count;
+    tr_piece_index_t next_to_hash;
+    tr_piece_index_t pending;
+    bool* readable;
+    bool* pass;
+};
+
+/* chunks with pieces that no hashing thread has claimed yet */
+static struct verify_chunk* hashQueue = NULL;
+static struct verify_chunk* hashQueueTail = NULL;
+static int hashThreadCount = 0;
+
+static tr_lock* getHashLock(void)
+{
+    static tr_lock* lock = NULL;
+
+    if (lock == NULL)
+    {
+        lock = tr_lockNew();
+    }
+
+    return lock;
+}
 
-    tr_logAddTorDbg(tor, "%s", "verifying torrent...");
-    tr_torrentSetChecked(tor, 0);
+static int getHashThreadLimit(tr_session const* session)
+{
+    return session->verifyThreads > 0 ? session->verifyThreads : (int)tr_getProcessorCount();
+}
 
-    while (!*stopFlag && pieceIndex < tor->info.pieceCount)
+/* must be called with the hash lock held */
+static struct verify_chunk* claimPieces(tr_piece_index_t* setme_index, tr_piece_index_t* setme_count)
+{
+    struct verify_chunk* chunk = hashQueue;
+
+    if (chunk != NULL)
     {
-        uint64_t leftInPiece;
-        uint64_t bytesThisPass;
-        uint64_t leftInFile;
-        tr_file const* file = &tor->info.files[fileIndex];
+        /* as many as tr_sha1_multi() hashes at once, unless that would leave other threads idle */
+        tr_piece_index_t const batch = MIN((tr_piece_index_t)tr_sha1_multi_width(),
+            MAX(chunk->piece_count / (tr_piece_index_t)getHashThreadLimit(chunk->tor->session), 1));
+
+        *setme_index = chunk->next_to_hash;
+        *setme_count = MIN(batch, chunk->piece_count - chunk->next_to_hash);
+        chunk->next_to_hash += *setme_count;
 
-        /* if we're starting a new piece... */
-        if (piecePos == 0)
+        if (chunk->next_to_hash == chunk->piece_count)
         {
-            hadPiece = tr_torrentPieceIsComplete(tor, pieceIndex);
+            hashQueue = chunk->next;
+
+            if (hashQueue == NULL)
+            {
+                hashQueueTail = NULL;
+            }
         }
+    }
+
+    return chunk;
+}
+
+static void hashPieces(tr_sha1_ctx_t sha, struct verify_chunk* chunk, tr_piece_index_t first, tr_piece_index_t count)
+{
+    tr_torrent const* tor = chunk->tor;
+    tr_sha1_job jobs[TR_SHA1_MULTI_MAX];
+    uint8_t hashes[TR_SHA1_MULTI_MAX][SHA_DIGEST_LENGTH];
+    tr_piece_index_t indices[TR_SHA1_MULTI_MAX];
+    size_t job_count = 0;
+    bool hashed;
+
+    TR_ASSERT(count <= TR_SHA1_MULTI_MAX);
+
+    for (tr_piece_index_t i = first; i < first + count; ++i)
+    {
+        tr_piece_index_t const piece = chunk->first_piece + i;
+
+        chunk->pass[i] = false;
 
-        /* if we're starting a new file... */
-        if (filePos == 0 && fd == TR_BAD_SYS_FILE && fileIndex != prevFileIndex)
+        if (chunk->readable[i])
         {
-            char* filename = tr_torrentFindFile(tor, fileIndex);
-            fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open(filename, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0,
-                NULL);
-            tr_free(filename);
-            prevFileIndex = fileIndex;
+            jobs[job_count].data = chunk->buf + ((uint64_t)piece * tor->info.pieceSize - chunk->byte_offset);
+            jobs[job_count].data_length = tr_torPieceCountBytes(tor, piece);
+            jobs[job_count].hash = hashes[job_count];
+            indices[job_count] = i;
+            ++job_count;
         }
+    }
+
+    hashed = job_count == 0 || tr_sha1_multi(sha, jobs, job_count);
+
+    for (size_t j = 0; hashed && j < job_count; ++j)
+    {
+        tr_piece_index_t const i = indices[j];
+        chunk->pass[i] = memcmp(hashes[j], tor->info.pieces[chunk->first_piece + i].hash, SHA_DIGEST_LENGTH) == 0;
+    }
+
+    tr_lockLock(getHashLock());
+    chunk->pending -= count;
+    tr_lockUnlock(getHashLock());
+}
+
+static void hashThreadFunc(void* unused UNUSED)
+{
+    tr_sha1_ctx_t sha = tr_sha1_init();
 
-        /* figure out how much we can read this pass */
-        leftInPiece = tr_torPieceCountBytes(tor, pieceIndex) - piecePos;
-        leftInFile = file->length - filePos;
-        bytesThisPass = MIN(leftInFile, leftInPiece);
-        bytesThisPass = MIN(bytesThisPass, buflen);
+    for (;;)
+    {
+        struct verify_chunk* chunk;
+        tr_piece_index_t i;
+        tr_piece_index_t n;
 
-        /* read a bit */
-        if (fd != TR_BAD_SYS_FILE)
+        tr_lockLock(getHashLock());
+
+        if ((chunk = claimPieces(&i, &n)) == NULL)
         {
-            uint64_t numRead;
+            --hashThreadCount;
+            tr_lockUnlock(getHashLock());
+            break;
+        }
 
-            if (tr_sys_file_read_at(fd, buffer, bytesThisPass, filePos, &numRead, NULL) && numRead > 0)
-            {
-                bytesThisPass = numRead;
-                tr_sha1_update(sha, buffer, bytesThisPass);
-                tr_sys_file_advise(fd, filePos, bytesThisPass, TR_SYS_FILE_ADVICE_DONT_NEED, NULL);
-            }
+        tr_lockUnlock(getHashLock());
+
+        hashPieces(sha, chunk, i, n);
+    }
+
+    tr_sha1_final(sha, NULL);
+}
+
+static void enqueueChunk(struct verify_chunk* chunk)
+{
+    int const limit = getHashThreadLimit(chunk->tor->session);
+
+    chunk->next = NULL;
+    chunk->next_to_hash = 0;
+    chunk->pending = chunk->piece_count;
+
+    tr_lockLock(getHashLock());
+
+    if (hashQueueTail != NULL)
+    {
+        hashQueueTail->next = chunk;
+    }
+    else
+    {
+        hashQueue = chunk;
+    }
+
+    hashQueueTail = chunk;
+
+    while (hashThreadCount < limit)
+    {
+        ++hashThreadCount;
+        tr_threadNew(hashThreadFunc, NULL);
+    }
+
+    tr_lockUnlock(getHashLock());
+}
+
+/* waits for a chunk to be hashed, helping out in the meantime */
+static void waitForChunk(tr_sha1_ctx_t sha, struct verify_chunk* chunk)
+{
+    for (;;)
+    {
+        bool done;
+        tr_piece_index_t i;
+        tr_piece_index_t n;
+        struct verify_chunk* other = NULL;
+
+        tr_lockLock(getHashLock());
+        done = chunk->pending == 0;
+
+        if (!done)
+        {
+            other = claimPieces(&i, &n);
         }
 
-        /* move our offsets */
-        leftInPiece -= bytesThisPass;
-        leftInFile -= bytesThisPass;
-        piecePos += bytesThisPass;
-        filePos += bytesThisPass;
+        tr_lockUnlock(getHashLock());
+
+        if (done)
+        {
+            break;
+        }
 
-        /* if we're finishing a piece... */
-        if (leftInPiece == 0)
+        if (other != NULL)
         {
-            time_t now;
-            bool hasPiece;
-            uint8_t hash[SHA_DIGEST_LENGTH];
+            hashPieces(sha, other, i, n);
+        }
+        else
+        {
+            tr_wait_msec(1);
+        }
+    }
+}
 
-            tr_sha1_final(sha, hash);
-            hasPiece = memcmp(hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH) == 0;
+/***
+****  Reading
+***/
 
-            if (hasPiece || hadPiece)
-            {
-                tr_torrentSetHasPiece(tor, pieceIndex, hasPiece);
-                changed |= hasPiece != hadPiece;
-            }
+struct verify_reader
+{
+    tr_torrent* tor;
+    tr_sys_file_t fd;
+    tr_file_index_t fd_file_index;
+    bool* stopFlag;
+};
 
-            tr_torrentSetPieceChecked(tor, pieceIndex);
-            now = tr_time();
-            tor->anyDate = now;
+/* spreads the verify speed limit over all of the readers */
+static void throttle(struct verify_reader const* reader, uint64_t bytes)
+{
+    static uint64_t nextReadAt = 0;
 
-            /* sleeping even just a few msec per second goes a long
-             * way towards reducing IO load... */
-            if (lastSleptAt != now)
-            {
-                lastSleptAt = now;
-                tr_wait_msec(MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
-            }
+    uint64_t const limit = reader->tor->session->verifySpeedLimit_Bps;
+    uint64_t now;
+    uint64_t readAt;
+
+    if (limit == 0)
+    {
+        return;
+    }
+
+    tr_lockLock(getHashLock());
+    now = tr_time_msec();
+    readAt = MAX(now, nextReadAt);
+    nextReadAt = readAt + bytes * 1000 / limit;
+    tr_lockUnlock(getHashLock());
+
+    while (now < readAt && !*reader->stopFlag)
+    {
+        tr_wait_msec(MIN(readAt - now, MAX_THROTTLE_SLEEP_MSEC));
+        now = tr_time_msec();
+    }
+}
+
+/* returns how many of the bytes could be read */
+static uint64_t readFileBytes(struct verify_reader* reader, tr_file_index_t fileIndex, uint64_t fileOffset, uint8_t* buf,
+    uint64_t len)
+{
+    uint64_t pos = 0;
+
+    if (reader->fd_file_index != fileIndex)
+    {
+        char* filename;
+
+        if (reader->fd != TR_BAD_SYS_FILE)
+        {
+            tr_sys_file_close(reader->fd, NULL);
+        }
+
+        filename = tr_torrentFindFile(reader->tor, fileIndex);
+        reader->fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open(filename,
+            TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
+        reader->fd_file_index = fileIndex;
+        tr_free(filename);
+    }
+
+    if (reader->fd == TR_BAD_SYS_FILE)
+    {
+        return 0;
+    }
+
+    while (pos < len)
+    {
+        uint64_t numRead;
 
-            sha = tr_sha1_init();
-            pieceIndex++;
-            piecePos = 0;
+        if (!tr_sys_file_read_at(reader->fd, buf + pos, len - pos, fileOffset + pos, &numRead, NULL) || numRead == 0)
+        {
+            break;
         }
 
-        /* if we're finishing a file... */
-        if (leftInFile == 0)
+        pos += numRead;
+    }
+
+    /* we won't need these bytes again, but we will need the ones that come next */
+    if (pos > 0)
+    {
+        tr_sys_file_advise(reader->fd, fileOffset, pos, TR_SYS_FILE_ADVICE_DONT_NEED, NULL);
+        tr_sys_file_advise(reader->fd, fileOffset + pos, CHUNK_BYTES, TR_SYS_FILE_ADVICE_WILL_NEED, NULL);
+    }
+
+    return pos;
+}
+
+static void readChunk(struct verify_reader* reader, struct verify_chunk* chunk)
+{
+    tr_torrent const* tor = reader->tor;
+    tr_piece_index_t const last_piece = chunk->first_piece + chunk->piece_count - 1;
+    uint64_t const len = (uint64_t)last_piece * tor->info.pieceSize + tr_torPieceCountBytes(tor, last_piece) -
+        chunk->byte_offset;
+    tr_file_index_t fileIndex;
+    uint64_t fileOffset;
+
+    tr_ioFindFileLocation(tor, chunk->first_piece, 0, &fileIndex, &fileOffset);
+
+    for (tr_piece_index_t i = 0; i < chunk->piece_count; ++i)
+    {
+        chunk->readable[i] = true;
+    }
+
+    for (uint64_t pos = 0; pos < len; ++fileIndex, fileOffset = 0)
+    {
+        uint64_t const n = MIN(len - pos, tor->info.files[fileIndex].length - fileOffset);
+        uint64_t const numRead = n > 0 ? readFileBytes(reader, fileIndex, fileOffset, chunk->buf + pos, n) : 0;
+
+        if (numRead < n)
         {
-            if (fd != TR_BAD_SYS_FILE)
+            /* every piece that overlaps the missing bytes fails */
+            tr_piece_index_t const first = (chunk->byte_offset + pos + numRead) / tor->info.pieceSize;
+            tr_piece_index_t const last = (chunk->byte_offset + pos + n - 1) / tor->info.pieceSize;
+
+            for (tr_piece_index_t p = first; p <= last; ++p)
             {
-                tr_sys_file_close(fd, NULL);
-                fd = TR_BAD_SYS_FILE;
+                chunk->readable[p - chunk->first_piece] = false;
             }
+        }
+
+        pos += n;
+    }
+}
+
+static bool applyChunk(tr_torrent* tor, struct verify_chunk const* chunk, uint8_t const* plan, bool* sampleFailed)
+{
+    bool changed = false;
+
+    for (tr_piece_index_t i = 0; i < chunk->piece_count; ++i)
+    {
+        tr_piece_index_t const piece = chunk->first_piece + i;
+        bool const hadPiece = tr_torrentPieceIsComplete(tor, piece);
+        bool const hasPiece = chunk->pass[i];
+
+        if (hasPiece || hadPiece)
+        {
+            tr_torrentSetHasPiece(tor, piece, hasPiece);
+            changed |= hasPiece != hadPiece;
+        }
+
+        if (plan != NULL && plan[piece] == PIECE_SAMPLE && !hasPiece)
+        {
+            *sampleFailed = true;
+        }
+
+        tr_torrentSetPieceChecked(tor, piece);
+    }
+
+    tor->anyDate = tr_time();
+    return changed;
+}
+
+/* Reads the pieces a chunk at a time, and hands each chunk to the hashing
+ * threads while it goes on to read the next one. If there's a plan, only
+ * the pieces that it doesn't trust are read. */
+static bool verifyPieces(tr_torrent* tor, uint8_t const* plan, bool* stopFlag, uint64_t* bytesHashed, bool* sampleFailed)
+{
+    bool changed = false;
+    struct verify_chunk chunks[2];
+    struct verify_chunk* prev = NULL;
+    struct verify_reader reader;
+    tr_sha1_ctx_t sha;
+    tr_piece_index_t pieceIndex = 0;
+    tr_piece_index_t const pieceCount = tor->info.pieceCount;
+    uint32_t const pieceSize = tor->info.pieceSize;
+    uint64_t const chunkBytes = MIN(MAX((uint64_t)CHUNK_BYTES,
+        (uint64_t)getHashThreadLimit(tor->session) * tr_sha1_multi_width() * pieceSize), (uint64_t)MAX_CHUNK_BYTES);
+    tr_piece_index_t const piecesPerChunk = MAX(chunkBytes / pieceSize, 1);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        chunks[i].tor = tor;
+        chunks[i].buf = tr_valloc((size_t)piecesPerChunk * pieceSize);
+        chunks[i].readable = tr_new(bool, piecesPerChunk);
+        chunks[i].pass = tr_new(bool, piecesPerChunk);
+    }
+
+    reader.tor = tor;
+    reader.fd = TR_BAD_SYS_FILE;
+    reader.fd_file_index = tor->info.fileCount;
+    reader.stopFlag = stopFlag;
+    sha = tr_sha1_init();
+
+    while (!*stopFlag && pieceIndex < pieceCount)
+    {
+        struct verify_chunk* chunk = prev == &chunks[0] ? &chunks[1] : &chunks[0];
+
+        if (plan != NULL && plan[pieceIndex] == PIECE_TRUST)
+        {
+            ++pieceIndex;
+            continue;
+        }
+
+        chunk->first_piece = pieceIndex;
+        chunk->piece_count = 1;
+        chunk->byte_offset = (uint64_t)pieceIndex * pieceSize;
 
-            fileIndex++;
-            filePos = 0;
+        while (chunk->piece_count < piecesPerChunk && pieceIndex + chunk->piece_count < pieceCount &&
+            (plan == NULL || plan[pieceIndex + chunk->piece_count] != PIECE_TRUST))
+        {
+            ++chunk->piece_count;
+        }
+
+        throttle(&reader, (uint64_t)chunk->piece_count * pieceSize);
+        readChunk(&reader, chunk);
+        enqueueChunk(chunk);
+        *bytesHashed += (uint64_t)(chunk->piece_count - 1) * pieceSize +
+            tr_torPieceCountBytes(tor, pieceIndex + chunk->piece_count - 1);
+
+        if (prev != NULL)
+        {
+            waitForChunk(sha, prev);
+            changed |= applyChunk(tor, prev, plan, sampleFailed);
         }
+
+        prev = chunk;
+        pieceIndex += chunk->piece_count;
+    }
+
+    if (prev != NULL)
+    {
+        waitForChunk(sha, prev);
+        changed |= applyChunk(tor, prev, plan, sampleFailed);
     }
 
     /* cleanup */
-    if (fd != TR_BAD_SYS_FILE)
+    if (reader.fd != TR_BAD_SYS_FILE)
     {
-        tr_sys_file_close(fd, NULL);
+        tr_sys_file_close(reader.fd, NULL);
     }
 
     tr_sha1_final(sha, NULL);
-    free(buffer);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        tr_free(chunks[i].pass);
+        tr_free(chunks[i].readable);
+        free(chunks[i].buf);
+    }
+
+    return changed;
+}
+
+/* A quick verify trusts the pieces whose files haven't changed since their
+ * fingerprints were taken, except for a random sample of the ones we have */
+static uint8_t* getQuickVerifyPlan(tr_torrent const* tor)
+{
+    tr_info const* inf = &tor->info;
+    uint8_t* plan = tr_new(uint8_t, inf->pieceCount);
+    tr_piece_index_t trusted = 0;
+    tr_piece_index_t sampled = 0;
+
+    memset(plan, PIECE_TRUST, inf->pieceCount);
+
+    for (tr_file_index_t fi = 0; fi < inf->fileCount; ++fi)
+    {
+        tr_file const* f = &inf->files[fi];
+
+        if (f->length > 0 && !tr_torrentFingerprintMatches(tor, fi))
+        {
+            memset(plan + f->firstPiece, PIECE_HASH, f->lastPiece + 1 - f->firstPiece);
+        }
+    }
+
+    for (tr_piece_index_t i = 0; i < inf->pieceCount; ++i)
+    {
+        if (plan[i] == PIECE_TRUST && tr_torrentPieceIsComplete(tor, i))
+        {
+            ++trusted;
+
+            if (tr_rand_int_weak(QUICK_VERIFY_SAMPLE_RATE) == 0)
+            {
+                plan[i] = PIECE_SAMPLE;
+                ++sampled;
+            }
+        }
+    }
+
+    /* always check at least one */
+    if (sampled == 0 && trusted > 0)
+    {
+        tr_piece_index_t n = tr_rand_int_weak(trusted);
+
+        for (tr_piece_index_t i = 0; i < inf->pieceCount; ++i)
+        {
+            if (plan[i] == PIECE_TRUST && tr_torrentPieceIsComplete(tor, i) && n-- == 0)
+            {
+                plan[i] = PIECE_SAMPLE;
+                break;
+            }
+        }
+    }
+
+    return plan;
+}
+
+static bool verifyTorrent(tr_torrent* tor, bool quick, bool* stopFlag)
+{
+    time_t end;
+    bool changed;
+    bool sampleFailed = false;
+    uint64_t bytesHashed = 0;
+    uint8_t* plan = NULL;
+    time_t const begin = tr_time();
+
+    tr_logAddTorDbg(tor, "%s", quick ? "quick verifying torrent..." : "verifying torrent...");
+
+    if (quick)
+    {
+        plan = getQuickVerifyPlan(tor);
+    }
+    else
+    {
+        tr_torrentSetChecked(tor, 0);
+    }
+
+    changed = verifyPieces(tor, plan, stopFlag, &bytesHashed, &sampleFailed);
+
+    if (sampleFailed && !*stopFlag)
+    {
+        /* something's changed that the fingerprints didn't catch, so none of them can be trusted */
+        tr_logAddTorInfo(tor, "%s", _("Spot check failed; verifying the rest of the torrent"));
+
+        for (tr_piece_index_t i = 0; i < tor->info.pieceCount; ++i)
+        {
+            plan[i] = plan[i] == PIECE_TRUST ? PIECE_HASH : PIECE_TRUST;
+        }
+
+        changed |= verifyPieces(tor, plan, stopFlag, &bytesHashed, &sampleFailed);
+    }
+
+    tr_free(plan);
 
     /* stopwatch */
     end = tr_time();
     tr_logAddTorDbg(tor, "Verification is done. It took %d seconds to verify %" PRIu64 " bytes (%" PRIu64 " bytes per second)",
-        (int)(end - begin), tor->info.totalSize, (uint64_t)(tor->info.totalSize / (1 + (end - begin))));
+        (int)(end - begin), bytesHashed, (uint64_t)(bytesHashed / (1 + (end - begin))));
 
     return changed;
 }
 
 /***
-****
+****  Scheduling
 ***/
 
 struct verify_node
 {
     tr_torrent* torrent;
+    tr_verify_task_func task_func; /* NULL for verifies */
     tr_verify_done_func callback_func;
     void* callback_data;
     uint64_t current_size;
+    bool quick;
+};
+
+/* Each reader verifies one torrent at a time. Only one torrent per download
+ * directory is read at once so that the disk doesn't have to seek back and forth
+ * between them; torrents on different disks are verified side by side. */
+struct verify_slot
+{
+    struct verify_node node;
+    char* dir;
+    bool active;
+    bool stop;
 };
 
-static struct verify_node currentNode;
+static struct verify_slot readers[MAX_READERS];
 static tr_list* verifyList = NULL;
-static tr_thread* verifyThread = NULL;
-static bool stopCurrent = false;
 
 static tr_lock* getVerifyLock(void)
 {
@@ -193,8 +635,45 @@ static tr_lock* getVerifyLock(void)
     return lock;
 }
 
-static void verifyThreadFunc(void* unused UNUSED)
+static char const* getReaderDir(tr_torrent const* tor)
+{
+    char const* dir = tr_torrentGetCurrentDir(tor);
+    return dir != NULL ? dir : "";
+}
+
+static bool isDirBeingRead(char const* dir)
+{
+    for (int i = 0; i < MAX_READERS; ++i)
+    {
+        if (readers[i].dir != NULL && strcmp(readers[i].dir, dir) == 0)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* must be called with the verify lock held */
+static struct verify_node* getNextNode(void)
+{
+    for (tr_list* l = verifyList; l != NULL; l = l->next)
+    {
+        struct verify_node* node = l->data;
+
+        if (!isDirBeingRead(getReaderDir(node->torrent)))
+        {
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+static void verifyThreadFunc(void* vslot)
 {
+    struct verify_slot* slot = vslot;
+
     for (;;)
     {
         bool changed = false;
@@ -202,39 +681,50 @@ static void verifyThreadFunc(void* unused UNUSED)
         struct verify_node* node;
 
         tr_lockLock(getVerifyLock());
-        stopCurrent = false;
-        node = verifyList != NULL ? verifyList->data : NULL;
+        slot->stop = false;
+        slot->node.torrent = NULL;
+        tr_free(slot->dir);
+        slot->dir = NULL;
+        node = getNextNode();
 
         if (node == NULL)
         {
-            currentNode.torrent = NULL;
             break;
         }
 
-        currentNode = *node;
-        tor = currentNode.torrent;
+        slot->node = *node;
+        slot->dir = tr_strdup(getReaderDir(node->torrent));
+        tor = slot->node.torrent;
         tr_list_remove_data(&verifyList, node);
         tr_free(node);
         tr_lockUnlock(getVerifyLock());
 
-        tr_logAddTorInfo(tor, "%s", _("Verifying torrent"));
-        tr_torrentSetVerifyState(tor, TR_VERIFY_NOW);
-        changed = verifyTorrent(tor, &stopCurrent);
-        tr_torrentSetVerifyState(tor, TR_VERIFY_NONE);
+        if (slot->node.task_func != NULL)
+        {
+            (*slot->node.task_func)(tor, &slot->stop, slot->node.callback_data);
+        }
+        else
+        {
+            tr_logAddTorInfo(tor, "%s", _("Verifying torrent"));
+            tr_torrentSetVerifyState(tor, TR_VERIFY_NOW);
+            changed = verifyTorrent(tor, slot->node.quick, &slot->stop);
+            tr_torrentSetVerifyState(tor, TR_VERIFY_NONE);
+        }
+
         TR_ASSERT(tr_isTorrent(tor));
 
-        if (!stopCurrent && changed)
+        if (!slot->stop && changed)
         {
             tr_torrentSetDirty(tor);
         }
 
-        if (currentNode.callback_func != NULL)
+        if (slot->node.callback_func != NULL)
         {
-            (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
+            (*slot->node.callback_func)(tor, slot->stop, slot->node.callback_data);
         }
     }
 
-    verifyThread = NULL;
+    slot->active = false;
     tr_lockUnlock(getVerifyLock());
 }
 
@@ -243,6 +733,12 @@ static int compareVerifyByPriorityAndSize(void const* va, void const* vb)
     struct verify_node const* a = va;
     struct verify_node const* b = vb;
 
+    /* tasks are quick next to verifies, so they go first, in the order they were added */
+    if (a->task_func != NULL || b->task_func != NULL)
+    {
+        return b->task_func != NULL ? 1 : -1;
+    }
+
     /* higher priority comes before lower priority */
     tr_priority_t const pa = tr_torrentGetPriority(a->torrent);
     tr_priority_t const pb = tr_torrentGetPriority(b->torrent);
@@ -266,26 +762,61 @@ static int compareVerifyByPriorityAndSize(void const* va, void const* vb)
     return 0;
 }
 
-void tr_verifyAdd(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_data)
+/* must be called with the verify lock held */
+static void startReader(void)
+{
+    /* the readers share the hash lock, so create it before any of them can race to */
+    getHashLock();
+
+    /* start another reader in case this torrent can be read alongside the ones being verified */
+    for (int i = 0; i < MAX_READERS; ++i)
+    {
+        if (!readers[i].active)
+        {
+            readers[i].active = true;
+            tr_threadNew(verifyThreadFunc, &readers[i]);
+            break;
+        }
+    }
+}
+
+void tr_verifyAdd(tr_torrent* tor, bool quick, tr_verify_done_func callback_func, void* callback_data)
 {
     TR_ASSERT(tr_isTorrent(tor));
     tr_logAddTorInfo(tor, "%s", _("Queued for verification"));
 
     struct verify_node* node = tr_new(struct verify_node, 1);
     node->torrent = tor;
+    node->task_func = NULL;
     node->callback_func = callback_func;
     node->callback_data = callback_data;
     node->current_size = tr_torrentGetCurrentSizeOnDisk(tor);
+    node->quick = quick;
 
     tr_lockLock(getVerifyLock());
     tr_torrentSetVerifyState(tor, TR_VERIFY_WAIT);
     tr_list_insert_sorted(&verifyList, node, compareVerifyByPriorityAndSize);
+    startReader();
+    tr_lockUnlock(getVerifyLock());
+}
 
-    if (verifyThread == NULL)
-    {
-        verifyThread = tr_threadNew(verifyThreadFunc, NULL);
-    }
+void tr_verifyAddTask(tr_torrent* tor, tr_verify_task_func task_func, tr_verify_done_func callback_func,
+    void* callback_data)
+{
+    TR_ASSERT(tr_isTorrent(tor));
+    TR_ASSERT(task_func != NULL);
 
+    struct verify_node* node = tr_new(struct verify_node, 1);
+    node->torrent = tor;
+    node->task_func = task_func;
+    node->callback_func = callback_func;
+    node->callback_data = callback_data;
+    node->current_size = 0;
+    node->quick = false;
+
+    tr_lockLock(getVerifyLock());
+    tr_list_insert_sorted(&verifyList, node, compareVerifyByPriorityAndSize);
+    startReader();
     tr_lockUnlock(getVerifyLock());
 }
 
@@ -303,11 +834,33 @@ void tr_verifyRemove(tr_torrent* tor)
     tr_lock* lock = getVerifyLock();
     tr_lockLock(lock);
 
-    if (tor == currentNode.torrent)
+    struct verify_slot* slot = NULL;
+
+    /* a torrent can have a verify and tasks queued at once. They're taken off
+     * the queue first, so that a reader can't move on to one of them below */
+    for (struct verify_node* node; (node = tr_list_remove(&verifyList, tor, compareVerifyByTorrent)) != NULL;)
+    {
+        if (node->callback_func != NULL)
+        {
+            (*node->callback_func)(tor, true, node->callback_data);
+        }
+
+        tr_free(node);
+    }
+
+    for (int i = 0; i < MAX_READERS; ++i)
+    {
+        if (readers[i].node.torrent == tor)
+        {
+            slot = &readers[i];
+        }
+    }
+
+    if (slot != NULL)
     {
-        stopCurrent = true;
+        slot->stop = true;
 
-        while (stopCurrent)
+        while (slot->node.torrent == tor)
         {
             tr_lockUnlock(lock);
             tr_wait_msec(100);
@@ -316,19 +869,7 @@ void tr_verifyRemove(tr_torrent* tor)
     }
     else
     {
-        struct verify_node* node = tr_list_remove(&verifyList, tor, compareVerifyByTorrent);
-
         tr_torrentSetVerifyState(tor, TR_VERIFY_NONE);
-
-        if (node != NULL)
-        {
-            if (node->callback_func != NULL)
-            {
-                (*node->callback_func)(tor, true, node->callback_data);
-            }
-
-            tr_free(node);
-        }
     }
 
     tr_lockUnlock(lock);
@@ -338,7 +879,11 @@ void tr_verifyClose(tr_session* session UNUSED)
 {
     tr_lockLock(getVerifyLock());
 
-    stopCurrent = true;
+    for (int i = 0; i < MAX_READERS; ++i)
+    {
+        readers[i].stop = true;
+    }
+
     tr_list_free(&verifyList, tr_free);
 
     tr_lockUnlock(getVerifyLock());
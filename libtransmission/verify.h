@@ -17,7 +17,22 @@
  * @{
  */
 
-void tr_verifyAdd(tr_torrent* tor, tr_verify_done_func callback_func, void* callback_user_data);
+/**
+ * Queues a torrent to be verified. A quick verify only hashes the files
+ * that have changed since their fingerprints were taken, and a sample
+ * of the others.
+ */
+void tr_verifyAdd(tr_torrent* tor, bool quick, tr_verify_done_func callback_func, void* callback_user_data);
+
+typedef void (* tr_verify_task_func)(tr_torrent* tor, bool const* stopFlag, void* user_data);
+
+/**
+ * Queues some other disk-bound work on a torrent, such as looking at its files,
+ * to be run by the verify threads instead of the libtransmission thread.
+ * `callback_func' is called when it's done or has been removed, as for verifies.
+ */
+void tr_verifyAddTask(tr_torrent* tor, tr_verify_task_func task_func, tr_verify_done_func callback_func,
+    void* callback_user_data);
 
 void tr_verifyRemove(tr_torrent* tor);
 
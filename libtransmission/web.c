@@ -391,6 +391,8 @@ struct tr_web_task* tr_webRunWebseed(tr_torrent* tor, char const* url, char cons
     return tr_webRunImpl(tor->session, tr_torrentId(tor), url, range, NULL, done_func, done_func_user_data, buffer);
 }
 
+#if LIBCURL_VERSION_NUM < 0x074200
+
 /**
  * Portability wrapper for select().
  *
@@ -426,6 +428,8 @@ static void tr_select(int nfds, fd_set* r_fd_set, fd_set* w_fd_set, fd_set* c_fd
 #endif
 }
 
+#endif
+
 static void tr_webThreadFunc(void* vsession)
 {
     char* str;
@@ -538,6 +542,18 @@ static void tr_webThreadFunc(void* vsession)
 
         if (msec > 0)
         {
+            if (msec > THREADFUNC_MAX_SLEEP_MSEC)
+            {
+                msec = THREADFUNC_MAX_SLEEP_MSEC;
+            }
+
+#if LIBCURL_VERSION_NUM >= 0x074200 /* curl_multi_poll() was added in 7.66.0 */
+
+            /* the fd limit can be past FD_SETSIZE, and select() can't wait on fds above that */
+            curl_multi_poll(multi, NULL, 0, (int)msec, NULL);
+
+#else
+
             int usec;
             int max_fd;
             struct timeval t;
@@ -551,15 +567,12 @@ static void tr_webThreadFunc(void* vsession)
             FD_ZERO(&c_fd_set);
             curl_multi_fdset(multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd);
 
-            if (msec > THREADFUNC_MAX_SLEEP_MSEC)
-            {
-                msec = THREADFUNC_MAX_SLEEP_MSEC;
-            }
-
             usec = msec * 1000;
             t.tv_sec = usec / 1000000;
             t.tv_usec = usec % 1000000;
             tr_select(max_fd + 1, &r_fd_set, &w_fd_set, &c_fd_set, &t);
+
+#endif
         }
 
         /* call curl_multi_perform() */